@@ -0,0 +1,332 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "PersistentJournal.h"
+#include "ConfigurationManager.h"
+
+#include <errno.h>
+#include <esp32/rom/crc.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utils/logging.h>
+#include <utils/StringPrintf.hxx>
+
+/// Calculates the CRC32 of a block of data.
+static inline uint32_t journal_crc(const void *data, size_t length
+                                 , uint32_t crc = 0)
+{
+  return crc32_le(crc, static_cast<const uint8_t *>(data), length);
+}
+
+PersistentJournal::PersistentJournal(const char *name, size_t compact_size)
+  : snapshotPath_(StringPrintf("%s/%s.snp", CS_CONFIG_DIR, name))
+  , tempPath_(StringPrintf("%s/%s.tmp", CS_CONFIG_DIR, name))
+  , journalPath_(StringPrintf("%s/%s.jnl", CS_CONFIG_DIR, name))
+  , compactSize_(compact_size)
+{
+}
+
+bool PersistentJournal::exists()
+{
+  struct stat statbuf;
+  // this code is not using access(path, F_OK) as that is not available for
+  // SPIFFS VFS. stat(path, buf) does work though.
+  return !stat(snapshotPath_.c_str(), &statbuf) ||
+         !stat(tempPath_.c_str(), &statbuf) ||
+         !stat(journalPath_.c_str(), &statbuf);
+}
+
+size_t PersistentJournal::load(LoadCallback callback)
+{
+  records_.clear();
+  dirty_.clear();
+  compactPending_ = false;
+
+  if (replay(snapshotPath_, records_, true) < 0)
+  {
+    // If the snapshot is missing or incomplete the device may have been reset
+    // during compaction after the old snapshot was removed but before the
+    // new one was renamed into place.
+    records_.clear();
+    if (replay(tempPath_, records_, true) >= 0)
+    {
+      LOG(WARNING, "[Journal] Recovered %s from incomplete compaction"
+        , snapshotPath_.c_str());
+      compactPending_ = true;
+    }
+    else
+    {
+      records_.clear();
+    }
+  }
+  size_t snapshotCount = records_.size();
+
+  ssize_t replayed = replay(journalPath_, records_, false);
+  if (replayed >= 0)
+  {
+    LOG(VERBOSE, "[Journal] Replayed %zd bytes from %s", replayed
+      , journalPath_.c_str());
+    compactPending_ = true;
+  }
+  LOG(VERBOSE, "[Journal] Loaded %zu records (%zu from snapshot)"
+    , records_.size(), snapshotCount);
+
+  // Compact any journal records into the snapshot so the next startup only
+  // needs to read the snapshot, this also drops any torn record at the end
+  // of the journal.
+  if (compactPending_)
+  {
+    compact();
+  }
+
+  for (const auto &record : records_)
+  {
+    callback(record.first, record.second);
+  }
+  return records_.size();
+}
+
+void PersistentJournal::put(uint32_t key, std::string payload)
+{
+  HASSERT(payload.length() <= UINT16_MAX);
+  auto ent = records_.find(key);
+  if (ent != records_.end())
+  {
+    if (ent->second == payload)
+    {
+      return;
+    }
+    ent->second = std::move(payload);
+  }
+  else
+  {
+    records_.emplace(key, std::move(payload));
+  }
+  dirty_.insert(key);
+}
+
+void PersistentJournal::erase(uint32_t key)
+{
+  if (records_.erase(key))
+  {
+    dirty_.insert(key);
+  }
+}
+
+void PersistentJournal::clear()
+{
+  records_.clear();
+  dirty_.clear();
+  compactPending_ = true;
+}
+
+bool PersistentJournal::sync()
+{
+  if (compactPending_)
+  {
+    return compact();
+  }
+  if (dirty_.empty())
+  {
+    return true;
+  }
+  std::string buffer;
+  for (uint32_t key : dirty_)
+  {
+    auto ent = records_.find(key);
+    if (ent != records_.end())
+    {
+      encode_record(buffer, RECORD_PUT, key, ent->second);
+    }
+    else
+    {
+      encode_record(buffer, RECORD_ERASE, key, "");
+    }
+  }
+  LOG(VERBOSE, "[Journal] Appending %zu records (%zu bytes) to %s"
+    , dirty_.size(), buffer.length(), journalPath_.c_str());
+  if (!write_file(journalPath_, buffer, true))
+  {
+    // The journal may now end with a partial record which would hide any
+    // records appended after it, rewrite the snapshot on the next sync.
+    compactPending_ = true;
+    return false;
+  }
+  dirty_.clear();
+  journalSize_ += buffer.length();
+  if (journalSize_ >= compactSize_)
+  {
+    return compact();
+  }
+  return true;
+}
+
+bool PersistentJournal::compact()
+{
+  std::string buffer;
+  for (const auto &record : records_)
+  {
+    encode_record(buffer, RECORD_PUT, record.first, record.second);
+  }
+  encode_record(buffer, RECORD_COMMIT, records_.size(), "");
+  LOG(VERBOSE, "[Journal] Compacting %zu records (%zu bytes) into %s"
+    , records_.size(), buffer.length(), snapshotPath_.c_str());
+  if (!write_file(tempPath_, buffer, false))
+  {
+    return false;
+  }
+  // FATFS does not allow rename to replace an existing file so the old
+  // snapshot has to be removed first, load() will fall back to the temporary
+  // snapshot if a reset happens between these two steps.
+  unlink(snapshotPath_.c_str());
+  if (rename(tempPath_.c_str(), snapshotPath_.c_str()))
+  {
+    LOG_ERROR("[Journal] Failed to rename %s to %s: %s", tempPath_.c_str()
+            , snapshotPath_.c_str(), strerror(errno));
+    return false;
+  }
+  unlink(journalPath_.c_str());
+  journalSize_ = 0;
+  dirty_.clear();
+  compactPending_ = false;
+  return true;
+}
+
+void PersistentJournal::encode_record(std::string &buffer, RecordType type
+                                    , uint32_t key
+                                    , const std::string &payload)
+{
+  RecordHeader header =
+  {
+    .magic = RECORD_MAGIC,
+    .type = type,
+    .length = (uint16_t)payload.length(),
+    .key = key
+  };
+  uint32_t crc = journal_crc(&header, sizeof(RecordHeader));
+  crc = journal_crc(payload.data(), payload.length(), crc);
+  buffer.append(reinterpret_cast<const char *>(&header)
+              , sizeof(RecordHeader));
+  buffer.append(payload);
+  buffer.append(reinterpret_cast<const char *>(&crc), sizeof(uint32_t));
+}
+
+ssize_t PersistentJournal::replay(const std::string &path
+                                , std::map<uint32_t, std::string> &records
+                                , bool snapshot)
+{
+  FILE *fp = fopen(path.c_str(), "rb");
+  if (fp == nullptr)
+  {
+    return -1;
+  }
+  // Records from a snapshot are collected separately and only applied once
+  // the commit record has been read.
+  std::map<uint32_t, std::string> pending;
+  std::map<uint32_t, std::string> &target = snapshot ? pending : records;
+  bool committed = false;
+  size_t offset = 0;
+  RecordHeader header;
+  std::string payload;
+  while (fread(&header, sizeof(RecordHeader), 1, fp) == 1)
+  {
+    if (header.magic != RECORD_MAGIC)
+    {
+      break;
+    }
+    payload.resize(header.length);
+    uint32_t crc;
+    if ((header.length &&
+         fread(&payload[0], header.length, 1, fp) != 1) ||
+        fread(&crc, sizeof(uint32_t), 1, fp) != 1)
+    {
+      break;
+    }
+    uint32_t expected = journal_crc(&header, sizeof(RecordHeader));
+    expected = journal_crc(payload.data(), payload.length(), expected);
+    if (crc != expected)
+    {
+      break;
+    }
+    offset += sizeof(RecordHeader) + header.length + sizeof(uint32_t);
+    if (header.type == RECORD_PUT)
+    {
+      target[header.key] = payload;
+    }
+    else if (header.type == RECORD_ERASE)
+    {
+      target.erase(header.key);
+    }
+    else if (header.type == RECORD_COMMIT)
+    {
+      committed = (header.key == target.size());
+      break;
+    }
+  }
+  bool torn = !feof(fp) && !committed;
+  fclose(fp);
+
+  if (snapshot)
+  {
+    if (!committed)
+    {
+      LOG_ERROR("[Journal] %s is incomplete, ignoring it", path.c_str());
+      return -1;
+    }
+    records.swap(pending);
+  }
+  else if (torn)
+  {
+    LOG(WARNING, "[Journal] %s has an invalid record at offset %zu, "
+                 "discarding remaining data", path.c_str(), offset);
+  }
+  return offset;
+}
+
+bool PersistentJournal::write_file(const std::string &path
+                                 , const std::string &buffer
+                                 , bool append)
+{
+  int flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
+  int fd = open(path.c_str(), flags, 0644);
+  if (fd < 0)
+  {
+    LOG_ERROR("[Journal] Failed to open %s: %s", path.c_str()
+            , strerror(errno));
+    return false;
+  }
+  size_t written = 0;
+  while (written < buffer.length())
+  {
+    ssize_t ret = ::write(fd, buffer.data() + written
+                        , buffer.length() - written);
+    if (ret <= 0)
+    {
+      LOG_ERROR("[Journal] Failed to write %s: %s", path.c_str()
+              , strerror(errno));
+      close(fd);
+      return false;
+    }
+    written += ret;
+  }
+  fsync(fd);
+  close(fd);
+  return true;
+}
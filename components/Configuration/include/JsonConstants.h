@@ -48,6 +48,7 @@ constexpr const char * JSON_LOCO_NODE = "loco";
 constexpr const char * JSON_CONSIST_NODE = "consist";
 constexpr const char * JSON_CONSISTS_NODE = "consists";
 constexpr const char * JSON_DECODER_ASSISTED_NODE = "decoderAssisted";
+constexpr const char * JSON_CONSIST_PROGRAMMED_NODE = "programmed";
 
 constexpr const char * JSON_OUTPUTS_NODE = "outputs";
 constexpr const char * JSON_ID_NODE = "id";
@@ -70,6 +71,10 @@ constexpr const char * JSON_PROG_ON_MAIN = "pom";
 constexpr const char * JSON_CV_NODE = "cv";
 constexpr const char * JSON_VALUE_NODE = "value";
 constexpr const char * JSON_CV_BIT_NODE = "bit";
+constexpr const char * JSON_CVS_NODE = "cvs";
+constexpr const char * JSON_ASYNC_NODE = "async";
+constexpr const char * JSON_JOB_NODE = "job";
+constexpr const char * JSON_VERIFY_NODE = "verify";
 constexpr const char * JSON_IDENTIFY_NODE = "identify";
 constexpr const char * JSON_ADDRESS_MODE_NODE = "addressMode";
 constexpr const char * JSON_SPEED_TABLE_NODE = "speedTable";
@@ -0,0 +1,203 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef PERSISTENT_JOURNAL_H_
+#define PERSISTENT_JOURNAL_H_
+
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+
+#include "sdkconfig.h"
+
+/// Keyed record store backed by a snapshot file and an append-only journal.
+///
+/// Each record is an opaque binary payload identified by a 32 bit key. Changes
+/// made with @ref put, @ref erase and @ref clear are held in memory until
+/// @ref sync is called, at which point only the modified records are appended
+/// to the journal with a single write. When the journal grows beyond the
+/// compaction size all records are written to a new snapshot and the journal
+/// is discarded.
+///
+/// Every record on disk is prefixed with a @ref RecordHeader and followed by
+/// a CRC32 of the header and payload. While loading, the journal is replayed
+/// up to the first record that is incomplete or fails the CRC check, this
+/// discards a record that was only partially written. A snapshot is written
+/// to a temporary file and only replaces the previous snapshot once it has
+/// been completely written, a snapshot without its trailing commit record is
+/// ignored.
+///
+/// This class is not thread safe, the owner is expected to serialize access.
+class PersistentJournal
+{
+public:
+  /// Callback used by @ref load for each record.
+  using LoadCallback = std::function<void(uint32_t, const std::string &)>;
+
+  /// Constructor.
+  ///
+  /// @param name is the base name of the files in the configuration
+  /// directory, the snapshot and journal extensions are appended to it.
+  /// @param compact_size is the journal size (in bytes) at which the records
+  /// will be compacted into a new snapshot.
+  PersistentJournal(const char *name
+                  , size_t compact_size=CONFIG_JOURNAL_COMPACTION_SIZE);
+
+  /// @return true if a snapshot or journal exists for this store.
+  bool exists();
+
+  /// Loads the snapshot and replays the journal. If the journal contained
+  /// any records they will be compacted into a new snapshot.
+  ///
+  /// @param callback will be invoked for each record that was loaded, in
+  /// ascending key order.
+  ///
+  /// @return the number of records loaded.
+  size_t load(LoadCallback callback);
+
+  /// Stores or replaces a record, this is a no-op if the record already has
+  /// the same payload.
+  ///
+  /// @param key is the record key.
+  /// @param payload is the record payload, at most 65535 bytes.
+  void put(uint32_t key, std::string payload);
+
+  /// Removes a record.
+  ///
+  /// @param key is the record key.
+  void erase(uint32_t key);
+
+  /// Removes all records, the next call to @ref sync will write an empty
+  /// snapshot.
+  void clear();
+
+  /// Writes all pending changes to persistent storage.
+  ///
+  /// @return true if the changes were written successfully.
+  bool sync();
+
+  /// Writes all records to a new snapshot and discards the journal.
+  ///
+  /// @return true if the snapshot was written successfully.
+  bool compact();
+
+  /// @return the number of records.
+  size_t size()
+  {
+    return records_.size();
+  }
+
+  /// @return true if there are changes that have not been written.
+  bool is_dirty()
+  {
+    return compactPending_ || !dirty_.empty();
+  }
+
+private:
+  /// On-disk record header, the payload and a CRC32 follow it.
+  struct RecordHeader
+  {
+    /// Always @ref RECORD_MAGIC.
+    uint8_t magic;
+
+    /// One of @ref RecordType.
+    uint8_t type;
+
+    /// Number of payload bytes that follow the header.
+    uint16_t length;
+
+    /// Record key, for @ref RECORD_COMMIT this is the number of records in
+    /// the snapshot.
+    uint32_t key;
+  };
+
+  /// Types of records.
+  enum RecordType : uint8_t
+  {
+    /// Stores or replaces the record with the key.
+    RECORD_PUT = 1,
+
+    /// Removes the record with the key.
+    RECORD_ERASE,
+
+    /// Marks the end of a completely written snapshot.
+    RECORD_COMMIT,
+  };
+
+  /// Value of @ref RecordHeader::magic.
+  static constexpr uint8_t RECORD_MAGIC = 0xA5;
+
+  static_assert(sizeof(RecordHeader) == 8, "unexpected record header size");
+
+  /// Appends an encoded record to a buffer.
+  ///
+  /// @param buffer is the buffer to append to.
+  /// @param type is the record type.
+  /// @param key is the record key.
+  /// @param payload is the record payload.
+  void encode_record(std::string &buffer, RecordType type, uint32_t key
+                   , const std::string &payload);
+
+  /// Reads all valid records from a file.
+  ///
+  /// @param path is the file to read.
+  /// @param records will receive the records.
+  /// @param snapshot should be true when the file is a snapshot, the records
+  /// will only be applied if the commit record is present.
+  ///
+  /// @return the number of bytes that were read successfully, or -1 if the
+  /// file could not be read or is an incomplete snapshot.
+  ssize_t replay(const std::string &path
+               , std::map<uint32_t, std::string> &records, bool snapshot);
+
+  /// Writes a buffer to a file and flushes it to persistent storage.
+  ///
+  /// @param path is the file to write.
+  /// @param buffer is the data to write.
+  /// @param append controls if the data is appended to the file.
+  ///
+  /// @return true if the buffer was written completely.
+  bool write_file(const std::string &path, const std::string &buffer
+                , bool append);
+
+  /// Path to the snapshot file.
+  const std::string snapshotPath_;
+
+  /// Path to the temporary snapshot file used during compaction.
+  const std::string tempPath_;
+
+  /// Path to the journal file.
+  const std::string journalPath_;
+
+  /// Journal size (in bytes) at which compaction will be triggered.
+  const size_t compactSize_;
+
+  /// Current size of the journal file in bytes.
+  size_t journalSize_{0};
+
+  /// Current contents of the store.
+  std::map<uint32_t, std::string> records_;
+
+  /// Keys that have been modified since the last @ref sync.
+  std::set<uint32_t> dirty_;
+
+  /// Set by @ref clear, the next @ref sync will compact the store.
+  bool compactPending_{false};
+};
+
+#endif // PERSISTENT_JOURNAL_H_
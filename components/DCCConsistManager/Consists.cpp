@@ -0,0 +1,818 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "Consists.h"
+#include "sdkconfig.h"
+
+#include <algorithm>
+#include <AllTrainNodes.hxx>
+#include <ConfigurationManager.h>
+#include <dcc/UpdateLoop.hxx>
+#include <DCCppProtocol.h>
+#include <DCCProgrammer.h>
+#include <esp_bit_defs.h>
+#include <executor/Executable.hxx>
+#include <executor/Notifiable.hxx>
+#include <JsonConstants.h>
+#include <json.hpp>
+#include <utils/StringPrintf.hxx>
+
+namespace esp32cs
+{
+
+using nlohmann::json;
+
+static constexpr const char * CONSISTS_JSON_FILE = "consists.json";
+
+/// CV21 value, F1-F8 respond to the consist address.
+static constexpr uint8_t CONSIST_F1_F8_ENABLED = 0xFF;
+
+/// CV22 value, F9-F12 respond to the consist address.
+static constexpr uint8_t CONSIST_F9_F12_ENABLED =
+  BIT(CONSIST_FUNCTION_CONTROL_FL_F9_F12_BITS::F9_BIT) |
+  BIT(CONSIST_FUNCTION_CONTROL_FL_F9_F12_BITS::F10_BIT) |
+  BIT(CONSIST_FUNCTION_CONTROL_FL_F9_F12_BITS::F11_BIT) |
+  BIT(CONSIST_FUNCTION_CONTROL_FL_F9_F12_BITS::F12_BIT);
+
+/// Highest function which can respond to the consist address.
+static constexpr uint32_t CONSIST_ADDRESS_MAX_FN = 12;
+
+// Runs the callback on the executor of the service and waits for it to
+// complete.
+static void run_on_executor(Service *service, std::function<void()> callback)
+{
+  SyncNotifiable n;
+  service->executor()->add(new CallbackExecutable([&]()
+  {
+    callback();
+    n.notify();
+  }));
+  n.wait_for_notification();
+}
+
+const ConsistMember *Consist::find(uint16_t address) const
+{
+  for (auto &member : members)
+  {
+    if (member.address == address)
+    {
+      return &member;
+    }
+  }
+  return nullptr;
+}
+
+ConsistManager::ConsistManager(Service *service)
+  : service_(service)
+  , persistFlow_(service, SEC_TO_NSEC(CONFIG_CONSIST_PERSISTENCE_INTERVAL_SEC)
+               , std::bind(&ConsistManager::persist, this))
+{
+  OSMutexLock h(&mux_);
+  LOG(INFO, "[Consist] Initializing consist database");
+  auto cfg = Singleton<ConfigurationManager>::instance();
+  if (!cfg->exists(CONSISTS_JSON_FILE))
+  {
+    return;
+  }
+  json root = json::parse(cfg->load(CONSISTS_JSON_FILE), nullptr, false);
+  if (root.is_discarded() || !root.is_array())
+  {
+    LOG_ERROR("[Consist] consist database is corrupt, no consists loaded!");
+    cfg->remove(CONSISTS_JSON_FILE);
+    return;
+  }
+  for (auto &entry : root)
+  {
+    Consist consist;
+    consist.id = entry[JSON_ID_NODE].get<int>();
+    consist.speed = dcc::SpeedType(0);
+    consist.headlight = false;
+    consist.decoderAssisted = entry.value(JSON_DECODER_ASSISTED_NODE, false);
+    consist.programmed = entry.value(JSON_CONSIST_PROGRAMMED_NODE, false);
+    consist.revision = ++revision_;
+    for (auto &loco : entry[JSON_LOCOS_NODE])
+    {
+      consist.members.push_back(
+        {loco[JSON_ADDRESS_NODE].get<uint16_t>()
+       , loco[JSON_ORIENTATION_NODE].get<string>() != JSON_VALUE_REVERSE});
+    }
+    if (consist.members.size() > 1)
+    {
+      consists_.push_back(consist);
+    }
+  }
+  LOG(INFO, "[Consist] Loaded %zu consist(s)", consists_.size());
+
+  // The members of programmed consists retain the consist address, switch
+  // their refresh to the consist address once the executor is running.
+  for (auto &consist : consists_)
+  {
+    if (consist.programmed)
+    {
+      Consist snapshot = consist;
+      service_->executor()->add(new CallbackExecutable([this, snapshot]()
+      {
+        set_refresh(snapshot, true);
+      }));
+    }
+  }
+}
+
+bool ConsistManager::create(uint8_t id, const std::vector<int32_t> &locos
+                          , bool decoder_assisted)
+{
+  if (id < MIN_CONSIST_ID || id > MAX_CONSIST_ID || locos.size() < 2)
+  {
+    return false;
+  }
+  Consist consist;
+  consist.id = id;
+  consist.speed = dcc::SpeedType(0);
+  consist.headlight = false;
+  consist.decoderAssisted = decoder_assisted;
+  consist.programmed = false;
+  for (int32_t loco : locos)
+  {
+    int32_t address = abs(loco);
+    if (!address || address > MAX_LOCO_ADDRESS || consist.find(address))
+    {
+      LOG_ERROR("[Consist %d] Invalid or duplicate locomotive %d", id
+              , address);
+      return false;
+    }
+    consist.members.push_back({(uint16_t)address, loco > 0});
+  }
+
+  Consist previous;
+  previous.programmed = false;
+  {
+    OSMutexLock h(&mux_);
+    for (auto &member : consist.members)
+    {
+      Consist *existing = find_consist_for_loco(member.address);
+      if (existing && existing->id != id)
+      {
+        LOG_ERROR("[Consist %d] Locomotive %d is already in consist %d", id
+                , member.address, existing->id);
+        return false;
+      }
+    }
+    consist.revision = ++revision_;
+    Consist *existing = find_consist(id);
+    if (existing)
+    {
+      previous = *existing;
+      *existing = consist;
+    }
+    else
+    {
+      consists_.push_back(consist);
+    }
+    dirty_ = true;
+  }
+  LOG(INFO, "[Consist %d] Created with %zu locomotives (lead: %d)", id
+    , consist.members.size(), consist.members.front().address);
+  if (previous.programmed)
+  {
+    release(previous);
+  }
+  if (decoder_assisted)
+  {
+    queue_programming(consist);
+  }
+  return true;
+}
+
+bool ConsistManager::remove(uint8_t id)
+{
+  Consist previous;
+  {
+    OSMutexLock h(&mux_);
+    auto it = std::find_if(consists_.begin(), consists_.end(),
+      [id](const Consist &consist)
+      {
+        return consist.id == id;
+      });
+    if (it == consists_.end())
+    {
+      return false;
+    }
+    previous = *it;
+    consists_.erase(it);
+    dirty_ = true;
+  }
+  LOG(INFO, "[Consist %d] Deleted", id);
+  if (previous.programmed)
+  {
+    release(previous);
+  }
+  return true;
+}
+
+bool ConsistManager::remove(uint8_t id, uint16_t address)
+{
+  Consist previous;
+  Consist updated;
+  {
+    OSMutexLock h(&mux_);
+    Consist *consist = find_consist(id);
+    if (!consist || !consist->find(address))
+    {
+      return false;
+    }
+    previous = *consist;
+    auto &members = consist->members;
+    members.erase(std::remove_if(members.begin(), members.end(),
+      [address](const ConsistMember &member)
+      {
+        return member.address == address;
+      }), members.end());
+    // the lead and trail may have changed so the remaining members need to
+    // be programmed again.
+    consist->programmed = false;
+    consist->revision = ++revision_;
+    updated = *consist;
+    dirty_ = true;
+  }
+  LOG(INFO, "[Consist %d] Removed locomotive %d", id, address);
+  if (previous.programmed)
+  {
+    release(previous);
+  }
+  if (updated.members.size() < 2)
+  {
+    remove(id);
+  }
+  else if (updated.decoderAssisted)
+  {
+    queue_programming(updated);
+  }
+  return true;
+}
+
+uint8_t ConsistManager::find(uint16_t address)
+{
+  OSMutexLock h(&mux_);
+  Consist *consist = find_consist_for_loco(address);
+  if (consist)
+  {
+    return consist->id;
+  }
+  return 0;
+}
+
+bool ConsistManager::is_decoder_assisted(uint8_t id)
+{
+  OSMutexLock h(&mux_);
+  Consist *consist = find_consist(id);
+  return consist && consist->decoderAssisted;
+}
+
+uint16_t ConsistManager::lead(uint8_t id)
+{
+  OSMutexLock h(&mux_);
+  Consist *consist = find_consist(id);
+  if (consist)
+  {
+    return consist->members.front().address;
+  }
+  return 0;
+}
+
+bool ConsistManager::set_speed(uint16_t address, dcc::SpeedType speed)
+{
+  Consist snapshot;
+  bool lights = false;
+  {
+    OSMutexLock h(&mux_);
+    Consist *consist = find_consist_for_loco(address);
+    if (!consist)
+    {
+      return false;
+    }
+    // convert the direction to be relative to the lead locomotive.
+    if (!consist->find(address)->forward)
+    {
+      speed.set_direction(speed.direction() == dcc::SpeedType::FORWARD ?
+                          dcc::SpeedType::REVERSE : dcc::SpeedType::FORWARD);
+    }
+    // the headlights move between the lead and trail when the direction
+    // changes.
+    lights = consist->speed.direction() != speed.direction();
+    consist->speed = speed;
+    snapshot = *consist;
+  }
+  LOG(CONFIG_CONSIST_LOG_LEVEL, "[Consist %d] Set speed to %d (%s)"
+    , snapshot.id, (int)speed.mph()
+    , speed.direction() == dcc::SpeedType::FORWARD ? "FWD" : "REV");
+  apply(snapshot, true, lights, 0, 0);
+  return true;
+}
+
+bool ConsistManager::set_fn(uint16_t address, uint32_t mask, uint32_t values)
+{
+  Consist snapshot;
+  {
+    OSMutexLock h(&mux_);
+    Consist *consist = find_consist_for_loco(address);
+    if (!consist)
+    {
+      return false;
+    }
+    if (mask & HEADLIGHT_FN_BIT)
+    {
+      consist->headlight = values & HEADLIGHT_FN_BIT;
+    }
+    snapshot = *consist;
+  }
+  LOG(CONFIG_CONSIST_LOG_LEVEL, "[Consist %d] Set functions %08x to %08x"
+    , snapshot.id, (unsigned)mask, (unsigned)(values & mask));
+  apply(snapshot, false, mask & HEADLIGHT_FN_BIT, mask & ~HEADLIGHT_FN_BIT
+      , values);
+  return true;
+}
+
+std::string ConsistManager::get_state_for_dccpp()
+{
+  OSMutexLock h(&mux_);
+  if (consists_.empty())
+  {
+    return COMMAND_FAILED_RESPONSE;
+  }
+  string status;
+  for (auto &consist : consists_)
+  {
+    status += StringPrintf("<U %d", consist.decoderAssisted ? -consist.id
+                                                            : consist.id);
+    for (auto &member : consist.members)
+    {
+      status += StringPrintf(" %d", member.forward ? member.address
+                                                   : -member.address);
+    }
+    status += ">";
+  }
+  return status;
+}
+
+std::string ConsistManager::get_state_as_json()
+{
+  OSMutexLock h(&mux_);
+  string state = "[";
+  for (auto &consist : consists_)
+  {
+    if (state.length() > 1)
+    {
+      state += ",";
+    }
+    state += to_json(consist);
+  }
+  state += "]";
+  return state;
+}
+
+std::string ConsistManager::get_state_json()
+{
+  OSMutexLock h(&mux_);
+  size_t assisted = 0;
+  size_t programmed = 0;
+  size_t saved = 0;
+  for (auto &consist : consists_)
+  {
+    if (consist.decoderAssisted)
+    {
+      assisted++;
+    }
+    if (consist.programmed)
+    {
+      // all members are replaced by the consist address.
+      programmed++;
+      saved += consist.members.size() - 1;
+    }
+  }
+  return StringPrintf(
+    "{\"consists\":%zu,\"decoderAssisted\":%zu,\"programmed\":%zu,"
+    "\"pending\":%u,\"failed\":%u,\"refreshSaved\":%zu}"
+  , consists_.size(), assisted, programmed, programmingPending_
+  , programmingFailed_, saved);
+}
+
+std::string ConsistManager::get_consist_as_json(uint8_t id)
+{
+  OSMutexLock h(&mux_);
+  Consist *consist = find_consist(id);
+  if (consist)
+  {
+    return to_json(*consist);
+  }
+  return "";
+}
+
+Consist *ConsistManager::find_consist(uint8_t id)
+{
+  for (auto &consist : consists_)
+  {
+    if (consist.id == id)
+    {
+      return &consist;
+    }
+  }
+  return nullptr;
+}
+
+Consist *ConsistManager::find_consist_for_loco(uint16_t address)
+{
+  for (auto &consist : consists_)
+  {
+    if (consist.find(address))
+    {
+      return &consist;
+    }
+  }
+  return nullptr;
+}
+
+void ConsistManager::apply(const Consist &consist, bool speed, bool lights
+                         , uint32_t mask, uint32_t values)
+{
+  // All members are updated from a single executor callback, each update is
+  // queued with the update loop in member order and no other update can be
+  // queued in between. This keeps the members within the same refresh window
+  // rather than interleaved with other throttle traffic.
+  run_on_executor(service_, [&]()
+  {
+    auto trains = Singleton<commandstation::AllTrainNodes>::instance();
+    if (consist.programmed)
+    {
+      apply_consist_address(consist, speed, lights, mask, values);
+      return;
+    }
+    bool forward = consist.speed.direction() == dcc::SpeedType::FORWARD;
+    size_t trail = consist.members.size() - 1;
+    for (size_t index = 0; index <= trail; index++)
+    {
+      const ConsistMember &member = consist.members[index];
+      auto impl =
+        trains->get_train_impl(commandstation::DccMode::DCC_128
+                             , member.address);
+      if (!impl)
+      {
+        continue;
+      }
+      if (speed)
+      {
+        dcc::SpeedType member_speed = consist.speed;
+        if (!member.forward)
+        {
+          member_speed.set_direction(forward ? dcc::SpeedType::REVERSE
+                                             : dcc::SpeedType::FORWARD);
+        }
+        impl->set_speed(member_speed);
+      }
+      if (lights)
+      {
+        // only the outward facing light of the consist is lit.
+        bool lit = consist.headlight &&
+                   ((index == 0 && forward) || (index == trail && !forward));
+        impl->set_fn(0, lit);
+      }
+      for (uint32_t fn = 1; fn <= MAX_CONSIST_FN; fn++)
+      {
+        if (mask & (1 << fn))
+        {
+          impl->set_fn(fn, (values >> fn) & 1);
+        }
+      }
+    }
+  });
+}
+
+void ConsistManager::apply_consist_address(const Consist &consist, bool speed
+                                         , bool lights, uint32_t mask
+                                         , uint32_t values)
+{
+  auto trains = Singleton<commandstation::AllTrainNodes>::instance();
+  auto source = consistSources_.find(consist.id);
+  if (source != consistSources_.end())
+  {
+    dcc::Dcc128Train *impl = source->second.get();
+    // The decoders apply their orientation (CV19) and only the lead and trail
+    // respond to F0 (CV22), so the consist state is sent as-is.
+    if (speed)
+    {
+      impl->set_speed(consist.speed);
+    }
+    if (lights)
+    {
+      impl->set_fn(0, consist.headlight);
+    }
+    for (uint32_t fn = 1; fn <= CONSIST_ADDRESS_MAX_FN; fn++)
+    {
+      if (mask & (1 << fn))
+      {
+        impl->set_fn(fn, (values >> fn) & 1);
+      }
+    }
+  }
+  // Functions above F12 can not be mapped to the consist address and are
+  // sent to the members. A member may have been recreated by a throttle
+  // since the consist was programmed so it is removed from the refresh.
+  for (auto &member : consist.members)
+  {
+    auto member_impl =
+      trains->get_train_impl(commandstation::DccMode::DCC_128
+                           , member.address);
+    if (!member_impl)
+    {
+      continue;
+    }
+    dcc::packet_processor_remove_refresh_source(
+      trains->get_packet_source(commandstation::DccMode::DCC_128
+                              , member.address));
+    for (uint32_t fn = CONSIST_ADDRESS_MAX_FN + 1; fn <= MAX_CONSIST_FN; fn++)
+    {
+      if (mask & (1 << fn))
+      {
+        member_impl->set_fn(fn, (values >> fn) & 1);
+      }
+    }
+  }
+}
+
+void ConsistManager::queue_programming(const Consist &consist)
+{
+  {
+    OSMutexLock h(&mux_);
+    programmingPending_++;
+  }
+  Consist snapshot = consist;
+  if (!queueProgrammingJob([this, snapshot]() { program(snapshot); }))
+  {
+    LOG_ERROR("[Consist %d] Unable to queue programming, the consist will be "
+              "managed by the command station", consist.id);
+    OSMutexLock h(&mux_);
+    programmingPending_--;
+    programmingFailed_++;
+  }
+}
+
+void ConsistManager::program(Consist consist)
+{
+  LOG(INFO, "[Consist %d] Programming %zu locomotives for decoder assisted "
+            "consisting", consist.id, consist.members.size());
+  size_t index = 0;
+  for (; index < consist.members.size(); index++)
+  {
+    if (!program_member(consist, index))
+    {
+      break;
+    }
+  }
+  bool success = index == consist.members.size();
+  if (!success)
+  {
+    LOG_ERROR("[Consist %d] Programming locomotive %d failed, the consist "
+              "will be managed by the command station", consist.id
+            , consist.members[index].address);
+    // the failed member may have accepted some of the CVs.
+    consist.members.resize(index + 1);
+    clear_consist_address(consist.members);
+  }
+
+  Consist snapshot;
+  bool current = false;
+  {
+    OSMutexLock h(&mux_);
+    programmingPending_--;
+    Consist *entry = find_consist(consist.id);
+    current = entry && entry->revision == consist.revision;
+    if (!success)
+    {
+      programmingFailed_++;
+    }
+    else if (current)
+    {
+      entry->programmed = true;
+      dirty_ = true;
+      snapshot = *entry;
+    }
+  }
+  if (success && !current)
+  {
+    // the consist was changed or deleted while it was being programmed.
+    LOG(CONFIG_CONSIST_LOG_LEVEL
+      , "[Consist %d] Discarding outdated programming", consist.id);
+    clear_consist_address(consist.members);
+  }
+  else if (success)
+  {
+    LOG(INFO, "[Consist %d] Programmed, refreshing consist address only"
+      , consist.id);
+    run_on_executor(service_, [&]()
+    {
+      set_refresh(snapshot, true);
+    });
+  }
+}
+
+bool ConsistManager::program_member(const Consist &consist, size_t index)
+{
+  const ConsistMember &member = consist.members[index];
+  uint8_t address = consist.id;
+  if (!member.forward)
+  {
+    address |= CONSIST_ADDRESS_REVERSED_ORIENTATION;
+  }
+  // F0 responds to the consist address on the lead when moving forward and
+  // on the trail when moving in reverse.
+  uint8_t fl_f9_f12 = CONSIST_F9_F12_ENABLED;
+  if (index == 0)
+  {
+    fl_f9_f12 |= BIT(CONSIST_FUNCTION_CONTROL_FL_F9_F12_BITS::FL_BIT);
+  }
+  if (index == consist.members.size() - 1)
+  {
+    fl_f9_f12 |= BIT(CONSIST_FUNCTION_CONTROL_FL_F9_F12_BITS::FL_REVERSE_BIT);
+  }
+#if CONFIG_OPS_RAILCOM
+  if (!writeOpsCVByteVerified(member.address
+                            , CV_NAMES::CONSIST_FUNCTION_CONTROL_F1_F8
+                            , CONSIST_F1_F8_ENABLED) ||
+      !writeOpsCVByteVerified(member.address
+                            , CV_NAMES::CONSIST_FUNCTION_CONTROL_FL_F9_F12
+                            , fl_f9_f12))
+  {
+    return false;
+  }
+  int16_t config = readOpsCV(member.address, CV_NAMES::DECODER_CONFIG);
+  if (config < 0)
+  {
+    return false;
+  }
+  if (!(config & BIT(DECODER_CONFIG_BITS::FL_CONTROLLED_BY_SPEED)) &&
+      !writeOpsCVByteVerified(member.address, CV_NAMES::DECODER_CONFIG
+                            , config |
+                              BIT(DECODER_CONFIG_BITS::FL_CONTROLLED_BY_SPEED)))
+  {
+    return false;
+  }
+  // the consist address is written last so the decoder does not respond to
+  // it until the function mapping is in place.
+  return writeOpsCVByteVerified(member.address, CV_NAMES::CONSIST_ADDRESS
+                              , address);
+#else
+  // without RailCom the decoder can not confirm the writes.
+  writeOpsCVByte(member.address, CV_NAMES::CONSIST_FUNCTION_CONTROL_F1_F8
+               , CONSIST_F1_F8_ENABLED);
+  writeOpsCVByte(member.address, CV_NAMES::CONSIST_FUNCTION_CONTROL_FL_F9_F12
+               , fl_f9_f12);
+  writeOpsCVBit(member.address, CV_NAMES::DECODER_CONFIG
+              , DECODER_CONFIG_BITS::FL_CONTROLLED_BY_SPEED, true);
+  writeOpsCVByte(member.address, CV_NAMES::CONSIST_ADDRESS, address);
+  return true;
+#endif // CONFIG_OPS_RAILCOM
+}
+
+void ConsistManager::clear_consist_address(
+  const std::vector<ConsistMember> &members)
+{
+  for (auto &member : members)
+  {
+    writeOpsCVByte(member.address, CV_NAMES::CONSIST_ADDRESS
+                 , CONSIST_ADDRESS_NO_ADDRESS);
+  }
+}
+
+void ConsistManager::set_refresh(const Consist &consist, bool consist_address)
+{
+  auto trains = Singleton<commandstation::AllTrainNodes>::instance();
+  bool forward = consist.speed.direction() == dcc::SpeedType::FORWARD;
+  for (auto &member : consist.members)
+  {
+    auto impl =
+      trains->get_train_impl(commandstation::DccMode::DCC_128
+                           , member.address);
+    if (!impl)
+    {
+      continue;
+    }
+    if (consist_address)
+    {
+      dcc::packet_processor_remove_refresh_source(
+        trains->get_packet_source(commandstation::DccMode::DCC_128
+                                , member.address));
+    }
+    else
+    {
+      dcc::SpeedType speed = consist.speed;
+      if (!member.forward)
+      {
+        speed.set_direction(forward ? dcc::SpeedType::REVERSE
+                                    : dcc::SpeedType::FORWARD);
+      }
+      impl->set_speed(speed);
+      dcc::packet_processor_add_refresh_source(
+        trains->get_packet_source(commandstation::DccMode::DCC_128
+                                , member.address));
+    }
+  }
+  if (consist_address)
+  {
+    auto &source = consistSources_[consist.id];
+    if (!source)
+    {
+      // registers itself with the update loop.
+      source.reset(new dcc::Dcc128Train(dcc::DccShortAddress(consist.id)));
+    }
+    source->set_speed(consist.speed);
+    source->set_fn(0, consist.headlight);
+  }
+  else
+  {
+    consistSources_.erase(consist.id);
+  }
+}
+
+void ConsistManager::release(const Consist &consist)
+{
+  LOG(INFO, "[Consist %d] Releasing decoder assisted consist", consist.id);
+  run_on_executor(service_, [&]()
+  {
+    set_refresh(consist, false);
+  });
+  clear_consist_address(consist.members);
+}
+
+std::string ConsistManager::to_json(const Consist &consist)
+{
+  json entry =
+  {
+    { JSON_ID_NODE, consist.id },
+    { JSON_DECODER_ASSISTED_NODE, consist.decoderAssisted },
+    { JSON_CONSIST_PROGRAMMED_NODE, consist.programmed },
+    { JSON_SPEED_NODE, (int)consist.speed.mph() },
+    { JSON_DIRECTION_NODE
+    , consist.speed.direction() == dcc::SpeedType::FORWARD ? JSON_VALUE_FORWARD
+                                                           : JSON_VALUE_REVERSE }
+  };
+  for (auto &member : consist.members)
+  {
+    entry[JSON_LOCOS_NODE].push_back(
+    {
+      { JSON_ADDRESS_NODE, member.address },
+      { JSON_ORIENTATION_NODE
+      , member.forward ? JSON_VALUE_FORWARD : JSON_VALUE_REVERSE }
+    });
+  }
+  return entry.dump();
+}
+
+void ConsistManager::persist()
+{
+  OSMutexLock h(&mux_);
+  if (!dirty_)
+  {
+    LOG(CONFIG_CONSIST_LOG_LEVEL, "[Consist] No entries require persistence.");
+    return;
+  }
+  dirty_ = false;
+  LOG(CONFIG_CONSIST_LOG_LEVEL, "[Consist] Persisting %zu consists"
+    , consists_.size());
+  json root = json::array();
+  for (auto &consist : consists_)
+  {
+    json entry =
+    {
+      { JSON_ID_NODE, consist.id },
+      { JSON_DECODER_ASSISTED_NODE, consist.decoderAssisted },
+      { JSON_CONSIST_PROGRAMMED_NODE, consist.programmed }
+    };
+    for (auto &member : consist.members)
+    {
+      entry[JSON_LOCOS_NODE].push_back(
+      {
+        { JSON_ADDRESS_NODE, member.address },
+        { JSON_ORIENTATION_NODE
+        , member.forward ? JSON_VALUE_FORWARD : JSON_VALUE_REVERSE }
+      });
+    }
+    root.push_back(entry);
+  }
+  Singleton<ConfigurationManager>::instance()->store(CONSISTS_JSON_FILE
+                                                   , root.dump());
+}
+
+} // namespace esp32cs
@@ -0,0 +1,296 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef CONSISTS_H_
+#define CONSISTS_H_
+
+#include <AutoPersistCallbackFlow.h>
+#include <dcc/Loco.hxx>
+#include <dcc/PacketSource.hxx>
+#include <executor/Service.hxx>
+#include <os/OS.hxx>
+#include <utils/Singleton.hxx>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace esp32cs
+{
+
+/// Locomotive which is part of a @ref Consist.
+struct ConsistMember
+{
+  /// DCC address of the locomotive.
+  uint16_t address;
+
+  /// True if the locomotive faces the same direction as the lead locomotive.
+  bool forward;
+};
+
+/// Command station managed consist.
+///
+/// The first member is the lead locomotive and the last member is the trail
+/// locomotive, directions for the consist are relative to the lead.
+struct Consist
+{
+  /// Identifier of the consist, 1-127.
+  uint8_t id;
+
+  /// Locomotives in the consist, lead first and trail last.
+  std::vector<ConsistMember> members;
+
+  /// Last commanded speed, the direction is relative to the lead.
+  dcc::SpeedType speed;
+
+  /// Last commanded state of F0 (headlight).
+  bool headlight;
+
+  /// True if the members should be programmed to respond to the consist
+  /// address (advanced consist).
+  bool decoderAssisted;
+
+  /// True when all members have been programmed with the consist address,
+  /// only the consist address is refreshed on the track.
+  bool programmed;
+
+  /// Incremented each time the members change, used to discard the result
+  /// of programming that no longer matches the consist.
+  uint32_t revision;
+
+  /// @return the member with the provided address or nullptr.
+  const ConsistMember *find(uint16_t address) const;
+};
+
+/// Manages the command station consists.
+///
+/// When any member of a consist is addressed the speed, direction and
+/// function updates are applied to every member. Members facing the opposite
+/// direction to the lead have their direction inverted, F0 is only enabled on
+/// the lead when moving forward and on the trail when moving in reverse so
+/// that only the outward facing light of the consist is lit.
+///
+/// The updates for all members are made from a single callback on the
+/// executor of the train nodes so they are queued consecutively with the DCC
+/// update loop and sent in the same refresh window. The update methods block
+/// until this is done and must not be called from that executor.
+///
+/// A decoder assisted consist has CV19, CV21, CV22 and CV29 of each member
+/// programmed via POM so that the members respond to the consist address.
+/// Once this succeeds only the consist address is refreshed on the track
+/// rather than every member. If programming fails the consist address is
+/// cleared from the members and the consist is managed by the command
+/// station instead. When RailCom is enabled each CV is verified via the
+/// decoder response, otherwise the writes can not be verified.
+class ConsistManager : public Singleton<ConsistManager>
+{
+public:
+  /// Minimum consist identifier.
+  static constexpr uint8_t MIN_CONSIST_ID = 1;
+
+  /// Maximum consist identifier.
+  static constexpr uint8_t MAX_CONSIST_ID = 127;
+
+  /// Highest DCC locomotive address.
+  static constexpr int32_t MAX_LOCO_ADDRESS = 10239;
+
+  /// Highest function number that is forwarded to the members.
+  static constexpr uint32_t MAX_CONSIST_FN = 28;
+
+  /// Constructor.
+  ///
+  /// @param service is the @ref Service which owns the train nodes, the
+  /// updates for the members are made on the executor of this service.
+  ConsistManager(Service *service);
+
+  /// Stops the background persistence.
+  void stop()
+  {
+    persistFlow_.stop();
+  }
+
+  /// Creates or replaces a consist.
+  ///
+  /// @param id is the consist identifier.
+  /// @param locos are the DCC addresses of the locomotives, lead first and
+  /// trail last. Negative addresses indicate the locomotive faces the
+  /// opposite direction to the lead.
+  /// @param decoder_assisted when true the members will be programmed in the
+  /// background to respond to the consist address.
+  ///
+  /// @return true if the consist was created, false if the parameters are
+  /// invalid or a locomotive is already in a different consist.
+  bool create(uint8_t id, const std::vector<int32_t> &locos
+            , bool decoder_assisted = false);
+
+  /// Deletes a consist.
+  ///
+  /// @param id is the consist identifier.
+  ///
+  /// @return true if the consist was deleted.
+  bool remove(uint8_t id);
+
+  /// Removes a locomotive from a consist, the consist will be deleted if
+  /// fewer than two locomotives remain.
+  ///
+  /// @param id is the consist identifier.
+  /// @param address is the DCC address of the locomotive.
+  ///
+  /// @return true if the locomotive was removed.
+  bool remove(uint8_t id, uint16_t address);
+
+  /// @return the identifier of the consist the locomotive is part of, or
+  /// zero if it is not part of a consist.
+  uint8_t find(uint16_t address);
+
+  /// @return true if the consist exists and is decoder assisted.
+  bool is_decoder_assisted(uint8_t id);
+
+  /// @return the DCC address of the lead locomotive of the consist, or zero
+  /// if the consist does not exist.
+  uint16_t lead(uint8_t id);
+
+  /// Sets the speed of the consist that the locomotive is part of.
+  ///
+  /// @param address is the DCC address of the locomotive being controlled.
+  /// @param speed is the requested speed, the direction is relative to the
+  /// locomotive being controlled.
+  ///
+  /// @return true if the locomotive is part of a consist and the update was
+  /// applied to all members, false if it is not part of a consist.
+  bool set_speed(uint16_t address, dcc::SpeedType speed);
+
+  /// Sets functions of the consist that the locomotive is part of.
+  ///
+  /// F0 only lights the outward facing light of the consist, all other
+  /// functions are forwarded to every member.
+  ///
+  /// @param address is the DCC address of the locomotive being controlled.
+  /// @param mask has bit N set for each function N that should be updated.
+  /// @param values has bit N set for each function N that should be on.
+  ///
+  /// @return true if the locomotive is part of a consist and the update was
+  /// applied to all members, false if it is not part of a consist.
+  bool set_fn(uint16_t address, uint32_t mask, uint32_t values);
+
+  /// @return DCC++ formatted status of all consists.
+  std::string get_state_for_dccpp();
+
+  /// @return json formatted list of all consists.
+  std::string get_state_as_json();
+
+  /// @return json formatted consist or an empty string if it does not exist.
+  std::string get_consist_as_json(uint8_t id);
+
+  /// @return json formatted statistics for the consists, including the
+  /// number of refresh sources saved by decoder assisted consists.
+  std::string get_state_json();
+
+private:
+  /// Bit mask for F0 in the function masks.
+  static constexpr uint32_t HEADLIGHT_FN_BIT = 1;
+
+  /// @return the consist with the provided identifier or nullptr.
+  Consist *find_consist(uint8_t id);
+
+  /// @return the consist containing the locomotive or nullptr.
+  Consist *find_consist_for_loco(uint16_t address);
+
+  /// Applies a speed and function update to all members of a consist.
+  ///
+  /// @param consist is a copy of the consist to update.
+  /// @param speed when true the speed of the consist is sent to all members.
+  /// @param lights when true F0 is updated on all members based on the
+  /// direction of the consist.
+  /// @param mask has bit N set for each function N that should be updated.
+  /// @param values has bit N set for each function N that should be on.
+  void apply(const Consist &consist, bool speed, bool lights, uint32_t mask
+           , uint32_t values);
+
+  /// Sends an update for a programmed consist to the consist address, this
+  /// is called on the executor.
+  void apply_consist_address(const Consist &consist, bool speed, bool lights
+                           , uint32_t mask, uint32_t values);
+
+  /// @return json formatted consist.
+  std::string to_json(const Consist &consist);
+
+  /// Queues the programming of the members of a decoder assisted consist.
+  void queue_programming(const Consist &consist);
+
+  /// Programs the members of a decoder assisted consist, this is called on
+  /// the programming thread.
+  void program(Consist consist);
+
+  /// Programs the consist CVs of a single member.
+  ///
+  /// @return true if the member was programmed successfully.
+  bool program_member(const Consist &consist, size_t index);
+
+  /// Clears the consist address from the members so they respond to their
+  /// own address again.
+  void clear_consist_address(const std::vector<ConsistMember> &members);
+
+  /// Selects which addresses of a consist are refreshed on the track, this
+  /// is called on the executor.
+  ///
+  /// @param consist is a copy of the consist.
+  /// @param consist_address when true only the consist address is refreshed,
+  /// when false the members are refreshed using the speed of the consist.
+  void set_refresh(const Consist &consist, bool consist_address);
+
+  /// Releases a programmed consist, the members resume at the speed of the
+  /// consist on their own address.
+  void release(const Consist &consist);
+
+  /// Persists the consists if they have changed.
+  void persist();
+
+  /// Service used for the updates to the members.
+  Service *service_;
+
+  /// All known consists.
+  std::vector<Consist> consists_;
+
+  /// Refresh sources for the consist address of programmed consists, keyed
+  /// by consist identifier. These are not registered with AllTrainNodes so a
+  /// locomotive using the same short address is never replaced or deleted.
+  /// This is only accessed on the executor of @ref service_.
+  std::map<uint8_t, std::unique_ptr<dcc::Dcc128Train>> consistSources_;
+
+  /// Background persistence flow.
+  AutoPersistFlow persistFlow_;
+
+  /// Set when @ref consists_ has changed since it was last persisted.
+  bool dirty_{false};
+
+  /// Last revision assigned to a consist.
+  uint32_t revision_{0};
+
+  /// Number of decoder assisted consists waiting to be programmed.
+  uint32_t programmingPending_{0};
+
+  /// Number of decoder assisted consists which failed programming.
+  uint32_t programmingFailed_{0};
+
+  /// Protects @ref consists_.
+  OSMutex mux_;
+};
+
+} // namespace esp32cs
+
+#endif // CONSISTS_H_
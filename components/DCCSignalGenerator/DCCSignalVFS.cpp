@@ -18,6 +18,9 @@ COPYRIGHT (c) 2020 Mike Dunston
 #include "RMTTrackDevice.h"
 #include "EStopHandler.h"
 #include "Esp32RailComDriver.h"
+#include "PacketCapture.h"
+#include "RailComOccupancy.h"
+#include "RailComPomFlow.h"
 #include "TrackPowerBitInterface.h"
 
 #include <dcc/DccOutput.hxx>
@@ -124,6 +127,10 @@ struct RailComHW
   /// Number of microseconds to wait for railcom data on channel 2.
   static constexpr uint32_t RAILCOM_MAX_READ_DELAY_CH_2 =
     454 - RAILCOM_MAX_READ_DELAY_CH_1;
+
+  /// Number of feedback packets to queue before delivery to the hub.
+  static constexpr size_t FEEDBACK_QUEUE_SIZE =
+    CONFIG_OPS_RAILCOM_FEEDBACK_QUEUE_SIZE;
 };
 
 /// RailCom driver instance for the OPS track.
@@ -147,9 +154,14 @@ static std::unique_ptr<HBridgeShortDetector> track_mon[RMT_CHANNEL_MAX];
 static std::unique_ptr<openlcb::BitEventConsumer> power_event;
 static std::unique_ptr<EStopHandler> estop_handler;
 static std::unique_ptr<ProgrammingTrackBackend> prog_track_backend;
+#if CONFIG_DCC_PACKET_CAPTURE
+static PacketCapture packet_capture;
+#endif // CONFIG_DCC_PACKET_CAPTURE
 #if CONFIG_OPS_RAILCOM
 static std::unique_ptr<dcc::RailcomHubFlow> railcom_hub;
 static std::unique_ptr<dcc::RailcomPrintfFlow> railcom_dumper;
+static std::unique_ptr<RailComOccupancy> railcom_occupancy;
+static std::unique_ptr<RailComPomFlow> railcom_pom;
 #endif // CONFIG_OPS_RAILCOM
 
 /// Updates the status display with the current state of the track outputs.
@@ -379,6 +391,10 @@ void init_dcc_vfs(openlcb::Node *node, Service *service
 #if defined(CONFIG_OPS_RAILCOM)
   railcom_hub.reset(new dcc::RailcomHubFlow(service));
   opsRailComDriver.hw_init(railcom_hub.get());
+  railcom_occupancy.reset(
+    new RailComOccupancy(node, railcom_hub.get()
+                       , SEC_TO_NSEC(CONFIG_OPS_RAILCOM_OCCUPANCY_TIMEOUT_SEC)));
+  railcom_pom.reset(new RailComPomFlow(service, railcom_hub.get()));
 #if defined(CONFIG_OPS_RAILCOM_DUMP_PACKETS)
   railcom_dumper.reset(new dcc::RailcomPrintfFlow(railcom_hub.get()));
 #endif
@@ -428,6 +444,10 @@ void init_dcc_vfs(openlcb::Node *node, Service *service
   dcc_poller.reset(new openlcb::RefreshLoop(node,
     { track_mon[OPS_RMT_CHANNEL].get()
     , track_mon[PROG_RMT_CHANNEL].get()
+#if CONFIG_OPS_RAILCOM
+    , &opsRailComDriver
+    , railcom_occupancy.get()
+#endif // CONFIG_OPS_RAILCOM
   }));
 
   update_status_display();
@@ -454,6 +474,29 @@ std::string get_track_state_json()
                     , track_mon[PROG_RMT_CHANNEL]->getStateAsJson().c_str());
 }
 
+/// @return string containing a two element json array of the signal
+/// generator statistics.
+std::string get_track_signal_json()
+{
+  return StringPrintf("[%s,%s]"
+                    , track[OPS_RMT_CHANNEL]->get_state_json().c_str()
+                    , track[PROG_RMT_CHANNEL]->get_state_json().c_str());
+}
+
+/// @return string containing the RailCom detector statistics, the detected
+/// locomotives and the POM request statistics.
+std::string get_railcom_state_json()
+{
+#if CONFIG_OPS_RAILCOM
+  return StringPrintf("{\"detector\":%s,\"occupancy\":%s,\"pom\":%s}"
+                    , opsRailComDriver.get_state_json().c_str()
+                    , railcom_occupancy->get_state_json().c_str()
+                    , railcom_pom->get_state_json().c_str());
+#else
+  return "{}";
+#endif // CONFIG_OPS_RAILCOM
+}
+
 /// @return DCC++ status data from the OPS track only.
 std::string get_track_state_for_dccpp()
 {
@@ -30,8 +30,9 @@
  * fd that represents the DCC mainline, such as TivaDCC.
  *
  * NOTE: This has been customized for ESP32 Command Station to split the OPS
- * and PROG ioctl handling based on the send_long_preamble header flag. This
- * is not intended for merge back to OpenMRN.
+ * and PROG handling into independent write flows based on the
+ * send_long_preamble header flag. This is not intended for merge back to
+ * OpenMRN.
  * 
  * @author Balazs Racz
  * @date 24 Aug 2014
@@ -46,32 +47,79 @@
 #include <sys/ioctl.h>
 #include <utils/Buffer.hxx>
 #include <utils/Queue.hxx>
+#include <utils/StringPrintf.hxx>
+
+#include "sdkconfig.h"
 
 namespace esp32cs
 {
 
-DuplexedTrackIf::DuplexedTrackIf(Service *service, int pool_size, int ops_fd
-                               , int prog_fd)
-    : StateFlow<Buffer<dcc::Packet>, QList<1>>(service)
-    , fd_ops_(ops_fd), fd_prog_(prog_fd)
-    , pool_(sizeof(Buffer<dcc::Packet>), pool_size)
+DuplexedTrackIf::DuplexedTrackIf(Service *service, int ops_pool_size
+                               , int prog_pool_size, int ops_fd, int prog_fd)
+  : ops_(service, CONFIG_OPS_TRACK_NAME, ops_pool_size, ops_fd)
+  , prog_(service, CONFIG_PROG_TRACK_NAME, prog_pool_size, prog_fd)
 {
 }
 
-StateFlowBase::Action DuplexedTrackIf::entry()
+void DuplexedTrackIf::send(Buffer<dcc::Packet> *packet, unsigned priority)
+{
+  if (!packet->data()->packet_header.send_long_preamble)
+  {
+    ops_.send(packet);
+    return;
+  }
+  // move the packet into the PROG pool so the OPS pool buffer is returned
+  // immediately.
+  Buffer<dcc::Packet> *prog_packet = nullptr;
+  prog_.pool()->alloc(&prog_packet);
+  if (prog_packet)
+  {
+    *prog_packet->data() = *packet->data();
+    prog_.send(prog_packet);
+  }
+  else
+  {
+    prog_.dropped();
+  }
+  packet->unref();
+}
+
+std::string DuplexedTrackIf::get_state_json()
+{
+  return StringPrintf("[%s,%s]", ops_.get_state_json().c_str()
+                    , prog_.get_state_json().c_str());
+}
+
+DuplexedTrackIf::TrackWriteFlow::TrackWriteFlow(Service *service
+                                              , const char *name
+                                              , int pool_size, int fd)
+  : StateFlow<Buffer<dcc::Packet>, QList<1>>(service), name_(name), fd_(fd)
+  , pool_(sizeof(Buffer<dcc::Packet>), pool_size)
+{
+}
+
+StateFlowBase::Action DuplexedTrackIf::TrackWriteFlow::entry()
 {
   auto *p = message()->data();
-  auto fd = p->packet_header.send_long_preamble ?
-    fd_prog_ : fd_ops_;
-  HASSERT(fd >= 0);
-  int ret = ::write(fd, p, sizeof(*p));
+  HASSERT(fd_ >= 0);
+  int ret = ::write(fd_, p, sizeof(*p));
   if (ret < 0)
   {
     HASSERT(errno == ENOSPC);
-    ::ioctl(fd, CAN_IOC_WRITE_ACTIVE, this);
+    waits_++;
+    ::ioctl(fd_, CAN_IOC_WRITE_ACTIVE, this);
     return wait();
   }
-  return finish();
+  written_++;
+  return release_and_exit();
+}
+
+std::string DuplexedTrackIf::TrackWriteFlow::get_state_json()
+{
+  return StringPrintf(
+    "{\"name\":\"%s\",\"written\":%u,\"waits\":%u,\"dropped\":%u,"
+    "\"free\":%zu}"
+  , name_, written_, waits_, dropped_, pool_.free_items());
 }
 
-} // namespace esp32cs
\ No newline at end of file
+} // namespace esp32cs
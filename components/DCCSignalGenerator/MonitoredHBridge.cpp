@@ -18,7 +18,7 @@ COPYRIGHT (c) 2019-2020 Mike Dunston
 #include "MonitoredHBridge.h"
 #include <dcc/ProgrammingTrackBackend.hxx>
 #include <json.hpp>
-#include <numeric>
+#include <StateBus.h>
 #include <StatusLED.h>
 
 namespace esp32cs
@@ -48,6 +48,8 @@ HBridgeShortDetector::HBridgeShortDetector(openlcb::Node *node
   , shutdownBit_(node, 0, 0, &state_, STATE_SHUTDOWN)
   , shortProducer_(&shortBit_)
   , shutdownProducer_(&shortBit_)
+  , ackDetector_(progAckLimit_, overCurrentLimit_, ACK_MIN_WIDTH
+               , ACK_MAX_WIDTH, SHORT_WIDTH)
 {
   // set warning limit to ~75% of overcurrent limit
   warnLimit_ = ((overCurrentLimit_ << 1) + overCurrentLimit_) >> 2;
@@ -77,10 +79,15 @@ HBridgeShortDetector::HBridgeShortDetector(openlcb::Node *node
   , shutdownBit_(node, 0, 0, &state_, STATE_SHUTDOWN)
   , shortProducer_(&shortBit_)
   , shutdownProducer_(&shortBit_)
+  , ackDetector_(progAckLimit_, overCurrentLimit_, ACK_MIN_WIDTH
+               , ACK_MAX_WIDTH, SHORT_WIDTH)
 {
   // set warning limit to ~75% of overcurrent limit
   warnLimit_ = ((overCurrentLimit_ << 1) + overCurrentLimit_) >> 2;
   configure();
+  memset(sampleRing_, 0, sizeof(sampleRing_));
+  os_thread_create(&sampleTask_, "ProgSense", SAMPLE_TASK_PRIORITY, 2048
+                 , sample_task, this);
 }
 
 string HBridgeShortDetector::getState()
@@ -163,36 +170,90 @@ void HBridgeShortDetector::configure()
   }
 }
 
-void HBridgeShortDetector::poll_33hz(openlcb::WriteHelper *helper, Notifiable *done)
+uint32_t HBridgeShortDetector::read_adc()
 {
-  vector<int> samples;
-
-  // collect samples from ADC
-  while(samples.size() < adcSampleCount_)
+  uint32_t total = 0;
+  for (uint8_t count = 0; count < adcSampleCount_; count++)
   {
-    samples.push_back(adc1_get_raw(channel_));
+    total += adc1_get_raw(channel_);
     ets_delay_us(1);
   }
-  // average the collected samples
-  lastReading_ = (std::accumulate(samples.begin(), samples.end(), 0) / samples.size());
+  return total / adcSampleCount_;
+}
+
+void *HBridgeShortDetector::sample_task(void *arg)
+{
+  static_cast<HBridgeShortDetector *>(arg)->sample_loop();
+  return nullptr;
+}
 
-  // if this is the PROG track check up front if we have a short or ACK.
-  if (isProgTrack_ && progEnable_)
+void HBridgeShortDetector::sample_loop()
+{
+  bool enabled = false;
+  while (true)
   {
-    LOG(VERBOSE, "[%s] reading: %d", name_.c_str(), lastReading_);
-    auto backend = Singleton<ProgrammingTrackBackend>::instance();
-    if (lastReading_ >= overCurrentLimit_)
+    uint16_t reading = read_adc();
+    sampleTotal_ += reading - sampleRing_[sampleIndex_];
+    sampleRing_[sampleIndex_] = reading;
+    sampleIndex_ = (sampleIndex_ + 1) % SAMPLE_RING_SIZE;
+
+    if (progEnable_)
     {
-      // note that only over current is checked here since this should be
-      // triggered before the shutdown current has been reached.
-      backend->notify_service_mode_short();
+      if (!enabled)
+      {
+        // the track output was just enabled, establish a new baseline.
+        ackDetector_.reset();
+        enabled = true;
+      }
+      ProgAckDetector::Result result = ackDetector_.sample(reading);
+      if (result != ProgAckDetector::NONE)
+      {
+        // the programming track backend is not thread safe, hand the result
+        // over to its executor rather than calling it from this task.
+        auto backend = Singleton<ProgrammingTrackBackend>::instance();
+        backend->service()->executor()->add(
+          new CallbackExecutable([backend, result]()
+        {
+          if (result == ProgAckDetector::SHORT)
+          {
+            backend->notify_service_mode_short();
+          }
+          else
+          {
+            backend->notify_service_mode_ack();
+          }
+        }));
+        if (result == ProgAckDetector::ACK)
+        {
+          LOG(VERBOSE, "[%s] ACK: %d/4096 over baseline %d"
+            , name_.c_str(), ackDetector_.last_ack_amplitude()
+            , ackDetector_.baseline());
+        }
+      }
+      vTaskDelay(pdMS_TO_TICKS(SAMPLE_INTERVAL_MSEC));
     }
-    else if (lastReading_ >= progAckLimit_)
+    else
     {
-      // send the ack over to the backend since it is over the limit.
-      backend->notify_service_mode_ack();
+      enabled = false;
+      vTaskDelay(pdMS_TO_TICKS(IDLE_SAMPLE_INTERVAL_MSEC));
     }
   }
+}
+
+void HBridgeShortDetector::poll_33hz(openlcb::WriteHelper *helper, Notifiable *done)
+{
+  if (isProgTrack_)
+  {
+    // the PROG track is sampled continuously by the sampling task which also
+    // handles the ACK and short notifications for the programming track
+    // backend, average the most recent samples.
+    lastReading_ = sampleTotal_ / SAMPLE_RING_SIZE;
+    LOG(VERBOSE, "[%s] reading: %d", name_.c_str(), lastReading_);
+  }
+  else
+  {
+    lastReading_ = read_adc();
+  }
 
   uint8_t previous_state = state_;
 
@@ -269,6 +330,20 @@ void HBridgeShortDetector::poll_33hz(openlcb::WriteHelper *helper, Notifiable *d
   bool async_event_req = false;
   if (previous_state != state_)
   {
+    TrackState track_state = TRACK_OFF;
+    if (state_ == STATE_ON)
+    {
+      track_state = TRACK_ON;
+    }
+    else if (state_ == STATE_OVERCURRENT)
+    {
+      track_state = TRACK_OVERCURRENT;
+    }
+    else if (state_ == STATE_SHUTDOWN)
+    {
+      track_state = TRACK_SHUTDOWN;
+    }
+    publish_state(TOPIC_TRACK, isProgTrack_, track_state);
     if (previous_state == STATE_SHUTDOWN || state_ == STATE_SHUTDOWN)
     {
       shutdownProducer_.SendEventReport(helper, done);
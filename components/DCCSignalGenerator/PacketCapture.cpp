@@ -0,0 +1,131 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "PacketCapture.h"
+
+#if CONFIG_DCC_PACKET_CAPTURE
+
+#include <algorithm>
+#include <esp_timer.h>
+#include <utils/StringPrintf.hxx>
+
+namespace esp32cs
+{
+
+void PacketCapture::record(uint8_t track, const dcc::Packet &packet)
+{
+  if (!enabled_ || !(trackMask_ & (1 << track)))
+  {
+    return;
+  }
+  if (!idle_ && !packet.packet_header.is_marklin && packet.dlc == 3 &&
+      packet.payload[0] == 0xFF && packet.payload[1] == 0)
+  {
+    return;
+  }
+  uint32_t head = head_.load(std::memory_order_relaxed);
+  Entry &entry = entries_[head & (CAPTURE_SIZE - 1)];
+  entry.timestamp = (uint32_t)esp_timer_get_time();
+  entry.track = track;
+  entry.flags = (packet.packet_header.is_marklin ? FLAG_MARKLIN : 0) |
+                (packet.packet_header.send_long_preamble ? FLAG_LONG_PREAMBLE
+                                                         : 0);
+  entry.dlc = std::min(packet.dlc, (uint8_t)dcc::Packet::MAX_PAYLOAD);
+  entry.repeat = packet.packet_header.rept_count;
+  memcpy(entry.payload, packet.payload, entry.dlc);
+  memset(entry.payload + entry.dlc, 0, sizeof(entry.payload) - entry.dlc);
+  head_.store(head + 1, std::memory_order_release);
+}
+
+std::string PacketCapture::read(uint32_t since, size_t max_count)
+{
+  uint32_t head = head_.load(std::memory_order_acquire);
+  uint32_t first = std::max(since, tail_);
+  // entries older than one ring length have been overwritten.
+  if (head - first > CAPTURE_SIZE)
+  {
+    first = head - CAPTURE_SIZE;
+  }
+  if ((int32_t)(head - first) < 0)
+  {
+    // the requested sequence is in the future, likely from before a reboot.
+    first = head;
+  }
+  uint32_t count = std::min((size_t)(head - first), max_count);
+
+  std::string stream(sizeof(Header) + (count * sizeof(Entry)), '\0');
+  Entry *entries = reinterpret_cast<Entry *>(&stream[sizeof(Header)]);
+  for (uint32_t index = 0; index < count; index++)
+  {
+    entries[index] = entries_[(first + index) & (CAPTURE_SIZE - 1)];
+  }
+
+  // The ISR may have recorded new packets while the entries were copied, any
+  // entry that has been reused (or is being reused) since must be discarded.
+  uint32_t latest = head_.load(std::memory_order_acquire);
+  uint32_t skip = 0;
+  if (latest - first >= CAPTURE_SIZE)
+  {
+    skip = std::min(latest - first - CAPTURE_SIZE + 1, count);
+  }
+  if (skip)
+  {
+    stream.erase(sizeof(Header), skip * sizeof(Entry));
+    first += skip;
+    count -= skip;
+  }
+
+  Header *header = reinterpret_cast<Header *>(&stream[0]);
+  header->magic = CAPTURE_MAGIC;
+  header->version = CAPTURE_VERSION;
+  header->entry_size = sizeof(Entry);
+  header->count = count;
+  header->first = first;
+  header->next = first + count;
+  return stream;
+}
+
+void PacketCapture::configure(bool enabled, uint8_t track_mask, bool idle)
+{
+  trackMask_ = track_mask;
+  idle_ = idle;
+  enabled_ = enabled;
+}
+
+void PacketCapture::clear()
+{
+  tail_ = head_.load(std::memory_order_acquire);
+}
+
+std::string PacketCapture::get_state_json()
+{
+  uint32_t head = head_.load(std::memory_order_acquire);
+  uint32_t available = head - tail_;
+  if (available > CAPTURE_SIZE)
+  {
+    available = CAPTURE_SIZE;
+  }
+  return StringPrintf(
+    "{\"enabled\":%s,\"tracks\":%u,\"idle\":%s,\"size\":%u,\"next\":%u,"
+    "\"available\":%u}"
+  , enabled_ ? "true" : "false", trackMask_, idle_ ? "true" : "false"
+  , CAPTURE_SIZE, head, available);
+}
+
+} // namespace esp32cs
+
+#endif // CONFIG_DCC_PACKET_CAPTURE
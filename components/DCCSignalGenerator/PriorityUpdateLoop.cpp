@@ -0,0 +1,355 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "PriorityUpdateLoop.h"
+#include "DuplexedTrackIf.h"
+
+#include <algorithm>
+#include <dcc/Loco.hxx>
+#include <utils/logging.h>
+#include <utils/StringPrintf.hxx>
+
+namespace esp32cs
+{
+
+PriorityUpdateLoop::PriorityUpdateLoop(Service *service
+                                     , dcc::PacketFlowInterface *track_send)
+  : StateFlow(service), trackSend_(track_send)
+{
+  memset(updateLatency_, 0, sizeof(updateLatency_));
+}
+
+PriorityUpdateLoop::~PriorityUpdateLoop()
+{
+}
+
+bool PriorityUpdateLoop::add_refresh_source(dcc::PacketSource *source
+                                          , unsigned priority)
+{
+  AtomicHolder h(this);
+  size_t index = find_source(source);
+  if (index != NO_REFRESH_SOURCE)
+  {
+    refreshSources_[index].priority = priority;
+  }
+  else
+  {
+    index = refreshSources_.size();
+    refreshSources_.push_back({source, priority, 0, 0, false});
+    // updates may have been queued before the source was registered.
+    for (size_t pending = 0; pending < pendingCount_; pending++)
+    {
+      if (pending_[pending].source == source)
+      {
+        pending_[pending].refreshIndex = index;
+      }
+    }
+  }
+  update_exclusive_source();
+  if (priority >= EXCLUSIVE_MIN_PRIORITY)
+  {
+    return exclusiveSource_ == source;
+  }
+  return exclusiveSource_ == nullptr;
+}
+
+void PriorityUpdateLoop::remove_refresh_source(dcc::PacketSource *source)
+{
+  AtomicHolder h(this);
+  size_t removed = find_source(source);
+  if (removed != NO_REFRESH_SOURCE)
+  {
+    refreshSources_.erase(refreshSources_.begin() + removed);
+  }
+  for (size_t index = 0; index < pendingCount_;)
+  {
+    if (pending_[index].source == source)
+    {
+      remove_pending(index);
+      continue;
+    }
+    // the sources after the removed one have shifted down by one.
+    if (removed != NO_REFRESH_SOURCE &&
+        pending_[index].refreshIndex != NO_REFRESH_SOURCE &&
+        pending_[index].refreshIndex > removed)
+    {
+      pending_[index].refreshIndex--;
+    }
+    index++;
+  }
+  update_exclusive_source();
+}
+
+void PriorityUpdateLoop::notify_update(dcc::PacketSource *source
+                                     , unsigned code)
+{
+  long long now = os_get_time_monotonic();
+  AtomicHolder h(this);
+  size_t refresh_index = find_source(source);
+  if (refresh_index != NO_REFRESH_SOURCE)
+  {
+    refreshSources_[refresh_index].lastUpdate = now;
+  }
+  // If there is already an update pending for the same source and code we do
+  // not need to queue another one, the packet will be generated from the
+  // latest source state when it is sent.
+  for (size_t index = 0; index < pendingCount_; index++)
+  {
+    if (pending_[index].source == source && pending_[index].code == code)
+    {
+      return;
+    }
+  }
+  if (pendingCount_ >= MAX_PENDING_UPDATES)
+  {
+    // The background refresh will deliver the latest state of the source.
+    droppedUpdates_++;
+    return;
+  }
+  pending_[pendingCount_++] = {source, code, now, refresh_index};
+}
+
+StateFlowBase::Action PriorityUpdateLoop::entry()
+{
+  long long now = os_get_time_monotonic();
+  dcc::PacketSource *source = nullptr;
+  size_t refresh_index = NO_REFRESH_SOURCE;
+  unsigned code = dcc::DccTrainUpdateCode::REFRESH;
+  // service mode packets would be dropped if the PROG output can not accept
+  // them, in which case the slot is used for the OPS track.
+  bool prog_ready = !Singleton<DuplexedTrackIf>::exists() ||
+                    Singleton<DuplexedTrackIf>::instance()->prog_ready();
+  {
+    AtomicHolder h(this);
+    if (exclusiveSource_ && exclusiveTurn_)
+    {
+      if (exclusivePriority_ != PROGRAMMING_PRIORITY || prog_ready)
+      {
+        source = exclusiveSource_;
+        refresh_index = find_source(source);
+        exclusivePackets_++;
+      }
+      else
+      {
+        exclusiveDeferred_++;
+      }
+    }
+    exclusiveTurn_ = !exclusiveTurn_;
+
+    // Find the first pending update that is not blocked by the decoder packet
+    // spacing, e-stop updates take precedence over all other updates.
+    if (!source)
+    {
+      size_t selected = pendingCount_;
+      for (size_t index = 0; index < pendingCount_; index++)
+      {
+        size_t entry = pending_[index].refreshIndex;
+        if (entry != NO_REFRESH_SOURCE &&
+            (now - refreshSources_[entry].lastPacket) <
+              DECODER_PACKET_SPACING_NSEC)
+        {
+          continue;
+        }
+        if (pending_[index].code == dcc::DccTrainUpdateCode::ESTOP)
+        {
+          selected = index;
+          break;
+        }
+        else if (selected == pendingCount_)
+        {
+          selected = index;
+        }
+      }
+      if (selected < pendingCount_)
+      {
+        source = pending_[selected].source;
+        refresh_index = pending_[selected].refreshIndex;
+        code = pending_[selected].code;
+        record_latency(now - pending_[selected].queued);
+        remove_pending(selected);
+        updatePackets_++;
+      }
+    }
+
+    // Select the background refresh source that has been waiting the longest,
+    // recently updated sources have their waiting time weighted so that they
+    // will be refreshed more often. Marklin-Motorola sources have their
+    // waiting time reduced as their packets occupy the track for longer.
+    if (!source)
+    {
+      long long best_score = 0;
+      for (size_t index = 0; index < refreshSources_.size(); index++)
+      {
+        RefreshSource &entry = refreshSources_[index];
+        long long waiting = now - entry.lastPacket;
+        if (entry.priority >= EXCLUSIVE_MIN_PRIORITY ||
+            waiting < DECODER_PACKET_SPACING_NSEC)
+        {
+          continue;
+        }
+        long long score = waiting;
+        if ((now - entry.lastUpdate) < RECENT_UPDATE_WINDOW_NSEC)
+        {
+          score *= RECENT_UPDATE_WEIGHT;
+        }
+        if (entry.marklin)
+        {
+          score /= MARKLIN_REFRESH_WEIGHT_DIVISOR;
+        }
+        if (score > best_score)
+        {
+          best_score = score;
+          source = entry.source;
+          refresh_index = index;
+        }
+      }
+      if (source)
+      {
+        refreshPackets_++;
+      }
+    }
+
+    if (refresh_index != NO_REFRESH_SOURCE)
+    {
+      refreshSources_[refresh_index].lastPacket = now;
+    }
+    if (!source)
+    {
+      idlePackets_++;
+    }
+  }
+
+  // The packet source is called without the lock held as it may add or remove
+  // itself from the update loop.
+  if (source)
+  {
+    source->get_next_packet(code, message()->data());
+    // record the packet type so that the source can be scheduled accordingly
+    // for the next background refresh.
+    bool marklin = message()->data()->packet_header.is_marklin;
+    AtomicHolder h(this);
+    // the source may have been added or removed while the lock was released.
+    if (refresh_index >= refreshSources_.size() ||
+        refreshSources_[refresh_index].source != source)
+    {
+      refresh_index = find_source(source);
+    }
+    if (refresh_index != NO_REFRESH_SOURCE)
+    {
+      refreshSources_[refresh_index].marklin = marklin;
+    }
+    if (marklin)
+    {
+      marklinPackets_++;
+    }
+  }
+  else
+  {
+    message()->data()->set_dcc_idle();
+  }
+
+  // We pass on the filled packet to the track processor.
+  trackSend_->send(transfer_message());
+  return exit();
+}
+
+std::string PriorityUpdateLoop::get_state_json()
+{
+  AtomicHolder h(this);
+  return StringPrintf(
+    "{\"sources\":%zu,\"pending\":%zu,\"update\":%u,\"refresh\":%u,"
+    "\"exclusive\":%u,\"deferred\":%u,\"marklin\":%u,\"idle\":%u,"
+    "\"dropped\":%u,"
+    "\"latency\":"
+    "{\"max\":%lld,\"p50\":%u,\"p99\":%u}}"
+  , refreshSources_.size(), pendingCount_, updatePackets_, refreshPackets_
+  , exclusivePackets_, exclusiveDeferred_, marklinPackets_, idlePackets_, droppedUpdates_
+  , maxUpdateLatency_ / 1000000LL, latency_percentile(50)
+  , latency_percentile(99));
+}
+
+void PriorityUpdateLoop::update_exclusive_source()
+{
+  exclusiveSource_ = nullptr;
+  unsigned highest = EXCLUSIVE_MIN_PRIORITY;
+  for (auto &entry : refreshSources_)
+  {
+    if (entry.priority >= highest)
+    {
+      highest = entry.priority;
+      exclusiveSource_ = entry.source;
+    }
+  }
+  exclusivePriority_ = exclusiveSource_ ? highest : 0;
+}
+
+size_t PriorityUpdateLoop::find_source(dcc::PacketSource *source)
+{
+  for (size_t index = 0; index < refreshSources_.size(); index++)
+  {
+    if (refreshSources_[index].source == source)
+    {
+      return index;
+    }
+  }
+  return NO_REFRESH_SOURCE;
+}
+
+void PriorityUpdateLoop::remove_pending(size_t index)
+{
+  HASSERT(index < pendingCount_);
+  // shift the remaining entries to preserve the order in which the updates
+  // were received.
+  for (size_t next = index + 1; next < pendingCount_; next++)
+  {
+    pending_[next - 1] = pending_[next];
+  }
+  pendingCount_--;
+}
+
+void PriorityUpdateLoop::record_latency(long long latency)
+{
+  maxUpdateLatency_ = std::max(maxUpdateLatency_, latency);
+  size_t bucket = std::min((size_t)(latency / 1000000LL), LATENCY_BUCKETS - 1);
+  updateLatency_[bucket]++;
+}
+
+uint32_t PriorityUpdateLoop::latency_percentile(uint32_t percentile)
+{
+  uint64_t total = 0;
+  for (size_t bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+  {
+    total += updateLatency_[bucket];
+  }
+  if (!total)
+  {
+    return 0;
+  }
+  uint64_t target = ((total * percentile) + 99) / 100;
+  uint64_t count = 0;
+  for (size_t bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+  {
+    count += updateLatency_[bucket];
+    if (count >= target)
+    {
+      return bucket + 1;
+    }
+  }
+  return LATENCY_BUCKETS;
+}
+
+} // namespace esp32cs
@@ -0,0 +1,121 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "ProgAckDetector.h"
+
+namespace esp32cs
+{
+
+ProgAckDetector::ProgAckDetector(uint16_t ackThreshold, uint16_t shortLimit
+                               , uint8_t minWidth, uint8_t maxWidth
+                               , uint8_t shortWidth)
+  : ackThreshold_(ackThreshold), shortLimit_(shortLimit), minWidth_(minWidth)
+  , maxWidth_(maxWidth), shortWidth_(shortWidth)
+{
+}
+
+ProgAckDetector::Result ProgAckDetector::sample(uint16_t reading)
+{
+  // short detection is independent of the baseline.
+  if (reading >= shortLimit_)
+  {
+    if (shortCount_ < shortWidth_ && ++shortCount_ == shortWidth_)
+    {
+      return SHORT;
+    }
+  }
+  else
+  {
+    shortCount_ = 0;
+  }
+
+  uint32_t scaled = (uint32_t)reading << BASELINE_SHIFT;
+
+  // collect the initial baseline, the first sample seeds the average.
+  if (settleCount_ < BASELINE_SETTLE_SAMPLES)
+  {
+    if (!settleCount_)
+    {
+      baseline_ = scaled;
+    }
+    else
+    {
+      baseline_ = (baseline_ + scaled) >> 1;
+    }
+    settleCount_++;
+    return NONE;
+  }
+
+  uint16_t current = baseline();
+  uint16_t delta = reading > current ? reading - current : 0;
+  if (delta >= ackThreshold_)
+  {
+    if (pulseWidth_ < UINT8_MAX)
+    {
+      pulseWidth_++;
+    }
+    if (delta > pulsePeak_)
+    {
+      pulsePeak_ = delta;
+    }
+    if (pulseWidth_ > maxWidth_)
+    {
+      // the current has been high for too long to be an ACK, consider this
+      // to be the new idle current level.
+      baseline_ = scaled;
+      pulseWidth_ = 0;
+      pulsePeak_ = 0;
+    }
+    return NONE;
+  }
+
+  // the pulse is only known to be an ACK once it has ended within the
+  // allowed width, a load change would otherwise be reported as an ACK.
+  Result result = NONE;
+  if (pulseWidth_ >= minWidth_ && pulseWidth_ <= maxWidth_)
+  {
+    ackCount_++;
+    lastAckWidth_ = pulseWidth_;
+    lastAckAmplitude_ = pulsePeak_;
+    result = ACK;
+  }
+  pulseWidth_ = 0;
+  pulsePeak_ = 0;
+
+  // track slow changes of the idle current, samples that are part of a pulse
+  // are not included.
+  if (scaled >= baseline_)
+  {
+    baseline_ += (scaled - baseline_) >> BASELINE_WEIGHT_SHIFT;
+  }
+  else
+  {
+    baseline_ -= (baseline_ - scaled) >> BASELINE_WEIGHT_SHIFT;
+  }
+  return result;
+}
+
+void ProgAckDetector::reset()
+{
+  baseline_ = 0;
+  settleCount_ = 0;
+  pulseWidth_ = 0;
+  pulsePeak_ = 0;
+  shortCount_ = 0;
+}
+
+} // namespace esp32cs
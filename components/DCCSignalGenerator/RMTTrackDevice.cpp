@@ -16,10 +16,12 @@ COPYRIGHT (c) 2019-2020 Mike Dunston
 **********************************************************************/
 
 #include "RMTTrackDevice.h"
+#include "PacketCapture.h"
 #include "sdkconfig.h"
 
 #include <dcc/DccDebug.hxx>
 #include <soc/gpio_struct.h>
+#include <xtensa/hal.h>
 
 
 namespace esp32cs
@@ -94,26 +96,64 @@ static constexpr rmt_item32_t DCC_RMT_ONE_BIT =
 #endif // CONFIG_DCC_RMT_HIGH_FIRST
 
 ///////////////////////////////////////////////////////////////////////////////
-// Marklin Motorola bit timing (WIP)
+// Marklin Motorola bit timing
 // https://people.zeelandnet.nl/zondervan/digispan.html
 // http://www.drkoenig.de/digital/motorola.htm
+//
+// Locomotive packets use a bit time of 208uS, a ZERO bit is a short positive
+// pulse and a ONE bit is a long positive pulse. Each packet is sent twice with
+// a pause of six bit times between the copies and a pause of at least 4.2mS
+// before the next packet.
 ///////////////////////////////////////////////////////////////////////////////
-static constexpr uint32_t MARKLIN_ZERO_BIT_PULSE_HIGH_USEC = 182;
-static constexpr uint32_t MARKLIN_ZERO_BIT_PULSE_LOW_USEC = 26;
-static constexpr uint32_t MARKLIN_ONE_BIT_PULSE_HIGH_USEC = 26;
-static constexpr uint32_t MARKLIN_ONE_BIT_PULSE_LOW_USEC = 182;
-static constexpr uint32_t MARKLIN_PREAMBLE_BIT_PULSE_HIGH_USEC = 104;
-static constexpr uint32_t MARKLIN_PREAMBLE_BIT_PULSE_LOW_USEC = 104;
+static constexpr uint32_t MARKLIN_BIT_USEC = 208;
+static constexpr uint32_t MARKLIN_ZERO_BIT_PULSE_HIGH_USEC = 26;
+static constexpr uint32_t MARKLIN_ZERO_BIT_PULSE_LOW_USEC = 182;
+static constexpr uint32_t MARKLIN_ONE_BIT_PULSE_HIGH_USEC = 182;
+static constexpr uint32_t MARKLIN_ONE_BIT_PULSE_LOW_USEC = 26;
+static constexpr uint32_t MARKLIN_REPEAT_PAUSE_USEC = 6 * MARKLIN_BIT_USEC;
+static constexpr uint32_t MARKLIN_PACKET_PAUSE_USEC = 4200;
+
+static_assert(MARKLIN_ZERO_BIT_PULSE_HIGH_USEC +
+              MARKLIN_ZERO_BIT_PULSE_LOW_USEC == MARKLIN_BIT_USEC
+            , "Marklin ZERO bit does not match the bit time");
+static_assert(MARKLIN_ONE_BIT_PULSE_HIGH_USEC +
+              MARKLIN_ONE_BIT_PULSE_LOW_USEC == MARKLIN_BIT_USEC
+            , "Marklin ONE bit does not match the bit time");
+static_assert(MARKLIN_ONE_BIT_PULSE_HIGH_USEC ==
+              MARKLIN_ZERO_BIT_PULSE_LOW_USEC
+            , "Marklin ONE bit must be the inverse of the ZERO bit");
+
+///////////////////////////////////////////////////////////////////////////////
+// The DCC timings are configured in RMT ticks, the Marklin-Motorola timings
+// are fixed and are converted from microseconds based on the RMT clock source
+// and divider.
+///////////////////////////////////////////////////////////////////////////////
+#if defined(CONFIG_DCC_RMT_USE_REF_CLOCK)
+static constexpr uint64_t RMT_SOURCE_CLOCK_HZ = 1000000ULL;
+#else
+static constexpr uint64_t RMT_SOURCE_CLOCK_HZ = 80000000ULL;
+#endif // CONFIG_DCC_RMT_USE_REF_CLOCK
+
+static constexpr uint32_t usec_to_rmt_ticks(uint32_t usec)
+{
+  return (usec * RMT_SOURCE_CLOCK_HZ) /
+         (CONFIG_DCC_RMT_CLOCK_DIVIDER * 1000000ULL);
+}
+
+static_assert(usec_to_rmt_ticks(MARKLIN_ZERO_BIT_PULSE_HIGH_USEC) > 0
+            , "RMT clock divider is too large for Marklin-Motorola timing");
+static_assert(usec_to_rmt_ticks(MARKLIN_PACKET_PAUSE_USEC / 2) < (1 << 15)
+            , "RMT clock divider is too small for Marklin-Motorola timing");
 
 ///////////////////////////////////////////////////////////////////////////////
 // Marklin Motorola ZERO bit pre-encoded in RMT format, sent as HIGH then LOW.
 ///////////////////////////////////////////////////////////////////////////////
 static constexpr rmt_item32_t MARKLIN_RMT_ZERO_BIT =
 {{{
-    MARKLIN_ZERO_BIT_PULSE_HIGH_USEC  // number of microseconds for TOP half
-  , 1                                 // of the square wave.
-  , MARKLIN_ZERO_BIT_PULSE_LOW_USEC   // number of microseconds for BOTTOM half
-  , 0                                 // of the square wave.
+    usec_to_rmt_ticks(MARKLIN_ZERO_BIT_PULSE_HIGH_USEC)
+  , 1                                 // TOP half of the square wave.
+  , usec_to_rmt_ticks(MARKLIN_ZERO_BIT_PULSE_LOW_USEC)
+  , 0                                 // BOTTOM half of the square wave.
 }}};
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -121,22 +161,34 @@ static constexpr rmt_item32_t MARKLIN_RMT_ZERO_BIT =
 ///////////////////////////////////////////////////////////////////////////////
 static constexpr rmt_item32_t MARKLIN_RMT_ONE_BIT =
 {{{
-    MARKLIN_ZERO_BIT_PULSE_HIGH_USEC  // number of microseconds for TOP half
-  , 1                                 // of the square wave.
-  , MARKLIN_ZERO_BIT_PULSE_LOW_USEC   // number of microseconds for BOTTOM half
-  , 0                                 // of the square wave.
+    usec_to_rmt_ticks(MARKLIN_ONE_BIT_PULSE_HIGH_USEC)
+  , 1                                 // TOP half of the square wave.
+  , usec_to_rmt_ticks(MARKLIN_ONE_BIT_PULSE_LOW_USEC)
+  , 0                                 // BOTTOM half of the square wave.
 }}};
 
 ///////////////////////////////////////////////////////////////////////////////
-// Marklin Motorola preamble bit pre-encoded in RMT format, both top and bottom
-// half of the wave are LOW.
+// Marklin Motorola pause between the two copies of a packet pre-encoded in RMT
+// format, both top and bottom half of the wave are LOW.
 ///////////////////////////////////////////////////////////////////////////////
-static constexpr rmt_item32_t MARKLIN_RMT_PREAMBLE_BIT =
+static constexpr rmt_item32_t MARKLIN_RMT_REPEAT_PAUSE =
 {{{
-    MARKLIN_PREAMBLE_BIT_PULSE_HIGH_USEC // number of microseconds for TOP half
-  , 0                                    // of the square wave.
-  , MARKLIN_PREAMBLE_BIT_PULSE_LOW_USEC  // number of microseconds for BOTTOM
-  , 0                                    // half of the square wave.
+    usec_to_rmt_ticks(MARKLIN_REPEAT_PAUSE_USEC / 2)
+  , 0                                 // TOP half of the square wave.
+  , usec_to_rmt_ticks(MARKLIN_REPEAT_PAUSE_USEC / 2)
+  , 0                                 // BOTTOM half of the square wave.
+}}};
+
+///////////////////////////////////////////////////////////////////////////////
+// Marklin Motorola pause after a packet pre-encoded in RMT format, both top
+// and bottom half of the wave are LOW.
+///////////////////////////////////////////////////////////////////////////////
+static constexpr rmt_item32_t MARKLIN_RMT_PACKET_PAUSE =
+{{{
+    usec_to_rmt_ticks(MARKLIN_PACKET_PAUSE_USEC / 2)
+  , 0                                 // TOP half of the square wave.
+  , usec_to_rmt_ticks(MARKLIN_PACKET_PAUSE_USEC / 2)
+  , 0                                 // BOTTOM half of the square wave.
 }}};
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -184,7 +236,7 @@ RMTTrackDevice::RMTTrackDevice(const char *name
                              , channel_(channel)
                              , dccPreambleBitCount_(dccPreambleBitCount)
                              , railcomDriver_(railcomDriver)
-                             , packetQueue_(DeviceBuffer<dcc::Packet>::create(packet_queue_len))
+                             , packetQueue_(packet_queue_len)
 {
   uint16_t maxBitCount = dccPreambleBitCount_             // preamble bits
                         + 1                               // packet start bit
@@ -192,6 +244,9 @@ RMTTrackDevice::RMTTrackDevice(const char *name
                         +  dcc::Packet::MAX_PAYLOAD       // end of byte bits
                         + 1                               // end of packet bit
                         + 1;                              // RMT extra bit
+  // Marklin-Motorola packets do not use the preamble but may be longer when
+  // the DCC preamble is short.
+  maxBitCount = std::max(maxBitCount, (uint16_t)MAX_MARKLIN_RMT_BITS);
   HASSERT(maxBitCount <= MAX_RMT_BITS);
 
   uint8_t memoryBlocks = (maxBitCount / RMT_MEM_ITEM_NUM) + 1;
@@ -207,12 +262,12 @@ RMTTrackDevice::RMTTrackDevice(const char *name
     , "low, high"
 #endif
     );
-  /*LOG(INFO
-    , "[%s] Marklin-Motorola config: zero: %duS (high), zero: %duS (low), "
-      "one: %duS (high), one: %duS (low), preamble: %duS (low)",
+  LOG(INFO
+    , "[%s] Marklin-Motorola config: zero: %duS (high), %duS (low), "
+      "one: %duS (high), %duS (low), pause: %duS (repeat), %duS (packet)"
     , name_, MARKLIN_ZERO_BIT_PULSE_HIGH_USEC, MARKLIN_ZERO_BIT_PULSE_LOW_USEC
     , MARKLIN_ONE_BIT_PULSE_HIGH_USEC, MARKLIN_ONE_BIT_PULSE_LOW_USEC
-    , MARKLIN_PREAMBLE_BIT_PULSE_HIGH_USEC + MARKLIN_PREAMBLE_BIT_PULSE_LOW_USEC);*/
+    , MARKLIN_REPEAT_PAUSE_USEC, MARKLIN_PACKET_PAUSE_USEC);
   LOG(INFO
     , "[%s] signal pin: %d, RMT(ch:%d,mem:%d[%d],clk-div:%d,clk-src:%s)"
     , name_, pin, channel_, maxBitCount, memoryBlocks
@@ -251,6 +306,16 @@ RMTTrackDevice::RMTTrackDevice(const char *name
   ESP_ERROR_CHECK(rmt_set_source_clk(channel_, RMT_BASECLK_REF));
 #endif // CONFIG_DCC_RMT_USE_APB_CLOCK
 
+  // The preamble is the same for all packets, encode it once and the payload
+  // will be appended after it for each packet.
+  for (auto &packet : packets_)
+  {
+    for (uint8_t bit = 0; bit < dccPreambleBitCount_; bit++)
+    {
+      packet.items[bit].val = DCC_RMT_ONE_BIT.val;
+    }
+  }
+
   LOG(INFO, "[%s] Starting signal generator", name_);
   // send one bit to kickstart the signal, remaining data will come from the
   // packet queue. We intentionally do not wait for the RMT TX complete here.
@@ -263,8 +328,6 @@ RMTTrackDevice::RMTTrackDevice(const char *name
 // This will write *ONE* dcc::Packet to either the OPS or PROG packet queue. If
 // there is no space in the packet queue the packet will be rejected and errno
 // set to ENOSPC.
-//
-// NOTE: At this time Marklin packets will be actively rejected.
 ///////////////////////////////////////////////////////////////////////////////
 ssize_t RMTTrackDevice::write(int fd, const void * data, size_t size)
 {
@@ -275,25 +338,21 @@ ssize_t RMTTrackDevice::write(int fd, const void * data, size_t size)
   }
   const dcc::Packet *sourcePacket{(dcc::Packet *)data};
 
-  if (sourcePacket->packet_header.is_marklin)
+  if (sourcePacket->packet_header.is_marklin &&
+     (!sourcePacket->dlc ||
+      sourcePacket->dlc % MARKLIN_PACKET_BYTES))
   {
-    // drop marklin packets as unsupported for now.
-    errno = ENOTSUP;
+    // Marklin-Motorola packets are sent as groups of three payload bytes.
+    errno = EINVAL;
     return -1;
   }
 
+  if (packetQueue_.push(*sourcePacket))
   {
-    AtomicHolder l(&packetQueueLock_);
-    dcc::Packet* writePacket;
-    if (packetQueue_->space() &&
-        packetQueue_->data_write_pointer(&writePacket))
-    {
-      memcpy(writePacket, data, size);
-      packetQueue_->advance(1);
-      return 1;
-    }
+    return 1;
   }
   // packet queue is full!
+  queueFullCount_++;
   errno = ENOSPC;
   return -1;
 }
@@ -305,6 +364,12 @@ ssize_t RMTTrackDevice::write(int fd, const void * data, size_t size)
 // there is no space in the queue the Notifiable will be stored to be called
 // after the next DCC packet has been transmitted. Any existing Notifiable will
 // be called to requeue themselves if necessary.
+//
+// The RMT ISR may consume a packet between the queue check and storing the
+// Notifiable, in which case it would not see the Notifiable. To avoid losing
+// the wake up the queue is checked again after the Notifiable is stored and if
+// space is now available the Notifiable is reclaimed and called here. The
+// Notifiable is exchanged atomically so exactly one side will call it.
 ///////////////////////////////////////////////////////////////////////////////
 int RMTTrackDevice::ioctl(int fd, int cmd, va_list args)
 {
@@ -314,12 +379,19 @@ int RMTTrackDevice::ioctl(int fd, int cmd, va_list args)
   {
     Notifiable* n = reinterpret_cast<Notifiable*>(va_arg(args, uintptr_t));
     HASSERT(n);
+    if (packetQueue_.full())
     {
-      AtomicHolder l(&packetQueueLock_);
-      if (!packetQueue_->space())
+      // stash the notifiable so we can call it later when there is space
+      n = notifiable_.exchange(n);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (!packetQueue_.full())
       {
-        // stash the notifiable so we can call it later when there is space
-        std::swap(n, notifiable_);
+        // the ISR consumed a packet while the notifiable was being stored.
+        Notifiable *pending = notifiable_.exchange(nullptr);
+        if (pending)
+        {
+          pending->notify();
+        }
       }
     }
     if (n)
@@ -329,6 +401,16 @@ int RMTTrackDevice::ioctl(int fd, int cmd, va_list args)
     return 0;
   }
 
+  // Retrieve the signal generator statistics
+  if (cmd == TRACK_IOC_SIGNAL_STATS)
+  {
+    track_signal_stats_t *stats =
+      reinterpret_cast<track_signal_stats_t *>(va_arg(args, uintptr_t));
+    HASSERT(stats);
+    get_signal_stats(stats);
+    return 0;
+  }
+
   // Unknown ioctl operation
   errno = EINVAL;
   return -1;
@@ -337,112 +419,283 @@ int RMTTrackDevice::ioctl(int fd, int cmd, va_list args)
 ///////////////////////////////////////////////////////////////////////////////
 // RMT transmit complete callback.
 //
-// When RailCom is enabled this will poll for RailCom data before transmission
-// of the next dcc::Packet from the queue.
+// Packets are double buffered, while one packet is being transmitted the next
+// packet is encoded into the other buffer. When the transmission completes the
+// already encoded packet only needs to be copied into the RMT memory which
+// keeps the inter-packet gap short and consistent. Repeats of the same packet
+// are transmitted directly from the RMT memory without any copy.
+//
+// When RailCom is enabled the cutout is started before the next packet is
+// loaded, the RailCom driver only disables the h-bridge and arms its timer so
+// the transmission starts without delay and the cutout overlays the preamble.
 //
 // Note: This does not use ESP-IDF provided rmt_write_items to increase
 // performance by avoiding various FreeRTOS functions used by the API.
 ///////////////////////////////////////////////////////////////////////////////
 void RMTTrackDevice::rmt_transmit_complete()
 {
-  encode_next_packet();
-  railcomDriver_->start_cutout();
+  uint32_t start = xthal_get_ccount();
+  EncodedPacket *current = &packets_[activePacket_];
+  // the RailCom cutout that follows belongs to the packet that just completed,
+  // there is no cutout after a Marklin-Motorola packet.
+  bool cutout = !current->marklin;
+  if (cutout)
+  {
+    railcomDriver_->set_feedback_key(current->feedbackKey);
+  }
+
+  bool reload = false;
+  if (--current->repeat < 0)
+  {
+    if (!nextPacketReady_)
+    {
+      // the look-ahead encoding did not happen, encode it now in the gap.
+      lookaheadMissCount_++;
+      encode_next_packet(&packets_[activePacket_ ^ 1]);
+    }
+    activePacket_ ^= 1;
+    nextPacketReady_ = false;
+    current = &packets_[activePacket_];
+    reload = true;
+  }
+
+  if (cutout)
+  {
+    railcomDriver_->start_cutout();
+  }
 
-  // send the packet to the RMT, note not using memcpy for the packet as this
-  // directly accesses hardware registers.
-  RMT.apb_conf.fifo_mask = RMT_DATA_MODE_MEM;
-  for(uint32_t index = 0; index < pktLength_; index++)
+  if (reload)
   {
-    RMTMEM.chan[channel_].data32[index].val = packet_[index].val;
+    // send the packet to the RMT, note not using memcpy for the packet as
+    // this directly accesses hardware registers.
+    RMT.apb_conf.fifo_mask = RMT_DATA_MODE_MEM;
+    for(uint32_t index = 0; index < current->length; index++)
+    {
+      RMTMEM.chan[channel_].data32[index].val = current->items[index].val;
+    }
+    // RMT marker for "end of data"
+    RMTMEM.chan[channel_].data32[current->length].val = 0;
   }
-  // RMT marker for "end of data"
-  RMTMEM.chan[channel_].data32[pktLength_].val = 0;
   // start transmit
   RMT.conf_ch[channel_].conf1.mem_rd_rst = 1;
   RMT.conf_ch[channel_].conf1.mem_owner = RMT_MEM_OWNER_TX;
   RMT.conf_ch[channel_].conf1.tx_start = 1;
+
+  uint32_t gap = xthal_get_ccount() - start;
+  {
+    AtomicHolder h(&statsLock_);
+    transmitCount_++;
+    gapCyclesTotal_ += gap;
+    gapCyclesMin_ = std::min(gapCyclesMin_, gap);
+    gapCyclesMax_ = std::max(gapCyclesMax_, gap);
+  }
+
+  // If this is the last transmission of the current packet encode the next
+  // packet while this one is on the wire.
+  if (current->repeat <= 0 && !nextPacketReady_)
+  {
+    encode_next_packet(&packets_[activePacket_ ^ 1]);
+    nextPacketReady_ = true;
+  }
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 // Transfers a dcc::Packet to the OPS packet queue.
 //
-// NOTE: At this time Marklin packets will be actively discarded.
+// NOTE: Malformed Marklin packets will be discarded.
 ///////////////////////////////////////////////////////////////////////////////
 void RMTTrackDevice::send(Buffer<dcc::Packet> *b, unsigned prio)
 {
-  // if it is not a Marklin Motorola packet put it in the queue, otherwise
-  // discard.
-  if (!b->data()->packet_header.is_marklin)
+  const dcc::Packet *packet = b->data();
+  if ((!packet->packet_header.is_marklin ||
+       (packet->dlc && (packet->dlc % MARKLIN_PACKET_BYTES) == 0)) &&
+      !packetQueue_.push(*packet))
   {
-    AtomicHolder l(&packetQueueLock_);
-    dcc::Packet* writePacket;
-    if (packetQueue_->space() &&
-        packetQueue_->data_write_pointer(&writePacket))
-    {
-      memcpy(writePacket, b->data(), b->size());
-      packetQueue_->advance(1);
-    }
+    queueFullCount_++;
   }
   b->unref();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Encode the next packet or reuse the existing packet.
+// Encode the next packet from the queue into the provided buffer.
 ///////////////////////////////////////////////////////////////////////////////
-void RMTTrackDevice::encode_next_packet()
+void RMTTrackDevice::encode_next_packet(EncodedPacket *target)
 {
-  // Check if we need to encode the next packet or if we still have at least
-  // one repeat left of the current packet.
-  if (--pktRepeatCount_ >= 0)
-  {
-    return;
-  }
   // attempt to fetch a packet from the queue or use an idle packet
-  Notifiable* n = nullptr;
   dcc::Packet packet{dcc::Packet::DCC_IDLE()};
+  if (packetQueue_.pop(&packet))
   {
-    AtomicHolder l(&packetQueueLock_);
-    if (packetQueue_->get(&packet, 1))
+    // since we removed a packet from the queue, check if we have a pending
+    // notifiable to wake up. The fence orders the queue update before the
+    // notifiable check, pairing with the re-check in ioctl().
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (notifiable_.load(std::memory_order_relaxed))
     {
-      // since we removed a packet from the queue, check if we have a pending
-      // notifiable to wake up.
-      std::swap(n, notifiable_);
+      Notifiable *n = notifiable_.exchange(nullptr);
+      if (n)
+      {
+        n->notify_from_isr();
+      }
     }
   }
-  if (n)
+  else
+  {
+    underrunCount_++;
+  }
+
+#if CONFIG_DCC_PACKET_CAPTURE
+  Singleton<PacketCapture>::instance()->record(channel_, packet);
+#endif // CONFIG_DCC_PACKET_CAPTURE
+
+  uint32_t start = xthal_get_ccount();
+  if (packet.packet_header.is_marklin)
+  {
+    encode_marklin_packet(packet, target);
+    marklinCount_++;
+  }
+  else
+  {
+    encode_dcc_packet(packet, target);
+  }
+  uint32_t cycles = xthal_get_ccount() - start;
   {
-    n->notify_from_isr();
+    AtomicHolder h(&statsLock_);
+    encodeCount_++;
+    encodeCyclesTotal_ += cycles;
+    encodeCyclesMin_ = std::min(encodeCyclesMin_, cycles);
+    encodeCyclesMax_ = std::max(encodeCyclesMax_, cycles);
   }
-  // TODO: add encoding for Marklin-Motorola
 
-  // encode the preamble bits
-  for (pktLength_ = 0; pktLength_ < dccPreambleBitCount_; pktLength_++)
+  // record the repeat count and feedback key
+  target->repeat = packet.packet_header.rept_count;
+  target->feedbackKey = packet.feedback_key;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Encodes a DCC packet payload after the shared preamble bits.
+//
+// The payload is encoded directly into the transmit buffer, the refresh of
+// multiple locomotives does not repeat the same payload often enough for a
+// cache of pre-encoded payloads to be faster (see
+// tests/host/RMTEncodeBenchmark.cpp).
+///////////////////////////////////////////////////////////////////////////////
+void RMTTrackDevice::encode_dcc_packet(const dcc::Packet &packet
+                                     , EncodedPacket *target)
+{
+  if (target->marklin)
   {
-    packet_[pktLength_].val = DCC_RMT_ONE_BIT.val;
+    // the buffer was last used for a Marklin-Motorola packet which
+    // overwrote the preamble, restore it.
+    for (uint8_t bit = 0; bit < dccPreambleBitCount_; bit++)
+    {
+      target->items[bit].val = DCC_RMT_ONE_BIT.val;
+    }
+    target->marklin = false;
   }
+  target->length = dccPreambleBitCount_;
   // start of payload marker
-  packet_[pktLength_++].val = DCC_RMT_ZERO_BIT.val;
+  target->items[target->length++].val = DCC_RMT_ZERO_BIT.val;
   // encode the packet bits
   for (uint8_t dlc = 0; dlc < packet.dlc; dlc++)
   {
     for(uint8_t bit = 0; bit < 8; bit++)
     {
-      packet_[pktLength_++].val =
+      target->items[target->length++].val =
         packet.payload[dlc] & PACKET_BIT_MASK[bit] ?
           DCC_RMT_ONE_BIT.val : DCC_RMT_ZERO_BIT.val;
     }
     // end of byte marker
-    packet_[pktLength_++].val = DCC_RMT_ZERO_BIT.val;
+    target->items[target->length++].val = DCC_RMT_ZERO_BIT.val;
   }
   // set the last bit of the encoded payload to be an end of packet marker
-  packet_[pktLength_ - 1].val = DCC_RMT_ONE_BIT.val;
+  target->items[target->length - 1].val = DCC_RMT_ONE_BIT.val;
   // add an extra ONE bit to the end to prevent mangling of the last bit by
   // the RMT
-  packet_[pktLength_++].val = DCC_RMT_ONE_BIT.val;
-  // record the repeat count
-  pktRepeatCount_ = packet.packet_header.rept_count;
+  target->items[target->length++].val = DCC_RMT_ONE_BIT.val;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Encodes a Marklin-Motorola packet.
+//
+// Each group of three payload bytes holds one 18 bit packet, the first byte
+// only uses the lowest two bits. The address trits are already converted to
+// bit pairs by dcc::Packet so the bits are sent as-is, MSB first. Each packet
+// is sent twice as required by the decoders, followed by the pause before the
+// next packet.
+///////////////////////////////////////////////////////////////////////////////
+void RMTTrackDevice::encode_marklin_packet(const dcc::Packet &packet
+                                         , EncodedPacket *target)
+{
+  target->length = 0;
+  target->marklin = true;
+  for (uint8_t offs = 0; offs + MARKLIN_PACKET_BYTES <= packet.dlc;
+       offs += MARKLIN_PACKET_BYTES)
+  {
+    uint32_t bits = (packet.payload[offs] << 16) |
+                    (packet.payload[offs + 1] << 8) |
+                     packet.payload[offs + 2];
+    for (uint8_t copy = 0; copy < 2; copy++)
+    {
+      for (int8_t bit = MARKLIN_PACKET_BITS - 1; bit >= 0; bit--)
+      {
+        target->items[target->length++].val =
+          bits & (1 << bit) ? MARKLIN_RMT_ONE_BIT.val
+                            : MARKLIN_RMT_ZERO_BIT.val;
+      }
+      target->items[target->length++].val =
+        copy ? MARKLIN_RMT_PACKET_PAUSE.val : MARKLIN_RMT_REPEAT_PAUSE.val;
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Retrieves the signal generator statistics.
+///////////////////////////////////////////////////////////////////////////////
+void RMTTrackDevice::get_signal_stats(track_signal_stats_t *stats)
+{
+  AtomicHolder h(&statsLock_);
+  stats->transmit_count = transmitCount_;
+  stats->underrun_count = underrunCount_;
+  stats->lookahead_miss_count = lookaheadMissCount_;
+  stats->gap_cycles_min = transmitCount_ ? gapCyclesMin_ : 0;
+  stats->gap_cycles_max = gapCyclesMax_;
+  stats->gap_cycles_mean =
+    transmitCount_ ? (uint32_t)(gapCyclesTotal_ / transmitCount_) : 0;
+}
 
-  railcomDriver_->set_feedback_key(packet.feedback_key);
+///////////////////////////////////////////////////////////////////////////////
+// Returns the encoder statistics as a json string.
+//
+// The cycle counts are measured in the ISR via the CPU cycle counter and cover
+// the encoding of the packet into the transmit buffer.
+///////////////////////////////////////////////////////////////////////////////
+std::string RMTTrackDevice::get_state_json()
+{
+  uint32_t count;
+  uint32_t cyclesMin;
+  uint32_t cyclesMax;
+  uint64_t cyclesTotal;
+  {
+    AtomicHolder h(&statsLock_);
+    count = encodeCount_;
+    cyclesMin = encodeCyclesMin_;
+    cyclesMax = encodeCyclesMax_;
+    cyclesTotal = encodeCyclesTotal_;
+  }
+  track_signal_stats_t stats;
+  get_signal_stats(&stats);
+  return StringPrintf(
+    "{\"name\":\"%s\",\"encode\":{\"count\":%u,"
+    "\"cycles\":{\"min\":%u,\"max\":%u,\"mean\":%u}},"
+    "\"transmit\":{\"count\":%u,\"marklin\":%u,\"underrun\":%u,"
+    "\"lookahead_miss\":%u,"
+    "\"gap_cycles\":{\"min\":%u,\"max\":%u,\"mean\":%u}},"
+    "\"queue\":{\"size\":%zu,\"pending\":%zu,\"full\":%u}}"
+  , name_, count, count ? cyclesMin : 0, cyclesMax
+  , count ? (uint32_t)(cyclesTotal / count) : 0
+  , stats.transmit_count, marklinCount_, stats.underrun_count, stats.lookahead_miss_count
+  , stats.gap_cycles_min, stats.gap_cycles_max, stats.gap_cycles_mean
+  , packetQueue_.capacity(), packetQueue_.size(), queueFullCount_);
 }
 
 } // namespace esp32cs
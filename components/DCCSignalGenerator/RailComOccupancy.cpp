@@ -0,0 +1,294 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "RailComOccupancy.h"
+#include "RailComPomFlow.h"
+
+#include <openlcb/EventHandlerTemplates.hxx>
+#include <utils/logging.h>
+#include <utils/StringPrintf.hxx>
+
+namespace esp32cs
+{
+
+/// Bit used in the event ID to indicate the locomotive has been detected.
+static constexpr openlcb::EventId RAILCOM_PRESENT_EVENT_BIT = 0x8000;
+
+/// Mask for the DCC address and address type in the event ID.
+static constexpr openlcb::EventId RAILCOM_ADDRESS_EVENT_MASK = 0x7FFF;
+
+/// Mask for the DCC address in a tracker key.
+static constexpr uint16_t RAILCOM_ADDRESS_MASK = 0x3FFF;
+
+/// Highest short DCC address, feedback keys above this are long addresses.
+static constexpr uintptr_t MAX_SHORT_ADDRESS = 127;
+
+/// Highest DCC locomotive address, feedback keys above this are not DCC
+/// addresses (ie: tagged POM keys or pointers).
+static constexpr uintptr_t MAX_LOCO_ADDRESS = 10239;
+
+RailComLocoTracker::RailComLocoTracker(long long timeout) : timeout_(timeout)
+{
+}
+
+void RailComLocoTracker::process(const dcc::Feedback &feedback, long long now)
+{
+  // channel 1 carries the address broadcast from the locomotive, alternating
+  // between ADR_HIGH and ADR_LOW. The decoder only reports an address after
+  // both halves have been received multiple times and retains it, so the
+  // locomotive is only refreshed when this cutout carried a half of it.
+  if (feedback.ch1Size)
+  {
+    uint8_t type;
+    uint8_t payload;
+    if (decode_address_broadcast(feedback, &type, &payload))
+    {
+      broadcast_.process_packet(feedback);
+      uint16_t address = broadcast_.current_address();
+      uint8_t high = address >> 8;
+      uint8_t low = address & 0xFF;
+      if (address && ((type == dcc::RMOB_ADRHIGH && payload == high) ||
+                      (type == dcc::RMOB_ADRLOW && payload == low)))
+      {
+        // ADR_HIGH has the top two bits set to 10 for a long address.
+        bool long_address = (high & 0xC0) == 0x80;
+        detected(key(((high & 0x3F) << 8) | low, long_address), now);
+      }
+    }
+  }
+  else
+  {
+    // an empty channel 1 ages out the address held by the decoder.
+    broadcast_.set_occupancy(false);
+  }
+
+  // any valid channel 2 datagram is a response from the addressed
+  // locomotive. The feedback key of a DCC packet is the address without its
+  // type, so addresses up to 127 are treated as short addresses as they are
+  // by AllTrainNodes.
+  uintptr_t address = feedback.feedbackKey;
+  if (address & RailComPomFlow::POM_FEEDBACK_KEY_TAG)
+  {
+    // POM keys carry the address in the lower bits.
+    address &= RAILCOM_ADDRESS_MASK;
+  }
+  if (feedback.ch2Size && address && address <= MAX_LOCO_ADDRESS)
+  {
+    dcc::Feedback ch2 = feedback;
+    ch2.ch1Size = 0;
+    dcc::parse_railcom_data(ch2, &datagrams_);
+    for (auto &datagram : datagrams_)
+    {
+      if (datagram.type != dcc::RailcomPacket::GARBAGE)
+      {
+        detected(key(address, address > MAX_SHORT_ADDRESS), now);
+        break;
+      }
+    }
+  }
+}
+
+bool RailComLocoTracker::decode_address_broadcast(
+  const dcc::Feedback &feedback, uint8_t *type, uint8_t *payload)
+{
+  if (feedback.ch1Size != 2)
+  {
+    return false;
+  }
+  uint8_t first = dcc::railcom_decode[feedback.ch1Data[0]];
+  uint8_t second = dcc::railcom_decode[feedback.ch1Data[1]];
+  // values above 63 are the special railcom_decode values (INV, ACK, etc).
+  if (first > 0x3F || second > 0x3F)
+  {
+    return false;
+  }
+  *type = first >> 2;
+  *payload = ((first & 0x03) << 6) | second;
+  return *type == dcc::RMOB_ADRHIGH || *type == dcc::RMOB_ADRLOW;
+}
+
+void RailComLocoTracker::expire(long long now)
+{
+  for (auto it = lastSeen_.begin(); it != lastSeen_.end();)
+  {
+    if (now - it->second > timeout_)
+    {
+      add_change(it->first, false);
+      it = lastSeen_.erase(it);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+}
+
+bool RailComLocoTracker::next_change(Change *change)
+{
+  if (changes_.empty())
+  {
+    return false;
+  }
+  *change = changes_.front();
+  changes_.pop_front();
+  return true;
+}
+
+void RailComLocoTracker::detected(uint16_t key, long long now)
+{
+  if (!(key & RAILCOM_ADDRESS_MASK))
+  {
+    return;
+  }
+  auto it = lastSeen_.find(key);
+  if (it == lastSeen_.end())
+  {
+    lastSeen_[key] = now;
+    add_change(key, true);
+  }
+  else
+  {
+    it->second = now;
+  }
+}
+
+void RailComLocoTracker::add_change(uint16_t key, bool present)
+{
+  if (changes_.size() >= MAX_PENDING_CHANGES)
+  {
+    changes_.pop_front();
+    droppedChanges_++;
+  }
+  changes_.push_back(
+    {(uint16_t)(key & RAILCOM_ADDRESS_MASK)
+   , (key & LONG_ADDRESS_FLAG) != 0, present});
+}
+
+RailComOccupancy::RailComOccupancy(openlcb::Node *node
+                                 , dcc::RailcomHubFlow *hub
+                                 , long long timeout)
+  : node_(node), hub_(hub), tracker_(timeout)
+{
+  hub_->register_port(this);
+}
+
+RailComOccupancy::~RailComOccupancy()
+{
+  hub_->unregister_port(this);
+}
+
+void RailComOccupancy::send(Buffer<dcc::RailcomHubData> *buf, unsigned prio)
+{
+  {
+    OSMutexLock l(&lock_);
+    tracker_.process(buf->data()->value(), os_get_time_monotonic());
+    feedbackCount_++;
+  }
+  buf->unref();
+  dispatch_changes();
+}
+
+void RailComOccupancy::poll_33hz(openlcb::WriteHelper *helper
+                               , Notifiable *done)
+{
+  {
+    OSMutexLock l(&lock_);
+    tracker_.expire(os_get_time_monotonic());
+  }
+  dispatch_changes();
+
+  openlcb::EventId event = 0;
+  {
+    OSMutexLock l(&lock_);
+    if (!events_.empty())
+    {
+      event = events_.front();
+      events_.pop_front();
+    }
+  }
+  if (event)
+  {
+    helper->WriteAsync(node_, openlcb::Defs::MTI_EVENT_REPORT
+                     , openlcb::WriteHelper::global()
+                     , openlcb::eventid_to_buffer(event), done);
+  }
+  else
+  {
+    done->notify();
+  }
+}
+
+void RailComOccupancy::subscribe(Subscriber subscriber)
+{
+  subscribers_.push_back(subscriber);
+}
+
+std::string RailComOccupancy::get_state_json()
+{
+  OSMutexLock l(&lock_);
+  long long now = os_get_time_monotonic();
+  std::string locos = "[";
+  for (auto &entry : tracker_.locos())
+  {
+    if (locos.length() > 1)
+    {
+      locos += ",";
+    }
+    locos += StringPrintf("{\"address\":%d,\"long\":%s,\"age\":%lld}"
+                        , entry.first & RAILCOM_ADDRESS_MASK
+                        , (entry.first & RailComLocoTracker::LONG_ADDRESS_FLAG)
+                            ? "true" : "false"
+                        , NSEC_TO_MSEC(now - entry.second));
+  }
+  locos += "]";
+  return StringPrintf("{\"feedback\":%u,\"dropped\":%u,\"locos\":%s}"
+                    , feedbackCount_, tracker_.dropped_changes()
+                    , locos.c_str());
+}
+
+void RailComOccupancy::dispatch_changes()
+{
+  while (true)
+  {
+    RailComLocoTracker::Change change;
+    {
+      OSMutexLock l(&lock_);
+      if (!tracker_.next_change(&change))
+      {
+        return;
+      }
+      if (events_.size() >= MAX_PENDING_EVENTS)
+      {
+        events_.pop_front();
+      }
+      events_.push_back((node_->node_id() << 16) |
+                        (change.present ? RAILCOM_PRESENT_EVENT_BIT : 0) |
+                        (RailComLocoTracker::key(change.address
+                                               , change.longAddress) &
+                         RAILCOM_ADDRESS_EVENT_MASK));
+    }
+    LOG(VERBOSE, "[RailCom] Loco %d%s %s", change.address
+      , change.longAddress ? " (long)" : ""
+      , change.present ? "detected" : "left");
+    for (auto &subscriber : subscribers_)
+    {
+      subscriber(change.address, change.longAddress, change.present);
+    }
+  }
+}
+
+} // namespace esp32cs
@@ -0,0 +1,198 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "RailComPomFlow.h"
+#include "DCCSignalVFS.h"
+#include "DuplexedTrackIf.h"
+
+#include <openlcb/Defs.hxx>
+#include <utils/logging.h>
+#include <utils/StringPrintf.hxx>
+
+namespace esp32cs
+{
+
+RailComPomFlow::RailComPomFlow(Service *service, dcc::RailcomHubFlow *hub)
+  : CallableFlow<RailComPomRequest>(service), hub_(hub)
+{
+  hub_->register_port(this);
+}
+
+RailComPomFlow::~RailComPomFlow()
+{
+  hub_->unregister_port(this);
+}
+
+void RailComPomFlow::send(Buffer<dcc::RailcomHubData> *buf, unsigned prio)
+{
+  AutoReleaseBuffer<dcc::RailcomHubData> ar(buf);
+  const dcc::Feedback &feedback = buf->data()->value();
+  if (response_ != RESPONSE_PENDING || !feedbackKey_ ||
+      feedback.feedbackKey != feedbackKey_)
+  {
+    // not a response to the current packet.
+    return;
+  }
+  dcc::parse_railcom_data(feedback, &datagrams_);
+  ResponseState state = RESPONSE_PENDING;
+  for (auto &datagram : datagrams_)
+  {
+    if (datagram.railcom_channel != 2)
+    {
+      continue;
+    }
+    if (datagram.type == dcc::RailcomPacket::MOB_POM)
+    {
+      responseValue_ = datagram.argument;
+      state = RESPONSE_OK;
+      break;
+    }
+    else if (datagram.type == dcc::RailcomPacket::BUSY)
+    {
+      state = RESPONSE_BUSY;
+    }
+    else if (state == RESPONSE_PENDING &&
+             datagram.type != dcc::RailcomPacket::NACK)
+    {
+      // NACK is ignored as some decoders use it as filler.
+      state = RESPONSE_INVALID;
+    }
+  }
+  if (state != RESPONSE_PENDING)
+  {
+    response_ = state;
+    timer_.trigger();
+  }
+}
+
+std::string RailComPomFlow::get_state_json()
+{
+  return StringPrintf(
+    "{\"completed\":%u,\"failed\":%u,\"retries\":%u,\"busy\":%u}"
+  , completed_, failed_, retries_, busy_);
+}
+
+StateFlowBase::Action RailComPomFlow::entry()
+{
+  if (!request()->cv_ || request()->cv_ > 1024 || !request()->address_ ||
+      request()->address_ > DCC_MAX_LOCO_ADDRESS)
+  {
+    failed_++;
+    return return_with_error(openlcb::Defs::ERROR_INVALID_ARGS);
+  }
+  // the track interface is created after the signal generator so it is
+  // resolved on first use.
+  if (!track_)
+  {
+    track_ = Singleton<DuplexedTrackIf>::instance();
+  }
+  if (!track_)
+  {
+    failed_++;
+    return return_with_error(RailComPomRequest::ERROR_NO_TRACK);
+  }
+  deadline_ =
+    os_get_time_monotonic() + MSEC_TO_NSEC(POM_REQUEST_TIMEOUT_MSEC);
+  return call_immediately(STATE(send_packet));
+}
+
+StateFlowBase::Action RailComPomFlow::send_packet()
+{
+  return allocate_and_call(track_, STATE(fill_packet));
+}
+
+StateFlowBase::Action RailComPomFlow::fill_packet()
+{
+  auto *b = get_allocation_result(track_);
+  RailComPomRequest *req = request();
+  b->data()->start_dcc_packet();
+  if (req->address_ > 127)
+  {
+    b->data()->add_dcc_address(dcc::DccLongAddress(req->address_));
+  }
+  else
+  {
+    b->data()->add_dcc_address(dcc::DccShortAddress(req->address_));
+  }
+  if (req->write_)
+  {
+    b->data()->add_dcc_pom_write1(req->cv_ - 1, req->value_);
+    // POM writes must be received twice by the decoder.
+    b->data()->packet_header.rept_count = 1;
+  }
+  else
+  {
+    b->data()->add_dcc_pom_read1(req->cv_ - 1);
+  }
+  // a new key for each packet so that a late response to an earlier packet
+  // is not mistaken for the response to this one. The lower bits carry the
+  // address so that other hub ports can still attribute the response.
+  sequence_ = (sequence_ + 1) & 0x7FFF;
+  feedbackKey_ = POM_FEEDBACK_KEY_TAG | ((uintptr_t)sequence_ << 16) |
+                 (req->address_ & 0x3FFF);
+  b->data()->feedback_key = feedbackKey_;
+  response_ = RESPONSE_PENDING;
+  req->attempts_++;
+  track_->send(b);
+  return sleep_and_call(&timer_, MSEC_TO_NSEC(POM_RESPONSE_TIMEOUT_MSEC)
+                      , STATE(response_received));
+}
+
+StateFlowBase::Action RailComPomFlow::response_received()
+{
+  RailComPomRequest *req = request();
+  ResponseState state = response_;
+  // stop accepting responses for this packet.
+  response_ = RESPONSE_INVALID;
+  feedbackKey_ = 0;
+
+  if (state == RESPONSE_OK)
+  {
+    if (req->write_ && responseValue_ != req->value_)
+    {
+      LOG(WARNING, "[POM] Loco %d CV %d wrote %d but read back %d"
+        , req->address_, req->cv_, req->value_, responseValue_);
+      failed_++;
+      return return_with_error(RailComPomRequest::ERROR_VERIFY_FAILED);
+    }
+    LOG(VERBOSE, "[POM] Loco %d CV %d: %d (%d packets)", req->address_
+      , req->cv_, responseValue_, req->attempts_);
+    req->value_ = responseValue_;
+    completed_++;
+    return return_ok();
+  }
+  else if (state == RESPONSE_BUSY)
+  {
+    busy_++;
+    if (os_get_time_monotonic() < deadline_)
+    {
+      retries_++;
+      return call_immediately(STATE(send_packet));
+    }
+  }
+  else if (req->attempts_ < POM_ATTEMPTS)
+  {
+    retries_++;
+    return call_immediately(STATE(send_packet));
+  }
+  LOG(WARNING, "[POM] Loco %d CV %d: no response after %d packets"
+    , req->address_, req->cv_, req->attempts_);
+  failed_++;
+  return return_with_error(RailComPomRequest::ERROR_NO_RESPONSE);
+}
+
+} // namespace esp32cs
@@ -23,6 +23,10 @@ COPYRIGHT (c) 2020 Mike Dunston
 namespace esp32cs
 {
 
+/// Highest locomotive address that can be used in a DCC packet, requests for
+/// addresses above this must be rejected before a packet is built.
+static constexpr uint16_t DCC_MAX_LOCO_ADDRESS = 10239;
+
 void init_dcc_vfs(openlcb::Node *node, Service *service
                 , const esp32cs::TrackOutputConfig &ops_cfg
                 , const esp32cs::TrackOutputConfig &prog_cfg);
@@ -39,6 +43,12 @@ void disable_track_outputs();
 
 std::string get_track_state_json();
 
+// retrieve the signal generator statistics for all tracks.
+std::string get_track_signal_json();
+
+// retrieve the RailCom detector statistics and detected locomotives.
+std::string get_railcom_state_json();
+
 // retrive status of the track signal and current usage.
 std::string get_track_state_for_dccpp();
 
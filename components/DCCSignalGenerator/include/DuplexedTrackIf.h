@@ -21,68 +21,127 @@ COPYRIGHT (c) 2019-2020 Mike Dunston
 #include <executor/Executor.hxx>
 #include <executor/StateFlow.hxx>
 #include <dcc/Packet.hxx>
+#include <dcc/PacketFlowInterface.hxx>
 #include <utils/Singleton.hxx>
 
 namespace esp32cs
 {
 
-/// StateFlow that accepts dcc::Packet structures and sends them to a local
-/// device driver for producing the track signal.
+/// Track interface that accepts dcc::Packet structures and sends them to the
+/// local device drivers for producing the OPS and PROG track signals.
 ///
-/// The device driver must support the notifiable-based asynchronous write
+/// Each track output has a dedicated write flow with its own packet pool and
+/// queue so that a full PROG device queue during programming does not delay
+/// the OPS packets and vice versa. Track selection is made based on the DCC
+/// header flag for a longer preamble which is only used for PROG track
+/// packets.
+///
+/// The device drivers must support the notifiable-based asynchronous write
 /// model.
-class DuplexedTrackIf : public StateFlow<Buffer<dcc::Packet>, QList<1>>
+class DuplexedTrackIf : public dcc::PacketFlowInterface
                       , public Singleton<DuplexedTrackIf>
 {
 public:
-    /// Creates a TrackInterface from an fd to the mainline and an fd for prog.
-    ///
-    /// This class currently does synchronous writes to the device. In order not
-    /// to block the executor, you have to create a new threadexecutor.
+  /// Creates a TrackInterface from an fd to the mainline and an fd for prog.
+  ///
+  /// @param service is the @ref Service to use for the write flows.
+  /// @param ops_pool_size will determine how many packets the OPS write flow
+  /// can hold, this is also the pool used by @ref alloc().
+  /// @param prog_pool_size will determine how many packets the PROG write flow
+  /// can hold.
+  /// @param ops_fd is the file descriptor for the OPS track.
+  /// @param prog_fd is the file descriptor for the PROG track.
+  DuplexedTrackIf(Service *service, int ops_pool_size, int prog_pool_size
+                , int ops_fd, int prog_fd);
+
+  /// @return the @ref FixedPool for dcc::Packet objects to send to the track.
+  FixedPool *pool() override
+  {
+    return ops_.pool();
+  }
+
+  /// Routes a packet to the OPS or PROG write flow.
+  ///
+  /// PROG packets are copied into a buffer from the PROG pool so that they do
+  /// not hold a buffer from @ref pool() while waiting for the PROG device. If
+  /// the PROG pool is exhausted the packet will be dropped.
+  ///
+  /// @param packet is the packet to send.
+  /// @param priority is unused.
+  void send(Buffer<dcc::Packet> *packet, unsigned priority = UINT_MAX) override;
+
+  /// @return true if a PROG packet can be accepted without being dropped.
+  bool prog_ready()
+  {
+    return prog_.pool()->free_items();
+  }
+
+  /// @return json formatted string containing the per-track statistics.
+  std::string get_state_json();
+
+private:
+  /// StateFlow that writes packets to a single track device.
+  class TrackWriteFlow : public StateFlow<Buffer<dcc::Packet>, QList<1>>
+  {
+  public:
+    /// Constructor.
     ///
-    /// @param service THE EXECUTOR OF THIS SERVICE WILL BE BLOCKED.
-    /// @param pool_size will determine how many packets the current flow's
-    /// alloc() will have.
-    /// @param ops_fd is the file descriptor for the OPS track.
-    /// @param prog_fd is the file descriptor for the PROG track.
-    DuplexedTrackIf(Service *service, int pool_size, int ops_fd, int prog_fd);
-
-    /// @return the @ref FixedPool for dcc::Packet objects to send to the track.
+    /// @param service is the @ref Service to use for this flow.
+    /// @param name is the name of the track output.
+    /// @param pool_size is the number of packets in the pool for this flow.
+    /// @param fd is the file descriptor for the track device.
+    TrackWriteFlow(Service *service, const char *name, int pool_size
+                 , int fd);
+
+    /// @return the @ref FixedPool for this track output.
     FixedPool *pool() override
     {
-        return &pool_;
+      return &pool_;
     }
 
-protected:
-    /// Sends a queued packet to either the OPS or PROG track.
-    ///
-    /// Track selection is made based on the DCC header flag for a longer
-    /// preamble which is only used for PROG track packets.
-    ///
-    /// If the packet can not be written to the file descriptor it will be held
-    /// until the device driver alerts that it is ready for another packet.
-    ///
-    /// Note: Both OPS and PROG packets will be processed by this method and if
-    /// either device driver prevents the write operation both tracks will be
-    /// blocked.
-    Action entry() override;
-
-    /// @return next action.
-    Action finish()
+    /// Records that a packet for this track has been dropped.
+    void dropped()
     {
-        return release_and_exit();
+      dropped_++;
     }
 
-    /// File descriptor for the OPS track output.
-    const int fd_ops_;
+    /// @return json formatted string containing the statistics.
+    std::string get_state_json();
+
+  private:
+    /// Writes the queued packet to the track device.
+    ///
+    /// If the packet can not be written to the file descriptor it will be
+    /// held until the device driver alerts that it is ready for another
+    /// packet, this only blocks the packets for this track.
+    Action entry() override;
+
+    /// Name of the track output.
+    const char *name_;
 
-    /// File descriptor for the PROG track output.
-    const int fd_prog_;
+    /// File descriptor for the track output.
+    const int fd_;
 
-    /// Packet pool from which to allocate packets.
+    /// Packet pool for this track output.
     FixedPool pool_;
+
+    /// Number of packets written to the track device.
+    uint32_t written_{0};
+
+    /// Number of times the track device was full and the flow had to wait.
+    uint32_t waits_{0};
+
+    /// Number of packets dropped due to the pool being exhausted.
+    uint32_t dropped_{0};
+  };
+
+  /// Write flow for the OPS track output.
+  TrackWriteFlow ops_;
+
+  /// Write flow for the PROG track output.
+  TrackWriteFlow prog_;
 };
 
 } // namespace esp32cs
 
-#endif // DUPLEXED_TRACK_IF_H_
\ No newline at end of file
+#endif // DUPLEXED_TRACK_IF_H_
@@ -0,0 +1,192 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef PACKET_CAPTURE_H_
+#define PACKET_CAPTURE_H_
+
+#include <atomic>
+#include <dcc/Packet.hxx>
+#include <string>
+#include <utils/macros.h>
+#include <utils/Singleton.hxx>
+
+#include "sdkconfig.h"
+
+#if CONFIG_DCC_PACKET_CAPTURE
+
+namespace esp32cs
+{
+
+/// Fixed size capture ring of the packets sent to the track outputs.
+///
+/// Packets are recorded by the signal generator at the time they are encoded
+/// for transmission, the oldest entries are overwritten when the ring is full.
+/// Recording does not allocate memory or take a lock and is safe to call from
+/// the RMT ISR, there must be only one recording context.
+///
+/// Every recorded packet is assigned a sequence number, readers provide the
+/// sequence number they have read up to and receive all entries after it that
+/// are still in the ring. A gap in the sequence numbers indicates entries that
+/// were overwritten before they could be read.
+///
+/// The binary stream returned by @ref read consists of a @ref Header followed
+/// by @ref Header::count instances of @ref Entry, all fields are little
+/// endian.
+class PacketCapture : public Singleton<PacketCapture>
+{
+public:
+  /// Binary stream header.
+  struct Header
+  {
+    /// Stream identifier, always @ref CAPTURE_MAGIC.
+    uint32_t magic;
+
+    /// Format version of the stream, currently @ref CAPTURE_VERSION.
+    uint8_t version;
+
+    /// Size of each @ref Entry in bytes.
+    uint8_t entry_size;
+
+    /// Number of entries that follow the header.
+    uint16_t count;
+
+    /// Sequence number of the first entry that follows the header.
+    uint32_t first;
+
+    /// Sequence number to request for the next read.
+    uint32_t next;
+  };
+
+  /// Captured packet.
+  struct Entry
+  {
+    /// Time the packet was encoded, in microseconds since startup. This
+    /// wraps roughly every 71 minutes.
+    uint32_t timestamp;
+
+    /// RMT channel of the track output.
+    uint8_t track;
+
+    /// Combination of @ref FLAG_MARKLIN and @ref FLAG_LONG_PREAMBLE.
+    uint8_t flags;
+
+    /// Number of payload bytes.
+    uint8_t dlc;
+
+    /// Number of times the packet will be repeated after the first
+    /// transmission.
+    uint8_t repeat;
+
+    /// Packet payload.
+    uint8_t payload[dcc::Packet::MAX_PAYLOAD];
+
+    /// Unused, keeps the entry size a multiple of four bytes.
+    uint8_t reserved[2];
+  };
+
+  /// Value of @ref Header::magic, "DCAP".
+  static constexpr uint32_t CAPTURE_MAGIC = 0x50414344;
+
+  /// Value of @ref Header::version.
+  static constexpr uint8_t CAPTURE_VERSION = 1;
+
+  /// @ref Entry::flags bit for a Marklin-Motorola packet.
+  static constexpr uint8_t FLAG_MARKLIN = 0x01;
+
+  /// @ref Entry::flags bit for a packet sent with the long preamble.
+  static constexpr uint8_t FLAG_LONG_PREAMBLE = 0x02;
+
+  /// Records a packet, this is a no-op if capture is disabled or the packet
+  /// does not pass the filters.
+  ///
+  /// @param track is the RMT channel of the track output.
+  /// @param packet is the packet being sent.
+  void record(uint8_t track, const dcc::Packet &packet);
+
+  /// Reads the captured packets.
+  ///
+  /// @param since is the sequence number of the first entry to return.
+  /// @param max_count is the maximum number of entries to return.
+  ///
+  /// @return binary stream of the captured packets.
+  std::string read(uint32_t since, size_t max_count);
+
+  /// Updates the capture configuration.
+  ///
+  /// @param enabled controls if packets are recorded.
+  /// @param track_mask is a bit mask of RMT channels to record.
+  /// @param idle controls if DCC idle packets are recorded.
+  void configure(bool enabled, uint8_t track_mask, bool idle);
+
+  /// @return true if packets are being recorded.
+  bool is_enabled()
+  {
+    return enabled_;
+  }
+
+  /// @return bit mask of RMT channels being recorded.
+  uint8_t get_track_mask()
+  {
+    return trackMask_;
+  }
+
+  /// @return true if DCC idle packets are being recorded.
+  bool is_idle_enabled()
+  {
+    return idle_;
+  }
+
+  /// Discards all captured packets, the sequence numbers continue from the
+  /// current value.
+  void clear();
+
+  /// @return json formatted string containing the capture configuration and
+  /// sequence numbers.
+  std::string get_state_json();
+
+private:
+  /// Number of entries in the ring.
+  static constexpr uint32_t CAPTURE_SIZE = CONFIG_DCC_PACKET_CAPTURE_SIZE;
+
+  static_assert((CAPTURE_SIZE & (CAPTURE_SIZE - 1)) == 0
+              , "DCC_PACKET_CAPTURE_SIZE must be a power of two");
+  static_assert(sizeof(Entry) == 16, "unexpected capture entry size");
+
+  /// Captured packets.
+  Entry entries_[CAPTURE_SIZE];
+
+  /// Sequence number of the next entry to be recorded.
+  std::atomic<uint32_t> head_{0};
+
+  /// Sequence number of the oldest entry that has not been cleared.
+  uint32_t tail_{0};
+
+  /// When true packets will be recorded.
+  bool enabled_{false};
+
+  /// Bit mask of RMT channels to record.
+  uint8_t trackMask_{0xFF};
+
+  /// When true DCC idle packets will be recorded.
+  bool idle_{false};
+};
+
+} // namespace esp32cs
+
+#endif // CONFIG_DCC_PACKET_CAPTURE
+
+#endif // PACKET_CAPTURE_H_
@@ -0,0 +1,243 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef PRIORITY_UPDATE_LOOP_H_
+#define PRIORITY_UPDATE_LOOP_H_
+
+#include <dcc/Packet.hxx>
+#include <dcc/PacketFlowInterface.hxx>
+#include <dcc/PacketSource.hxx>
+#include <dcc/UpdateLoop.hxx>
+#include <executor/StateFlow.hxx>
+#include <utils/Singleton.hxx>
+
+#include "sdkconfig.h"
+
+namespace esp32cs
+{
+
+/// DCC update loop which replaces the strict round-robin behavior of
+/// @ref dcc::SimpleUpdateLoop with a prioritized packet scheduler.
+///
+/// Each time the track interface requests a packet the following order is
+/// used to select the packet source:
+///
+/// 1. The highest priority exclusive source (@ref EXCLUSIVE_MIN_PRIORITY or
+///    above) receives every other packet slot. Since the PROG track has a
+///    dedicated output the OPS refresh is not stopped while an exclusive
+///    source (service mode programming, e-stop) is active. The service mode
+///    programming source is skipped while the PROG output of
+///    @ref DuplexedTrackIf has no space for another packet, the slot is used
+///    for the OPS track instead.
+/// 2. Pending updates from @ref notify_update, e-stop requests are always
+///    sent before any other pending update.
+/// 3. Background refresh, the source which has waited the longest will be
+///    selected. Sources which have been updated recently have their waiting
+///    time weighted so they are refreshed more frequently than idle sources.
+///    The source itself rotates the speed and function group packets as part
+///    of the REFRESH code handling. Marklin-Motorola sources compete in the
+///    same selection with their waiting time divided by
+///    @ref MARKLIN_REFRESH_WEIGHT_DIVISOR.
+/// 4. DCC idle packet.
+///
+/// For all packet sources the NMRA S-9.2.4 minimum spacing of 5msec between
+/// two packets to the same decoder is enforced, a source that was sent a
+/// packet within this window will be skipped until the window expires.
+class PriorityUpdateLoop : public StateFlow<Buffer<dcc::Packet>, QList<1>>
+                         , public Singleton<PriorityUpdateLoop>
+                         , private dcc::UpdateLoopBase
+{
+public:
+  /// Constructor.
+  ///
+  /// @param service is the @ref Service to use for this flow.
+  /// @param track_send is the @ref PacketFlowInterface to send packets to.
+  PriorityUpdateLoop(Service *service, dcc::PacketFlowInterface *track_send);
+
+  /// Destructor.
+  ~PriorityUpdateLoop();
+
+  /// Adds a new refresh source to the background refresh packets.
+  ///
+  /// @param source is the @ref PacketSource to add.
+  /// @param priority is the priority of the source, if this is at least
+  /// @ref EXCLUSIVE_MIN_PRIORITY the source will be handled as exclusive.
+  ///
+  /// @return true if there was no higher priority exclusive source than the
+  /// one added now.
+  bool add_refresh_source(dcc::PacketSource *source
+                        , unsigned priority) override;
+
+  /// Deletes a packet refresh source.
+  ///
+  /// @param source is the @ref PacketSource to remove, any pending updates
+  /// for the source will be discarded.
+  void remove_refresh_source(dcc::PacketSource *source) override;
+
+  /// Queues an update for a packet source to be sent ahead of the background
+  /// refresh.
+  ///
+  /// @param source is the @ref PacketSource that has been updated.
+  /// @param code is the source specific update code.
+  void notify_update(dcc::PacketSource *source, unsigned code) override;
+
+  /// Entry to the state flow, called when a new packet needs to be sent.
+  Action entry() override;
+
+  /// @return json formatted string containing the scheduler statistics.
+  std::string get_state_json();
+
+private:
+  /// Minimum time between two packets sent to the same packet source, from
+  /// NMRA S-9.2.4 section C.
+  static constexpr long long DECODER_PACKET_SPACING_NSEC = MSEC_TO_NSEC(5);
+
+  /// Time window after a @ref notify_update call during which the source will
+  /// be considered as recently active.
+  static constexpr long long RECENT_UPDATE_WINDOW_NSEC = SEC_TO_NSEC(10);
+
+  /// Weight factor applied to the refresh waiting time for recently active
+  /// sources.
+  static constexpr unsigned RECENT_UPDATE_WEIGHT = 4;
+
+  /// Divisor applied to the refresh waiting time for Marklin-Motorola
+  /// sources. The Marklin-Motorola packets take roughly three times as long
+  /// as a DCC packet on the track, this keeps each source type to a similar
+  /// share of the track time.
+  static constexpr unsigned MARKLIN_REFRESH_WEIGHT_DIVISOR = 3;
+
+  /// Maximum number of pending updates that can be queued.
+  static constexpr size_t MAX_PENDING_UPDATES =
+    CONFIG_DCC_UPDATE_LOOP_PENDING_QUEUE_SIZE;
+
+  /// Number of one millisecond buckets to use for the update latency
+  /// histogram, the last bucket accumulates all higher values.
+  static constexpr size_t LATENCY_BUCKETS = 64;
+
+  /// Index used when a packet source is not in @ref refreshSources_.
+  static constexpr size_t NO_REFRESH_SOURCE = SIZE_MAX;
+
+  /// Tracking data for a registered packet source.
+  struct RefreshSource
+  {
+    /// Packet source.
+    dcc::PacketSource *source;
+
+    /// Priority of the source.
+    unsigned priority;
+
+    /// Time of the last packet generated by this source.
+    long long lastPacket;
+
+    /// Time of the last @ref notify_update call for this source.
+    long long lastUpdate;
+
+    /// True if the last packet generated by this source was a
+    /// Marklin-Motorola packet.
+    bool marklin;
+  };
+
+  /// Pending update for a packet source.
+  struct PendingUpdate
+  {
+    /// Packet source.
+    dcc::PacketSource *source;
+
+    /// Source specific update code.
+    unsigned code;
+
+    /// Time the update was queued.
+    long long queued;
+
+    /// Index of the source in @ref refreshSources_ or
+    /// @ref NO_REFRESH_SOURCE, this avoids a search of the refresh sources
+    /// for each pending update when selecting the next packet.
+    size_t refreshIndex;
+  };
+
+  /// Place where we forward the packets filled in.
+  dcc::PacketFlowInterface *trackSend_;
+
+  /// Packet sources to ask about refreshing data periodically.
+  std::vector<RefreshSource> refreshSources_;
+
+  /// Pending updates in the order they were received.
+  PendingUpdate pending_[MAX_PENDING_UPDATES];
+
+  /// Number of entries used in @ref pending_.
+  size_t pendingCount_{0};
+
+  /// Highest priority exclusive source, nullptr when there is none.
+  dcc::PacketSource *exclusiveSource_{nullptr};
+
+  /// Priority of @ref exclusiveSource_.
+  unsigned exclusivePriority_{0};
+
+  /// When true the next packet slot belongs to @ref exclusiveSource_.
+  bool exclusiveTurn_{true};
+
+  /// Number of packets generated from pending updates.
+  uint32_t updatePackets_{0};
+
+  /// Number of packets generated from background refresh.
+  uint32_t refreshPackets_{0};
+
+  /// Number of packets generated from exclusive sources.
+  uint32_t exclusivePackets_{0};
+
+  /// Number of exclusive slots given to other sources due to the PROG output
+  /// being full.
+  uint32_t exclusiveDeferred_{0};
+
+  /// Number of Marklin-Motorola packets generated.
+  uint32_t marklinPackets_{0};
+
+  /// Number of idle packets generated.
+  uint32_t idlePackets_{0};
+
+  /// Number of updates dropped due to the pending queue being full.
+  uint32_t droppedUpdates_{0};
+
+  /// Longest time an update has waited in the pending queue.
+  long long maxUpdateLatency_{0};
+
+  /// Histogram of update latency in one millisecond buckets.
+  uint32_t updateLatency_[LATENCY_BUCKETS];
+
+  /// Recalculates @ref exclusiveSource_, must be called with the lock held.
+  void update_exclusive_source();
+
+  /// @return the index of the provided source in @ref refreshSources_ or
+  /// @ref NO_REFRESH_SOURCE if it is not registered, must be called with the
+  /// lock held.
+  size_t find_source(dcc::PacketSource *source);
+
+  /// Removes the pending update at the provided index, must be called with the
+  /// lock held.
+  void remove_pending(size_t index);
+
+  /// Records the latency of a pending update, must be called with the lock
+  /// held.
+  void record_latency(long long latency);
+
+  /// @return the approximate latency in msec for the provided percentile.
+  uint32_t latency_percentile(uint32_t percentile);
+};
+
+} // namespace esp32cs
+
+#endif // PRIORITY_UPDATE_LOOP_H_
@@ -0,0 +1,237 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef RAILCOM_OCCUPANCY_H_
+#define RAILCOM_OCCUPANCY_H_
+
+#include <dcc/RailCom.hxx>
+#include <dcc/RailcomBroadcastDecoder.hxx>
+#include <dcc/RailcomHub.hxx>
+#include <deque>
+#include <functional>
+#include <map>
+#include <openlcb/EventHandler.hxx>
+#include <openlcb/Node.hxx>
+#include <openlcb/RefreshLoop.hxx>
+#include <os/OS.hxx>
+#include <utils/Singleton.hxx>
+#include <vector>
+
+namespace esp32cs
+{
+
+/// Tracks which locomotives have been detected on the track via RailCom.
+///
+/// A locomotive is considered present when it reports its address in a
+/// channel 1 broadcast or when it responds in channel 2 to a packet addressed
+/// to it. When a locomotive has not been detected for the configured timeout
+/// it is considered to have left the track.
+///
+/// This class has no hardware or executor dependencies so that it can be
+/// driven from recorded feedback streams.
+class RailComLocoTracker
+{
+public:
+  /// Bit set in the keys of @ref locos for long DCC addresses, the lower 14
+  /// bits are the DCC address.
+  static constexpr uint16_t LONG_ADDRESS_FLAG = 0x4000;
+
+  /// Change in the presence of a locomotive.
+  struct Change
+  {
+    /// DCC address of the locomotive.
+    uint16_t address;
+
+    /// True if @ref address is a long address.
+    bool longAddress;
+
+    /// True if the locomotive has been detected, false if it has left.
+    bool present;
+  };
+
+  /// @return the key used for a DCC address in @ref locos.
+  static uint16_t key(uint16_t address, bool long_address)
+  {
+    return address | (long_address ? LONG_ADDRESS_FLAG : 0);
+  }
+
+  /// Constructor.
+  ///
+  /// @param timeout is the number of nanoseconds after the last detection
+  /// before a locomotive is considered to have left the track.
+  RailComLocoTracker(long long timeout);
+
+  /// Processes the feedback received for a single DCC packet.
+  ///
+  /// @param feedback is the RailCom feedback, the feedback key is expected to
+  /// be the DCC address of the packet or zero for broadcast packets.
+  /// @param now is the current time in nanoseconds.
+  void process(const dcc::Feedback &feedback, long long now);
+
+  /// Removes locomotives which have not been detected within the timeout.
+  ///
+  /// @param now is the current time in nanoseconds.
+  void expire(long long now);
+
+  /// Retrieves the oldest unreported change.
+  ///
+  /// @param change will receive the change.
+  ///
+  /// @return true if a change was retrieved, false if there are no changes.
+  bool next_change(Change *change);
+
+  /// @return the detected locomotives, keyed by @ref key, and the time they
+  /// were last detected.
+  const std::map<uint16_t, long long> &locos() const
+  {
+    return lastSeen_;
+  }
+
+  /// @return number of changes discarded due to the change queue being full.
+  uint32_t dropped_changes() const
+  {
+    return droppedChanges_;
+  }
+
+private:
+  /// Maximum number of unreported changes.
+  static constexpr size_t MAX_PENDING_CHANGES = 32;
+
+  /// Decodes a channel 1 address broadcast.
+  ///
+  /// @param feedback is the RailCom feedback.
+  /// @param type will receive the datagram type.
+  /// @param payload will receive the ADR_HIGH or ADR_LOW value.
+  ///
+  /// @return true if channel 1 contains a valid ADR_HIGH or ADR_LOW datagram.
+  static bool decode_address_broadcast(const dcc::Feedback &feedback
+                                     , uint8_t *type, uint8_t *payload);
+
+  /// Records the detection of a locomotive.
+  ///
+  /// @param key is the @ref key of the locomotive.
+  void detected(uint16_t key, long long now);
+
+  /// Queues a change for reporting.
+  ///
+  /// @param key is the @ref key of the locomotive.
+  void add_change(uint16_t key, bool present);
+
+  /// Number of nanoseconds before a locomotive is considered gone.
+  const long long timeout_;
+
+  /// Decoder for the channel 1 address broadcasts.
+  dcc::RailcomBroadcastDecoder broadcast_;
+
+  /// Detected locomotives and the time they were last detected.
+  std::map<uint16_t, long long> lastSeen_;
+
+  /// Unreported changes.
+  std::deque<Change> changes_;
+
+  /// Scratch space for decoding channel 2 datagrams.
+  std::vector<dcc::RailcomPacket> datagrams_;
+
+  /// Number of changes discarded due to the change queue being full.
+  uint32_t droppedChanges_{0};
+};
+
+/// RailCom occupancy service for the OPS track.
+///
+/// Feedback is received from the @ref dcc::RailcomHubFlow and decoded by
+/// @ref RailComLocoTracker. Changes are delivered to the registered
+/// subscribers and produced as LCC events, the event ID is the node ID
+/// shifted left by 16 bits with the DCC address in the lower 14 bits, bit 14
+/// set for a long address and bit 15 set when the locomotive has been
+/// detected.
+class RailComOccupancy : public dcc::RailcomHubPortInterface
+                       , public openlcb::Polling
+                       , public Singleton<RailComOccupancy>
+{
+public:
+  /// Callback invoked when a locomotive has been detected or has left the
+  /// track.
+  typedef std::function<void(uint16_t address, bool long_address
+                           , bool present)> Subscriber;
+
+  /// Constructor.
+  ///
+  /// @param node is the node to produce the events from.
+  /// @param hub is the RailCom hub to receive feedback from.
+  /// @param timeout is the number of nanoseconds after the last detection
+  /// before a locomotive is considered to have left the track.
+  RailComOccupancy(openlcb::Node *node, dcc::RailcomHubFlow *hub
+                 , long long timeout);
+
+  /// Destructor.
+  ~RailComOccupancy();
+
+  /// Receives the RailCom feedback from the hub.
+  ///
+  /// @param buf is the feedback to process.
+  /// @param prio is unused.
+  void send(Buffer<dcc::RailcomHubData> *buf, unsigned prio) override;
+
+  /// Expires locomotives that have left the track and produces the LCC
+  /// event for the oldest pending change.
+  ///
+  /// @param helper is used to send the LCC event.
+  /// @param done is notified when the event has been sent.
+  void poll_33hz(openlcb::WriteHelper *helper, Notifiable *done) override;
+
+  /// Registers a callback for changes, this is called on the executor of
+  /// the RailCom hub.
+  ///
+  /// @param subscriber is the callback to register.
+  void subscribe(Subscriber subscriber);
+
+  /// @return json formatted string containing the detected locomotives.
+  std::string get_state_json();
+
+private:
+  /// Maximum number of LCC events waiting to be sent.
+  static constexpr size_t MAX_PENDING_EVENTS = 32;
+
+  /// Delivers pending changes to the subscribers and the LCC event queue.
+  void dispatch_changes();
+
+  /// Protects @ref tracker_ and @ref events_, the state is read from the
+  /// web server executor.
+  OSMutex lock_;
+
+  /// Node to produce events from.
+  openlcb::Node *node_;
+
+  /// RailCom hub the feedback is received from.
+  dcc::RailcomHubFlow *hub_;
+
+  /// Decoder for the feedback.
+  RailComLocoTracker tracker_;
+
+  /// Registered change subscribers.
+  std::vector<Subscriber> subscribers_;
+
+  /// LCC events waiting to be sent.
+  std::deque<openlcb::EventId> events_;
+
+  /// Number of feedback packets processed.
+  uint32_t feedbackCount_{0};
+};
+
+} // namespace esp32cs
+
+#endif // RAILCOM_OCCUPANCY_H_
@@ -0,0 +1,215 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef RAILCOM_POM_FLOW_H_
+#define RAILCOM_POM_FLOW_H_
+
+#include <dcc/PacketFlowInterface.hxx>
+#include <dcc/RailCom.hxx>
+#include <dcc/RailcomHub.hxx>
+#include <executor/CallableFlow.hxx>
+#include <executor/Timer.hxx>
+#include <utils/Singleton.hxx>
+#include <vector>
+
+namespace esp32cs
+{
+
+/// Request for @ref RailComPomFlow.
+struct RailComPomRequest : public CallableFlowRequestBase
+{
+  enum ReadCV
+  {
+    READ_CV
+  };
+
+  enum WriteCV
+  {
+    WRITE_CV
+  };
+
+  /// Result code when the decoder did not respond, or did not respond with
+  /// a valid CV value, within the allowed number of attempts.
+  static constexpr int ERROR_NO_RESPONSE = 0x1000;
+
+  /// Result code when the decoder responded with a value other than the one
+  /// that was written.
+  static constexpr int ERROR_VERIFY_FAILED = 0x1001;
+
+  /// Result code when the track interface is not available.
+  static constexpr int ERROR_NO_TRACK = 0x1002;
+
+  /// Sets up a POM read.
+  ///
+  /// @param address is the DCC address of the locomotive.
+  /// @param cv is the CV number to read, starting from 1.
+  void reset(ReadCV, uint16_t address, uint16_t cv)
+  {
+    reset_base();
+    write_ = false;
+    address_ = address;
+    cv_ = cv;
+    value_ = 0;
+    attempts_ = 0;
+  }
+
+  /// Sets up a POM write that is verified by the decoder response.
+  ///
+  /// @param address is the DCC address of the locomotive.
+  /// @param cv is the CV number to write, starting from 1.
+  /// @param value is the value to write.
+  void reset(WriteCV, uint16_t address, uint16_t cv, uint8_t value)
+  {
+    reset_base();
+    write_ = true;
+    address_ = address;
+    cv_ = cv;
+    value_ = value;
+    attempts_ = 0;
+  }
+
+  /// True for a write request, false for a read request.
+  bool write_;
+
+  /// DCC address of the locomotive.
+  uint16_t address_;
+
+  /// CV number, starting from 1.
+  uint16_t cv_;
+
+  /// Value to write, when the request completes successfully this is the
+  /// value reported by the decoder.
+  uint8_t value_;
+
+  /// Number of packets sent to the decoder for this request.
+  uint8_t attempts_;
+};
+
+/// Programming-on-Main read and verified write service for the OPS track.
+///
+/// Each packet is sent with a unique feedback key that carries the DCC
+/// address in the lower 14 bits, the RailCom channel 2 response with the
+/// same key is used to complete the request. When no usable response is
+/// received the packet is resent, a decoder reporting BUSY is retried until
+/// the request deadline has passed.
+///
+/// Requests are processed one at a time in the order received, use
+/// invoke_flow() from a thread other than the executor of the service.
+class RailComPomFlow : public CallableFlow<RailComPomRequest>
+                     , public dcc::RailcomHubPortInterface
+                     , public Singleton<RailComPomFlow>
+{
+public:
+  /// Tag bit for the feedback keys generated by this flow, the lower 14 bits
+  /// of these keys are the DCC address of the packet.
+  static constexpr uintptr_t POM_FEEDBACK_KEY_TAG = 0x80000000;
+
+  /// Constructor.
+  ///
+  /// @param service is the @ref Service to use for this flow, this must be
+  /// the same service used by the RailCom hub.
+  /// @param hub is the RailCom hub to receive the responses from.
+  RailComPomFlow(Service *service, dcc::RailcomHubFlow *hub);
+
+  /// Destructor.
+  ~RailComPomFlow();
+
+  /// Receives the RailCom feedback from the hub.
+  ///
+  /// @param buf is the feedback to process.
+  /// @param prio is unused.
+  void send(Buffer<dcc::RailcomHubData> *buf, unsigned prio) override;
+
+  /// @return json formatted string containing the request statistics.
+  std::string get_state_json();
+
+private:
+  /// Number of packets to send for a request before giving up when the
+  /// decoder does not respond.
+  static constexpr uint8_t POM_ATTEMPTS = 4;
+
+  /// Number of milliseconds to wait for a response to each packet, this
+  /// allows for the RailCom feedback being delivered in batches.
+  static constexpr uint32_t POM_RESPONSE_TIMEOUT_MSEC = 250;
+
+  /// Number of milliseconds a decoder reporting BUSY will be retried for.
+  static constexpr uint32_t POM_REQUEST_TIMEOUT_MSEC = 2000;
+
+  /// State of the response for the packet most recently sent.
+  enum ResponseState : uint8_t
+  {
+    RESPONSE_PENDING,
+    RESPONSE_OK,
+    RESPONSE_BUSY,
+    RESPONSE_INVALID
+  };
+
+  /// Validates the request and sends the first packet.
+  Action entry() override;
+
+  /// Allocates a packet from the track interface.
+  Action send_packet();
+
+  /// Fills in and sends the POM packet.
+  Action fill_packet();
+
+  /// Evaluates the response, or lack of response, to the packet.
+  Action response_received();
+
+  /// RailCom hub the responses are received from.
+  dcc::RailcomHubFlow *hub_;
+
+  /// Track interface the packets are sent to.
+  dcc::PacketFlowInterface *track_{nullptr};
+
+  /// Timer used for the response timeout.
+  StateFlowTimer timer_{this};
+
+  /// Scratch space for decoding the response datagrams.
+  std::vector<dcc::RailcomPacket> datagrams_;
+
+  /// Feedback key of the packet most recently sent.
+  uintptr_t feedbackKey_{0};
+
+  /// Sequence number used for generating the feedback keys.
+  uint16_t sequence_{0};
+
+  /// State of the response for the packet most recently sent.
+  ResponseState response_{RESPONSE_PENDING};
+
+  /// CV value from the response.
+  uint8_t responseValue_{0};
+
+  /// Time at which BUSY responses will no longer be retried.
+  long long deadline_{0};
+
+  /// Number of requests completed successfully.
+  uint32_t completed_{0};
+
+  /// Number of requests that failed.
+  uint32_t failed_{0};
+
+  /// Number of packets that were resent.
+  uint32_t retries_{0};
+
+  /// Number of BUSY responses received.
+  uint32_t busy_{0};
+};
+
+} // namespace esp32cs
+
+#endif // RAILCOM_POM_FLOW_H_
@@ -18,18 +18,22 @@ COPYRIGHT (c) 2020 Mike Dunston
 #ifndef ESP32_RAILCOM_DRIVER_H_
 #define ESP32_RAILCOM_DRIVER_H_
 
+#include <algorithm>
+#include <atomic>
 #include <dcc/RailCom.hxx>
 #include <dcc/RailcomHub.hxx>
 #include <esp_intr_alloc.h>
 #include <esp32/clk.h>
 #include <esp32/rom/gpio.h>
 #include <freertos_drivers/arduino/RailcomDriver.hxx>
+#include <openlcb/RefreshLoop.hxx>
 #include <os/Gpio.hxx>
 #include <soc/gpio_periph.h>
 #include <soc/timer_periph.h>
 #include <soc/uart_periph.h>
 #include <stdint.h>
 #include <utils/logging.h>
+#include <utils/StringPrintf.hxx>
 
 namespace esp32cs
 {
@@ -40,8 +44,27 @@ static void esp32_railcom_timer_tick(void *param);
 template <class HW>
 static void esp32_railcom_uart_isr(void *arg);
 
+/// RailCom detector for the ESP32.
+///
+/// Feedback is collected by the ISRs into a fixed ring of dcc::Feedback
+/// slots, one slot per DCC packet, without any allocations. The ring is
+/// drained by @ref poll_33hz on the executor which delivers the feedback to
+/// the @ref dcc::RailcomHubFlow in batches. When the ring is full the
+/// feedback for the packet is discarded and counted.
+///
+/// The cutout is sequenced entirely by the hardware timer, @ref start_cutout
+/// only disables the h-bridge and arms the timer so the RMT ISR can start the
+/// (already encoded) next packet immediately. The preamble of that packet
+/// continues on the RMT output while the h-bridge is disabled, the output is
+/// re-enabled by the timer at the end of the cutout.
+///
+/// PRE_CUTOUT -> CUTOUT_TRIGGER: h-bridge disabled, waiting for the trigger
+///                               delay.
+/// CUTOUT_TRIGGER -> CUTOUT_PHASE1: detector and UART enabled, channel 1.
+/// CUTOUT_PHASE1 -> CUTOUT_PHASE2: channel 2.
+/// CUTOUT_PHASE2 -> PRE_CUTOUT: detector disabled, h-bridge re-enabled.
 template <class HW>
-class Esp32RailComDriver : public RailcomDriver
+class Esp32RailComDriver : public RailcomDriver, public openlcb::Polling
 {
 public:
   Esp32RailComDriver()
@@ -95,8 +118,6 @@ public:
     // cutout.
     enabled_= HW::HB_ENABLE::get();
     HW::HB_ENABLE::set(false);
-
-    //ets_delay_us(0);
   }
 
   void enable_output()
@@ -107,27 +128,19 @@ public:
 
   void start_cutout() override
   {
+    if (railcomPhase_ != RailComPhase::PRE_CUTOUT)
+    {
+      // the previous cutout has not completed, this can only happen if the
+      // timer ISR was delayed by more than a full packet.
+      cutoutOverrun_++;
+      return;
+    }
     disable_output();
 
-    ets_delay_us(HW::RAILCOM_TRIGGER_DELAY_USEC);
-
-    // flush the uart queue of any pending data
-    reset_uart_fifo();
-    
-    // enable the UART RX interrupts
-    SET_PERI_REG_MASK(
-      UART_INT_CLR_REG(HW::UART)
-                     , (UART_RXFIFO_FULL_INT_CLR | UART_RXFIFO_TOUT_INT_CLR));
-    SET_PERI_REG_MASK(
-      UART_INT_ENA_REG(HW::UART)
-                     , (UART_RXFIFO_FULL_INT_ENA | UART_RXFIFO_TOUT_INT_ENA));
-
-    // enable the RailCom detector
-    HW::RC_ENABLE::set(true);
-
-    // set our phase and start the timer
-    railcomPhase_ = RailComPhase::CUTOUT_PHASE1;
-    start_timer(HW::RAILCOM_MAX_READ_DELAY_CH_1);
+    // the remainder of the cutout is sequenced by the timer ISR.
+    cutoutElapsed_ = 0;
+    railcomPhase_ = RailComPhase::CUTOUT_TRIGGER;
+    start_timer(HW::RAILCOM_TRIGGER_DELAY_USEC);
   }
 
   void middle_cutout() override
@@ -145,23 +158,85 @@ public:
     // disable the RailCom detector
     HW::RC_ENABLE::set(false);
 
-    // ets_delay_us(0);
+    // collect any channel 2 data that arrived after the last UART interrupt,
+    // this leaves the FIFO empty for the next cutout.
+    drain_uart_fifo(railComFeedback_);
   }
 
   void set_feedback_key(uint32_t key) override
   {
+    uint32_t head = feedbackHead_.load(std::memory_order_relaxed);
     if (railComFeedback_)
     {
-      // send the feedback to the hub
-      railComHubFlow_->send(railComFeedback_);
+      // publish the feedback collected for the previous packet.
+      railComFeedback_ = nullptr;
+      feedbackHead_.store(++head, std::memory_order_release);
     }
-    // allocate a feedback packet
-    railComFeedback_ = railComHubFlow_->alloc();
-    if (railComFeedback_)
+    if (head - feedbackTail_.load(std::memory_order_acquire) >=
+        HW::FEEDBACK_QUEUE_SIZE)
+    {
+      // the executor has not drained the ring, discard the feedback for
+      // this packet.
+      feedbackOverflow_++;
+      return;
+    }
+    railComFeedback_ = &feedback_[head & (HW::FEEDBACK_QUEUE_SIZE - 1)];
+    railComFeedback_->reset(key);
+  }
+
+  /// Delivers the collected feedback to the RailCom hub.
+  ///
+  /// @param helper is unused.
+  /// @param done is notified when the feedback has been delivered.
+  void poll_33hz(openlcb::WriteHelper *helper, Notifiable *done) override
+  {
+    uint32_t tail = feedbackTail_.load(std::memory_order_relaxed);
+    uint32_t head = feedbackHead_.load(std::memory_order_acquire);
+    uint32_t count = head - tail;
+    if (count > feedbackBatchMax_)
+    {
+      feedbackBatchMax_ = count;
+    }
+    while (tail != head)
     {
-      railComFeedback_->data()->reset(key);
-      railcomFeedbackKey_ = key;
+      auto *b = railComHubFlow_->alloc();
+      b->data()->value() = feedback_[tail & (HW::FEEDBACK_QUEUE_SIZE - 1)];
+      railComHubFlow_->send(b);
+      tail++;
     }
+    // release the slots back to the ISR.
+    feedbackTail_.store(tail, std::memory_order_release);
+    feedbackDelivered_ += count;
+    done->notify();
+  }
+
+  /// Discards RailCom data received when there is no feedback slot.
+  void feedback_lost()
+  {
+    feedbackLost_++;
+  }
+
+  /// @return json formatted string containing the detector statistics.
+  std::string get_state_json()
+  {
+    std::string late = "[";
+    for (size_t bucket = 0; bucket < CUTOUT_LATE_BUCKETS; bucket++)
+    {
+      if (bucket)
+      {
+        late += ",";
+      }
+      late += StringPrintf("%u", cutoutLate_[bucket]);
+    }
+    late += "]";
+    return StringPrintf(
+      "{\"delivered\":%u,\"overflow\":%u,\"lost\":%u,\"batch\":%u,"
+      "\"queue\":%u,\"cutout\":{\"count\":%u,\"overrun\":%u,"
+      "\"min\":%u,\"max\":%u,\"late\":%s}}"
+    , feedbackDelivered_, feedbackOverflow_, feedbackLost_
+    , feedbackBatchMax_, (unsigned)HW::FEEDBACK_QUEUE_SIZE, cutoutCount_
+    , cutoutOverrun_, cutoutCount_ ? cutoutMin_ : 0, cutoutMax_
+    , late.c_str());
   }
 
   void timer_tick()
@@ -169,7 +244,32 @@ public:
     // clear the interrupt status register for our timer
     HW::TIMER_BASE->int_clr_timers.val = BIT(HW::TIMER_IDX);
 
-    if (railcomPhase_ == RailComPhase::CUTOUT_PHASE1)
+    // the timer counts microseconds since the phase started, anything past
+    // the alarm is ISR latency.
+    uint32_t elapsed = timer_elapsed_usec();
+    uint32_t alarm = HW::TIMER_BASE->hw_timer[HW::TIMER_IDX].alarm_low;
+    uint32_t late = elapsed > alarm ? elapsed - alarm : 0;
+    cutoutLate_[late ? std::min(32 - __builtin_clz(late)
+                              , (int)CUTOUT_LATE_BUCKETS - 1) : 0]++;
+    cutoutElapsed_ += elapsed;
+
+    if (railcomPhase_ == RailComPhase::CUTOUT_TRIGGER)
+    {
+      // enable the UART RX interrupts
+      SET_PERI_REG_MASK(
+        UART_INT_CLR_REG(HW::UART)
+                       , (UART_RXFIFO_FULL_INT_CLR | UART_RXFIFO_TOUT_INT_CLR));
+      SET_PERI_REG_MASK(
+        UART_INT_ENA_REG(HW::UART)
+                       , (UART_RXFIFO_FULL_INT_ENA | UART_RXFIFO_TOUT_INT_ENA));
+
+      // enable the RailCom detector
+      HW::RC_ENABLE::set(true);
+
+      railcomPhase_ = RailComPhase::CUTOUT_PHASE1;
+      start_timer(HW::RAILCOM_MAX_READ_DELAY_CH_1);
+    }
+    else if (railcomPhase_ == RailComPhase::CUTOUT_PHASE1)
     {
       middle_cutout();
 
@@ -179,14 +279,19 @@ public:
     else if (railcomPhase_ == RailComPhase::CUTOUT_PHASE2)
     {
       end_cutout();
-      railcomPhase_ = RailComPhase::PRE_CUTOUT;
       enable_output();
+      railcomPhase_ = RailComPhase::PRE_CUTOUT;
+
+      cutoutCount_++;
+      cutoutMin_ = std::min(cutoutMin_, cutoutElapsed_);
+      cutoutMax_ = std::max(cutoutMax_, cutoutElapsed_);
     }
   }
 
   typedef enum : uint8_t
   {
     PRE_CUTOUT,
+    CUTOUT_TRIGGER,
     CUTOUT_PHASE1,
     CUTOUT_PHASE2
   } RailComPhase;
@@ -196,7 +301,7 @@ public:
     return railcomPhase_;
   }
 
-  Buffer<dcc::RailcomHubData> *buf()
+  dcc::Feedback *feedback()
   {
     return railComFeedback_;
   }
@@ -241,20 +346,84 @@ private:
     HW::TIMER_BASE->hw_timer[HW::TIMER_IDX].config.enable = enable_timer;
   }
 
-  void reset_uart_fifo()
+  /// @return number of microseconds since the timer was last started.
+  uint32_t timer_elapsed_usec()
+  {
+    // latch the counter value before reading it.
+    HW::TIMER_BASE->hw_timer[HW::TIMER_IDX].update = 1;
+    return HW::TIMER_BASE->hw_timer[HW::TIMER_IDX].cnt_low;
+  }
+
+  /// Reads the bytes currently in the UART FIFO, this is bounded by the FIFO
+  /// count at the time of the call rather than waiting for it to be empty.
+  ///
+  /// @param fb is the feedback to add the bytes to as channel 2 data, when
+  /// nullptr the bytes are discarded.
+  void drain_uart_fifo(dcc::Feedback *fb)
   {
-    while(HW::UART_BASE->status.rxfifo_cnt != 0
-      || (HW::UART_BASE->mem_rx_status.wr_addr !=
-          HW::UART_BASE->mem_rx_status.rd_addr))
+    for (uint32_t count = HW::UART_BASE->status.rxfifo_cnt; count; count--)
     {
-      (void)HW::UART_BASE->fifo.rw_byte;
+      uint8_t data = HW::UART_BASE->fifo.rw_byte;
+      if (fb)
+      {
+        fb->add_ch2_data(data);
+      }
     }
   }
 
-  uintptr_t railcomFeedbackKey_{0}; 
+  /// Number of buckets in the cutout timer latency histogram, the buckets are
+  /// 0, 1, 2-3, 4-7, 8-15, 16-31, 32-63 and 64+ microseconds.
+  static constexpr size_t CUTOUT_LATE_BUCKETS = 8;
+
+  static_assert((HW::FEEDBACK_QUEUE_SIZE & (HW::FEEDBACK_QUEUE_SIZE - 1)) == 0
+              , "RailCom feedback queue size must be a power of two");
+
   dcc::RailcomHubFlow *railComHubFlow_;
-  Buffer<dcc::RailcomHubData> *railComFeedback_{nullptr};
-  RailComPhase railcomPhase_{RailComPhase::PRE_CUTOUT};
+
+  // feedback slot being filled by the UART ISR, nullptr when the ring was
+  // full at the start of the packet.
+  dcc::Feedback *railComFeedback_{nullptr};
+
+  // ring of feedback slots, written by the ISRs and read by poll_33hz.
+  dcc::Feedback feedback_[HW::FEEDBACK_QUEUE_SIZE];
+
+  // sequence number of the next slot to publish, only modified by the ISR.
+  std::atomic<uint32_t> feedbackHead_{0};
+
+  // sequence number of the next slot to deliver, only modified by
+  // poll_33hz.
+  std::atomic<uint32_t> feedbackTail_{0};
+
+  // number of feedback packets delivered to the hub.
+  uint32_t feedbackDelivered_{0};
+
+  // number of packets for which feedback was discarded due to the ring
+  // being full.
+  uint32_t feedbackOverflow_{0};
+
+  // number of UART interrupts with data that had no feedback slot.
+  uint32_t feedbackLost_{0};
+
+  // largest number of feedback packets delivered in one batch.
+  uint32_t feedbackBatchMax_{0};
+
+  // number of completed cutouts.
+  uint32_t cutoutCount_{0};
+
+  // number of cutouts skipped as the previous cutout was still in progress.
+  uint32_t cutoutOverrun_{0};
+
+  // duration of the cutout in progress, in microseconds.
+  uint32_t cutoutElapsed_{0};
+
+  // shortest and longest completed cutout, in microseconds.
+  uint32_t cutoutMin_{UINT32_MAX};
+  uint32_t cutoutMax_{0};
+
+  // histogram of the timer ISR latency for each cutout phase.
+  uint32_t cutoutLate_[CUTOUT_LATE_BUCKETS]{0};
+
+  volatile RailComPhase railcomPhase_{RailComPhase::PRE_CUTOUT};
   bool enabled_{false};
 };
 
@@ -271,19 +440,28 @@ static void esp32_railcom_uart_isr(void *param)
 {
   Esp32RailComDriver<HW> *driver =
     reinterpret_cast<Esp32RailComDriver<HW> *>(param);
-  Buffer<dcc::RailcomHubData> *fb = driver->buf();
+  dcc::Feedback *fb = driver->feedback();
 
   if (HW::UART_BASE->int_st.rxfifo_full  // RX fifo is full
    || HW::UART_BASE->int_st.rxfifo_tout) // RX data available
   {
     uint8_t rx_fifo_len = HW::UART_BASE->status.rxfifo_cnt;
-    if (driver->railcom_phase() ==
+    if (!fb)
+    {
+      // there is no slot for this packet, flush the uart.
+      for (uint8_t idx = 0; idx < rx_fifo_len; idx++)
+      {
+        (void)HW::UART_BASE->fifo.rw_byte;
+      }
+      driver->feedback_lost();
+    }
+    else if (driver->railcom_phase() ==
         Esp32RailComDriver<HW>::RailComPhase::CUTOUT_PHASE1)
     {
       // this will flush the uart and process only the first two bytes
       for (uint8_t idx = 0; idx < rx_fifo_len; idx++)
       {
-        fb->data()->add_ch1_data(HW::UART_BASE->fifo.rw_byte);
+        fb->add_ch1_data(HW::UART_BASE->fifo.rw_byte);
       }
     }
     else if (driver->railcom_phase() ==
@@ -292,7 +470,7 @@ static void esp32_railcom_uart_isr(void *param)
       // this will flush the uart and process only the first six bytes
       for (uint8_t idx = 0; idx < rx_fifo_len; idx++)
       {
-        fb->data()->add_ch2_data(HW::UART_BASE->fifo.rw_byte);
+        fb->add_ch2_data(HW::UART_BASE->fifo.rw_byte);
       }
     }
 
@@ -18,6 +18,7 @@ COPYRIGHT (c) 2018-2020 Mike Dunston
 #ifndef MONITORED_H_BRIDGE_
 #define MONITORED_H_BRIDGE_
 
+#include "ProgAckDetector.h"
 #include "TrackOutputDescriptor.h"
 #include "sdkconfig.h"
 
@@ -31,6 +32,7 @@ COPYRIGHT (c) 2018-2020 Mike Dunston
 #include <utils/Debouncer.hxx>
 #include <utils/format_utils.hxx>
 #include <utils/logging.h>
+#include <atomic>
 #include <driver/adc.h>
 #include <esp_adc_cal.h>
 #include <esp_bit_defs.h>
@@ -158,6 +160,32 @@ public:
   }
 
 private:
+  /// Number of current sense samples retained for the PROG track, one sample
+  /// is collected every @ref SAMPLE_INTERVAL_MSEC.
+  static constexpr uint8_t SAMPLE_RING_SIZE = 32;
+
+  /// Interval between current sense samples when the PROG track is enabled.
+  static constexpr uint32_t SAMPLE_INTERVAL_MSEC = 1;
+
+  /// Interval between current sense samples when the PROG track is not in
+  /// use for programming.
+  static constexpr uint32_t IDLE_SAMPLE_INTERVAL_MSEC = 10;
+
+  /// Minimum width of an ACK pulse in samples, NMRA S-9.2.3 requires 6mS
+  /// (+/- 1mS) and one additional sample is allowed for scheduling jitter.
+  static constexpr uint8_t ACK_MIN_WIDTH = 4;
+
+  /// Maximum width of an ACK pulse in samples.
+  static constexpr uint8_t ACK_MAX_WIDTH = 9;
+
+  /// Number of consecutive samples over the overcurrent limit before the
+  /// programming track backend will be notified of a short.
+  static constexpr uint8_t SHORT_WIDTH = 2;
+
+  /// Priority of the PROG track current sampling task, this needs to be
+  /// above the executor threads so that an ACK is reported promptly.
+  static constexpr int SAMPLE_TASK_PRIORITY = configMAX_PRIORITIES - 2;
+
   const adc1_channel_t channel_;
   const Gpio *enablePin_;
   const Gpio *thermalWarningPin_;
@@ -182,9 +210,23 @@ private:
   uint32_t lastReading_{0};
   uint8_t state_{STATE_OFF};
   uint8_t overCurrentCheckCount_{0};
-  bool progEnable_{false};
+  std::atomic<bool> progEnable_{false};
+  ProgAckDetector ackDetector_;
+  /// Most recent PROG track samples, only accessed by the sampling task.
+  uint16_t sampleRing_[SAMPLE_RING_SIZE];
+  uint8_t sampleIndex_{0};
+  /// Sum of @ref sampleRing_, maintained by the sampling task and read by
+  /// @ref poll_33hz.
+  std::atomic<uint32_t> sampleTotal_{0};
+  os_thread_t sampleTask_;
 
   void configure();
+
+  uint32_t read_adc();
+
+  static void *sample_task(void *arg);
+
+  void sample_loop();
 };
 
 } // namespace esp32cs
@@ -0,0 +1,158 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef PROG_ACK_DETECTOR_H_
+#define PROG_ACK_DETECTOR_H_
+
+#include <stdint.h>
+
+namespace esp32cs
+{
+
+/// Service mode acknowledgement detector for the PROG track current sense.
+///
+/// The detector is fed with one averaged ADC reading per sample period and
+/// tracks the idle current of the track as a slow moving baseline. A decoder
+/// acknowledgement is an increase of at least 60mA over the baseline for
+/// 6mS (+/- 1mS) per NMRA S-9.2.3, a pulse is reported as an ACK on the
+/// sample where it falls back below the threshold if its width was within
+/// the minimum and maximum width. Pulses which remain over the threshold for
+/// longer than the maximum width are treated as a load change and the
+/// baseline is moved to the new level.
+///
+/// This class has no hardware dependencies so that it can be driven from
+/// recorded current traces.
+class ProgAckDetector
+{
+public:
+  /// Result of processing a single sample.
+  enum Result : uint8_t
+  {
+    /// Nothing detected.
+    NONE,
+
+    /// Acknowledgement pulse detected.
+    ACK,
+
+    /// Current has been over the short limit for the required time.
+    SHORT
+  };
+
+  /// Constructor.
+  ///
+  /// @param ackThreshold is the minimum raw ADC increase over the baseline to
+  /// be considered part of an acknowledgement pulse.
+  /// @param shortLimit is the raw ADC reading which is considered a short.
+  /// @param minWidth is the minimum number of samples the pulse must be over
+  /// the threshold to be reported as an ACK.
+  /// @param maxWidth is the maximum number of samples the pulse can be over
+  /// the threshold to be reported as an ACK, longer pulses are considered to
+  /// be a load change.
+  /// @param shortWidth is the number of consecutive samples over the short
+  /// limit before a short will be reported.
+  ProgAckDetector(uint16_t ackThreshold, uint16_t shortLimit, uint8_t minWidth
+                , uint8_t maxWidth, uint8_t shortWidth);
+
+  /// Processes a single sample.
+  ///
+  /// @param reading is the averaged raw ADC reading.
+  ///
+  /// @return @ref Result for the sample, ACK and SHORT are reported only once
+  /// per pulse.
+  Result sample(uint16_t reading);
+
+  /// Discards the baseline and any pulse in progress, this should be called
+  /// when the track output has been enabled.
+  void reset();
+
+  /// @return the current baseline as raw ADC reading.
+  uint16_t baseline() const
+  {
+    return baseline_ >> BASELINE_SHIFT;
+  }
+
+  /// @return number of ACK pulses detected.
+  uint32_t ack_count() const
+  {
+    return ackCount_;
+  }
+
+  /// @return width in samples of the last detected ACK pulse.
+  uint8_t last_ack_width() const
+  {
+    return lastAckWidth_;
+  }
+
+  /// @return peak raw ADC increase over the baseline of the last ACK pulse.
+  uint16_t last_ack_amplitude() const
+  {
+    return lastAckAmplitude_;
+  }
+
+private:
+  /// Number of fractional bits used for the baseline.
+  static constexpr uint8_t BASELINE_SHIFT = 4;
+
+  /// Weight of new samples in the baseline average, as a power of two.
+  static constexpr uint8_t BASELINE_WEIGHT_SHIFT = 3;
+
+  /// Number of samples used to establish the initial baseline.
+  static constexpr uint8_t BASELINE_SETTLE_SAMPLES = 8;
+
+  /// Minimum increase over the baseline for an ACK.
+  const uint16_t ackThreshold_;
+
+  /// Reading which is considered a short.
+  const uint16_t shortLimit_;
+
+  /// Minimum ACK pulse width in samples.
+  const uint8_t minWidth_;
+
+  /// Maximum ACK pulse width in samples.
+  const uint8_t maxWidth_;
+
+  /// Number of samples over @ref shortLimit_ before reporting a short.
+  const uint8_t shortWidth_;
+
+  /// Idle current baseline with @ref BASELINE_SHIFT fractional bits.
+  uint32_t baseline_{0};
+
+  /// Number of samples collected for the initial baseline.
+  uint8_t settleCount_{0};
+
+  /// Width of the pulse in progress in samples.
+  uint8_t pulseWidth_{0};
+
+  /// Peak increase over the baseline of the pulse in progress.
+  uint16_t pulsePeak_{0};
+
+  /// Number of consecutive samples over @ref shortLimit_.
+  uint8_t shortCount_{0};
+
+  /// Number of ACK pulses detected.
+  uint32_t ackCount_{0};
+
+  /// Width of the last ACK pulse.
+  uint8_t lastAckWidth_{0};
+
+  /// Peak increase over the baseline of the last ACK pulse.
+  uint16_t lastAckAmplitude_{0};
+};
+
+} // namespace esp32cs
+
+#endif // PROG_ACK_DETECTOR_H_
@@ -28,7 +28,6 @@ COPYRIGHT (c) 2019-2020 Mike Dunston
 #include <dcc/PacketFlowInterface.hxx>
 #include <dcc/RailCom.hxx>
 #include <dcc/RailcomHub.hxx>
-#include <freertos_drivers/arduino/DeviceBuffer.hxx>
 #include <freertos_drivers/arduino/RailcomDriver.hxx>
 #include <os/OS.hxx>
 #include <utils/Atomic.hxx>
@@ -38,6 +37,8 @@ COPYRIGHT (c) 2019-2020 Mike Dunston
 
 #include "can_ioctl.h"
 #include "MonitoredHBridge.h"
+#include "SPSCQueue.h"
+#include "track_ioctl.h"
 #include "sdkconfig.h"
 
 namespace esp32cs
@@ -61,6 +62,8 @@ public:
   void rmt_transmit_complete();
 
   // Used only for DCCProgrammer OPS track requests, TBD if this can be removed.
+  // This shares the producer side of the packet queue with write() and must
+  // be called from the same thread.
   void send(Buffer<dcc::Packet> *, unsigned);
 
   const char *name() const
@@ -68,6 +71,12 @@ public:
     return name_;
   }
 
+  // Returns the encoder statistics as a json string.
+  std::string get_state_json();
+
+  // Retrieves the signal generator statistics.
+  void get_signal_stats(track_signal_stats_t *stats);
+
 private:
   // maximum number of RMT memory blocks (256 bytes each, 4 bytes per data bit)
   // this will result in a max payload of 192 bits which is larger than any
@@ -77,18 +86,73 @@ private:
   // maximum number of bits that can be transmitted as one packet.
   static constexpr uint8_t MAX_RMT_BITS = (RMT_MEM_ITEM_NUM * MAX_RMT_MEMORY_BLOCKS);
 
+  // number of bits in a single Marklin-Motorola packet.
+  static constexpr uint8_t MARKLIN_PACKET_BITS = 18;
+
+  // number of payload bytes used for a single Marklin-Motorola packet.
+  static constexpr uint8_t MARKLIN_PACKET_BYTES = 3;
+
+  // maximum number of RMT items needed for a Marklin-Motorola packet, each
+  // packet is sent twice with a pause after each copy.
+  static constexpr uint8_t MAX_MARKLIN_RMT_BITS =
+    (dcc::Packet::MAX_PAYLOAD / MARKLIN_PACKET_BYTES) *
+    2 * (MARKLIN_PACKET_BITS + 1);
+
+  // Encoded packet ready for transmission, two of these are used so that the
+  // next packet can be encoded while the current packet is transmitted.
+  struct EncodedPacket
+  {
+    // number of RMT items in the encoded packet.
+    uint32_t length{0};
+
+    // number of remaining repeats of this packet.
+    int8_t repeat{0};
+
+    // RailCom feedback key for this packet.
+    uintptr_t feedbackKey{0};
+
+    // true if the items contain a Marklin-Motorola packet, these do not have
+    // the DCC preamble and are not followed by a RailCom cutout.
+    bool marklin{false};
+
+    // encoded RMT items for the packet, including the preamble.
+    rmt_item32_t items[MAX_RMT_BITS];
+  };
+
   const char *name_;
   const rmt_channel_t channel_;
   const uint8_t dccPreambleBitCount_;
   RailcomDriver *railcomDriver_;
-  Atomic packetQueueLock_;
-  DeviceBuffer<dcc::Packet> *packetQueue_;
-  Notifiable* notifiable_{nullptr};
-  int8_t pktRepeatCount_{0};
-  uint32_t pktLength_{0};
-  rmt_item32_t packet_[MAX_RMT_BITS];
-
-  void encode_next_packet();
+  // packets waiting for transmission, the writer is the track interface and
+  // the reader is the RMT ISR.
+  SPSCQueue<dcc::Packet> packetQueue_;
+  // notifiable to wake up when space is available in the packet queue, this
+  // is exchanged atomically by the writer and the RMT ISR.
+  std::atomic<Notifiable *> notifiable_{nullptr};
+  EncodedPacket packets_[2];
+  uint8_t activePacket_{0};
+  bool nextPacketReady_{false};
+  uint32_t transmitCount_{0};
+  uint32_t underrunCount_{0};
+  uint32_t queueFullCount_{0};
+  uint32_t lookaheadMissCount_{0};
+  uint32_t marklinCount_{0};
+  uint32_t gapCyclesMin_{UINT32_MAX};
+  uint32_t gapCyclesMax_{0};
+  uint64_t gapCyclesTotal_{0};
+  uint32_t encodeCount_{0};
+  uint32_t encodeCyclesMin_{UINT32_MAX};
+  uint32_t encodeCyclesMax_{0};
+  uint64_t encodeCyclesTotal_{0};
+  // protects the statistics above which are updated by the RMT ISR, the 64
+  // bit totals can not be read atomically.
+  Atomic statsLock_;
+
+  void encode_next_packet(EncodedPacket *target);
+
+  void encode_dcc_packet(const dcc::Packet &packet, EncodedPacket *target);
+
+  void encode_marklin_packet(const dcc::Packet &packet, EncodedPacket *target);
 
   DISALLOW_COPY_AND_ASSIGN(RMTTrackDevice);
 };
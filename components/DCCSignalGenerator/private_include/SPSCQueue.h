@@ -0,0 +1,169 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef SPSC_QUEUE_H_
+#define SPSC_QUEUE_H_
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <utils/macros.h>
+
+namespace esp32cs
+{
+
+/// Wait-free single-producer / single-consumer ring buffer.
+///
+/// The producer only writes @ref head_ and the consumer only writes
+/// @ref tail_, neither side needs to disable interrupts or take a lock which
+/// allows the consumer to be an ISR running on the other core. The indices
+/// are free running and the capacity is rounded up to a power of two so that
+/// the slot is selected with a mask and wrap around needs no special casing.
+///
+/// The two indices are kept in separate cache lines so that the producer and
+/// consumer cores do not invalidate each other's line on every operation when
+/// the queue is placed in cached memory.
+///
+/// @param T is the element type, it must be copy assignable.
+template <typename T>
+class SPSCQueue
+{
+public:
+  /// Constructor.
+  ///
+  /// @param size is the minimum number of elements the queue must hold, this
+  /// will be rounded up to the next power of two.
+  SPSCQueue(size_t size)
+    : mask_(round_up_pow2(size) - 1), items_(new T[mask_ + 1])
+  {
+  }
+
+  /// Destructor.
+  ~SPSCQueue()
+  {
+    delete[] items_;
+  }
+
+  /// Adds an element to the queue, must only be called by the producer.
+  ///
+  /// @param item is the element to add.
+  ///
+  /// @return true if the element was added, false if the queue is full.
+  bool push(const T &item)
+  {
+    uint32_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) > mask_)
+    {
+      return false;
+    }
+    items_[head & mask_] = item;
+    // publish the element before the index so the consumer never sees a
+    // partially written slot.
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// Removes the oldest element from the queue, must only be called by the
+  /// consumer.
+  ///
+  /// @param item will receive the element.
+  ///
+  /// @return true if an element was removed, false if the queue is empty.
+  bool pop(T *item)
+  {
+    uint32_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire))
+    {
+      return false;
+    }
+    *item = items_[tail & mask_];
+    // release the slot only after it has been read.
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// @return true if there is no space for another element. This is exact
+  /// when called by the producer, the queue can only drain concurrently.
+  bool full() const
+  {
+    return size() > mask_;
+  }
+
+  /// @return true if there are no elements in the queue. This is exact when
+  /// called by the consumer, the queue can only fill concurrently.
+  bool empty() const
+  {
+    return size() == 0;
+  }
+
+  /// @return approximate number of elements in the queue.
+  size_t size() const
+  {
+    return head_.load(std::memory_order_acquire) -
+           tail_.load(std::memory_order_acquire);
+  }
+
+  /// @return maximum number of elements the queue can hold.
+  size_t capacity() const
+  {
+    return mask_ + 1;
+  }
+
+private:
+  /// Size of the cache line used to separate the producer and consumer
+  /// indices.
+  static constexpr size_t CACHE_LINE_SIZE = 32;
+
+  static_assert(ATOMIC_INT_LOCK_FREE == 2
+              , "SPSCQueue requires lock-free 32-bit atomics");
+
+  /// @return the smallest power of two which is at least @param size.
+  static uint32_t round_up_pow2(size_t size)
+  {
+    uint32_t value = 1;
+    while (value < size)
+    {
+      value <<= 1;
+    }
+    return value;
+  }
+
+  /// Mask applied to the free running indices to select a slot.
+  const uint32_t mask_;
+
+  /// Storage for the elements.
+  T *items_;
+
+  /// Padding to move @ref head_ out of the cache line of the read-only
+  /// members.
+  uint8_t pad0_[CACHE_LINE_SIZE - sizeof(uint32_t) - sizeof(T *)];
+
+  /// Index of the next slot to write, only modified by the producer.
+  std::atomic<uint32_t> head_{0};
+
+  /// Padding to keep @ref head_ and @ref tail_ in separate cache lines.
+  uint8_t pad1_[CACHE_LINE_SIZE - sizeof(std::atomic<uint32_t>)];
+
+  /// Index of the next slot to read, only modified by the consumer.
+  std::atomic<uint32_t> tail_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(SPSCQueue);
+};
+
+} // namespace esp32cs
+
+#endif // SPSC_QUEUE_H_
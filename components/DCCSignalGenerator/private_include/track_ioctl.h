@@ -0,0 +1,67 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef _TRACK_IOCTL_H_
+#define _TRACK_IOCTL_H_
+
+#include <stdint.h>
+#include "stropts.h"
+
+#if defined (__cplusplus)
+extern "C" {
+#endif
+
+/** Magic number for the /dev/track ioctl calls */
+#define TRACK_IOC_MAGIC ('t')
+
+/** Signal generator statistics for a track output. */
+typedef struct
+{
+  /** Number of packet transmissions started. */
+  uint32_t transmit_count;
+
+  /** Number of times the packet queue was empty and an idle packet was sent
+   * instead. */
+  uint32_t underrun_count;
+
+  /** Number of times the next packet was not encoded ahead of time and had to
+   * be encoded in the inter-packet gap. */
+  uint32_t lookahead_miss_count;
+
+  /** Minimum CPU cycles between the end of one packet and the start of the
+   * next. */
+  uint32_t gap_cycles_min;
+
+  /** Maximum CPU cycles between the end of one packet and the start of the
+   * next. */
+  uint32_t gap_cycles_max;
+
+  /** Mean CPU cycles between the end of one packet and the start of the
+   * next. */
+  uint32_t gap_cycles_mean;
+} track_signal_stats_t;
+
+/** Read the signal generator statistics. Argument is a pointer to a
+ * track_signal_stats_t. */
+#define TRACK_IOC_SIGNAL_STATS \
+  IOR(TRACK_IOC_MAGIC, 1, sizeof(track_signal_stats_t))
+
+#if defined (__cplusplus)
+}
+#endif
+
+#endif /* _TRACK_IOCTL_H_ */
@@ -22,6 +22,7 @@ COPYRIGHT (c) 2017-2019 Mike Dunston
 #include <dcc/UpdateLoop.hxx>
 #include <JsonConstants.h>
 #include <json.hpp>
+#include <StateBus.h>
 
 using nlohmann::json;
 
@@ -29,6 +30,26 @@ std::unique_ptr<TurnoutManager> turnoutManager;
 
 static constexpr const char * TURNOUTS_JSON_FILE = "turnouts.json";
 
+static constexpr const char * TURNOUTS_JOURNAL = "turnouts";
+
+/// Journal payload for a single turnout.
+struct TurnoutRecord
+{
+  /// Layout version of this record, @ref TURNOUT_RECORD_VERSION.
+  uint8_t version;
+  uint8_t type;
+  uint8_t thrown;
+  uint8_t reserved;
+
+  /// Insertion ordinal of the turnout, the journal replays in address order
+  /// so this is used to restore the DCC++ turnout IDs. Deleted turnouts leave
+  /// gaps which are ignored.
+  uint32_t ordinal;
+};
+
+/// Current version of @ref TurnoutRecord.
+static constexpr uint8_t TURNOUT_RECORD_VERSION = 1;
+
 static constexpr const char *TURNOUT_TYPE_STRINGS[] =
 {
   "LEFT",
@@ -41,18 +62,79 @@ TurnoutManager::TurnoutManager(openlcb::Node *node, Service *service)
   : turnoutEventConsumer_(node, this)
   , persistFlow_(service, SEC_TO_NSEC(CONFIG_TURNOUT_PERSISTENCE_INTERVAL_SEC)
               , std::bind(&TurnoutManager::persist, this))
-  , dirty_(false)
+  , journal_(TURNOUTS_JOURNAL)
 {
   OSMutexLock h(&mux_);
   LOG(INFO, "[Turnout] Initializing DCC Turnout database");
-  json root = json::parse(
-    Singleton<ConfigurationManager>::instance()->load(TURNOUTS_JSON_FILE));
-  for (auto turnout : root)
+  auto cfg = Singleton<ConfigurationManager>::instance();
+  if (!journal_.exists() && cfg->exists(TURNOUTS_JSON_FILE))
   {
-    turnouts_.push_back(
-      std::make_unique<Turnout>(turnout[JSON_ADDRESS_NODE].get<int>()
-                              , turnout[JSON_STATE_NODE].get<int>()
-                              , (TurnoutType)turnout[JSON_TYPE_NODE].get<int>()));
+    LOG(INFO, "[Turnout] Converting %s to journal", TURNOUTS_JSON_FILE);
+    json root = json::parse(cfg->load(TURNOUTS_JSON_FILE), nullptr, false);
+    if (!root.is_discarded())
+    {
+      for (auto turnout : root)
+      {
+        uint16_t address = turnout[JSON_ADDRESS_NODE].get<int>();
+        if (index_.find(address) != TurnoutIndex::NOT_FOUND)
+        {
+          continue;
+        }
+        add_locked(new Turnout(address
+                             , turnout[JSON_STATE_NODE].get<int>()
+                             , (TurnoutType)turnout[JSON_TYPE_NODE].get<int>())
+                 , nextOrdinal_++);
+        journal_locked(turnouts_.size() - 1);
+      }
+    }
+    if (journal_.compact())
+    {
+      cfg->remove(TURNOUTS_JSON_FILE);
+    }
+  }
+  else
+  {
+    std::vector<std::pair<uint32_t, Turnout *>> loaded;
+    journal_.load([&](uint32_t address, const string &payload)
+    {
+      TurnoutRecord record;
+      if (payload.length() != sizeof(TurnoutRecord) ||
+          address > UINT16_MAX)
+      {
+        LOG_ERROR("[Turnout %d] Invalid persistent entry, ignoring it"
+                , address);
+        return;
+      }
+      memcpy(&record, payload.data(), sizeof(TurnoutRecord));
+      if (record.version != TURNOUT_RECORD_VERSION)
+      {
+        LOG_ERROR("[Turnout %d] Unsupported persistent entry version %d, "
+                  "ignoring it", address, record.version);
+        return;
+      }
+      if (record.type >= TurnoutType::MAX_TURNOUT_TYPES)
+      {
+        record.type = TurnoutType::LEFT;
+      }
+      loaded.emplace_back(record.ordinal
+                        , new Turnout(address, record.thrown
+                                    , (TurnoutType)record.type));
+    });
+    // restore the list order so the DCC++ turnout IDs remain stable.
+    std::stable_sort(loaded.begin(), loaded.end()
+                   , [](const std::pair<uint32_t, Turnout *> &a
+                      , const std::pair<uint32_t, Turnout *> &b)
+    {
+      return a.first < b.first;
+    });
+    for (auto &entry : loaded)
+    {
+      add_locked(entry.second, entry.first);
+    }
+    if (!loaded.empty())
+    {
+      nextOrdinal_ = loaded.back().first + 1;
+    }
   }
   LOG(INFO, "[Turnout] Loaded %d DCC turnout(s)", turnouts_.size());
 }
@@ -65,56 +147,49 @@ void TurnoutManager::clear()
     turnout.reset(nullptr);
   }
   turnouts_.clear();
-  dirty_ = true;
+  ordinals_.clear();
+  nextOrdinal_ = 0;
+  index_.clear();
+  journal_.clear();
 }
 
-#define FIND_TURNOUT(address) \
-  std::find_if(turnouts_.begin(), turnouts_.end(),        \
-    [address](std::unique_ptr<Turnout> & turnout) -> bool \
-    {                                                     \
-      return (turnout->getAddress() == address);          \
-    }                                                     \
-  )
-
 string TurnoutManager::set(uint16_t address, bool thrown, bool sendDCC)
 {
   OSMutexLock h(&mux_);
-  auto const &elem = FIND_TURNOUT(address);
-  if (elem != turnouts_.end())
+  uint16_t index = set_locked(address, thrown, sendDCC);
+  return StringPrintf("<H %d %d>", index + 1, turnouts_[index]->isThrown());
+}
+
+void TurnoutManager::set(const std::vector<std::pair<uint16_t, bool>> &states
+                       , bool sendDCC)
+{
+  OSMutexLock h(&mux_);
+  for (const auto &state : states)
   {
-    elem->get()->set(thrown, sendDCC);
-    dirty_ = true;
-    return StringPrintf("<H %d %d>"
-                      , std::distance(turnouts_.begin(), elem) + 1
-                      , elem->get()->isThrown());
+    set_locked(state.first, state.second, sendDCC);
   }
-
-  // we didn't find it, create it and set it
-  turnouts_.push_back(std::make_unique<Turnout>(turnouts_.size() + 1
-                                              , address));
-  turnouts_.back().get()->set(thrown, sendDCC);
-  return StringPrintf("<H %d %d>", turnouts_.size()
-                    , turnouts_.back().get()->isThrown());
 }
 
 string TurnoutManager::toggle(uint16_t address)
 {
   OSMutexLock h(&mux_);
-  auto const &elem = FIND_TURNOUT(address);
-  if (elem != turnouts_.end())
+  uint16_t index = index_.find(address);
+  if (index != TurnoutIndex::NOT_FOUND)
   {
-    elem->get()->toggle();
-    dirty_ = true;
-    return StringPrintf("<H %d %d>"
-                      , std::distance(turnouts_.begin(), elem)
-                      , elem->get()->isThrown());
+    turnouts_[index]->toggle();
+    journal_locked(index);
+    esp32cs::publish_state(esp32cs::TOPIC_TURNOUT, address
+                         , turnouts_[index]->isThrown(), index + 1);
+    return StringPrintf("<H %d %d>", index, turnouts_[index]->isThrown());
   }
 
   // we didn't find it, create it and throw it
-  turnouts_.push_back(std::make_unique<Turnout>(address, -1));
-  turnouts_.back().get()->toggle();
-  return StringPrintf("<H %d %d>", turnouts_.size()
-                    , turnouts_.back().get()->isThrown());
+  Turnout *turnout = add_locked(new Turnout(address, -1), nextOrdinal_++);
+  turnout->toggle();
+  journal_locked(turnouts_.size() - 1);
+  esp32cs::publish_state(esp32cs::TOPIC_TURNOUT, address, turnout->isThrown()
+                       , turnouts_.size());
+  return StringPrintf("<H %d %d>", turnouts_.size(), turnout->isThrown());
 }
 
 string TurnoutManager::getStateAsJson(bool readable)
@@ -147,28 +222,38 @@ Turnout *TurnoutManager::createOrUpdate(const uint16_t address
                                       , const TurnoutType type)
 {
   OSMutexLock h(&mux_);
-  auto const &elem = FIND_TURNOUT(address);
-  if (elem != turnouts_.end())
+  uint16_t index = index_.find(address);
+  if (index != TurnoutIndex::NOT_FOUND)
+  {
+    turnouts_[index]->update(address, type);
+  }
+  else
   {
-    elem->get()->update(address, type);
-    dirty_ = true;
-    return elem->get();
+    // we didn't find it, create it!
+    index = turnouts_.size();
+    add_locked(new Turnout(address, false, type), nextOrdinal_++);
   }
-  // we didn't find it, create it!
-  turnouts_.push_back(std::make_unique<Turnout>(address, false, type));
-  dirty_ = true;
-  return turnouts_.back().get();
+  journal_locked(index);
+  return turnouts_[index].get();
 }
 
 bool TurnoutManager::remove(const uint16_t address)
 {
   OSMutexLock h(&mux_);
-  auto const &elem = FIND_TURNOUT(address);
-  if (elem != turnouts_.end())
+  uint16_t index = index_.find(address);
+  if (index != TurnoutIndex::NOT_FOUND)
   {
     LOG(CONFIG_TURNOUT_LOG_LEVEL, "[Turnout %d] Deleted", address);
-    turnouts_.erase(elem);
-    dirty_ = true;
+    turnouts_.erase(turnouts_.begin() + index);
+    ordinals_.erase(ordinals_.begin() + index);
+    // the remaining turnouts keep their ordinals, the gap is skipped when the
+    // journal is loaded.
+    journal_.erase(address);
+    index_.clear();
+    for (index = 0; index < turnouts_.size(); index++)
+    {
+      index_.insert(turnouts_[index]->getAddress(), index);
+    }
     return true;
   }
   LOG(WARNING, "[Turnout %d] not found", address);
@@ -190,13 +275,12 @@ Turnout *TurnoutManager::getByIndex(const uint16_t index)
 Turnout *TurnoutManager::get(const uint16_t address)
 {
   OSMutexLock h(&mux_);
-  auto const &elem = FIND_TURNOUT(address);
-  if (elem != turnouts_.end())
+  Turnout *turnout = find_locked(address);
+  if (!turnout)
   {
-    return elem->get();
+    LOG(WARNING, "[Turnout %d] not found", address);
   }
-  LOG(WARNING, "[Turnout %d] not found", address);
-  return nullptr;
+  return turnout;
 }
 
 uint16_t TurnoutManager::count()
@@ -208,7 +292,6 @@ uint16_t TurnoutManager::count()
 // TODO: shift this to consume the LCC event directly
 void TurnoutManager::send(Buffer<dcc::Packet> *b, unsigned prio)
 {
-  // add ref count so send doesn't delete it
   dcc::Packet *pkt = b->data();
   // Verify that the packet looks like a DCC Accessory decoder packet
   if(!pkt->packet_header.is_marklin &&
@@ -237,8 +320,14 @@ void TurnoutManager::send(Buffer<dcc::Packet> *b, unsigned prio)
     uint8_t boardIndex = (pkt->payload[1] & 0b00000110) >> 1;
     // least significant bit of the second byte is thrown/closed indicator.
     bool state = pkt->payload[1] & 0b00000001;
-    // Set the turnout to the requested state, don't send a DCC packet.
-    set(decodeDCCAccessoryAddress(boardAddress, boardIndex), state);
+    uint16_t address = decodeDCCAccessoryAddress(boardAddress, boardIndex);
+    // The packet is no longer needed, release it before taking the lock.
+    b->unref();
+    // Set the turnout to the requested state, don't send a DCC packet. This
+    // bypasses set() since there is no DCC++ response to generate.
+    OSMutexLock h(&mux_);
+    set_locked(address, state, false);
+    return;
   }
   b->unref();
 }
@@ -263,18 +352,64 @@ string TurnoutManager::get_state_as_json(bool readableStrings)
 void TurnoutManager::persist()
 {
   OSMutexLock h(&mux_);
-  bool dirtyFlag = dirty_;
-  dirty_ = false;
   // Check if we have any changes to persist, if not exit early.
-  if (!dirtyFlag || turnouts_.empty())
+  if (!journal_.is_dirty())
   {
     LOG(CONFIG_TURNOUT_LOG_LEVEL, "[Turnout] No entries require persistence.");
     return;
   }
-  LOG(CONFIG_TURNOUT_LOG_LEVEL, "[Turnout] Persisting %zu turnouts"
-    , turnouts_.size());
-  Singleton<ConfigurationManager>::instance()->store(TURNOUTS_JSON_FILE
-                                                   , get_state_as_json(false));
+  LOG(CONFIG_TURNOUT_LOG_LEVEL, "[Turnout] Persisting turnout changes");
+  journal_.sync();
+}
+
+Turnout *TurnoutManager::find_locked(uint16_t address)
+{
+  uint16_t index = index_.find(address);
+  if (index == TurnoutIndex::NOT_FOUND)
+  {
+    return nullptr;
+  }
+  return turnouts_[index].get();
+}
+
+Turnout *TurnoutManager::add_locked(Turnout *turnout, uint32_t ordinal)
+{
+  index_.insert(turnout->getAddress(), turnouts_.size());
+  turnouts_.emplace_back(turnout);
+  ordinals_.push_back(ordinal);
+  return turnout;
+}
+
+uint16_t TurnoutManager::set_locked(uint16_t address, bool thrown
+                                  , bool sendDCC)
+{
+  uint16_t index = index_.find(address);
+  if (index == TurnoutIndex::NOT_FOUND)
+  {
+    // we didn't find it, create it and set it
+    index = turnouts_.size();
+    add_locked(new Turnout(address, thrown), nextOrdinal_++);
+  }
+  turnouts_[index]->set(thrown, sendDCC);
+  journal_locked(index);
+  esp32cs::publish_state(esp32cs::TOPIC_TURNOUT, address, thrown, index + 1);
+  return index;
+}
+
+void TurnoutManager::journal_locked(uint16_t index)
+{
+  Turnout *turnout = turnouts_[index].get();
+  TurnoutRecord record =
+  {
+    .version = TURNOUT_RECORD_VERSION,
+    .type = (uint8_t)turnout->getType(),
+    .thrown = turnout->isThrown(),
+    .reserved = 0,
+    .ordinal = ordinals_[index]
+  };
+  journal_.put(turnout->getAddress()
+             , string(reinterpret_cast<const char *>(&record)
+                    , sizeof(TurnoutRecord)));
 }
 
 void encodeDCCAccessoryAddress(uint16_t *board, int8_t *port
@@ -0,0 +1,150 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef TURNOUT_INDEX_H_
+#define TURNOUT_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/// Open addressing hash table which maps an accessory address to a position
+/// in the turnout list.
+///
+/// Collisions are resolved with linear probing and the table is doubled in
+/// size when it becomes half full. Individual entries can not be removed,
+/// when a turnout is removed the positions of the following turnouts change
+/// so the table is cleared and repopulated instead.
+class TurnoutIndex
+{
+public:
+  /// Returned by @ref find when the address is not in the table.
+  static constexpr uint16_t NOT_FOUND = UINT16_MAX;
+
+  /// @param address is the accessory address to search for.
+  ///
+  /// @return the position of the turnout or @ref NOT_FOUND.
+  uint16_t find(uint16_t address) const
+  {
+    if (slots_.empty())
+    {
+      return NOT_FOUND;
+    }
+    for (size_t slot = hash(address); ; slot = (slot + 1) & mask())
+    {
+      if (slots_[slot].address == address)
+      {
+        return slots_[slot].index;
+      }
+      else if (slots_[slot].address == EMPTY_SLOT)
+      {
+        return NOT_FOUND;
+      }
+    }
+  }
+
+  /// Adds or replaces an entry in the table.
+  ///
+  /// @param address is the accessory address of the turnout.
+  /// @param index is the position of the turnout.
+  void insert(uint16_t address, uint16_t index)
+  {
+    if ((count_ + 1) * 2 > slots_.size())
+    {
+      grow();
+    }
+    size_t slot = hash(address);
+    while (slots_[slot].address != EMPTY_SLOT &&
+           slots_[slot].address != address)
+    {
+      slot = (slot + 1) & mask();
+    }
+    if (slots_[slot].address == EMPTY_SLOT)
+    {
+      count_++;
+    }
+    slots_[slot] = {address, index};
+  }
+
+  /// Removes all entries, the table capacity is retained.
+  void clear()
+  {
+    for (auto &slot : slots_)
+    {
+      slot = {EMPTY_SLOT, NOT_FOUND};
+    }
+    count_ = 0;
+  }
+
+private:
+  /// Marker for an unused slot, this is not a valid accessory address.
+  static constexpr uint16_t EMPTY_SLOT = UINT16_MAX;
+
+  /// Initial number of slots, this must be a power of two.
+  static constexpr size_t INITIAL_SLOTS = 64;
+
+  /// Hash table entry.
+  struct Slot
+  {
+    /// Accessory address or @ref EMPTY_SLOT.
+    uint16_t address;
+
+    /// Position of the turnout.
+    uint16_t index;
+  };
+
+  /// @return the slot mask for the current table size.
+  size_t mask() const
+  {
+    return slots_.size() - 1;
+  }
+
+  /// @return the preferred slot for an address.
+  size_t hash(uint16_t address) const
+  {
+    // Fibonacci hashing spreads sequential addresses across the table.
+    return (address * 0x9E3779B1U) >> (32 - bits_);
+  }
+
+  /// Doubles the number of slots and re-inserts all entries.
+  void grow()
+  {
+    std::vector<Slot> previous;
+    previous.swap(slots_);
+    bits_ = previous.empty() ? __builtin_ctz(INITIAL_SLOTS) : bits_ + 1;
+    slots_.resize(1 << bits_, {EMPTY_SLOT, NOT_FOUND});
+    count_ = 0;
+    for (const auto &slot : previous)
+    {
+      if (slot.address != EMPTY_SLOT)
+      {
+        insert(slot.address, slot.index);
+      }
+    }
+  }
+
+  /// Hash table slots, the size is always a power of two.
+  std::vector<Slot> slots_;
+
+  /// Number of slots in use.
+  size_t count_{0};
+
+  /// Number of bits in the slot mask.
+  uint8_t bits_{0};
+};
+
+#endif // TURNOUT_INDEX_H_
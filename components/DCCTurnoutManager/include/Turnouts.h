@@ -23,6 +23,8 @@ COPYRIGHT (c) 2017-2019 Mike Dunston
 #include <dcc/PacketSource.hxx>
 #include <DCCppProtocol.h>
 #include <openlcb/DccAccyConsumer.hxx>
+#include <PersistentJournal.h>
+#include <TurnoutIndex.h>
 #include <utils/Singleton.hxx>
 
 enum TurnoutType
@@ -83,6 +85,15 @@ public:
   }
   void clear();
   std::string set(uint16_t, bool=false, bool=true);
+
+  /// Sets the state of multiple turnouts, this is intended for routes which
+  /// throw many turnouts at once.
+  ///
+  /// @param states is the list of accessory addresses and the requested
+  /// state (true for thrown), unknown turnouts will be created.
+  /// @param sendDCC controls if DCC packets will be sent to the track.
+  void set(const std::vector<std::pair<uint16_t, bool>> &states
+         , bool sendDCC=true);
   std::string toggle(uint16_t);
   std::string getStateAsJson(bool=true);
   std::string get_state_for_dccpp();
@@ -95,10 +106,42 @@ public:
 private:
   std::string get_state_as_json(bool);
   void persist();
+
+  /// @return the turnout with the provided address or nullptr if not found,
+  /// the caller must hold @ref mux_.
+  Turnout *find_locked(uint16_t);
+
+  /// Adds a turnout to @ref turnouts_ and @ref index_ with the provided
+  /// ordinal, the caller must hold @ref mux_.
+  Turnout *add_locked(Turnout *, uint32_t);
+
+  /// Sets the state of a turnout, creating it if needed, the caller must
+  /// hold @ref mux_.
+  ///
+  /// @return the position of the turnout in @ref turnouts_.
+  uint16_t set_locked(uint16_t, bool, bool);
+
+  /// Records the current state and ordinal of the turnout at the provided
+  /// index of @ref turnouts_ in @ref journal_, the caller must hold
+  /// @ref mux_.
+  void journal_locked(uint16_t);
   std::vector<std::unique_ptr<Turnout>> turnouts_;
+
+  /// Insertion ordinal of each entry in @ref turnouts_, the journal is
+  /// replayed in address order and sorted by this to restore the DCC++
+  /// turnout IDs.
+  std::vector<uint32_t> ordinals_;
+
+  /// Ordinal to assign to the next turnout that is added.
+  uint32_t nextOrdinal_{0};
+
+  /// Lookup of @ref turnouts_ by accessory address.
+  TurnoutIndex index_;
   openlcb::DccAccyConsumer turnoutEventConsumer_;
   AutoPersistFlow persistFlow_;
-  bool dirty_;
+
+  /// Persistent storage of the turnouts, keyed by turnout address.
+  PersistentJournal journal_;
   OSMutex mux_;
 };
 
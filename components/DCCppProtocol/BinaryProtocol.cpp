@@ -0,0 +1,387 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "BinaryProtocol.h"
+#include "DCCppProtocol.h"
+
+#include "sdkconfig.h"
+
+#include <algorithm>
+#include <AllTrainNodes.hxx>
+#include <Consists.h>
+#include <DCCSignalVFS.h>
+#include <executor/Executable.hxx>
+#include <executor/Notifiable.hxx>
+#include <LCCStackManager.h>
+#include <openlcb/SimpleStack.hxx>
+#include <string.h>
+#include <Turnouts.h>
+#include <utils/logging.h>
+#if CONFIG_GPIO_SENSORS
+#include <Sensors.h>
+#endif // CONFIG_GPIO_SENSORS
+
+namespace esp32cs
+{
+
+using dcc::SpeedType;
+
+/// Appends a message to a response buffer.
+///
+/// @param response is the buffer to append to.
+/// @param message is the message to append.
+template <typename T>
+static inline void append_message(std::vector<uint8_t> &response
+                                , const T &message)
+{
+  const uint8_t *data = reinterpret_cast<const uint8_t *>(&message);
+  response.insert(response.end(), data, data + sizeof(T));
+}
+
+/// Copies a request into its message structure, the received data may not
+/// be aligned.
+///
+/// @param data is the start of the request.
+/// @return the decoded request.
+template <typename T>
+static inline T decode_message(const uint8_t *data)
+{
+  T message;
+  memcpy(&message, data, sizeof(T));
+  return message;
+}
+
+/// @return true if the address can be used for a DCC locomotive.
+///
+/// @param address is the locomotive address.
+static inline bool is_valid_loco_address(uint16_t address)
+{
+  return address && address <= DCC_MAX_LOCO_ADDRESS;
+}
+
+/// @return the @ref openlcb::TrainImpl for a locomotive address, this is
+/// retrieved on the LCC executor since it may create the train node.
+///
+/// @param address is the locomotive address.
+static openlcb::TrainImpl *get_loco(uint16_t address)
+{
+  openlcb::TrainImpl *impl = nullptr;
+  SyncNotifiable n;
+  Singleton<LCCStackManager>::instance()->stack()->executor()->add(
+    new CallbackExecutable([&]()
+    {
+      impl = Singleton<commandstation::AllTrainNodes>::instance()->get_train_impl(
+        commandstation::DccMode::DCC_128, address);
+      n.notify();
+    }));
+  n.wait_for_notification();
+  return impl;
+}
+
+/// Encodes the state of a locomotive.
+///
+/// @param impl is the locomotive.
+/// @param address is the locomotive address.
+/// @param response will receive the encoded state message.
+static void encode_loco(openlcb::TrainImpl *impl, uint16_t address
+                      , std::vector<uint8_t> &response)
+{
+  SpeedType speed(impl->get_speed());
+  BinLocoState state =
+  {
+    .type = BIN_LOCO_STATE,
+    .flags = 0,
+    .address = address,
+    .speed = (uint8_t)speed.mph(),
+    .functions = 0
+  };
+  if (speed.direction() == SpeedType::FORWARD)
+  {
+    state.flags |= BIN_FLAG_FORWARD;
+  }
+  if (impl->get_emergencystop())
+  {
+    state.flags |= BIN_FLAG_ESTOP;
+  }
+  for (uint32_t fn = 0; fn <= ConsistManager::MAX_CONSIST_FN; fn++)
+  {
+    if (impl->get_fn(fn))
+    {
+      state.functions |= BIT(fn);
+    }
+  }
+  append_message(response, state);
+}
+
+void BinaryProtocolConsumer::feed(const uint8_t *data, size_t length
+                                , std::vector<uint8_t> &response)
+{
+  while (length)
+  {
+    if (partialSize_)
+    {
+      // complete the request that was split across frames.
+      size_t needed = request_size(partial_[0]) - partialSize_;
+      size_t count = std::min(needed, length);
+      memcpy(partial_ + partialSize_, data, count);
+      partialSize_ += count;
+      data += count;
+      length -= count;
+      if (count < needed)
+      {
+        return;
+      }
+      process(partial_, response);
+      partialSize_ = 0;
+      continue;
+    }
+    size_t size = request_size(data[0]);
+    if (!size)
+    {
+      // without a known size the start of the next request can not be
+      // found, discard the remainder of the data.
+      LOG_ERROR("[BinProto] Unknown request type %02x, discarding %zu bytes"
+              , data[0], length);
+      append_message(response, BinError{BIN_ERROR, data[0]});
+      return;
+    }
+    if (length < size)
+    {
+      memcpy(partial_, data, length);
+      partialSize_ = length;
+      return;
+    }
+    process(data, response);
+    data += size;
+    length -= size;
+  }
+}
+
+void BinaryProtocolConsumer::encode_state(std::vector<uint8_t> &response)
+{
+  auto turnouts = Singleton<TurnoutManager>::instance();
+  for (uint16_t index = 0; index < turnouts->count(); index++)
+  {
+    Turnout *turnout = turnouts->getByIndex(index);
+    if (turnout)
+    {
+      append_message(response
+                   , BinTurnoutState{BIN_TURNOUT_STATE, turnout->isThrown()
+                                   , turnout->getAddress()});
+    }
+  }
+#if CONFIG_GPIO_SENSORS
+  for (const auto &sensor : SensorManager::get_states())
+  {
+    append_message(response
+                 , BinSensorState{BIN_SENSOR_STATE, sensor.second
+                                , sensor.first});
+  }
+#endif // CONFIG_GPIO_SENSORS
+  append_message(response
+               , BinTrackPower{BIN_TRACK_POWER_STATE
+                             , is_ops_track_output_enabled()});
+}
+
+void BinaryProtocolConsumer::encode_loco_state(uint16_t address
+                                             , std::vector<uint8_t> &response)
+{
+  encode_loco(get_loco(address), address, response);
+}
+
+void BinaryProtocolConsumer::encode_state_change(const StateChange &change
+                                               , std::vector<uint8_t> &response)
+{
+  switch (change.topic)
+  {
+    case TOPIC_TURNOUT:
+      append_message(response
+                   , BinTurnoutState{BIN_TURNOUT_STATE, (uint8_t)change.value
+                                   , change.id});
+      break;
+    case TOPIC_SENSOR:
+    case TOPIC_S88:
+    case TOPIC_REMOTE_SENSOR:
+      append_message(response
+                   , BinSensorState{BIN_SENSOR_STATE, (uint8_t)change.value
+                                  , change.id});
+      break;
+    case TOPIC_TRACK:
+      // the binary protocol only reports the OPS track.
+      if (!change.id)
+      {
+        append_message(response
+                     , BinTrackPower{BIN_TRACK_POWER_STATE
+                                   , change.value == TRACK_ON});
+      }
+      break;
+    case TOPIC_LOCO:
+    {
+      BinLocoState state =
+      {
+        .type = BIN_LOCO_STATE,
+        .flags = 0,
+        .address = change.id,
+        .speed = (uint8_t)(change.value & LOCO_STATE_SPEED_MASK),
+        .functions = change.aux
+      };
+      if (change.value & LOCO_STATE_FORWARD)
+      {
+        state.flags |= BIN_FLAG_FORWARD;
+      }
+      if (change.value & LOCO_STATE_ESTOP)
+      {
+        state.flags |= BIN_FLAG_ESTOP;
+      }
+      append_message(response, state);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+size_t BinaryProtocolConsumer::request_size(uint8_t type)
+{
+  switch (type)
+  {
+    case BIN_THROTTLE_SPEED:
+      return sizeof(BinThrottleSpeed);
+    case BIN_THROTTLE_FUNCTION:
+      return sizeof(BinThrottleFunction);
+    case BIN_LOCO_REQUEST:
+      return sizeof(BinLocoRequest);
+    case BIN_TURNOUT_SET:
+      return sizeof(BinTurnoutState);
+    case BIN_SUBSCRIBE:
+      return sizeof(BinSubscribe);
+    case BIN_TRACK_POWER:
+      return sizeof(BinTrackPower);
+    case BIN_ESTOP:
+    case BIN_STATE_REQUEST:
+      return sizeof(BinRequest);
+  }
+  return 0;
+}
+
+void BinaryProtocolConsumer::process(const uint8_t *request
+                                   , std::vector<uint8_t> &response)
+{
+  switch (request[0])
+  {
+    case BIN_THROTTLE_SPEED:
+    {
+      auto msg = decode_message<BinThrottleSpeed>(request);
+      if (!is_valid_loco_address(msg.address))
+      {
+        append_message(response, BinError{BIN_ERROR, request[0]});
+        break;
+      }
+      openlcb::TrainImpl *impl = get_loco(msg.address);
+      if (msg.flags & BIN_FLAG_ESTOP)
+      {
+        impl->set_emergencystop();
+      }
+      else
+      {
+        auto speed = SpeedType::from_mph(msg.speed);
+        if (!(msg.flags & BIN_FLAG_FORWARD))
+        {
+          speed.set_direction(SpeedType::REVERSE);
+        }
+        set_loco_speed(impl, msg.address, speed);
+      }
+      encode_loco(impl, msg.address, response);
+      break;
+    }
+    case BIN_THROTTLE_FUNCTION:
+    {
+      auto msg = decode_message<BinThrottleFunction>(request);
+      if (!is_valid_loco_address(msg.address))
+      {
+        append_message(response, BinError{BIN_ERROR, request[0]});
+        break;
+      }
+      openlcb::TrainImpl *impl = get_loco(msg.address);
+      if (msg.function <= ConsistManager::MAX_CONSIST_FN)
+      {
+        set_loco_fn(impl, msg.address, BIT(msg.function)
+                  , msg.state ? BIT(msg.function) : 0);
+      }
+      else
+      {
+        impl->set_fn(msg.function, msg.state);
+      }
+      encode_loco(impl, msg.address, response);
+      break;
+    }
+    case BIN_LOCO_REQUEST:
+    {
+      auto msg = decode_message<BinLocoRequest>(request);
+      if (!is_valid_loco_address(msg.address))
+      {
+        append_message(response, BinError{BIN_ERROR, request[0]});
+        break;
+      }
+      encode_loco_state(msg.address, response);
+      break;
+    }
+    case BIN_TURNOUT_SET:
+    {
+      auto msg = decode_message<BinTurnoutState>(request);
+      uint16_t address = msg.address;
+      bool thrown = msg.thrown;
+      Singleton<TurnoutManager>::instance()->set({{address, thrown}});
+      msg.type = BIN_TURNOUT_STATE;
+      append_message(response, msg);
+      break;
+    }
+    case BIN_TRACK_POWER:
+    {
+      auto msg = decode_message<BinTrackPower>(request);
+      if (msg.on)
+      {
+        enable_ops_track_output();
+      }
+      else
+      {
+        disable_track_outputs();
+      }
+      // the requested state is reported since enable/disable is deferred
+      // until the next check interval.
+      msg.type = BIN_TRACK_POWER_STATE;
+      append_message(response, msg);
+      break;
+    }
+    case BIN_ESTOP:
+      initiate_estop();
+      break;
+    case BIN_STATE_REQUEST:
+      encode_state(response);
+      break;
+    case BIN_SUBSCRIBE:
+    {
+      auto msg = decode_message<BinSubscribe>(request);
+      topics_ = msg.topics & ALL_STATE_TOPICS;
+      // send the current state so the client can apply the changes to it.
+      encode_state(response);
+      break;
+    }
+  }
+}
+
+} // namespace esp32cs
@@ -17,14 +17,70 @@ COPYRIGHT (c) 2019 Mike Dunston
 
 #include "DCCProgrammer.h"
 
+#include <algorithm>
+#include <ConfigurationManager.h>
 #include <dcc/ProgrammingTrackBackend.hxx>
 #include <dcc/DccDebug.hxx>
 #include <DuplexedTrackIf.h>
+#include <deque>
+#include <json.hpp>
+#include <JsonConstants.h>
+#include <map>
+#include <os/OS.hxx>
+#include <RailComPomFlow.h>
+#include <utils/StringPrintf.hxx>
 #include <utils/Uninitialized.hxx>
 
+#include "sdkconfig.h"
+
 // number of attempts the programming track will make to read/write a CV
 static constexpr uint8_t PROG_TRACK_CV_ATTEMPTS = 3;
 
+// persistent cache of CV values keyed by decoder manufacturer and version.
+static constexpr const char * CV_CACHE_JSON_FILE = "cvcache.json";
+
+// Commonly used default CV values, these are tried with a single byte verify
+// before falling back to reading the CV bit by bit.
+static const std::multimap<uint16_t, uint8_t> DEFAULT_CV_VALUES =
+{
+  { CV_NAMES::SHORT_ADDRESS, 3 }
+, { CV_NAMES::ACCESSORY_DECODER_MSB_ADDRESS, 0 }
+, { CV_NAMES::LONG_ADDRESS_MSB_ADDRESS, 192 }
+, { CV_NAMES::LONG_ADDRESS_LSB_ADDRESS, 0 }
+, { CV_NAMES::CONSIST_ADDRESS, 0 }
+, { CV_NAMES::CONSIST_FUNCTION_CONTROL_F1_F8, 0 }
+, { CV_NAMES::CONSIST_FUNCTION_CONTROL_FL_F9_F12, 0 }
+, { CV_NAMES::DECODER_CONFIG, 6 }
+, { CV_NAMES::DECODER_CONFIG, 2 }
+, { CV_NAMES::DECODER_CONFIG, 14 }
+};
+
+// maximum number of queued asynchronous programming track requests.
+static constexpr size_t MAX_PENDING_PROG_JOBS = 8;
+
+// Cached CV values, the key is (manufacturer << 8) | version.
+static std::map<uint16_t, std::map<uint16_t, uint8_t>> cv_cache;
+
+// true when cv_cache has been loaded from persistent storage.
+static bool cv_cache_loaded = false;
+
+// Lock held for the duration of a PROG track operation, this serializes the
+// synchronous and asynchronous requests and protects cv_cache.
+static OSMutex prog_track_lock;
+
+// Pending asynchronous programming track requests.
+static std::deque<std::function<void()>> prog_jobs;
+
+// Lock protecting prog_jobs.
+static OSMutex prog_jobs_lock;
+
+// Signaled for each request added to prog_jobs.
+static OSSem prog_jobs_sem;
+
+// Thread processing prog_jobs, created on first use.
+static os_thread_t prog_jobs_thread;
+static bool prog_jobs_thread_started = false;
+
 static bool enterServiceMode()
 {
   BufferPtr<ProgrammingTrackRequest> req =
@@ -84,56 +140,257 @@ static bool executeProgTrackWriteRequest(dcc::Packet pkt)
   return false;
 }
 
-int16_t readCV(const uint16_t cv)
+// Sends a service mode verify byte packet, returns true if the decoder
+// acknowledged the value.
+static bool verifyServiceModeByte(const uint16_t cv, const uint8_t value)
 {
-  int16_t value = -1;
-  if (enterServiceMode())
+  dcc::Packet pkt;
+  pkt.set_dcc_svc_verify_byte(cv - 1, value);
+  return sendServiceModePacketWithAck(pkt);
+}
+
+// Reads a CV while already in service mode. The guesses are verified with a
+// single byte verify each before falling back to a bit by bit read, which
+// takes nine round trips to the decoder.
+static int16_t readCVInServiceMode(const uint16_t cv
+                                 , const std::vector<uint8_t> &guesses
+                                 , uint16_t &packets)
+{
+  for (uint8_t guess : guesses)
   {
-    for(int attempt = 0; attempt < PROG_TRACK_CV_ATTEMPTS && value == -1; attempt++) {
-      LOG(INFO, "[PROG %d/%d] Attempting to read CV %d", attempt+1, PROG_TRACK_CV_ATTEMPTS, cv);
-      // reset cvValue to all bits OFF
-      value = 0;
-      for(uint8_t bit = 0; bit < 8; bit++) {
-        LOG(VERBOSE, "[PROG %d/%d] CV %d, bit [%d/7]", attempt+1, PROG_TRACK_CV_ATTEMPTS, cv, bit);
-        dcc::Packet pkt;
-        pkt.start_dcc_svc_packet();
-        pkt.add_dcc_prog_command(0x78, cv, 0xE8 + bit);
-        if (sendServiceModePacketWithAck(pkt))
-        {
-          LOG(VERBOSE, "[PROG %d/%d] CV %d, bit [%d/7] ON", attempt+1, PROG_TRACK_CV_ATTEMPTS, cv, bit);
-          value &= (1 << bit);
-        } else {
-          LOG(VERBOSE, "[PROG %d/%d] CV %d, bit [%d/7] OFF", attempt+1, PROG_TRACK_CV_ATTEMPTS, cv, bit);
-        }
-      }
+    packets++;
+    if (verifyServiceModeByte(cv, guess))
+    {
+      LOG(VERBOSE, "[PROG] CV %d, verified guess %d", cv, guess);
+      return guess;
+    }
+  }
+  for(int attempt = 0; attempt < PROG_TRACK_CV_ATTEMPTS; attempt++)
+  {
+    LOG(INFO, "[PROG %d/%d] Attempting to read CV %d", attempt+1
+      , PROG_TRACK_CV_ATTEMPTS, cv);
+    // reset cvValue to all bits OFF
+    uint8_t value = 0;
+    for(uint8_t bit = 0; bit < 8; bit++)
+    {
       dcc::Packet pkt;
-      pkt.set_dcc_svc_verify_byte(cv, value);
+      pkt.set_dcc_svc_verify_bit(cv - 1, bit, true);
+      packets++;
       if (sendServiceModePacketWithAck(pkt))
       {
-        LOG(INFO, "[PROG %d/%d] CV %d, verified as %d", attempt+1, PROG_TRACK_CV_ATTEMPTS, cv, value);
+        LOG(VERBOSE, "[PROG %d/%d] CV %d, bit [%d/7] ON", attempt+1
+          , PROG_TRACK_CV_ATTEMPTS, cv, bit);
+        value |= (1 << bit);
       }
       else
       {
-        LOG(WARNING, "[PROG %d/%d] CV %d, could not be verified", attempt+1, PROG_TRACK_CV_ATTEMPTS, cv);
-        value = -1;
+        LOG(VERBOSE, "[PROG %d/%d] CV %d, bit [%d/7] OFF", attempt+1
+          , PROG_TRACK_CV_ATTEMPTS, cv, bit);
       }
     }
-    LOG(INFO, "[PROG] CV %d value is %d", cv, value);
-    leaveServiceMode();
+    packets++;
+    if (verifyServiceModeByte(cv, value))
+    {
+      LOG(INFO, "[PROG %d/%d] CV %d, verified as %d", attempt+1
+        , PROG_TRACK_CV_ATTEMPTS, cv, value);
+      return value;
+    }
+    LOG(WARNING, "[PROG %d/%d] CV %d, could not be verified", attempt+1
+      , PROG_TRACK_CV_ATTEMPTS, cv);
   }
-  else
+  return -1;
+}
+
+// Loads the CV cache from persistent storage, must be called with
+// prog_track_lock held.
+static void loadCVCache()
+{
+  if (cv_cache_loaded)
+  {
+    return;
+  }
+  cv_cache_loaded = true;
+  auto cfg = Singleton<ConfigurationManager>::instance();
+  if (!cfg->exists(CV_CACHE_JSON_FILE))
+  {
+    return;
+  }
+  nlohmann::json root =
+    nlohmann::json::parse(cfg->load(CV_CACHE_JSON_FILE), nullptr, false);
+  if (root.is_discarded())
+  {
+    LOG_ERROR("[PROG] CV cache is corrupt, discarding");
+    return;
+  }
+  for (auto &decoder : root.items())
+  {
+    uint16_t key = std::stoi(decoder.key());
+    for (auto &entry : decoder.value().items())
+    {
+      cv_cache[key][std::stoi(entry.key())] = entry.value().get<uint8_t>();
+    }
+  }
+  LOG(INFO, "[PROG] Loaded CV cache for %zu decoder(s)", cv_cache.size());
+}
+
+// Persists the CV cache, must be called with prog_track_lock held.
+static void storeCVCache()
+{
+  nlohmann::json root = nlohmann::json::object();
+  for (auto &decoder : cv_cache)
+  {
+    nlohmann::json cvs = nlohmann::json::object();
+    for (auto &entry : decoder.second)
+    {
+      cvs[std::to_string(entry.first)] = entry.second;
+    }
+    root[std::to_string(decoder.first)] = cvs;
+  }
+  Singleton<ConfigurationManager>::instance()->store(CV_CACHE_JSON_FILE
+                                                   , root.dump());
+}
+
+// Builds the list of byte verify guesses for a CV, the value cached for the
+// same decoder type is tried first followed by common defaults.
+static std::vector<uint8_t> getCVGuesses(const uint16_t cv
+                                       , const std::map<uint16_t, uint8_t> *cached)
+{
+  std::vector<uint8_t> guesses;
+  if (cached && cached->count(cv))
+  {
+    guesses.push_back(cached->at(cv));
+  }
+  auto range = DEFAULT_CV_VALUES.equal_range(cv);
+  for (auto it = range.first; it != range.second; ++it)
+  {
+    if (std::find(guesses.begin(), guesses.end(), it->second) == guesses.end())
+    {
+      guesses.push_back(it->second);
+    }
+  }
+  return guesses;
+}
+
+// Reads a single CV and records the timing details.
+static CVReadResult readCVWithStats(const uint16_t cv
+                                  , const std::map<uint16_t, uint8_t> *cached)
+{
+  CVReadResult result{cv, -1, 0, 0};
+  long long start = os_get_time_monotonic();
+  result.value = readCVInServiceMode(cv, getCVGuesses(cv, cached)
+                                   , result.packets);
+  result.elapsedMs = NSEC_TO_MSEC(os_get_time_monotonic() - start);
+  LOG(INFO, "[PROG] CV %d value is %d (%d packets, %u ms)", cv, result.value
+    , result.packets, result.elapsedMs);
+  return result;
+}
+
+int16_t readCV(const uint16_t cv)
+{
+  auto results = readCVs({cv});
+  return results[0].value;
+}
+
+// Reads a list of CVs in a single service mode session. When more than one CV
+// is requested the decoder manufacturer (CV8) and version (CV7) are read first
+// so that the values previously read from the same decoder type can be used
+// as guesses. All successfully read values are added to the CV cache.
+std::vector<CVReadResult> readCVs(const std::vector<uint16_t> &cvs
+                                , CVReadProgress progress)
+{
+  std::vector<CVReadResult> results;
+  OSMutexLock l(&prog_track_lock);
+  if (!enterServiceMode())
   {
     LOG_ERROR("[PROG] Failed to enter programming mode!");
+    for (uint16_t cv : cvs)
+    {
+      results.push_back({cv, -1, 0, 0});
+      if (progress)
+      {
+        progress(results.back());
+      }
+    }
+    return results;
   }
-  return value;
+
+  loadCVCache();
+  std::map<uint16_t, uint8_t> *cached = nullptr;
+  int32_t key = -1;
+  CVReadResult manufacturer{CV_NAMES::DECODER_MANUFACTURER, -1, 0, 0};
+  CVReadResult version{CV_NAMES::DECODER_VERSION, -1, 0, 0};
+  if (cvs.size() > 1)
+  {
+    manufacturer = readCVWithStats(CV_NAMES::DECODER_MANUFACTURER, nullptr);
+    version = readCVWithStats(CV_NAMES::DECODER_VERSION, nullptr);
+    if (manufacturer.value >= 0 && version.value >= 0)
+    {
+      key = (manufacturer.value << 8) | version.value;
+      cached = &cv_cache[key];
+    }
+  }
+
+  bool updated = false;
+  for (uint16_t cv : cvs)
+  {
+    if (cv == CV_NAMES::DECODER_MANUFACTURER && manufacturer.value >= 0)
+    {
+      results.push_back(manufacturer);
+    }
+    else if (cv == CV_NAMES::DECODER_VERSION && version.value >= 0)
+    {
+      results.push_back(version);
+    }
+    else
+    {
+      results.push_back(readCVWithStats(cv, cached));
+    }
+    const CVReadResult &result = results.back();
+    if (progress)
+    {
+      progress(result);
+    }
+    if (cached && result.value >= 0 &&
+       (!cached->count(cv) || cached->at(cv) != result.value))
+    {
+      (*cached)[cv] = result.value;
+      updated = true;
+    }
+  }
+  leaveServiceMode();
+
+  if (updated)
+  {
+    storeCVCache();
+  }
+  return results;
+}
+
+std::string cv_results_to_json(const std::vector<CVReadResult> &results)
+{
+  std::string response = "[";
+  for (const auto &result : results)
+  {
+    if (response.length() > 1)
+    {
+      response += ",";
+    }
+    response +=
+      StringPrintf("{\"%s\":%d,\"%s\":%d,\"packets\":%d,\"ms\":%u}"
+                 , JSON_CV_NODE, result.cv, JSON_VALUE_NODE, result.value
+                 , result.packets, result.elapsedMs);
+  }
+  response += "]";
+  return response;
 }
 
 bool writeProgCVByte(const uint16_t cv, const uint8_t value)
 {
+  OSMutexLock l(&prog_track_lock);
   bool writeVerified = false;
   dcc::Packet pkt, verifyPkt;
-  pkt.set_dcc_svc_write_byte(cv, value);
-  verifyPkt.set_dcc_svc_verify_byte(cv, value);
+  pkt.set_dcc_svc_write_byte(cv - 1, value);
+  verifyPkt.set_dcc_svc_verify_byte(cv - 1, value);
   
   for(uint8_t attempt = 1;
       attempt <= PROG_TRACK_CV_ATTEMPTS && !writeVerified;
@@ -165,10 +422,11 @@ bool writeProgCVByte(const uint16_t cv, const uint8_t value)
 
 bool writeProgCVBit(const uint16_t cv, const uint8_t bit, const bool value)
 {
+  OSMutexLock l(&prog_track_lock);
   bool writeVerified = false;
   dcc::Packet pkt, verifyPkt;
-  pkt.set_dcc_svc_write_bit(cv, bit, value);
-  verifyPkt.set_dcc_svc_verify_bit(cv, bit, value);
+  pkt.set_dcc_svc_write_bit(cv - 1, bit, value);
+  verifyPkt.set_dcc_svc_verify_bit(cv - 1, bit, value);
 
   for(uint8_t attempt = 1;
       attempt <= PROG_TRACK_CV_ATTEMPTS && !writeVerified;
@@ -196,6 +454,82 @@ bool writeProgCVBit(const uint16_t cv, const uint8_t bit, const bool value)
   return writeVerified;
 }
 
+// Processes the queued asynchronous programming track requests.
+static void *processProgrammingJobs(void *arg)
+{
+  while (true)
+  {
+    prog_jobs_sem.wait();
+    std::function<void()> job;
+    {
+      OSMutexLock l(&prog_jobs_lock);
+      job = std::move(prog_jobs.front());
+      prog_jobs.pop_front();
+    }
+    job();
+  }
+  return nullptr;
+}
+
+// Adds a request to the queue, returns false if the queue is full.
+bool queueProgrammingJob(std::function<void()> job)
+{
+  OSMutexLock l(&prog_jobs_lock);
+  if (prog_jobs.size() >= MAX_PENDING_PROG_JOBS)
+  {
+    LOG_ERROR("[PROG] Request queue is full, rejecting request");
+    return false;
+  }
+  if (!prog_jobs_thread_started)
+  {
+    os_thread_create(&prog_jobs_thread, "PROG", 1, 4096
+                   , processProgrammingJobs, nullptr);
+    prog_jobs_thread_started = true;
+  }
+  prog_jobs.push_back(std::move(job));
+  prog_jobs_sem.post();
+  return true;
+}
+
+bool readCVsAsync(const std::vector<uint16_t> &cvs, CVReadProgress progress
+                , CVReadComplete done)
+{
+  return queueProgrammingJob([cvs, progress, done]()
+  {
+    auto results = readCVs(cvs, progress);
+    if (done)
+    {
+      done(results);
+    }
+  });
+}
+
+bool writeProgCVByteAsync(const uint16_t cv, const uint8_t value
+                        , CVWriteComplete done)
+{
+  return queueProgrammingJob([cv, value, done]()
+  {
+    bool result = writeProgCVByte(cv, value);
+    if (done)
+    {
+      done(result);
+    }
+  });
+}
+
+bool writeProgCVBitAsync(const uint16_t cv, const uint8_t bit, const bool value
+                       , CVWriteComplete done)
+{
+  return queueProgrammingJob([cv, bit, value, done]()
+  {
+    bool result = writeProgCVBit(cv, bit, value);
+    if (done)
+    {
+      done(result);
+    }
+  });
+}
+
 void writeOpsCVByte(const uint16_t locoAddress, const uint16_t cv
                   , const uint8_t cvValue)
 {
@@ -215,9 +549,9 @@ void writeOpsCVByte(const uint16_t locoAddress, const uint16_t cv
     {
       b->data()->add_dcc_address(dcc::DccShortAddress(locoAddress));
     }
-    b->data()->add_dcc_pom_write1(cv, cvValue);
+    b->data()->add_dcc_pom_write1(cv - 1, cvValue);
     b->data()->packet_header.rept_count = 3;
-    track->send(b.get());
+    track->send(b.release());
   }
   else
   {
@@ -247,10 +581,92 @@ void writeOpsCVBit(const uint16_t locoAddress, const uint16_t cv
     b->data()->add_dcc_prog_command(0xe8, cv - 1
                                   , (uint8_t)(0xF0 + bit + value * 8));
     b->data()->packet_header.rept_count = 3;
-    track->send(b.get());
+    track->send(b.release());
   }
   else
   {
     LOG_ERROR("[OPS] Failed to retrieve DCC Packet for programming request");
   }
 }
+
+// Reads a single CV via POM and records the timing details.
+static CVReadResult readOpsCVWithStats(const uint16_t loco, const uint16_t cv)
+{
+  CVReadResult result{cv, -1, 0, 0};
+#if CONFIG_OPS_RAILCOM
+  long long start = os_get_time_monotonic();
+  BufferPtr<esp32cs::RailComPomRequest> req =
+    invoke_flow<esp32cs::RailComPomRequest>(
+      Singleton<esp32cs::RailComPomFlow>::instance()
+    , esp32cs::RailComPomRequest::READ_CV, loco, cv);
+  result.packets = req->data()->attempts_;
+  result.elapsedMs = NSEC_TO_MSEC(os_get_time_monotonic() - start);
+  if (req->data()->resultCode == 0)
+  {
+    result.value = req->data()->value_;
+  }
+  LOG(INFO, "[POM] Loco %d CV %d value is %d (%d packets, %u ms)", loco, cv
+    , result.value, result.packets, result.elapsedMs);
+#else
+  LOG_ERROR("[POM] RailCom is not enabled, unable to read CV %d", cv);
+#endif // CONFIG_OPS_RAILCOM
+  return result;
+}
+
+int16_t readOpsCV(const uint16_t loco, const uint16_t cv)
+{
+  return readOpsCVWithStats(loco, cv).value;
+}
+
+// Reads a list of CVs from a locomotive on the OPS track, the reads are sent
+// one at a time as the decoder only answers the most recent POM request.
+std::vector<CVReadResult> readOpsCVs(const uint16_t loco
+                                   , const std::vector<uint16_t> &cvs
+                                   , CVReadProgress progress)
+{
+  std::vector<CVReadResult> results;
+  for (uint16_t cv : cvs)
+  {
+    results.push_back(readOpsCVWithStats(loco, cv));
+    if (progress)
+    {
+      progress(results.back());
+    }
+  }
+  return results;
+}
+
+bool readOpsCVsAsync(const uint16_t loco, const std::vector<uint16_t> &cvs
+                   , CVReadProgress progress, CVReadComplete done)
+{
+  return queueProgrammingJob([loco, cvs, progress, done]()
+  {
+    auto results = readOpsCVs(loco, cvs, progress);
+    if (done)
+    {
+      done(results);
+    }
+  });
+}
+
+bool verifyOpsCVByte(const uint16_t loco, const uint16_t cv
+                   , const uint8_t value)
+{
+  return readOpsCV(loco, cv) == value;
+}
+
+bool writeOpsCVByteVerified(const uint16_t loco, const uint16_t cv
+                          , const uint8_t value)
+{
+#if CONFIG_OPS_RAILCOM
+  LOG(INFO, "[POM] Writing CV %d as %d for loco %d", cv, value, loco);
+  BufferPtr<esp32cs::RailComPomRequest> req =
+    invoke_flow<esp32cs::RailComPomRequest>(
+      Singleton<esp32cs::RailComPomFlow>::instance()
+    , esp32cs::RailComPomRequest::WRITE_CV, loco, cv, value);
+  return req->data()->resultCode == 0;
+#else
+  LOG_ERROR("[POM] RailCom is not enabled, unable to verify CV %d", cv);
+  return false;
+#endif // CONFIG_OPS_RAILCOM
+}
@@ -27,6 +27,7 @@ and has been adapter for use in ESP32 COMMAND STATION.
 
 #include <algorithm>
 #include <AllTrainNodes.hxx>
+#include <Consists.h>
 #include <LCCStackManager.h>
 #include <DCCSignalVFS.h>
 #include <esp_ota_ops.h>
@@ -35,6 +36,7 @@ and has been adapter for use in ESP32 COMMAND STATION.
 #include <memory>
 #include <HttpStringUtils.h>
 #include <openlcb/SimpleStack.hxx>
+#include <string.h>
 #if CONFIG_GPIO_OUTPUTS
 #include <Outputs.h>
 #endif // CONFIG_GPIO_OUTPUTS
@@ -50,74 +52,156 @@ and has been adapter for use in ESP32 COMMAND STATION.
 using dcc::SpeedType;
 using std::vector;
 
-vector<std::unique_ptr<DCCPPProtocolCommand>> commands;
+// Registered command with its ID, the ID is cached so that it does not need
+// to be retrieved from the command for every dispatch.
+struct RegisteredCommand
+{
+  string id;
+  std::unique_ptr<DCCPPProtocolCommand> command;
+};
+
+// Commands are grouped by the first character of their ID, all command IDs
+// start with a printable ASCII character so the lookup is a table index
+// followed by a comparison against the (usually single) command in the slot.
+static constexpr size_t COMMAND_TABLE_SIZE = 128;
+static vector<RegisteredCommand> commands[COMMAND_TABLE_SIZE];
 
 // <R {CV} {CALLBACK} {CALLBACK-SUB}> command handler, this command attempts
 // to read a CV value from the PROGRAMMING track. The returned value will be
 // the actual CV value or -1 when there is a failure reading or verifying the
 // CV.
-DECLARE_DCC_PROTOCOL_COMMAND_CLASS(ReadCVCommand, "R", 3)
-DCC_PROTOCOL_COMMAND_HANDLER(ReadCVCommand,
-[](const vector<string> arguments)
+//
+// <R {FIRST-CV} {LAST-CV} {CALLBACK} {CALLBACK-SUB}> reads a range of CVs in
+// a single programming session, one response is sent per CV.
+//
+// When the client supports asynchronous responses the read is queued for the
+// programming track thread and the responses are sent as each CV completes.
+DECLARE_DCC_PROTOCOL_ASYNC_COMMAND_CLASS(ReadCVCommand, "R", 3)
+DCC_PROTOCOL_ASYNC_COMMAND_HANDLER(ReadCVCommand,
+[](const vector<string> &arguments, std::shared_ptr<DCCPPAsyncResponse> async)
 {
-  uint16_t cv = std::stoi(arguments[0]);
-  uint16_t callback = std::stoi(arguments[1]);
-  uint16_t callbackSub = std::stoi(arguments[2]);
-  int16_t value = readCV(cv);
-  return StringPrintf("<r%d|%d|%d %d>",
-    callback,
-    callbackSub,
-    cv,
-    value);
+  uint16_t firstCV = std::stoi(arguments[0]);
+  uint16_t lastCV = firstCV;
+  size_t callbackIndex = 1;
+  if (arguments.size() > 3)
+  {
+    lastCV = std::stoi(arguments[1]);
+    callbackIndex = 2;
+  }
+  uint16_t callback = std::stoi(arguments[callbackIndex]);
+  uint16_t callbackSub = std::stoi(arguments[callbackIndex + 1]);
+  if (firstCV == 0 || lastCV < firstCV || lastCV > 1024)
+  {
+    return COMMAND_FAILED_RESPONSE;
+  }
+  vector<uint16_t> cvs;
+  for (uint16_t cv = firstCV; cv <= lastCV; cv++)
+  {
+    cvs.push_back(cv);
+  }
+  auto format = [callback, callbackSub](const CVReadResult &result)
+  {
+    return StringPrintf("<r%d|%d|%d %d>", callback, callbackSub, result.cv
+                      , result.value);
+  };
+  if (async)
+  {
+    if (readCVsAsync(cvs
+    , [async, format](const CVReadResult &result)
+      {
+        async->append(format(result));
+      }, nullptr))
+    {
+      return COMMAND_NO_RESPONSE;
+    }
+    return COMMAND_FAILED_RESPONSE;
+  }
+  string response;
+  for (const auto &result : readCVs(cvs))
+  {
+    response += format(result);
+  }
+  return response;
 })
 
 // <W {CV} {VALUE} {CALLBACK} {CALLBACK-SUB}> command handler, this command
 // attempts to write a CV value on the PROGRAMMING track. The returned value
 // is either the actual CV value written or -1 if there is a failure writing or
 // verifying the CV value.
-DECLARE_DCC_PROTOCOL_COMMAND_CLASS(WriteCVByteProgCommand, "W", 4)
-DCC_PROTOCOL_COMMAND_HANDLER(WriteCVByteProgCommand,
-[](const vector<string> arguments)
+DECLARE_DCC_PROTOCOL_ASYNC_COMMAND_CLASS(WriteCVByteProgCommand, "W", 4)
+DCC_PROTOCOL_ASYNC_COMMAND_HANDLER(WriteCVByteProgCommand,
+[](const vector<string> &arguments, std::shared_ptr<DCCPPAsyncResponse> async)
 {
   uint16_t cv = std::stoi(arguments[0]);
   int16_t value = std::stoi(arguments[1]);
   uint16_t callback = std::stoi(arguments[2]);
   uint16_t callbackSub = std::stoi(arguments[3]);
-  if (!writeProgCVByte(cv, value))
+  auto format = [=](bool success)
   {
-    LOG_ERROR("[PROG] Failed to write CV %d as %d", cv, value);
-    value = -1;
+    if (!success)
+    {
+      LOG_ERROR("[PROG] Failed to write CV %d as %d", cv, value);
+    }
+    return StringPrintf("<r%d|%d|%d %d>", callback, callbackSub, cv
+                      , success ? value : -1);
+  };
+  if (async)
+  {
+    if (writeProgCVByteAsync(cv, value
+    , [async, format](bool success)
+      {
+        async->append(format(success));
+      }))
+    {
+      return COMMAND_NO_RESPONSE;
+    }
+    return format(false);
   }
-  return StringPrintf("<r%d|%d|%d %d>", callback, callbackSub, cv, value);
+  return format(writeProgCVByte(cv, value));
 })
 
 // <W {CV} {BIT} {VALUE} {CALLBACK} {CALLBACK-SUB}> command handler, this
 // command attempts to write a single bit value for a CV on the PROGRAMMING
 // track. The returned value is either the actual bit value of the CV or -1 if
 // there is a failure writing or verifying the CV value.
-DECLARE_DCC_PROTOCOL_COMMAND_CLASS(WriteCVBitProgCommand, "B", 5)
-DCC_PROTOCOL_COMMAND_HANDLER(WriteCVBitProgCommand,
-[](const vector<string> arguments)
+DECLARE_DCC_PROTOCOL_ASYNC_COMMAND_CLASS(WriteCVBitProgCommand, "B", 5)
+DCC_PROTOCOL_ASYNC_COMMAND_HANDLER(WriteCVBitProgCommand,
+[](const vector<string> &arguments, std::shared_ptr<DCCPPAsyncResponse> async)
 {
   int cv = std::stoi(arguments[0]);
   uint8_t bit = std::stoi(arguments[1]);
   int8_t value = std::stoi(arguments[2]);
   uint16_t callback = std::stoi(arguments[3]);
   uint16_t callbackSub = std::stoi(arguments[4]);
-  if (!writeProgCVBit(cv, bit, value))
+  auto format = [=](bool success)
+  {
+    if (!success)
+    {
+      LOG_ERROR("[PROG] Failed to write CV %d BIT %d as %d", cv, bit, value);
+    }
+    return StringPrintf("<r%d|%d|%d %d %d>", callback, callbackSub, cv, bit
+                      , success ? value : -1);
+  };
+  if (async)
   {
-    LOG_ERROR("[PROG] Failed to write CV %d BIT %d as %d", cv, bit, value);
-    value = -1;
+    if (writeProgCVBitAsync(cv, bit, value
+    , [async, format](bool success)
+      {
+        async->append(format(success));
+      }))
+    {
+      return COMMAND_NO_RESPONSE;
+    }
+    return format(false);
   }
-  return StringPrintf("<r%d|%d|%d %d %d>", callback, callbackSub, cv, bit
-                    , value);
+  return format(writeProgCVBit(cv, bit, value));
 })
 
 // <w {LOCO} {CV} {VALUE}> command handler, this command sends a CV write packet
 // on the MAIN OPERATIONS track for a given LOCO. No verification is attempted.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(WriteCVByteOpsCommand, "w", 3)
 DCC_PROTOCOL_COMMAND_HANDLER(WriteCVByteOpsCommand,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   writeOpsCVByte(std::stoi(arguments[0]), std::stoi(arguments[1])
                , std::stoi(arguments[2]));
@@ -129,13 +213,72 @@ DCC_PROTOCOL_COMMAND_HANDLER(WriteCVByteOpsCommand,
 // is attempted.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(WriteCVBitOpsCommand, "b", 4)
 DCC_PROTOCOL_COMMAND_HANDLER(WriteCVBitOpsCommand,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   writeOpsCVBit(std::stoi(arguments[0]), std::stoi(arguments[1])
               , std::stoi(arguments[2]), arguments[3][0] == '1');
   return COMMAND_SUCCESSFUL_RESPONSE;
 })
 
+// <m {LOCO} {CV} {CALLBACK} {CALLBACK-SUB}> command handler, this command
+// reads a CV from a LOCO on the MAIN OPERATIONS track via RailCom. The
+// returned value will be the CV value or -1 when the decoder did not respond.
+//
+// <m {LOCO} {FIRST-CV} {LAST-CV} {CALLBACK} {CALLBACK-SUB}> reads a range of
+// CVs, one response is sent per CV.
+//
+// When the client supports asynchronous responses the read is queued and the
+// responses are sent as each CV completes.
+DECLARE_DCC_PROTOCOL_ASYNC_COMMAND_CLASS(ReadCVOpsCommand, "m", 4)
+DCC_PROTOCOL_ASYNC_COMMAND_HANDLER(ReadCVOpsCommand,
+[](const vector<string> &arguments, std::shared_ptr<DCCPPAsyncResponse> async)
+{
+  int loco = std::stoi(arguments[0]);
+  uint16_t firstCV = std::stoi(arguments[1]);
+  uint16_t lastCV = firstCV;
+  size_t callbackIndex = 2;
+  if (arguments.size() > 4)
+  {
+    lastCV = std::stoi(arguments[2]);
+    callbackIndex = 3;
+  }
+  uint16_t callback = std::stoi(arguments[callbackIndex]);
+  uint16_t callbackSub = std::stoi(arguments[callbackIndex + 1]);
+  if (loco <= 0 || loco > esp32cs::DCC_MAX_LOCO_ADDRESS || firstCV == 0 ||
+      lastCV < firstCV || lastCV > 1024)
+  {
+    return COMMAND_FAILED_RESPONSE;
+  }
+  vector<uint16_t> cvs;
+  for (uint16_t cv = firstCV; cv <= lastCV; cv++)
+  {
+    cvs.push_back(cv);
+  }
+  auto format = [callback, callbackSub](const CVReadResult &result)
+  {
+    return StringPrintf("<r%d|%d|%d %d>", callback, callbackSub, result.cv
+                      , result.value);
+  };
+  if (async)
+  {
+    if (readOpsCVsAsync(loco, cvs
+    , [async, format](const CVReadResult &result)
+      {
+        async->append(format(result));
+      }, nullptr))
+    {
+      return COMMAND_NO_RESPONSE;
+    }
+    return COMMAND_FAILED_RESPONSE;
+  }
+  string response;
+  for (const auto &result : readOpsCVs(loco, cvs))
+  {
+    response += format(result);
+  }
+  return response;
+})
+
 string convert_loco_to_dccpp_state(openlcb::TrainImpl *impl, size_t id)
 {
   SpeedType speed(impl->get_speed());
@@ -151,7 +294,7 @@ string convert_loco_to_dccpp_state(openlcb::TrainImpl *impl, size_t id)
 // <F> command handler, this command sends the current free heap space as response.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(FreeHeapCommand, "F", 0)
 DCC_PROTOCOL_COMMAND_HANDLER(FreeHeapCommand,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   return StringPrintf("<f %d>", os_get_free_heap());
 })
@@ -160,7 +303,7 @@ DCC_PROTOCOL_COMMAND_HANDLER(FreeHeapCommand,
 // locomotives.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(EStopCommand, "estop", 0)
 DCC_PROTOCOL_COMMAND_HANDLER(EStopCommand,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   esp32cs::initiate_estop();
   return COMMAND_SUCCESSFUL_RESPONSE;
@@ -168,14 +311,14 @@ DCC_PROTOCOL_COMMAND_HANDLER(EStopCommand,
 
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(CurrentDrawCommand, "c", 0)
 DCC_PROTOCOL_COMMAND_HANDLER(CurrentDrawCommand,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   return esp32cs::get_track_state_for_dccpp();
 })
 
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(PowerOnCommand, "1", 0)
 DCC_PROTOCOL_COMMAND_HANDLER(PowerOnCommand,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   esp32cs::enable_ops_track_output();
   // hardcoded response since enable/disable is deferred until the next
@@ -185,7 +328,7 @@ DCC_PROTOCOL_COMMAND_HANDLER(PowerOnCommand,
 
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(PowerOffCommand, "0", 0)
 DCC_PROTOCOL_COMMAND_HANDLER(PowerOffCommand,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   esp32cs::disable_track_outputs();
   // hardcoded response since enable/disable is deferred until the next
@@ -207,12 +350,43 @@ DCC_PROTOCOL_COMMAND_HANDLER(PowerOffCommand,
     n.wait_for_notification();                                                        \
   }
 
+// Sends the speed to all locomotives in the consist the locomotive is part of,
+// or only to the locomotive when it is not part of a consist.
+void set_loco_speed(openlcb::TrainImpl *impl, uint16_t address
+                  , SpeedType speed)
+{
+  if (!Singleton<esp32cs::ConsistManager>::instance()->set_speed(address
+                                                                , speed))
+  {
+    impl->set_speed(speed);
+  }
+}
+
+// Sends the function states to all locomotives in the consist the locomotive
+// is part of, or only to the locomotive when it is not part of a consist.
+// Bit N of mask is set for each function N to update.
+void set_loco_fn(openlcb::TrainImpl *impl, uint16_t address, uint32_t mask
+               , uint32_t values)
+{
+  if (!Singleton<esp32cs::ConsistManager>::instance()->set_fn(address, mask
+                                                             , values))
+  {
+    for (uint32_t fn = 0; fn <= esp32cs::ConsistManager::MAX_CONSIST_FN; fn++)
+    {
+      if (mask & BIT(fn))
+      {
+        impl->set_fn(fn, (values & BIT(fn)) != 0);
+      }
+    }
+  }
+}
+
 // <t {REGISTER} {LOCO} {SPEED} {DIRECTION}> command handler, this command
 // converts the provided locomotive control command into a compatible DCC
 // locomotive control packet.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(ThrottleCommandAdapter, "t", 4)
 DCC_PROTOCOL_COMMAND_HANDLER(ThrottleCommandAdapter,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   int reg_num = std::stoi(arguments[0]);
   uint16_t loco_addr = std::stoi(arguments[1]);
@@ -228,7 +402,7 @@ DCC_PROTOCOL_COMMAND_HANDLER(ThrottleCommandAdapter,
   {
     speed.set_direction(SpeedType::REVERSE);
   }
-  impl->set_speed(speed);
+  set_loco_speed(impl, loco_addr, speed);
   return convert_loco_to_dccpp_state(impl, reg_num);
 });
 
@@ -237,7 +411,7 @@ DCC_PROTOCOL_COMMAND_HANDLER(ThrottleCommandAdapter,
 // locomotive control packet.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(ThrottleExCommandAdapter, "tex", 3)
 DCC_PROTOCOL_COMMAND_HANDLER(ThrottleExCommandAdapter,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   uint16_t loco_addr = std::stoi(arguments[0]);
   int8_t req_speed = std::stoi(arguments[1]);
@@ -258,7 +432,7 @@ DCC_PROTOCOL_COMMAND_HANDLER(ThrottleExCommandAdapter,
     }
     LOG(INFO, "[DCC++ loco %d] Set speed to %d (%s)", loco_addr, abs(req_speed)
       , impl->get_speed().direction() == SpeedType::FORWARD ? "FWD" : "REV");
-    impl->set_speed(speed);
+    set_loco_speed(impl, loco_addr, speed);
   }
   else if (req_dir >= 0)
   {
@@ -266,7 +440,7 @@ DCC_PROTOCOL_COMMAND_HANDLER(ThrottleExCommandAdapter,
     speed.set_direction(req_dir ? SpeedType::FORWARD : SpeedType::REVERSE);
     LOG(INFO, "[DCC++ loco %d] Set direction to %s", loco_addr
       , impl->get_speed().direction() == SpeedType::FORWARD ? "FWD" : "REV");
-    impl->set_speed(speed);
+    set_loco_speed(impl, loco_addr, speed);
   }
   return convert_loco_to_dccpp_state(impl, 0);
 })
@@ -275,13 +449,15 @@ DCC_PROTOCOL_COMMAND_HANDLER(ThrottleExCommandAdapter,
 // locomotive function update into a compatible DCC function control packet.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(FunctionCommandAdapter, "f", 2)
 DCC_PROTOCOL_COMMAND_HANDLER(FunctionCommandAdapter,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   uint16_t loco_addr = std::stoi(arguments[0]);
   uint8_t func_byte = std::stoi(arguments[1]);
   uint8_t first{1};
   uint8_t last{4};
   uint8_t bits{func_byte};
+  uint32_t mask{0};
+  uint32_t values{0};
 
   GET_LOCO_VIA_EXECUTOR(impl, loco_addr);
 
@@ -317,15 +493,24 @@ DCC_PROTOCOL_COMMAND_HANDLER(FunctionCommandAdapter,
     }
     else
     {
-      impl->set_fn(0, func_byte & BIT(4));
+      mask |= BIT(0);
+      if (func_byte & BIT(4))
+      {
+        values |= BIT(0);
+      }
     }
   }
   for(uint8_t id = first; id <= last; id++)
   {
     LOG(INFO, "[DCC++ loco %d] Set function %d to %d", loco_addr, id
       , (int)(bits & BIT(id - first)));
-    impl->set_fn(id, bits & BIT(id - first));
+    mask |= BIT(id);
+    if (bits & BIT(id - first))
+    {
+      values |= BIT(id);
+    }
   }
+  set_loco_fn(impl, loco_addr, mask, values);
   return COMMAND_NO_RESPONSE;
 });
 
@@ -333,7 +518,7 @@ DCC_PROTOCOL_COMMAND_HANDLER(FunctionCommandAdapter,
 // locomotive function update into a compatible DCC function control packet.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(FunctionExCommandAdapter, "fex", 3)
 DCC_PROTOCOL_COMMAND_HANDLER(FunctionExCommandAdapter,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   int loco_addr = std::stoi(arguments[0]);
   int function = std::stoi(arguments[1]);
@@ -342,7 +527,14 @@ DCC_PROTOCOL_COMMAND_HANDLER(FunctionExCommandAdapter,
   GET_LOCO_VIA_EXECUTOR(impl, loco_addr);
   LOG(INFO, "[DCC++ loco %d] Set function %d to %d", loco_addr, function
     , state);
-  impl->set_fn(function, state);
+  if (function >= 0 && function <= esp32cs::ConsistManager::MAX_CONSIST_FN)
+  {
+    set_loco_fn(impl, loco_addr, BIT(function), state ? BIT(function) : 0);
+  }
+  else
+  {
+    impl->set_fn(function, state);
+  }
   return COMMAND_NO_RESPONSE;
 });
 
@@ -352,88 +544,63 @@ DCC_PROTOCOL_COMMAND_HANDLER(FunctionExCommandAdapter,
 // DELETE: <C {ID}>
 // QUERY : <C 0 {LOCO}>
 // SHOW  : <C>
+// A negative ID is used for decoder assisted consists, the locomotives are
+// programmed via POM to respond to the consist address.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(ConsistCommandAdapter, "C", 0)
 DCC_PROTOCOL_COMMAND_HANDLER(ConsistCommandAdapter,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
-  // TODO: reimplement
-  /*
+  auto consists = Singleton<esp32cs::ConsistManager>::instance();
   if (arguments.empty())
   {
-    return locoManager->getConsistStateAsDCCpp();
+    return consists->get_state_for_dccpp();
   }
-  else if (arguments.size() == 1 &&
-           locoManager->removeLocomotiveConsist(std::stoi(arguments[1])))
+  // negative consist IDs indicate a decoder assisted consist.
+  int consist_id = std::stoi(arguments[0]);
+  bool decoder_assisted = consist_id < 0;
+  consist_id = abs(consist_id);
+  if (arguments.size() == 1)
   {
-    return COMMAND_SUCCESSFUL_RESPONSE;
+    if (consists->remove(consist_id))
+    {
+      return COMMAND_SUCCESSFUL_RESPONSE;
+    }
   }
   else if (arguments.size() == 2)
   {
-    int8_t consistAddress = std::stoi(arguments[0]);
-    uint16_t locomotiveAddress = std::stoi(arguments[1]);
-    if (consistAddress == 0)
+    uint16_t loco_addr = std::stoi(arguments[1]);
+    if (consist_id == 0)
     {
-      // query which consist loco is in
-      auto consist = locoManager->getConsistForLoco(locomotiveAddress);
-      if (consist)
+      // query which consist the loco is in
+      consist_id = consists->find(loco_addr);
+      if (consist_id)
       {
-        return StringPrintf("<V %d %d>",
-          consist->legacy_address() * consist->isDecoderAssistedConsist() ? -1 : 1,
-          locomotiveAddress);
+        return StringPrintf("<V %d %d>"
+                          , consists->is_decoder_assisted(consist_id) ?
+                              -consist_id : consist_id
+                          , loco_addr);
       }
     }
-    else
+    else if (consists->remove(consist_id, loco_addr))
     {
-      // remove loco from consist
-      auto consist = locoManager->getConsistByID(consistAddress);
-      if (consist->isAddressInConsist(locomotiveAddress))
-      {
-        consist->removeLocomotive(locomotiveAddress);
-        return COMMAND_SUCCESSFUL_RESPONSE;
-      }
+      // loco removed from consist
+      return COMMAND_SUCCESSFUL_RESPONSE;
     }
-    // if we get here either the query or remove failed
-    return COMMAND_FAILED_RESPONSE;
   }
-  else if (arguments.size() >= 3)
+  else
   {
     // create or update consist
-    uint16_t consistAddress = std::stoi(arguments[0]);
-    auto consist = locoManager->getConsistByID(consistAddress);
-    if (consist)
+    vector<int32_t> locos;
+    for (size_t index = 1; index < arguments.size(); index++)
     {
-      // existing consist, need to update
-      consist->releaseLocomotives();
+      locos.push_back(std::stoi(arguments[index]));
     }
-    else
-    {
-      // verify if all provided locos are not already in a consist
-      for(int index = 1; index < arguments.size(); index++)
-      {
-        int32_t locomotiveAddress = std::stoi(arguments[index]);
-        if(locoManager->isAddressInConsist(abs(locomotiveAddress)))
-        {
-          LOG_ERROR("[Consist] Locomotive %d is already in a consist.", abs(locomotiveAddress));
-          return COMMAND_FAILED_RESPONSE;
-        }
-      }
-      consist = locoManager->createLocomotiveConsist(consistAddress);
-      if(!consist)
-      {
-        LOG_ERROR("[Consist] Unable to create new Consist");
-        return COMMAND_FAILED_RESPONSE;
-      }
-    }
-    // add locomotives to consist
-    for(int index = 1; index < arguments.size(); index++)
+    if (consist_id > 0 && consists->create(consist_id, locos
+                                         , decoder_assisted))
     {
-      int32_t locomotiveAddress = std::stoi(arguments[index]);
-      consist->addLocomotive(abs(locomotiveAddress), locomotiveAddress > 0,
-        index - 1);
+      return COMMAND_SUCCESSFUL_RESPONSE;
     }
-    return COMMAND_SUCCESSFUL_RESPONSE;
   }
-  */
   return COMMAND_FAILED_RESPONSE;
 })
 
@@ -461,7 +628,7 @@ where
 */
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(TurnoutCommandAdapter, "T", 0)
 DCC_PROTOCOL_COMMAND_HANDLER(TurnoutCommandAdapter,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   auto turnoutManager = Singleton<TurnoutManager>::instance();
   if (arguments.empty())
@@ -488,7 +655,7 @@ DCC_PROTOCOL_COMMAND_HANDLER(TurnoutCommandAdapter,
       auto turnout = turnoutManager->getByIndex(index);
       if (turnout)
       {
-        turnout->set(std::stoi(arguments[1]));
+        turnoutManager->set(turnout->getAddress(), std::stoi(arguments[1]));
         return COMMAND_SUCCESSFUL_RESPONSE;
       }
     }
@@ -534,7 +701,7 @@ where
 */
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(TurnoutExCommandAdapter, "Tex", 1)
 DCC_PROTOCOL_COMMAND_HANDLER(TurnoutExCommandAdapter,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   if (!arguments.empty())
   {
@@ -571,7 +738,7 @@ where
 */
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(AccessoryCommand, "a", 3)
 DCC_PROTOCOL_COMMAND_HANDLER(AccessoryCommand,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   return Singleton<TurnoutManager>::instance()->set(
       decodeDCCAccessoryAddress(std::stoi(arguments[0])
@@ -586,7 +753,7 @@ DCC_PROTOCOL_COMMAND_HANDLER(AccessoryCommand,
 // running with the PCB configuration only turnouts will be cleared.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(ConfigErase, "e", 0)
 DCC_PROTOCOL_COMMAND_HANDLER(ConfigErase,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   Singleton<TurnoutManager>::instance()->clear();
 #if CONFIG_GPIO_SENSORS
@@ -610,7 +777,7 @@ DCC_PROTOCOL_COMMAND_HANDLER(ConfigErase,
 // PCB configuration only turnouts will be stored.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(ConfigStore, "E", 0)
 DCC_PROTOCOL_COMMAND_HANDLER(ConfigStore,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   return StringPrintf("<e %d %d %d>"
                     , Singleton<TurnoutManager>::instance()->count()
@@ -635,7 +802,7 @@ DCC_PROTOCOL_COMMAND_HANDLER(ConfigStore,
 // command.
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(StatusCommand, "s", 0)
 DCC_PROTOCOL_COMMAND_HANDLER(StatusCommand,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   wifi_mode_t mode;
   const esp_app_desc_t *app_data = esp_ota_get_app_description();
@@ -696,6 +863,7 @@ void DCCPPProtocolHandler::init()
   registerCommand(new WriteCVBitProgCommand());
   registerCommand(new WriteCVByteOpsCommand());
   registerCommand(new WriteCVBitOpsCommand());
+  registerCommand(new ReadCVOpsCommand());
   registerCommand(new ConfigErase());
   registerCommand(new ConfigStore());
 #if defined(CONFIG_GPIO_OUTPUTS)
@@ -715,90 +883,236 @@ void DCCPPProtocolHandler::init()
   registerCommand(new EStopCommand());
 }
 
-string DCCPPProtocolHandler::process(const string &commandString)
+// Returns the registered command with the provided ID or nullptr.
+static DCCPPProtocolCommand *find_command(const char *id, size_t length)
+{
+  uint8_t slot = id[0];
+  if (!length || slot >= COMMAND_TABLE_SIZE)
+  {
+    return nullptr;
+  }
+  for (const auto &entry : commands[slot])
+  {
+    if (entry.id.length() == length && !memcmp(entry.id.data(), id, length))
+    {
+      return entry.command.get();
+    }
+  }
+  return nullptr;
+}
+
+string DCCPPProtocolHandler::process(const char *command, size_t length
+                                   , vector<string> &args
+                                   , std::shared_ptr<DCCPPAsyncResponse> async)
 {
-  vector<string> parts;
-  http::tokenize(commandString, parts);
-  string commandID = parts.front();
-  parts.erase(parts.begin());
-  LOG(VERBOSE, "Command: %s, argument count: %d", commandID.c_str()
-    , parts.size());
-  auto command = std::find_if(commands.begin(), commands.end()
-  , [commandID](const auto &cmd)
+  const char *end = command + length;
+  const char *id = nullptr;
+  size_t idLength = 0;
+  size_t count = 0;
+  // split the command on spaces, the command ID is referenced in place and
+  // the arguments are assigned to the existing strings which will not
+  // allocate for arguments that fit in the small string buffer.
+  for (const char *pos = command; pos < end;)
+  {
+    const char *token = pos;
+    pos = std::find(pos, end, ' ');
+    if (pos != token)
     {
-      return cmd->getID() == commandID;
-    });
-  if (command != commands.end())
+      if (!id)
+      {
+        id = token;
+        idLength = pos - token;
+      }
+      else if (count < args.size())
+      {
+        args[count++].assign(token, pos - token);
+      }
+      else
+      {
+        args.emplace_back(token, pos - token);
+        count++;
+      }
+    }
+    if (pos < end)
+    {
+      pos++;
+    }
+  }
+  args.resize(count);
+  if (!id)
   {
-    if (parts.size() >= (*command)->getMinArgCount())
+    LOG_ERROR("Empty command received, reporting failure");
+    return COMMAND_FAILED_RESPONSE;
+  }
+  LOG(VERBOSE, "Command: %.*s, argument count: %zu", (int)idLength, id
+    , count);
+  DCCPPProtocolCommand *handler = find_command(id, idLength);
+  if (handler)
+  {
+    if (count >= handler->getMinArgCount())
     {
-      return (*command)->process(parts);
+      return handler->process_async(args, async);
     }
     else
     {
-      LOG_ERROR("%s requires (at least) %zu args but %zu args were provided, "
-                "reporting failure", commandID.c_str()
-              , (*command)->getMinArgCount(), parts.size());
+      LOG_ERROR("%.*s requires (at least) %zu args but %zu args were "
+                "provided, reporting failure", (int)idLength, id
+              , handler->getMinArgCount(), count);
     }
   }
   else
   {
-    LOG_ERROR("No command handler for [%s]", commandID.c_str());
+    LOG_ERROR("No command handler for [%.*s]", (int)idLength, id);
   }
   return COMMAND_FAILED_RESPONSE;
 }
 
 void DCCPPProtocolHandler::registerCommand(DCCPPProtocolCommand *cmd)
 {
-  for (const auto& command : commands)
+  string id = cmd->getID();
+  if (id.empty() || (uint8_t)id[0] >= COMMAND_TABLE_SIZE)
+  {
+    LOG_ERROR("Ignoring attempt to register command with invalid ID: %s"
+            , id.c_str());
+    delete cmd;
+    return;
+  }
+  if (find_command(id.data(), id.length()))
+  {
+    LOG_ERROR("Ignoring attempt to register second command with ID: %s",
+      id.c_str());
+    return;
+  }
+  LOG(VERBOSE, "Registering interface command %s", id.c_str());
+  commands[(uint8_t)id[0]].push_back(
+    {id, std::unique_ptr<DCCPPProtocolCommand>(cmd)});
+}
+
+DCCPPProtocolConsumer::DCCPPProtocolConsumer(
+  std::function<void(std::string &)> sink)
+  : _async(std::make_shared<DCCPPAsyncResponse>(sink))
+{
+}
+
+DCCPPProtocolConsumer::~DCCPPProtocolConsumer()
+{
+  if (_stateSubscription)
+  {
+    Singleton<esp32cs::StateBus>::instance()->unsubscribe(_stateSubscription);
+  }
+}
+
+// Formats a single state change as a DCC++ response.
+static void append_dccpp_state(std::string &response
+                             , const esp32cs::StateChange &change)
+{
+  switch (change.topic)
   {
-    if(!command->getID().compare(cmd->getID()))
+    case esp32cs::TOPIC_TURNOUT:
+      response += StringPrintf("<H %u %u>", change.aux, change.value);
+      break;
+    case esp32cs::TOPIC_SENSOR:
+    case esp32cs::TOPIC_S88:
+    case esp32cs::TOPIC_REMOTE_SENSOR:
+      response += StringPrintf("<%c %d>", change.value ? 'Q' : 'q'
+                             , change.id);
+      break;
+    case esp32cs::TOPIC_TRACK:
     {
-      LOG_ERROR("Ignoring attempt to register second command with ID: %s",
-        cmd->getID().c_str());
-      return;
+      const char *name = change.id ? CONFIG_PROG_TRACK_NAME
+                                   : CONFIG_OPS_TRACK_NAME;
+      int state = 0;
+      if (change.value == esp32cs::TRACK_ON)
+      {
+        state = 1;
+      }
+      else if (change.value == esp32cs::TRACK_OVERCURRENT)
+      {
+        state = 2;
+      }
+      response += StringPrintf("<p%d %s>", state, name);
+      break;
     }
+    default:
+      break;
   }
-  LOG(VERBOSE, "Registering interface command %s", cmd->getID().c_str());
-  commands.emplace_back(cmd);
 }
 
-DCCPPProtocolConsumer::DCCPPProtocolConsumer()
+void DCCPPProtocolConsumer::subscribe_state(uint32_t topics)
 {
-  _buffer.resize(256);
+  if (_stateSubscription || !Singleton<esp32cs::StateBus>::exists())
+  {
+    return;
+  }
+  // the async response holder is shared with the subscription as it can
+  // still be invoked while this consumer is being destroyed.
+  std::shared_ptr<DCCPPAsyncResponse> async = _async;
+  _stateSubscription = Singleton<esp32cs::StateBus>::instance()->subscribe(
+    topics & ~esp32cs::topic_bit(esp32cs::TOPIC_LOCO)
+  , [async](const std::vector<esp32cs::StateChange> &changes)
+    {
+      std::string response;
+      for (const auto &change : changes)
+      {
+        append_dccpp_state(response, change);
+      }
+      if (!response.empty())
+      {
+        async->append(std::move(response));
+      }
+    });
 }
 
 std::string DCCPPProtocolConsumer::feed(uint8_t *data, size_t len)
 {
-  for(size_t i = 0; i < len; i++)
+  string response;
+  while (len)
   {
-    _buffer.emplace_back(data[i]);
+    size_t count = std::min(len, COMMAND_BUFFER_SIZE - _bufferUsed);
+    memcpy(_buffer + _bufferUsed, data, count);
+    _bufferUsed += count;
+    data += count;
+    len -= count;
+    size_t consumed = processData(response);
+    if (consumed)
+    {
+      // move the incomplete command (if any) to the start of the buffer.
+      memmove(_buffer, _buffer + consumed, _bufferUsed - consumed);
+      _bufferUsed -= consumed;
+    }
+    else if (_bufferUsed == COMMAND_BUFFER_SIZE)
+    {
+      LOG_ERROR("Command exceeds %zu bytes, discarding buffered data"
+              , COMMAND_BUFFER_SIZE);
+      _bufferUsed = 0;
+    }
   }
-  return processData();
+  return response;
 }
 
-string DCCPPProtocolConsumer::processData()
+size_t DCCPPProtocolConsumer::processData(string &response)
 {
-  auto s = _buffer.begin();
-  auto consumed = _buffer.begin();
-  string response;
-  for(; s != _buffer.end();)
+  const char *buffer = reinterpret_cast<const char *>(_buffer);
+  const char *end = buffer + _bufferUsed;
+  const char *pos = buffer;
+  while (pos < end)
   {
-    s = std::find(s, _buffer.end(), '<');
-    auto e = std::find(s, _buffer.end(), '>');
-    if(s != _buffer.end() && e != _buffer.end())
+    const char *s = std::find(pos, end, '<');
+    if (s == end)
     {
-      // discard the <
-      s++;
-      // discard the >
-      *e = 0;
-      std::string str(reinterpret_cast<char*>(&*s));
-      response += DCCPPProtocolHandler::process(std::move(str));
-      consumed = e;
+      // no command start, discard everything.
+      return _bufferUsed;
     }
-    s = e;
+    const char *e = std::find(s, end, '>');
+    if (e == end)
+    {
+      // incomplete command, keep it until the remainder is received.
+      return s - buffer;
+    }
+    response += DCCPPProtocolHandler::process(s + 1, e - s - 1, _args
+                                            , _async);
+    _commandCount++;
+    pos = e + 1;
   }
-  // drop everything we used from the buffer.
-  _buffer.erase(_buffer.begin(), consumed);
-  return response;
+  return pos - buffer;
 }
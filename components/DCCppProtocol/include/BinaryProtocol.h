@@ -0,0 +1,269 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef BINARY_PROTOCOL_H_
+#define BINARY_PROTOCOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <StateBus.h>
+#include <vector>
+
+namespace esp32cs
+{
+
+/// WebSocket subprotocol name for the binary protocol, clients which do not
+/// request it use the DCC++ text protocol.
+static constexpr const char *BINARY_PROTOCOL_NAME = "esp32cs.bin.v1";
+
+/// Message types for the binary protocol.
+///
+/// Every message starts with the type byte and has a fixed size which is
+/// determined by the type, multiple messages can be sent in a single frame.
+/// All multi-byte fields are little-endian.
+enum BinaryMessageType : uint8_t
+{
+  /// Client request to set the speed and direction of a locomotive, this is
+  /// answered with @ref BIN_LOCO_STATE.
+  BIN_THROTTLE_SPEED = 0x01,
+
+  /// Client request to set a locomotive function, this is answered with
+  /// @ref BIN_LOCO_STATE.
+  BIN_THROTTLE_FUNCTION = 0x02,
+
+  /// Client request for the state of a locomotive, this is answered with
+  /// @ref BIN_LOCO_STATE.
+  BIN_LOCO_REQUEST = 0x03,
+
+  /// Client request to set a turnout, this is answered with
+  /// @ref BIN_TURNOUT_STATE.
+  BIN_TURNOUT_SET = 0x04,
+
+  /// Client request to turn the OPS track power on or off, this is answered
+  /// with @ref BIN_TRACK_POWER_STATE.
+  BIN_TRACK_POWER = 0x05,
+
+  /// Client request for an emergency stop of all locomotives.
+  BIN_ESTOP = 0x06,
+
+  /// Client request for the state of all turnouts, sensors and the track
+  /// power.
+  BIN_STATE_REQUEST = 0x07,
+
+  /// Client request to receive state changes as they happen, this is
+  /// answered in the same way as @ref BIN_STATE_REQUEST and the changes are
+  /// sent using the state messages.
+  BIN_SUBSCRIBE = 0x08,
+
+  /// State of a single locomotive.
+  BIN_LOCO_STATE = 0x81,
+
+  /// State of a single turnout.
+  BIN_TURNOUT_STATE = 0x82,
+
+  /// State of a single sensor.
+  BIN_SENSOR_STATE = 0x83,
+
+  /// State of the OPS track power.
+  BIN_TRACK_POWER_STATE = 0x84,
+
+  /// Sent when a request could not be processed, this includes locomotive
+  /// requests for an address outside of 1-10239.
+  BIN_ERROR = 0xFF,
+};
+
+/// Locomotive is moving forward, used by @ref BinThrottleSpeed and
+/// @ref BinLocoState.
+static constexpr uint8_t BIN_FLAG_FORWARD = 0x01;
+
+/// Locomotive is in emergency stop, used by @ref BinThrottleSpeed and
+/// @ref BinLocoState.
+static constexpr uint8_t BIN_FLAG_ESTOP = 0x02;
+
+/// @ref BIN_THROTTLE_SPEED message.
+struct BinThrottleSpeed
+{
+  uint8_t type;
+  /// Combination of @ref BIN_FLAG_FORWARD and @ref BIN_FLAG_ESTOP.
+  uint8_t flags;
+  uint16_t address;
+  /// Speed step, 0 (stop) to 126.
+  uint8_t speed;
+} __attribute__((packed));
+
+/// @ref BIN_THROTTLE_FUNCTION message.
+struct BinThrottleFunction
+{
+  uint8_t type;
+  uint8_t function;
+  uint16_t address;
+  uint8_t state;
+} __attribute__((packed));
+
+/// @ref BIN_LOCO_REQUEST message.
+struct BinLocoRequest
+{
+  uint8_t type;
+  uint8_t reserved;
+  uint16_t address;
+} __attribute__((packed));
+
+/// @ref BIN_TURNOUT_SET and @ref BIN_TURNOUT_STATE message.
+struct BinTurnoutState
+{
+  uint8_t type;
+  uint8_t thrown;
+  uint16_t address;
+} __attribute__((packed));
+
+/// @ref BIN_TRACK_POWER and @ref BIN_TRACK_POWER_STATE message.
+struct BinTrackPower
+{
+  uint8_t type;
+  uint8_t on;
+} __attribute__((packed));
+
+/// @ref BIN_ESTOP and @ref BIN_STATE_REQUEST message.
+struct BinRequest
+{
+  uint8_t type;
+} __attribute__((packed));
+
+/// @ref BIN_SUBSCRIBE message.
+struct BinSubscribe
+{
+  uint8_t type;
+  uint8_t reserved;
+  /// Bit N is set to receive changes for @ref StateTopic N, zero stops the
+  /// state changes.
+  uint16_t topics;
+} __attribute__((packed));
+
+/// @ref BIN_LOCO_STATE message.
+struct BinLocoState
+{
+  uint8_t type;
+  /// Combination of @ref BIN_FLAG_FORWARD and @ref BIN_FLAG_ESTOP.
+  uint8_t flags;
+  uint16_t address;
+  /// Speed step, 0 (stop) to 126.
+  uint8_t speed;
+  /// Bit N is set when function N is on (F0-F28).
+  uint32_t functions;
+} __attribute__((packed));
+
+/// @ref BIN_SENSOR_STATE message.
+struct BinSensorState
+{
+  uint8_t type;
+  uint8_t active;
+  uint16_t id;
+} __attribute__((packed));
+
+/// @ref BIN_ERROR message.
+struct BinError
+{
+  uint8_t type;
+  /// Type of the request that failed.
+  uint8_t request;
+} __attribute__((packed));
+
+static_assert(sizeof(BinThrottleSpeed) == 5, "unexpected message size");
+static_assert(sizeof(BinThrottleFunction) == 5, "unexpected message size");
+static_assert(sizeof(BinLocoRequest) == 4, "unexpected message size");
+static_assert(sizeof(BinTurnoutState) == 4, "unexpected message size");
+static_assert(sizeof(BinTrackPower) == 2, "unexpected message size");
+static_assert(sizeof(BinSubscribe) == 4, "unexpected message size");
+static_assert(sizeof(BinLocoState) == 9, "unexpected message size");
+static_assert(sizeof(BinSensorState) == 4, "unexpected message size");
+static_assert(sizeof(BinError) == 2, "unexpected message size");
+
+/// Decodes and executes binary protocol requests received from a single
+/// client.
+///
+/// Requests are copied into their fixed size structure and dispatched on the
+/// message type, responses are encoded directly into the caller provided
+/// buffer. A request which is split across multiple frames is held until the
+/// remainder has been received.
+class BinaryProtocolConsumer
+{
+public:
+  /// Processes received data.
+  ///
+  /// @param data is the received data.
+  /// @param length is the number of bytes received.
+  /// @param response will receive the encoded responses, it is not cleared
+  /// before use.
+  void feed(const uint8_t *data, size_t length
+          , std::vector<uint8_t> &response);
+
+  /// Encodes the state of all turnouts, sensors and the track power.
+  ///
+  /// @param response will receive the encoded state messages.
+  static void encode_state(std::vector<uint8_t> &response);
+
+  /// Encodes the state of a locomotive.
+  ///
+  /// @param address is the locomotive address.
+  /// @param response will receive the encoded state message.
+  static void encode_loco_state(uint16_t address
+                              , std::vector<uint8_t> &response);
+
+  /// Encodes a change received from the @ref StateBus.
+  ///
+  /// @param change is the change to encode.
+  /// @param response will receive the encoded state message, nothing is
+  /// added for changes which have no binary representation.
+  static void encode_state_change(const StateChange &change
+                                , std::vector<uint8_t> &response);
+
+  /// @return the @ref StateTopic filter requested by the client with
+  /// @ref BIN_SUBSCRIBE.
+  uint32_t topics()
+  {
+    return topics_;
+  }
+
+private:
+  /// Largest request message size.
+  static constexpr size_t MAX_REQUEST_SIZE = sizeof(BinThrottleSpeed);
+
+  /// @return the size of a request message or zero for an unknown type.
+  ///
+  /// @param type is the message type.
+  static size_t request_size(uint8_t type);
+
+  /// Executes a single complete request.
+  ///
+  /// @param request is the request data, it is at least
+  /// @ref request_size bytes.
+  /// @param response will receive the encoded responses.
+  void process(const uint8_t *request, std::vector<uint8_t> &response);
+
+  /// Holds a partially received request.
+  uint8_t partial_[MAX_REQUEST_SIZE];
+
+  /// Number of bytes in @ref partial_.
+  size_t partialSize_{0};
+
+  /// @ref StateTopic filter requested by the client.
+  uint32_t topics_{0};
+};
+
+} // namespace esp32cs
+
+#endif // BINARY_PROTOCOL_H_
@@ -18,7 +18,10 @@ COPYRIGHT (c) 2019 Mike Dunston
 #ifndef DCC_PROG_H_
 #define DCC_PROG_H_
 
+#include <functional>
 #include <stdint.h>
+#include <string>
+#include <vector>
 
 enum CV_NAMES
 {
@@ -61,19 +64,77 @@ enum CONSIST_FUNCTION_CONTROL_F1_F8_BITS
 , F8_BIT = 7
 };
 
+// Bit assignments from NMRA S-9.2.2, FL_BIT is F0 in the forward direction.
 enum CONSIST_FUNCTION_CONTROL_FL_F9_F12_BITS
 {
-  FL_BIT  = 0
-, F9_BIT  = 1
-, F10_BIT = 2
-, F11_BIT = 3
-, F12_BIT = 4
+  FL_BIT         = 0
+, FL_REVERSE_BIT = 1
+, F9_BIT         = 2
+, F10_BIT        = 3
+, F11_BIT        = 4
+, F12_BIT        = 5
 };
 
+// Result of reading a single CV from the PROG track.
+struct CVReadResult
+{
+  // CV number that was read.
+  uint16_t cv;
+
+  // CV value or -1 if the CV could not be read.
+  int16_t value;
+
+  // number of verify packets sent to the decoder for this CV.
+  uint16_t packets;
+
+  // number of milliseconds taken to read the CV.
+  uint32_t elapsedMs;
+};
+
+// Callback invoked as each CV of a read request completes.
+typedef std::function<void(const CVReadResult &)> CVReadProgress;
+
+// Callback invoked when an asynchronous CV read request completes.
+typedef std::function<void(const std::vector<CVReadResult> &)> CVReadComplete;
+
+// Callback invoked when an asynchronous CV write request completes.
+typedef std::function<void(bool)> CVWriteComplete;
+
 int16_t readCV(const uint16_t);
+std::vector<CVReadResult> readCVs(const std::vector<uint16_t> &
+                                , CVReadProgress progress = nullptr);
+std::string cv_results_to_json(const std::vector<CVReadResult> &);
+
+// Asynchronous variants of the PROG track operations, these queue the request
+// for the programming track thread and return false if the queue is full. The
+// callbacks are invoked on the programming track thread.
+bool readCVsAsync(const std::vector<uint16_t> &, CVReadProgress
+                , CVReadComplete);
+bool writeProgCVByteAsync(const uint16_t, const uint8_t, CVWriteComplete);
+bool writeProgCVBitAsync(const uint16_t, const uint8_t, const bool
+                       , CVWriteComplete);
+
 bool writeProgCVByte(const uint16_t, const uint8_t);
 bool writeProgCVBit(const uint16_t, const uint8_t, const bool);
 void writeOpsCVByte(const uint16_t, const uint16_t, const uint8_t);
 void writeOpsCVBit(const uint16_t, const uint16_t, const uint8_t, const bool);
 
+// Programming-on-Main operations verified via RailCom, these require the
+// RailCom detector to be enabled and the locomotive to be on the OPS track.
+// The first parameter is the locomotive address. A CV value of -1 indicates
+// the decoder did not respond.
+int16_t readOpsCV(const uint16_t, const uint16_t);
+std::vector<CVReadResult> readOpsCVs(const uint16_t
+                                   , const std::vector<uint16_t> &
+                                   , CVReadProgress progress = nullptr);
+bool readOpsCVsAsync(const uint16_t, const std::vector<uint16_t> &
+                   , CVReadProgress, CVReadComplete);
+bool verifyOpsCVByte(const uint16_t, const uint16_t, const uint8_t);
+bool writeOpsCVByteVerified(const uint16_t, const uint16_t, const uint8_t);
+
+// Queues a job for the programming thread, this is used for sequences of
+// OPS track operations that would otherwise block the caller. Returns false
+// if the queue is full.
+bool queueProgrammingJob(std::function<void()>);
+
 #endif // DCC_PROG_H_
\ No newline at end of file
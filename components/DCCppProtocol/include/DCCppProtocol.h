@@ -18,18 +18,67 @@ COPYRIGHT (c) 2017-2020 Mike Dunston
 #ifndef DCC_PROTOCOL_H_
 #define DCC_PROTOCOL_H_
 
+#include <functional>
+#include <memory>
 #include <vector>
 #include <string>
 #include <openlcb/TractionTrain.hxx>
+#include <os/OS.hxx>
+#include <StateBus.h>
 
 #include "sdkconfig.h"
 
+// Holds responses that are generated after the command which triggered them
+// has returned. When a sink is provided the responses are delivered to it
+// directly, otherwise they are retained until the consumer picks them up.
+class DCCPPAsyncResponse
+{
+public:
+  DCCPPAsyncResponse(std::function<void(std::string &)> sink = nullptr)
+    : sink_(sink)
+  {
+  }
+
+  void append(std::string response)
+  {
+    if (sink_)
+    {
+      sink_(response);
+      return;
+    }
+    OSMutexLock l(&lock_);
+    pending_.append(response);
+  }
+
+  std::string take()
+  {
+    OSMutexLock l(&lock_);
+    std::string response;
+    response.swap(pending_);
+    return response;
+  }
+private:
+  std::function<void(std::string &)> sink_;
+  OSMutex lock_;
+  std::string pending_;
+};
+
 // Class definition for a single protocol command
 class DCCPPProtocolCommand
 {
 public:
   virtual ~DCCPPProtocolCommand() {}
-  virtual std::string process(const std::vector<std::string>) = 0;
+  virtual std::string process(const std::vector<std::string> &) = 0;
+
+  // Processes the command with a channel for responses that will be generated
+  // after this call returns. By default the command is processed synchronously
+  // and the channel is not used.
+  virtual std::string process_async(const std::vector<std::string> &args
+                                  , std::shared_ptr<DCCPPAsyncResponse>)
+  {
+    return process(args);
+  }
+
   virtual std::string getID() = 0;
   virtual size_t getMinArgCount() = 0;
 };
@@ -38,7 +87,7 @@ public:
 class name : public DCCPPProtocolCommand                          \
 {                                                                 \
 public:                                                           \
-  std::string process(const std::vector<std::string>) override;   \
+  std::string process(const std::vector<std::string> &) override; \
   std::string getID() override                                    \
   {                                                               \
     return id;                                                    \
@@ -50,28 +99,94 @@ public:                                                           \
 };
 
 #define DCC_PROTOCOL_COMMAND_HANDLER(name, func)                  \
-std::string name::process(const std::vector<std::string> args)    \
+std::string name::process(const std::vector<std::string> &args)  \
 {                                                                 \
  return func(args);                                               \
 }
 
+// Declares a command which can complete after the handler returns, the
+// handler receives the async response channel which will be nullptr when the
+// command must be processed synchronously.
+#define DECLARE_DCC_PROTOCOL_ASYNC_COMMAND_CLASS(name, id, min_args) \
+class name : public DCCPPProtocolCommand                          \
+{                                                                 \
+public:                                                           \
+  std::string process(const std::vector<std::string> &args) override \
+  {                                                               \
+    return process_async(args, nullptr);                          \
+  }                                                               \
+  std::string process_async(const std::vector<std::string> &      \
+                          , std::shared_ptr<DCCPPAsyncResponse>) override; \
+  std::string getID() override                                    \
+  {                                                               \
+    return id;                                                    \
+  }                                                               \
+  size_t getMinArgCount() override                                \
+  {                                                               \
+    return min_args;                                              \
+  }                                                               \
+};
+
+#define DCC_PROTOCOL_ASYNC_COMMAND_HANDLER(name, ...)             \
+std::string name::process_async(const std::vector<std::string> &args \
+                              , std::shared_ptr<DCCPPAsyncResponse> async) \
+{                                                                 \
+ return (__VA_ARGS__)(args, async);                               \
+}
+
 // Class definition for the Protocol Interpreter
 class DCCPPProtocolHandler
 {
 public:
   static void init();
-  static std::string process(const std::string &);
+  // Processes a single command, the command is the text between the < and >
+  // characters. The command ID is looked up without copying it and the
+  // arguments are assigned into the caller provided vector so that it can
+  // be reused for every command processed by a consumer.
+  static std::string process(const char *command, size_t length
+                           , std::vector<std::string> &args
+                           , std::shared_ptr<DCCPPAsyncResponse> async = nullptr);
   static void registerCommand(DCCPPProtocolCommand *);
 };
 
 class DCCPPProtocolConsumer
 {
 public:
-  DCCPPProtocolConsumer();
+  DCCPPProtocolConsumer(std::function<void(std::string &)> sink = nullptr);
+  ~DCCPPProtocolConsumer();
   std::string feed(uint8_t *, size_t);
+
+  // Subscribes to state changes published on the StateBus, the changes are
+  // formatted as DCC++ responses (<H>, <Q>/<q> and <p>) and delivered in the
+  // same way as asynchronous responses. Locomotive changes have no DCC++
+  // representation outside of a throttle register and are not delivered.
+  void subscribe_state(uint32_t topics = esp32cs::ALL_STATE_TOPICS);
+
+  // Returns any responses generated by commands that completed after they
+  // were processed, this is always empty when a sink has been provided.
+  std::string take_async_response()
+  {
+    return _async->take();
+  }
+
+  // Returns the number of commands that have been processed.
+  uint32_t command_count()
+  {
+    return _commandCount;
+  }
 private:
-  std::string processData();
-  std::vector<uint8_t> _buffer;
+  // Maximum length of a buffered command, including the < and > characters.
+  static constexpr size_t COMMAND_BUFFER_SIZE = 256;
+  // Processes all complete commands in the buffer and returns the number of
+  // bytes that were consumed.
+  size_t processData(std::string &response);
+  uint8_t _buffer[COMMAND_BUFFER_SIZE];
+  size_t _bufferUsed{0};
+  // Reused for the arguments of each command.
+  std::vector<std::string> _args;
+  uint32_t _commandCount{0};
+  std::shared_ptr<DCCPPAsyncResponse> _async;
+  uint32_t _stateSubscription{0};
 };
 
 const std::string COMMAND_FAILED_RESPONSE = "<X>";
@@ -80,4 +195,15 @@ const std::string COMMAND_NO_RESPONSE = "";
 
 std::string convert_loco_to_dccpp_state(openlcb::TrainImpl *impl, size_t id);
 
+// Sends the speed to all locomotives in the consist the locomotive is part of,
+// or only to the locomotive when it is not part of a consist.
+void set_loco_speed(openlcb::TrainImpl *impl, uint16_t address
+                  , openlcb::SpeedType speed);
+
+// Sends the function states to all locomotives in the consist the locomotive
+// is part of, or only to the locomotive when it is not part of a consist.
+// Bit N of mask is set for each function N to update.
+void set_loco_fn(openlcb::TrainImpl *impl, uint16_t address, uint32_t mask
+               , uint32_t values);
+
 #endif // DCC_PROTOCOL_H_
\ No newline at end of file
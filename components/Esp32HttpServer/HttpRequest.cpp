@@ -46,6 +46,7 @@ std::map<HttpHeader, string> well_known_http_headers =
 , { WS_VERSION, "Sec-WebSocket-Version" }
 , { WS_KEY, "Sec-WebSocket-Key" }
 , { WS_ACCEPT, "Sec-WebSocket-Accept"}
+, { WS_PROTOCOL, "Sec-WebSocket-Protocol" }
 };
 
 void HttpRequest::method(const string &value)
@@ -957,6 +957,8 @@ StateFlowBase::Action HttpRequestFlow::upgrade_to_websocket()
     , "[Httpd fd:%d,uri:%s] Upgrading to WebSocket", fd_, req_.uri().c_str());
   new WebSocketFlow(server_, fd_, remote_ip_, req_.header(HttpHeader::WS_KEY)
                   , req_.header(HttpHeader::WS_VERSION)
+                  , server_->ws_protocol(req_.uri()
+                                       , req_.header(HttpHeader::WS_PROTOCOL))
                   , server_->ws_handler(req_.uri()));
   req_.reset();
   server_->schedule_cleanup(this);
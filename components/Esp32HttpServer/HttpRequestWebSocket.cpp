@@ -17,6 +17,9 @@ COPYRIGHT (c) 2019-2020 Mike Dunston
 
 #include "Httpd.h"
 
+#include <sys/socket.h>
+#include <sys/uio.h>
+
 #if defined(CONFIG_IDF_TARGET)
 // ESP-IDF includes mbedTLS and optional accelerated SHA1.
 #include <mbedtls/sha1.h>
@@ -45,17 +48,65 @@ static constexpr uint8_t WEBSOCKET_FRAME_LEN_UINT64 = 127;
 // This is the WebSocket UUID it is used as part of the handshake process.
 static constexpr const char * WEBSOCKET_UUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 
+// Maximum size of the frame header for an unmasked frame.
+static constexpr size_t WEBSOCKET_MAX_HEADER_SIZE = 10;
+
+WebSocketMessage::WebSocketMessage(const string &text, uint32_t coalesce_key)
+  : coalesceKey_(coalesce_key)
+{
+  encode(OP_TEXT, text.data(), text.length());
+}
+
+WebSocketMessage::WebSocketMessage(const uint8_t *data, size_t length
+                                 , uint32_t coalesce_key)
+  : coalesceKey_(coalesce_key)
+{
+  encode(OP_BINARY, data, length);
+}
+
+void WebSocketMessage::encode(uint8_t opcode, const void *data, size_t length)
+{
+  frame_.reserve(length + WEBSOCKET_MAX_HEADER_SIZE);
+  frame_.push_back(WEBSOCKET_FINAL_FRAME | opcode);
+  if (length < WEBSOCKET_FRAME_LEN_SINGLE)
+  {
+    frame_.push_back(length);
+  }
+  else if (length <= UINT16_MAX)
+  {
+    // extended payload length is sent in network byte order.
+    frame_.push_back(WEBSOCKET_FRAME_LEN_UINT16);
+    frame_.push_back((length >> 8) & 0xFF);
+    frame_.push_back(length & 0xFF);
+  }
+  else
+  {
+    frame_.push_back(WEBSOCKET_FRAME_LEN_UINT64);
+    for (int shift = 56; shift >= 0; shift -= 8)
+    {
+      frame_.push_back(((uint64_t)length >> shift) & 0xFF);
+    }
+  }
+  const uint8_t *payload = static_cast<const uint8_t *>(data);
+  frame_.insert(frame_.end(), payload, payload + length);
+}
+
 WebSocketFlow::WebSocketFlow(Httpd *server, int fd, uint32_t remote_ip
                            , const string &ws_key, const string &ws_version
-                           , WebSocketHandler handler)
+                           , const string &protocol, WebSocketHandler handler)
                            : StateFlowBase(server)
                            , server_(server)
                            , fd_(fd)
                            , remote_ip_(remote_ip)
+                           , protocol_(protocol)
                            , timeout_(MSEC_TO_NSEC(config_httpd_websocket_timeout_ms()))
                            , max_frame_size_(config_httpd_websocket_max_frame_size())
+                           , max_queued_(config_httpd_websocket_max_queued_messages())
                            , handler_(handler)
 {
+  bzero(&stats_, sizeof(WebSocketStats));
+  stats_.id = fd_;
+  stats_.ip = remote_ip_;
   server_->add_websocket(fd, this);
   string key_data = ws_key + WEBSOCKET_UUID;
   unsigned char key_sha1[20];
@@ -73,6 +124,10 @@ WebSocketFlow::WebSocketFlow(Httpd *server, int fd, uint32_t remote_ip
     resp.header(HttpHeader::WS_VERSION, ws_version);
     resp.header(HttpHeader::WS_ACCEPT
               , base64_encode(string((char *)key_sha1, 20)));
+    if (!protocol_.empty())
+    {
+      resp.header(HttpHeader::WS_PROTOCOL, protocol_);
+    }
     handshake_.assign(std::move(resp.to_string()));
 
     // Allocate buffer for frame data.
@@ -103,13 +158,63 @@ WebSocketFlow::~WebSocketFlow()
   {
     free(data_);
   }
-  textToSend_.clear();
+  queue_.clear();
 }
 
 void WebSocketFlow::send_text(string &text)
 {
-  OSMutexLock l(&textLock_);
-  textToSend_.append(text);
+  send(std::make_shared<const WebSocketMessage>(text));
+}
+
+void WebSocketFlow::send_binary(const uint8_t *data, size_t length)
+{
+  send(std::make_shared<const WebSocketMessage>(data, length));
+}
+
+void WebSocketFlow::send(WebSocketMessagePtr message)
+{
+  OSMutexLock l(&queueLock_);
+  // The first message can not be replaced or discarded once part of it has
+  // been written to the socket.
+  size_t first = sendOffset_ ? 1 : 0;
+  if (message->coalesce_key())
+  {
+    for (size_t pos = first; pos < queue_.size(); pos++)
+    {
+      if (queue_[pos]->coalesce_key() == message->coalesce_key())
+      {
+        stats_.queued_bytes -= queue_[pos]->size();
+        stats_.queued_bytes += message->size();
+        stats_.coalesced++;
+        queue_[pos] = std::move(message);
+        return;
+      }
+    }
+  }
+  if (queue_.size() >= max_queued_ && queue_.size() > first)
+  {
+    LOG(CONFIG_HTTP_WS_LOG_LEVEL
+      , "[WebSocket fd:%d] Queue full, discarding oldest message", fd_);
+    remove_locked(first);
+    stats_.dropped++;
+  }
+  stats_.queued_bytes += message->size();
+  queue_.push_back(std::move(message));
+  stats_.queued = queue_.size();
+  stats_.peak_queued = std::max(stats_.peak_queued, stats_.queued);
+}
+
+WebSocketStats WebSocketFlow::stats()
+{
+  OSMutexLock l(&queueLock_);
+  return stats_;
+}
+
+void WebSocketFlow::remove_locked(size_t pos)
+{
+  stats_.queued_bytes -= queue_[pos]->size();
+  queue_.erase(queue_.begin() + pos);
+  stats_.queued = queue_.size();
 }
 
 int WebSocketFlow::id()
@@ -122,6 +227,11 @@ uint32_t WebSocketFlow::ip()
   return remote_ip_;
 }
 
+const string &WebSocketFlow::protocol()
+{
+  return protocol_;
+}
+
 void WebSocketFlow::request_close()
 {
   close_requested_ = true;
@@ -212,12 +322,11 @@ StateFlowBase::Action WebSocketFlow::read_frame_header()
   frameLenType_ = 0;
   frameLength_ = 0;
   maskingKey_ = 0;
-  bzero(data_, max_frame_size_);
   LOG(CONFIG_HTTP_WS_LOG_LEVEL, "[WebSocket fd:%d] Reading WS packet", fd_);
   return read_fully_with_timeout(&header_, sizeof(uint16_t)
                                , config_httpd_websocket_max_read_attempts()
                                , STATE(frame_header_received)
-                               , STATE(send_frame_header));
+                               , STATE(send_queued_frames));
 }
 
 StateFlowBase::Action WebSocketFlow::frame_header_received()
@@ -300,7 +409,7 @@ StateFlowBase::Action WebSocketFlow::start_recv_frame_data()
   return read_fully_with_timeout(data_, data_size_
                                , config_httpd_websocket_max_read_attempts()
                                , STATE(recv_frame_data)
-                               , STATE(send_frame_header));
+                               , STATE(send_queued_frames));
 }
 
 StateFlowBase::Action WebSocketFlow::recv_frame_data()
@@ -358,66 +467,64 @@ StateFlowBase::Action WebSocketFlow::shutdown_connection()
   return exit();
 }
 
-StateFlowBase::Action WebSocketFlow::send_frame_header()
+StateFlowBase::Action WebSocketFlow::send_queued_frames()
 {
-  // TODO: add binary message sending support
-  OSMutexLock l(&textLock_);
-  if (textToSend_.empty())
+  OSMutexLock l(&queueLock_);
+  if (queue_.empty())
   {
     return yield_and_call(STATE(read_frame_header));
   }
-  bzero(data_, max_frame_size_);
-  size_t send_size = 0;
-  if (textToSend_.length() < WEBSOCKET_FRAME_LEN_SINGLE)
+  // Pass as many queued frames as possible to the socket in one call, the
+  // frames are referenced directly from the shared messages.
+  size_t limit = std::min((size_t)MAX_WRITE_MESSAGES
+                        , (size_t)config_httpd_websocket_max_write_messages());
+  size_t count = std::min(queue_.size(), limit);
+  struct iovec iov[MAX_WRITE_MESSAGES];
+  size_t offset = sendOffset_;
+  for (size_t idx = 0; idx < count; idx++)
   {
-    data_[0] = WEBSOCKET_FINAL_FRAME | OP_TEXT;
-    data_[1] = textToSend_.length();
-    memcpy(data_ + 2, textToSend_.data(), textToSend_.length());
-    data_size_ = textToSend_.length();
-    send_size = data_size_ + 2;
+    iov[idx].iov_base = (void *)(queue_[idx]->frame() + offset);
+    iov[idx].iov_len = queue_[idx]->size() - offset;
+    offset = 0;
   }
-  else if (textToSend_.length() < max_frame_size_ - 4)
+  struct msghdr msg;
+  bzero(&msg, sizeof(struct msghdr));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = count;
+  ssize_t sent = sendmsg(fd_, &msg, MSG_DONTWAIT);
+  if (sent < 0)
   {
-    data_size_ = textToSend_.length();
-    data_[0] = WEBSOCKET_FINAL_FRAME | OP_TEXT;
-    data_[1] = WEBSOCKET_FRAME_LEN_UINT16;
-    data_[2] = data_size_ & 0xFF;
-    data_[3] = (data_size_ >> 8) & 0xFF;
-    memcpy(data_+ 4, textToSend_.data(), textToSend_.length());
-    send_size = data_size_ + 4;
-  }
-  else
-  {
-    // size is greater than our max frame, send it as fragments
-    data_size_ = max_frame_size_ - 4;
-    data_[0] = OP_CONTINUATION;
-    data_[1] = WEBSOCKET_FRAME_LEN_UINT16;
-    data_[2] = data_size_ & 0xFF;
-    data_[3] = (data_size_ >> 8) & 0xFF;
-    memcpy(data_+ 4, textToSend_.data(), data_size_);
-    send_size = data_size_ + 4;
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+    {
+      // socket buffer is full, check for incoming data and try again later.
+      return yield_and_call(STATE(read_frame_header));
+    }
+    LOG_ERROR("[WebSocket fd:%d] write-error (%d: %s), disconnecting (frame)"
+            , fd_, errno, strerror(errno));
+    return yield_and_call(STATE(shutdown_connection));
   }
   LOG(CONFIG_HTTP_WS_LOG_LEVEL
-    , "[WebSocket fd:%d] send:%zu, text:%zu", fd_, send_size
-    , textToSend_.length());
-  return write_repeated(&helper_, fd_, data_, send_size, STATE(frame_sent));
-}
-
-StateFlowBase::Action WebSocketFlow::frame_sent()
-{
-  if (helper_.hasError_)
+    , "[WebSocket fd:%d] sent:%zd, frames:%zu, queued:%zu", fd_, sent, count
+    , queue_.size());
+  size_t remaining = sent;
+  while (remaining && !queue_.empty())
   {
-    LOG_ERROR("[WebSocket fd:%d] read-error (%d: %s), disconnecting (frame)"
-            , fd_, errno, strerror(errno));
-    return yield_and_call(STATE(shutdown_connection));
+    size_t pending = queue_.front()->size() - sendOffset_;
+    if (remaining < pending)
+    {
+      sendOffset_ += remaining;
+      break;
+    }
+    remaining -= pending;
+    sendOffset_ = 0;
+    remove_locked(0);
+    stats_.sent++;
   }
-  OSMutexLock l(&textLock_);
-  textToSend_.erase(0, data_size_);
-  if (textToSend_.empty())
+  if (queue_.empty() || sent == 0)
   {
     return yield_and_call(STATE(read_frame_header));
   }
-  return yield_and_call(STATE(send_frame_header));
+  return yield_and_call(STATE(send_queued_frames));
 }
 
 } // namespace http
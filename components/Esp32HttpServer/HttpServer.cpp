@@ -16,6 +16,7 @@ COPYRIGHT (c) 2019 Mike Dunston
 **********************************************************************/
 
 #include "Httpd.h"
+#include "HttpStringUtils.h"
 
 #ifdef CONFIG_IDF_TARGET
 
@@ -84,6 +85,7 @@ Httpd::~Httpd()
   static_uris_.clear();
   redirect_uris_.clear();
   websocket_uris_.clear();
+  websocket_protocols_.clear();
 }
 
 void Httpd::uri(const std::string &uri, const size_t method_mask
@@ -123,12 +125,17 @@ void Httpd::static_uri(const string &uri, const uint8_t *payload
                     HttpStatusCode::STATUS_NOT_MODIFIED)));
 }
 
-void Httpd::websocket_uri(const string &uri, WebSocketHandler handler)
+void Httpd::websocket_uri(const string &uri, WebSocketHandler handler
+                        , const vector<string> &protocols)
 {
+  if (!protocols.empty())
+  {
+    websocket_protocols_.insert(std::make_pair(uri, protocols));
+  }
   websocket_uris_.insert(std::make_pair(std::move(uri), std::move(handler)));
 }
 
-void Httpd::send_websocket_binary(int id, uint8_t *data, size_t len)
+void Httpd::send_websocket_binary(int id, const uint8_t *data, size_t len)
 {
   OSMutexLock l(&websocketsLock_);
   if (!websockets_.count(id))
@@ -137,7 +144,7 @@ void Httpd::send_websocket_binary(int id, uint8_t *data, size_t len)
               "discarding.", id);
     return;
   }
-  //websockets_[id]->send_binary(data, len);
+  websockets_[id]->send_binary(data, len);
 }
 
 void Httpd::send_websocket_text(int id, std::string &text)
@@ -153,14 +160,42 @@ void Httpd::send_websocket_text(int id, std::string &text)
 }
 
 void Httpd::broadcast_websocket_text(std::string &text)
+{
+  broadcast_websocket(std::make_shared<const WebSocketMessage>(text));
+}
+
+void Httpd::send_websocket(int id, WebSocketMessagePtr message)
+{
+  OSMutexLock l(&websocketsLock_);
+  if (!websockets_.count(id))
+  {
+    LOG_ERROR("[Httpd] Attempt to send message to unknown websocket:%d, "
+              "discarding.", id);
+    return;
+  }
+  websockets_[id]->send(message);
+}
+
+void Httpd::broadcast_websocket(WebSocketMessagePtr message)
 {
   OSMutexLock l(&websocketsLock_);
   for (auto &client : websockets_)
   {
-    client.second->send_text(text);
+    client.second->send(message);
   }
 }
 
+std::vector<WebSocketStats> Httpd::websocket_stats()
+{
+  std::vector<WebSocketStats> stats;
+  OSMutexLock l(&websocketsLock_);
+  for (auto &client : websockets_)
+  {
+    stats.push_back(client.second->stats());
+  }
+  return stats;
+}
+
 void Httpd::new_connection(int fd)
 {
   sockaddr_in source;
@@ -400,4 +435,33 @@ WebSocketHandler Httpd::ws_handler(const string &uri)
   return nullptr;
 }
 
+string Httpd::ws_protocol(const string &uri, const string &requested)
+{
+  auto supported = websocket_protocols_.find(uri);
+  if (supported == websocket_protocols_.end() || requested.empty())
+  {
+    return "";
+  }
+  vector<string> protocols;
+  tokenize(requested, protocols, ",", true, true);
+  for (auto &protocol : protocols)
+  {
+    // strip the optional whitespace around each entry.
+    protocol.erase(0, protocol.find_first_not_of(' '));
+    protocol.erase(protocol.find_last_not_of(' ') + 1);
+  }
+  for (const auto &protocol : supported->second)
+  {
+    if (std::find(protocols.begin(), protocols.end(), protocol) !=
+        protocols.end())
+    {
+      return protocol;
+    }
+  }
+  LOG(CONFIG_HTTP_SERVER_LOG_LEVEL
+    , "[Httpd uri:%s] No supported WebSocket protocol in: %s", uri.c_str()
+    , requested.c_str());
+  return "";
+}
+
 } // namespace http
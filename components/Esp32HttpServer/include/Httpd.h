@@ -21,8 +21,11 @@ COPYRIGHT (c) 2019-2020 Mike Dunston
 #define HTTPD_H_
 
 #include <algorithm>
+#include <deque>
 #include <map>
+#include <memory>
 #include <stdint.h>
+#include <vector>
 
 #include <executor/Service.hxx>
 #include <executor/StateFlow.hxx>
@@ -97,6 +100,15 @@ DECLARE_CONST(httpd_websocket_max_frame_size);
 /// frame before attempting to send out a websocket frame.
 DECLARE_CONST(httpd_websocket_max_read_attempts);
 
+/// This is the maximum number of messages that will be queued for a single
+/// websocket client. When this limit is reached the oldest queued message
+/// will be discarded.
+DECLARE_CONST(httpd_websocket_max_queued_messages);
+
+/// This is the maximum number of queued messages that will be passed to the
+/// socket in a single write operation, values above 16 will be treated as 16.
+DECLARE_CONST(httpd_websocket_max_write_messages);
+
 /// This controls the Cache-Control: max-age=XXX value in the response headers
 /// for static content.
 DECLARE_CONST(httpd_cache_max_age_sec);
@@ -193,6 +205,7 @@ enum HttpHeader
   WS_VERSION,
   WS_KEY,
   WS_ACCEPT,
+  WS_PROTOCOL,
 };
 
 /// Commonly used and well-known values for the Content-Type HTTP header.
@@ -267,6 +280,96 @@ static constexpr const char * HTTP_ENCODING_GZIP = "gzip";
 /// of various classes.
 class WebSocketFlow;
 
+/// Immutable WebSocket message.
+///
+/// The frame header is generated once when the message is created and the
+/// message is shared (via @ref WebSocketMessagePtr) by all clients it is
+/// queued to, this avoids copying the payload for each client.
+class WebSocketMessage
+{
+public:
+  /// Constructor.
+  ///
+  /// @param text is the text to send.
+  /// @param coalesce_key is used to replace an older message that is still
+  /// queued for a client when it has the same (non-zero) key, this should be
+  /// used for messages which carry the full state of a single object.
+  WebSocketMessage(const std::string &text, uint32_t coalesce_key = 0);
+
+  /// Constructor.
+  ///
+  /// @param data is the binary data to send.
+  /// @param length is the length of the binary data.
+  /// @param coalesce_key is used to replace an older message that is still
+  /// queued for a client when it has the same (non-zero) key.
+  WebSocketMessage(const uint8_t *data, size_t length
+                 , uint32_t coalesce_key = 0);
+
+  /// @return the encoded frame (header and payload).
+  const uint8_t *frame() const
+  {
+    return frame_.data();
+  }
+
+  /// @return the number of bytes in the encoded frame.
+  size_t size() const
+  {
+    return frame_.size();
+  }
+
+  /// @return the coalesce key for this message, zero if none.
+  uint32_t coalesce_key() const
+  {
+    return coalesceKey_;
+  }
+
+private:
+  /// Encodes the frame header and payload into @ref frame_.
+  ///
+  /// @param opcode is the WebSocket opcode for the frame.
+  /// @param data is the payload to send.
+  /// @param length is the length of the payload.
+  void encode(uint8_t opcode, const void *data, size_t length);
+
+  /// Encoded frame.
+  std::vector<uint8_t> frame_;
+
+  /// Key used to replace an older queued message.
+  const uint32_t coalesceKey_;
+};
+
+/// Shared reference to a @ref WebSocketMessage.
+typedef std::shared_ptr<const WebSocketMessage> WebSocketMessagePtr;
+
+/// Outbound queue statistics for a single WebSocket client.
+struct WebSocketStats
+{
+  /// ID of the WebSocket.
+  int id;
+
+  /// IP address of the remote side of the WebSocket, zero if unknown.
+  uint32_t ip;
+
+  /// Number of messages currently queued.
+  size_t queued;
+
+  /// Number of bytes currently queued.
+  size_t queued_bytes;
+
+  /// Highest number of messages that have been queued at one time.
+  size_t peak_queued;
+
+  /// Number of messages that have been sent completely.
+  uint32_t sent;
+
+  /// Number of messages that were discarded due to the queue being full.
+  uint32_t dropped;
+
+  /// Number of messages that were replaced by a newer message with the same
+  /// coalesce key.
+  uint32_t coalesced;
+};
+
 /// Forward declaration of the HttpdRequestFlow so it can access internal
 /// methods of various classes.
 class HttpRequestFlow;
@@ -802,11 +905,17 @@ public:
                 , const size_t length, const std::string &mime_type
                 , const std::string &encoding = HTTP_ENCODING_NONE);
 
-  /// Registers a WebSocket handler for a given URI.  ///
+  /// Registers a WebSocket handler for a given URI.
+  ///
   /// @param uri is the URI to process as a WebSocket endpoint.
   /// @param handler is the @ref WebSocketHandler to invoke when this URI is
   /// requested.
-  void websocket_uri(const std::string &uri, WebSocketHandler handler);
+  /// @param protocols is the list of WebSocket subprotocols supported by the
+  /// handler in order of preference. When the client requests one or more of
+  /// these the first one supported will be selected, otherwise the WebSocket
+  /// is established without a subprotocol.
+  void websocket_uri(const std::string &uri, WebSocketHandler handler
+                   , const std::vector<std::string> &protocols = {});
 
   /// Sends a binary message to a single WebSocket.
   ///
@@ -814,9 +923,7 @@ public:
   /// @param data is the binary data to send to the websocket client.
   /// @param length is the length of the binary data to send to the websocket
   /// client.
-  ///
-  /// Note: this is currently unimplemented.
-  void send_websocket_binary(int id, uint8_t *data, size_t length);
+  void send_websocket_binary(int id, const uint8_t *data, size_t length);
 
   /// Sends a text message to a single WebSocket.
   /// 
@@ -829,6 +936,22 @@ public:
   /// @param text is the text to send to all WebSocket clients.
   void broadcast_websocket_text(std::string &text);
 
+  /// Sends a pre-built message to a single WebSocket.
+  ///
+  /// @param id is the ID of the WebSocket to send the message to.
+  /// @param message is the @ref WebSocketMessage to send.
+  void send_websocket(int id, WebSocketMessagePtr message);
+
+  /// Broadcasts a pre-built message to all connected WebSocket clients, the
+  /// message is shared by all clients.
+  ///
+  /// @param message is the @ref WebSocketMessage to send.
+  void broadcast_websocket(WebSocketMessagePtr message);
+
+  /// @return the outbound queue statistics for all connected WebSocket
+  /// clients.
+  std::vector<WebSocketStats> websocket_stats();
+
   /// Creates a new @ref HttpRequestFlow for the provided socket handle.
   ///
   /// @param fd is the socket handle.
@@ -916,6 +1039,14 @@ private:
   /// @param uri is the URI to retrieve the @ref WebSocketHandler for.
   WebSocketHandler ws_handler(const std::string &uri);
 
+  /// @return the WebSocket subprotocol to use for the provided URI, this will
+  /// be empty if none of the requested subprotocols are supported.
+  /// @param uri is the URI of the WebSocket.
+  /// @param requested is the "Sec-WebSocket-Protocol" HTTP header from the
+  /// initial request.
+  std::string ws_protocol(const std::string &uri
+                        , const std::string &requested);
+
   /// @return true if there is a @ref AbstractHttpResponse for the URI.
   /// @param uri is the URI to check.
   bool have_known_response(const std::string &uri);
@@ -987,6 +1118,9 @@ private:
   /// Internal map of all registered @ref WebSocketHandler URIs.
   std::map<std::string, WebSocketHandler> websocket_uris_;
 
+  /// Internal map of supported subprotocols for WebSocket URIs.
+  std::map<std::string, std::vector<std::string>> websocket_protocols_;
+
   /// Internal map of active @ref WebSocketFlow instances.
   std::map<int, WebSocketFlow *> websockets_;
 
@@ -1155,11 +1289,12 @@ public:
   /// request.
   /// @param ws_version is the "Sec-WebSocket-Version" HTTP header from the
   /// initial request.
+  /// @param protocol is the negotiated WebSocket subprotocol, empty if none.
   /// @param handler is the @ref WebSocketHandler that will process the events
   /// as they are raised.
   WebSocketFlow(Httpd *server, int fd, uint32_t remote_ip
               , const std::string &ws_key, const std::string &ws_version
-              , WebSocketHandler handler);
+              , const std::string &protocol, WebSocketHandler handler);
 
   /// Destructor.
   ~WebSocketFlow();
@@ -1169,6 +1304,25 @@ public:
   /// @param text is the text to send.
   void send_text(std::string &text);
 
+  /// Sends binary data to this WebSocket at the next possible interval.
+  ///
+  /// @param data is the binary data to send.
+  /// @param length is the length of the binary data.
+  void send_binary(const uint8_t *data, size_t length);
+
+  /// Queues a message to this WebSocket.
+  ///
+  /// If the message has a coalesce key and a message with the same key is
+  /// still waiting to be sent it will be replaced by this message. If the
+  /// queue is full the oldest message that has not been partially sent will
+  /// be discarded.
+  ///
+  /// @param message is the @ref WebSocketMessage to send.
+  void send(WebSocketMessagePtr message);
+
+  /// @return the outbound queue statistics for this WebSocket.
+  WebSocketStats stats();
+
   /// @return the ID of the WebSocket.
   int id();
 
@@ -1178,12 +1332,19 @@ public:
   /// known.
   uint32_t ip();
 
+  /// @return the negotiated WebSocket subprotocol, empty if none.
+  const std::string &protocol();
+
   /// This will trigger an orderly shutdown of the WebSocket at the next
   /// opportunity. This will trigger the @ref WebSocketHandler with the
   /// @ref WebSocketEvent set to @ref WebSocketEvent::WS_EVENT_DISCONNECT.
   void request_close();
 
 private:
+  /// Upper bound for @ref httpd_websocket_max_write_messages, this sizes the
+  /// iovec array used by @ref send_queued_frames.
+  static constexpr size_t MAX_WRITE_MESSAGES = 16;
+
   /// @ref StateFlowTimedSelectHelper which assists in reading/writing of the
   /// request data stream.
   StateFlowTimedSelectHelper helper_{this};
@@ -1197,13 +1358,19 @@ private:
   /// Remote client IP (if known).
   uint32_t remote_ip_;
 
+  /// Negotiated WebSocket subprotocol.
+  const std::string protocol_;
+
   /// WebSocket read/write timeout for a data frame.
   const uint64_t timeout_;
 
   /// Maximum size to read/write of a frame in one call.
   const uint64_t max_frame_size_;
 
-  /// Temporary buffer used for reading/writing WebSocket frame data.
+  /// Maximum number of messages to queue for this client.
+  const size_t max_queued_;
+
+  /// Temporary buffer used for reading WebSocket frame data.
   uint8_t *data_;
 
   /// Size of the used data in the temporary buffer.
@@ -1237,12 +1404,26 @@ private:
   /// 32bit XOR mask to apply to the data when @ref masked_ is true.
   uint32_t maskingKey_;
 
-  /// Lock for the @ref textToSend_ buffer.
-  OSMutex textLock_;
+  /// Lock for the @ref queue_ and @ref stats_.
+  OSMutex queueLock_;
+
+  /// Messages waiting to be sent to the client, the first entry may have
+  /// been partially sent.
+  std::deque<WebSocketMessagePtr> queue_;
+
+  /// Number of bytes of the first entry in @ref queue_ that have already
+  /// been sent.
+  size_t sendOffset_{0};
 
-  /// Buffer of raw text message(s) to send to the client. Multiple messages
-  /// can be sent as one frame if they are sent to this client rapidly.
-  std::string textToSend_;
+  /// Outbound queue statistics.
+  WebSocketStats stats_;
+
+  /// Removes the message at the given position in @ref queue_.
+  ///
+  /// @param pos is the position of the message to remove.
+  ///
+  /// Note: @ref queueLock_ must be held by the caller.
+  void remove_locked(size_t pos);
 
   /// When set to true the @ref WebSocketFlow will attempt to shutdown the
   /// WebSocket connection at it's next opportunity.
@@ -1271,8 +1452,7 @@ private:
   STATE_FLOW_STATE(start_recv_frame_data);
   STATE_FLOW_STATE(recv_frame_data);
   STATE_FLOW_STATE(shutdown_connection);
-  STATE_FLOW_STATE(send_frame_header);
-  STATE_FLOW_STATE(frame_sent);
+  STATE_FLOW_STATE(send_queued_frames);
 };
 
 } // namespace http
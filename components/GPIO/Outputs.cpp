@@ -320,7 +320,7 @@ where
 **********************************************************************/
 
 DCC_PROTOCOL_COMMAND_HANDLER(OutputCommandAdapter,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   if(arguments.empty())
   {
@@ -353,7 +353,7 @@ DCC_PROTOCOL_COMMAND_HANDLER(OutputCommandAdapter,
 })
 
 DCC_PROTOCOL_COMMAND_HANDLER(OutputExCommandAdapter,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   uint16_t outputID = std::stoi(arguments[0]);
   auto output = OutputManager::getOutput(outputID);
@@ -157,7 +157,7 @@ string RemoteSensor::toJson(bool includeState)
 }
 
 DCC_PROTOCOL_COMMAND_HANDLER(RemoteSensorsCommandAdapter,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   if(arguments.empty())
   {
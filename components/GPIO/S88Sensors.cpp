@@ -67,6 +67,16 @@ constexpr uint16_t S88_SENSOR_READ_TIME = 25;
 
 static constexpr const char * S88_SENSORS_JSON_FILE = "s88.json";
 
+static constexpr const char * S88_SENSORS_JOURNAL = "s88";
+
+/// Journal payload for a single sensor bus.
+struct S88BusRecord
+{
+  uint8_t pin;
+  uint8_t reserved;
+  uint16_t count;
+};
+
 GPIO_PIN(S88_CLOCK, GpioOutputSafeLow, CONFIG_GPIO_S88_CLOCK_PIN);
 GPIO_PIN(S88_LOAD, GpioOutputSafeLow, CONFIG_GPIO_S88_LOAD_PIN);
 #if CONFIG_GPIO_S88_RESET_PIN >= 0
@@ -88,6 +98,7 @@ void *s88_task(void *param)
 }
 
 S88BusManager::S88BusManager(openlcb::Node *node) : poller_(node, {this})
+                                                  , journal_(S88_SENSORS_JOURNAL)
 {
 #if CONFIG_GPIO_S88_RESET_PIN >= 0
   LOG(INFO, "[S88] Configuration (clock: %d, reset: %d, load: %d)"
@@ -100,13 +111,43 @@ S88BusManager::S88BusManager(openlcb::Node *node) : poller_(node, {this})
   S88PinInit::hw_init();
 
   LOG(INFO, "[S88] Initializing SensorBus list");
-  nlohmann::json root = nlohmann::json::parse(
-    Singleton<ConfigurationManager>::instance()->load(S88_SENSORS_JSON_FILE));
-  for (auto bus : root[JSON_SENSORS_NODE])
+  auto cfg = Singleton<ConfigurationManager>::instance();
+  if (!journal_.exists() && cfg->exists(S88_SENSORS_JSON_FILE))
+  {
+    LOG(INFO, "[S88] Converting %s to journal", S88_SENSORS_JSON_FILE);
+    nlohmann::json root =
+      nlohmann::json::parse(cfg->load(S88_SENSORS_JSON_FILE), nullptr, false);
+    if (!root.is_discarded())
+    {
+      for (auto bus : root)
+      {
+        buses_.push_back(
+          std::make_unique<S88SensorBus>(bus[JSON_ID_NODE], bus[JSON_PIN_NODE]
+                                       , bus[JSON_COUNT_NODE]));
+      }
+    }
+    store();
+    if (journal_.compact())
+    {
+      cfg->remove(S88_SENSORS_JSON_FILE);
+    }
+  }
+  else
   {
-    buses_.push_back(
-      std::make_unique<S88SensorBus>(bus[JSON_ID_NODE], bus[JSON_PIN_NODE]
-                                   , bus[JSON_COUNT_NODE]));
+    journal_.load([&](uint32_t id, const string &payload)
+    {
+      S88BusRecord record;
+      if (payload.length() != sizeof(S88BusRecord) || id > UINT8_MAX)
+      {
+        LOG_ERROR("[S88] Invalid persistent entry for bus %d, ignoring it"
+                , id);
+        return;
+      }
+      memcpy(&record, payload.data(), sizeof(S88BusRecord));
+      buses_.push_back(
+        std::make_unique<S88SensorBus>(id, (gpio_num_t)record.pin
+                                     , record.count));
+    });
   }
   LOG(INFO, "[S88] Loaded %d Sensor Buses", buses_.size());
   os_thread_create(&taskHandle_, "s88", 1, 2048, s88_task, this);
@@ -120,27 +161,36 @@ S88BusManager::~S88BusManager()
 
 void S88BusManager::clear()
 {
+  OSMutexLock j(&journalLock_);
+  AtomicHolder l(this);
   buses_.clear();
+  journal_.clear();
 }
 
 uint16_t S88BusManager::store()
 {
-  AtomicHolder l(this);
+  OSMutexLock j(&journalLock_);
   uint16_t count = 0;
-  string content = "[";
-  for (const auto& bus : buses_)
   {
-    // only add the seperator if we have already serialized at least one
-    // bus.
-    if (content.length() > 1)
+    AtomicHolder l(this);
+    for (const auto& bus : buses_)
     {
-      content += ",";
+      // only buses that have changed since they were last stored will be
+      // written to the journal.
+      S88BusRecord record =
+      {
+        .pin = (uint8_t)bus->getDataPin(),
+        .reserved = 0,
+        .count = bus->getSensorCount()
+      };
+      journal_.put(bus->getID()
+                 , string(reinterpret_cast<const char *>(&record)
+                        , sizeof(S88BusRecord)));
+      count += bus->getSensorCount();
     }
-    content += bus->toJson();
-    count += bus->getSensorCount();
   }
-  content += "]";
-  Singleton<ConfigurationManager>::instance()->store(S88_SENSORS_JSON_FILE, content);
+  // file I/O is done outside of the critical section.
+  journal_.sync();
   return count;
 }
 
@@ -224,6 +274,7 @@ bool S88BusManager::createOrUpdateBus(const uint8_t id, const gpio_num_t dataPin
 
 bool S88BusManager::removeBus(const uint8_t id)
 {
+  OSMutexLock j(&journalLock_);
   AtomicHolder l(this);
   const auto & ent = std::find_if(buses_.begin(), buses_.end(),
   [id](std::unique_ptr<S88SensorBus> & bus) -> bool
@@ -233,6 +284,8 @@ bool S88BusManager::removeBus(const uint8_t id)
   if (ent != buses_.end())
   {
     buses_.erase(ent);
+    // the removal will be persisted by the next call to store().
+    journal_.erase(id);
     return true;
   }
   return false;
@@ -392,7 +445,7 @@ S88Sensor::S88Sensor(uint16_t id, uint16_t index)
 }
 
 DCC_PROTOCOL_COMMAND_HANDLER(S88BusCommandAdapter,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   auto s88 = S88BusManager::instance();
   if (arguments.empty())
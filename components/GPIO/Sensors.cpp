@@ -24,6 +24,7 @@ COPYRIGHT (c) 2017-2020 Mike Dunston
 #include <driver/gpio.h>
 #include <json.hpp>
 #include <JsonConstants.h>
+#include <PersistentJournal.h>
 #include <StatusDisplay.h>
 
 #include "Sensors.h"
@@ -38,19 +39,61 @@ static constexpr uint32_t SENSOR_TASK_STACK_SIZE = 2048;
 
 static constexpr const char * SENSORS_JSON_FILE = "sensors.json";
 
+static constexpr const char * SENSORS_JOURNAL = "sensors";
+
+// Persistent storage of the sensors, keyed by sensor ID.
+std::unique_ptr<PersistentJournal> sensorJournal;
+
+/// Journal payload for a single sensor.
+struct SensorRecord
+{
+  uint8_t pin;
+  uint8_t pullUp;
+};
+
 void SensorManager::init()
 {
   LOG(INFO, "[Sensors] Initializing sensors");
-  nlohmann::json root = nlohmann::json::parse(Singleton<ConfigurationManager>::instance()->load(SENSORS_JSON_FILE));
-  if(root.contains(JSON_COUNT_NODE))
+  auto cfg = Singleton<ConfigurationManager>::instance();
+  sensorJournal.reset(new PersistentJournal(SENSORS_JOURNAL));
+  if (!sensorJournal->exists() && cfg->exists(SENSORS_JSON_FILE))
   {
-    uint16_t sensorCount = root[JSON_COUNT_NODE].get<uint16_t>();
-    Singleton<StatusDisplay>::instance()->status("Found %02d Sensors", sensorCount);
-    for(auto sensor : root[JSON_SENSORS_NODE])
+    LOG(INFO, "[Sensors] Converting %s to journal", SENSORS_JSON_FILE);
+    nlohmann::json root =
+      nlohmann::json::parse(cfg->load(SENSORS_JSON_FILE), nullptr, false);
+    if(!root.is_discarded() && root.contains(JSON_COUNT_NODE))
     {
-      string data = sensor.dump();
-      sensors.push_back(std::make_unique<Sensor>(data));
+      for(auto sensor : root[JSON_SENSORS_NODE])
+      {
+        string data = sensor.dump();
+        sensors.push_back(std::make_unique<Sensor>(data));
+      }
     }
+    store();
+    if (sensorJournal->compact())
+    {
+      cfg->remove(SENSORS_JSON_FILE);
+    }
+  }
+  else
+  {
+    sensorJournal->load([](uint32_t id, const string &payload)
+    {
+      SensorRecord record;
+      if (payload.length() != sizeof(SensorRecord) || id > UINT16_MAX)
+      {
+        LOG_ERROR("[Sensors] Invalid persistent entry for Sensor(%d), "
+                  "ignoring it", id);
+        return;
+      }
+      memcpy(&record, payload.data(), sizeof(SensorRecord));
+      sensors.push_back(
+        std::make_unique<Sensor>(id, (gpio_num_t)record.pin, record.pullUp));
+    });
+  }
+  if (!sensors.empty())
+  {
+    Singleton<StatusDisplay>::instance()->status("Found %02d Sensors", sensors.size());
   }
   LOG(INFO, "[Sensors] Loaded %d sensors", sensors.size());
   xTaskCreate(sensorTask, "SensorManager", SENSOR_TASK_STACK_SIZE, NULL, SENSOR_TASK_PRIORITY, &_taskHandle);
@@ -58,23 +101,33 @@ void SensorManager::init()
 
 void SensorManager::clear()
 {
+  OSMutexLock l(&_lock);
   sensors.clear();
+  sensorJournal->clear();
 }
 
 uint16_t SensorManager::store()
 {
-  nlohmann::json root;
+  OSMutexLock l(&_lock);
   uint16_t sensorStoredCount = 0;
   for (const auto& sensor : sensors)
   {
     if (sensor->getPin() != NON_STORED_SENSOR_PIN)
     {
-      root[JSON_SENSORS_NODE].push_back(sensor->toJson());
+      // only sensors that have changed since they were last stored will be
+      // written to the journal.
+      SensorRecord record =
+      {
+        .pin = (uint8_t)sensor->getPin(),
+        .pullUp = sensor->isPullUp()
+      };
+      sensorJournal->put(sensor->getID()
+                       , string(reinterpret_cast<const char *>(&record)
+                              , sizeof(SensorRecord)));
       sensorStoredCount++;
     }
   }
-  root[JSON_COUNT_NODE] = sensorStoredCount;
-  Singleton<ConfigurationManager>::instance()->store(SENSORS_JSON_FILE, root.dump());
+  sensorJournal->sync();
   return sensorStoredCount;
 }
 
@@ -157,6 +210,8 @@ bool SensorManager::remove(const uint16_t id)
   {
     LOG(INFO, "[Sensors] Removing Sensor(%d)", (*ent)->getID());
     sensors.erase(ent);
+    // the removal will be persisted by the next call to store().
+    sensorJournal->erase(id);
     return true;
   }
   return false;
@@ -182,6 +237,18 @@ string SensorManager::get_state_for_dccpp()
   return res;
 }
 
+std::vector<std::pair<uint16_t, bool>> SensorManager::get_states()
+{
+  OSMutexLock l(&_lock);
+  std::vector<std::pair<uint16_t, bool>> states;
+  states.reserve(sensors.size());
+  for (const auto &sensor : sensors)
+  {
+    states.emplace_back(sensor->getID(), sensor->isActive());
+  }
+  return states;
+}
+
 Sensor::Sensor(uint16_t sensorID, gpio_num_t pin, bool pullUp, bool announce, bool initialState)
   : _sensorID(sensorID), _pin(pin), _pullUp(pullUp), _lastState(initialState)
 {
@@ -266,7 +333,7 @@ string Sensor::set(bool state)
   {
     _lastState = state;
     LOG(INFO, "Sensor: %d :: %s", _sensorID, _lastState ? "ACTIVE" : "INACTIVE");
-    // TODO: find a way to send this out on the JMRI interface
+    esp32cs::publish_state(topic(), _sensorID, _lastState);
     return StringPrintf("<%c %d>", state ? 'Q' : 'q', _sensorID);
   }
   return COMMAND_NO_RESPONSE;
@@ -300,7 +367,7 @@ where
 **********************************************************************/
 
 DCC_PROTOCOL_COMMAND_HANDLER(SensorCommandAdapter,
-[](const vector<string> arguments)
+[](const vector<string> &arguments)
 {
   if(arguments.empty())
   {
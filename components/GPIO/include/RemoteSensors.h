@@ -50,6 +50,11 @@ public:
   virtual void check();
   std::string get_state_for_dccpp() override;
   virtual std::string toJson(bool=false) override;
+protected:
+  esp32cs::StateTopic topic() override
+  {
+    return esp32cs::TOPIC_REMOTE_SENSOR;
+  }
 private:
   uint16_t _rawID;
   uint16_t _value;
@@ -22,6 +22,8 @@ COPYRIGHT (c) 2017-2020 Mike Dunston
 #include <driver/gpio.h>
 
 #include <openlcb/RefreshLoop.hxx>
+#include <os/OS.hxx>
+#include <PersistentJournal.h>
 #include <utils/Atomic.hxx>
 #include <utils/Singleton.hxx>
 
@@ -43,6 +45,10 @@ public:
   uint16_t getIndex() {
     return _index;
   }
+protected:
+  esp32cs::StateTopic topic() override {
+    return esp32cs::TOPIC_S88;
+  }
 private:
   uint16_t _index;
 };
@@ -109,6 +115,13 @@ private:
   openlcb::RefreshLoop poller_;
   std::vector<std::unique_ptr<S88SensorBus>> buses_;
   os_thread_t taskHandle_;
+
+  /// Persistent storage of the sensor buses, keyed by bus ID.
+  PersistentJournal journal_;
+
+  /// Protects @ref journal_, this is separate from the @ref Atomic lock so
+  /// that file I/O is not done inside the critical section.
+  OSMutex journalLock_;
 };
 
 #endif // S88_SENSORS_H_
\ No newline at end of file
@@ -20,6 +20,7 @@ COPYRIGHT (c) 2017-2020 Mike Dunston
 
 #include <DCCppProtocol.h>
 #include <driver/gpio.h>
+#include <StateBus.h>
 
 DECLARE_DCC_PROTOCOL_COMMAND_CLASS(SensorCommandAdapter, "S", 0)
 
@@ -53,6 +54,11 @@ public:
   virtual std::string get_state_for_dccpp();
 protected:
   virtual std::string set(bool);
+  /// @return the @ref esp32cs::StateBus topic for changes of this sensor.
+  virtual esp32cs::StateTopic topic()
+  {
+    return esp32cs::TOPIC_SENSOR;
+  }
   void setID(uint16_t id)
   {
     _sensorID = id;
@@ -77,6 +83,9 @@ public:
   static bool remove(const uint16_t);
   static gpio_num_t getSensorPin(const uint16_t);
   static std::string get_state_for_dccpp();
+
+  /// @return the ID and current state (true for active) of all sensors.
+  static std::vector<std::pair<uint16_t, bool>> get_states();
 private:
   static TaskHandle_t _taskHandle;
   static OSMutex _lock;
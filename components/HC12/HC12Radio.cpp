@@ -78,6 +78,7 @@ StateFlowBase::Action HC12Radio::initialize()
   if (uartFd_ >= 0)
   {
     LOG(INFO, "[HC12] Initialized");
+    subscribe_state();
     return call_immediately(STATE(wait_for_data));
   }
 
@@ -99,10 +100,19 @@ StateFlowBase::Action HC12Radio::data_received()
   }
   else if (helper_.remaining_ == RX_BUF_SIZE)
   {
-    return yield_and_call(STATE(wait_for_data));
+    // no data received, send any responses from commands that completed
+    // asynchronously.
+    tx_buffer_ = take_async_response();
+    if (tx_buffer_.empty())
+    {
+      return yield_and_call(STATE(wait_for_data));
+    }
+  }
+  else
+  {
+    tx_buffer_ = std::move(feed(rx_buffer_, RX_BUF_SIZE - helper_.remaining_));
+    tx_buffer_.append(take_async_response());
   }
-
-  tx_buffer_ = std::move(feed(rx_buffer_, RX_BUF_SIZE - helper_.remaining_));
   if (tx_buffer_.length() > 0)
   {
     return write_repeated(&helper_, uartFd_, tx_buffer_.c_str()
@@ -18,18 +18,22 @@ COPYRIGHT (c) 2017-2020 Mike Dunston
 #ifndef JMRI_CLIENT_FLOW_H_
 #define JMRI_CLIENT_FLOW_H_
 
+#include <algorithm>
+#include <deque>
 #include <DCCppProtocol.h>
 #include <executor/StateFlow.hxx>
+#include <sys/socket.h>
+#include <vector>
 
 class JmriClientFlow : private StateFlowBase, public DCCPPProtocolConsumer
 {
 public:
   JmriClientFlow(int fd, uint32_t remote_ip, Service *service)
     : StateFlowBase(service), DCCPPProtocolConsumer(), fd_(fd)
-    , remoteIP_(remote_ip)
+    , remoteIP_(remote_ip), readBuf_(MIN_READ_SIZE)
+    , connectedAt_(os_get_time_monotonic()), rateStart_(connectedAt_)
   {
     LOG(INFO, "[JMRI %s] Connected", name().c_str());
-    bzero(buf_, BUFFER_SIZE);
 
     struct timeval tm;
     tm.tv_sec = 0;
@@ -37,29 +41,106 @@ public:
     ERRNOCHECK("setsockopt_timeout",
         setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tm, sizeof(tm)));
 
+    // state changes are picked up with the asynchronous responses when the
+    // read times out.
+    subscribe_state();
+
+    {
+      OSMutexLock l(&clientsLock_);
+      clients_.push_back(this);
+    }
+
     start_flow(STATE(read_data));
   }
 
   virtual ~JmriClientFlow()
   {
-    LOG(INFO, "[JMRI %s] Disconnected", name().c_str());
+    {
+      OSMutexLock l(&clientsLock_);
+      clients_.erase(std::remove(clients_.begin(), clients_.end(), this)
+                   , clients_.end());
+    }
+    LOG(INFO, "[JMRI %s] Disconnected (commands:%u, peak:%u/s, max "
+              "latency:%uus)", name().c_str(), command_count(), peakRate_
+      , (uint32_t)NSEC_TO_USEC(maxLatency_));
     ::close(fd_);
   }
+
+  // Returns json formatted statistics for all connected JMRI clients.
+  static std::string get_stats_json();
 private:
-  static const size_t BUFFER_SIZE = 128;
+  // Initial read size, the read buffer returns to this size when the client
+  // has been idle.
+  static constexpr size_t MIN_READ_SIZE = 128;
+
+  // Largest read size, the read buffer doubles up to this size each time a
+  // read fills it completely.
+  static constexpr size_t MAX_READ_SIZE = 1024;
+
+  // Number of consecutive empty reads (~10ms each) before the read buffer is
+  // reduced to MIN_READ_SIZE.
+  static constexpr uint32_t IDLE_READS_BEFORE_SHRINK = 100;
+
+  // Maximum number of responses passed to the socket in one write.
+  static constexpr size_t MAX_WRITE_RESPONSES = 8;
+
+  // Reading stops when this many response bytes are waiting for the client.
+  static constexpr size_t MAX_PENDING_BYTES = 4096;
+
+  // Response waiting to be sent to the client.
+  struct PendingResponse
+  {
+    string data;
+    // Time the request was received, zero for asynchronous responses.
+    long long received;
+  };
+
+  // Copy of the statistics that is read by get_stats_json(), this is only
+  // accessed while holding clientsLock_.
+  struct StatsSnapshot
+  {
+    uint32_t commands;
+    uint32_t rate;
+    uint32_t peakRate;
+    uint32_t rxBytes;
+    uint32_t txBytes;
+    uint32_t writes;
+    uint32_t avgLatencyUsec;
+    uint32_t maxLatencyUsec;
+    uint32_t readSize;
+    uint32_t pendingBytes;
+  };
+
+  static OSMutex clientsLock_;
+  static std::vector<JmriClientFlow *> clients_;
+
   int fd_;
   uint32_t remoteIP_;
-  uint8_t buf_[BUFFER_SIZE];
-  size_t buf_used_{0};
-  string res_;
+  std::vector<uint8_t> readBuf_;
+  uint32_t idleReads_{0};
+  std::deque<PendingResponse> pending_;
+  size_t pendingBytes_{0};
+  // Number of bytes of the first pending response that have been sent.
+  size_t sendOffset_{0};
   StateFlowTimedSelectHelper helper_{this};
 
+  // Statistics.
+  const long long connectedAt_;
+  long long rateStart_;
+  uint32_t rateCommands_{0};
+  uint32_t rate_{0};
+  uint32_t peakRate_{0};
+  uint32_t rxBytes_{0};
+  uint32_t txBytes_{0};
+  uint32_t writes_{0};
+  uint32_t responses_{0};
+  long long totalLatency_{0};
+  long long maxLatency_{0};
+  StatsSnapshot snapshot_{};
+
   Action read_data()
   {
-    // clear the buffer of data we have sent back
-    res_.clear();
-
-    return read_nonblocking(&helper_, fd_, buf_, BUFFER_SIZE
+    return read_nonblocking(&helper_, fd_, readBuf_.data(), readBuf_.size()
                           , STATE(process_data));
   }
 
@@ -69,28 +150,172 @@ private:
     {
       return delete_this();
     }
-    else if (helper_.remaining_ == BUFFER_SIZE)
+    long long now = os_get_time_monotonic();
+    size_t received = readBuf_.size() - helper_.remaining_;
+    if (received)
     {
-      return yield_and_call(STATE(read_data));
+      LOG(VERBOSE, "[JMRI %s] received %zu bytes", name().c_str(), received);
+      rxBytes_ += received;
+      idleReads_ = 0;
+      queue_response(feed(readBuf_.data(), received), now);
+      // a full read means more data is likely waiting, such as during the
+      // JMRI startup burst, so read more at once next time.
+      if (received == readBuf_.size() && readBuf_.size() < MAX_READ_SIZE)
+      {
+        readBuf_.resize(readBuf_.size() * 2);
+      }
     }
-    else
+    else if (readBuf_.size() > MIN_READ_SIZE &&
+             ++idleReads_ >= IDLE_READS_BEFORE_SHRINK)
     {
-      buf_used_ = BUFFER_SIZE - helper_.remaining_;
-      LOG(VERBOSE, "[JMRI %s] received %zu bytes", name().c_str(), buf_used_);
+      std::vector<uint8_t>(MIN_READ_SIZE).swap(readBuf_);
+      idleReads_ = 0;
     }
-    res_.append(feed(buf_, buf_used_));
-    buf_used_ = 0;
+    // responses from commands that completed asynchronously and state
+    // changes are sent along with any other responses.
+    queue_response(take_async_response(), 0);
+    update_rate(now);
     return yield_and_call(STATE(send_data));
   }
 
   Action send_data()
   {
-    if(res_.empty())
+    if (pending_.empty())
     {
       return yield_and_call(STATE(read_data));
     }
-    return write_repeated(&helper_, fd_, res_.data(), res_.length()
-                        , STATE(read_data));
+    // pass as many responses as possible to the socket in one call, the
+    // responses are referenced directly from the queue.
+    size_t count = std::min(pending_.size(), (size_t)MAX_WRITE_RESPONSES);
+    struct iovec iov[MAX_WRITE_RESPONSES];
+    size_t offset = sendOffset_;
+    size_t requested = 0;
+    for (size_t idx = 0; idx < count; idx++)
+    {
+      iov[idx].iov_base = (void *)(pending_[idx].data.data() + offset);
+      iov[idx].iov_len = pending_[idx].data.length() - offset;
+      requested += iov[idx].iov_len;
+      offset = 0;
+    }
+    struct msghdr msg;
+    bzero(&msg, sizeof(struct msghdr));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    ssize_t sent = sendmsg(fd_, &msg, MSG_DONTWAIT);
+    if (sent < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        if (pendingBytes_ >= MAX_PENDING_BYTES)
+        {
+          // stop reading until the socket can accept more data, this waits
+          // for the socket to become writable.
+          return connect_and_call(&helper_, fd_, STATE(send_data));
+        }
+        // continue reading while the client catches up.
+        return yield_and_call(STATE(read_data));
+      }
+      LOG_ERROR("[JMRI %s] write failed (%d: %s), disconnecting"
+              , name().c_str(), errno, strerror(errno));
+      return delete_this();
+    }
+    txBytes_ += sent;
+    writes_++;
+    consume_responses(sent);
+    if (!pending_.empty() && (size_t)sent == requested)
+    {
+      // more responses are queued than fit in a single write.
+      return yield_and_call(STATE(send_data));
+    }
+    return yield_and_call(STATE(read_data));
+  }
+
+  // Adds a response to the send queue.
+  void queue_response(string response, long long received)
+  {
+    if (!response.empty())
+    {
+      pendingBytes_ += response.length();
+      pending_.push_back({std::move(response), received});
+    }
+  }
+
+  // Removes the sent bytes from the send queue and records the latency of
+  // each response that has been completely sent.
+  void consume_responses(size_t sent)
+  {
+    long long now = os_get_time_monotonic();
+    pendingBytes_ -= sent;
+    while (sent && !pending_.empty())
+    {
+      size_t remaining = pending_.front().data.length() - sendOffset_;
+      if (sent < remaining)
+      {
+        sendOffset_ += sent;
+        break;
+      }
+      sent -= remaining;
+      sendOffset_ = 0;
+      if (pending_.front().received)
+      {
+        long long latency = now - pending_.front().received;
+        totalLatency_ += latency;
+        maxLatency_ = std::max(maxLatency_, latency);
+        responses_++;
+      }
+      pending_.pop_front();
+    }
+  }
+
+  // Updates the commands per second rate and the statistics snapshot once
+  // per second.
+  void update_rate(long long now)
+  {
+    if (now - rateStart_ >= SEC_TO_NSEC(1))
+    {
+      rate_ = (command_count() - rateCommands_) * SEC_TO_NSEC(1)
+            / (now - rateStart_);
+      peakRate_ = std::max(peakRate_, rate_);
+      rateCommands_ = command_count();
+      rateStart_ = now;
+      update_snapshot();
+    }
+  }
+
+  // Copies the statistics into snapshot_ for get_stats_json().
+  void update_snapshot()
+  {
+    OSMutexLock l(&clientsLock_);
+    snapshot_.commands = command_count();
+    snapshot_.rate = rate_;
+    snapshot_.peakRate = peakRate_;
+    snapshot_.rxBytes = rxBytes_;
+    snapshot_.txBytes = txBytes_;
+    snapshot_.writes = writes_;
+    snapshot_.avgLatencyUsec =
+      responses_ ? (uint32_t)NSEC_TO_USEC(totalLatency_ / responses_) : 0;
+    snapshot_.maxLatencyUsec = (uint32_t)NSEC_TO_USEC(maxLatency_);
+    snapshot_.readSize = readBuf_.size();
+    snapshot_.pendingBytes = pendingBytes_;
+  }
+
+  // Returns json formatted statistics for this client, the caller must hold
+  // clientsLock_.
+  string stats_json()
+  {
+    long long now = os_get_time_monotonic();
+    return StringPrintf("{\"ip\":\"%s\",\"fd\":%d,\"connected\":%u,"
+                        "\"commands\":%u,\"rate\":%u,\"peak_rate\":%u,"
+                        "\"avg_latency_us\":%u,\"max_latency_us\":%u,"
+                        "\"rx\":%u,\"tx\":%u,\"writes\":%u,"
+                        "\"read_size\":%u,\"pending\":%u}"
+                      , ipv4_to_string(remoteIP_).c_str(), fd_
+                      , (uint32_t)NSEC_TO_SEC(now - connectedAt_)
+                      , snapshot_.commands, snapshot_.rate
+                      , snapshot_.peakRate, snapshot_.avgLatencyUsec
+                      , snapshot_.maxLatencyUsec, snapshot_.rxBytes
+                      , snapshot_.txBytes, snapshot_.writes
+                      , snapshot_.readSize, snapshot_.pendingBytes);
   }
 
   string name()
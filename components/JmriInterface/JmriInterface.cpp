@@ -22,9 +22,34 @@ COPYRIGHT (c) 2017-2020 Mike Dunston
 #include <memory>
 #include <utils/socket_listener.hxx>
 #include "JmriClientFlow.h"
+#include "JmriInterface.h"
 
 std::unique_ptr<SocketListener> listener;
 
+OSMutex JmriClientFlow::clientsLock_;
+std::vector<JmriClientFlow *> JmriClientFlow::clients_;
+
+std::string JmriClientFlow::get_stats_json()
+{
+  OSMutexLock l(&clientsLock_);
+  string res = "[";
+  for (auto client : clients_)
+  {
+    if (res.length() > 1)
+    {
+      res += ",";
+    }
+    res += client->stats_json();
+  }
+  res += "]";
+  return res;
+}
+
+std::string get_jmri_client_stats_json()
+{
+  return JmriClientFlow::get_stats_json();
+}
+
 void init_jmri_interface()
 {
   Singleton<Esp32WiFiManager>::instance()->register_network_up_callback(
@@ -15,4 +15,9 @@ COPYRIGHT (c) 2017-2020 Mike Dunston
   along with this program.  If not, see http://www.gnu.org/licenses
 **********************************************************************/
 
-void init_jmri_interface();
\ No newline at end of file
+#include <string>
+
+void init_jmri_interface();
+
+// Returns json formatted statistics for all connected JMRI clients.
+std::string get_jmri_client_stats_json();
\ No newline at end of file
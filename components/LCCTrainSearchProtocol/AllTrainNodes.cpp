@@ -43,6 +43,7 @@
 #include <openlcb/SimpleNodeInfo.hxx>
 #include <openlcb/TractionDefs.hxx>
 #include <openlcb/TractionTrain.hxx>
+#include <StateBus.h>
 #include <utils/format_utils.hxx>
 
 #include <algorithm>
@@ -52,6 +53,107 @@ namespace commandstation
 
 using openlcb::Defs;
 using openlcb::TractionDefs;
+using openlcb::SpeedType;
+
+/// Wraps a train implementation and publishes the train state to the
+/// @ref esp32cs::StateBus whenever it is modified.
+class StatePublishingTrain : public openlcb::TrainImpl
+{
+ public:
+  /// Constructor.
+  ///
+  /// @param train is the train implementation to wrap, ownership is
+  /// transferred to this object.
+  StatePublishingTrain(openlcb::TrainImpl* train) : train_(train)
+  {
+  }
+
+  ~StatePublishingTrain()
+  {
+    delete train_;
+  }
+
+  void set_speed(SpeedType speed) override
+  {
+    train_->set_speed(speed);
+    publish();
+  }
+
+  SpeedType get_speed() override
+  {
+    return train_->get_speed();
+  }
+
+  SpeedType get_commanded_speed() override
+  {
+    return train_->get_commanded_speed();
+  }
+
+  SpeedType get_actual_speed() override
+  {
+    return train_->get_actual_speed();
+  }
+
+  void set_emergencystop() override
+  {
+    train_->set_emergencystop();
+    publish();
+  }
+
+  bool get_emergencystop() override
+  {
+    return train_->get_emergencystop();
+  }
+
+  void set_fn(uint32_t address, uint16_t value) override
+  {
+    train_->set_fn(address, value);
+    publish();
+  }
+
+  uint16_t get_fn(uint32_t address) override
+  {
+    return train_->get_fn(address);
+  }
+
+  uint32_t legacy_address() override
+  {
+    return train_->legacy_address();
+  }
+
+  dcc::TrainAddressType legacy_address_type() override
+  {
+    return train_->legacy_address_type();
+  }
+
+ private:
+  /// Highest function number included in the published state.
+  static constexpr uint32_t MAX_PUBLISHED_FN = 28;
+
+  /// Publishes the current state of the train.
+  void publish()
+  {
+    SpeedType speed = train_->get_speed();
+    uint32_t value = (uint32_t)speed.mph() & esp32cs::LOCO_STATE_SPEED_MASK;
+    if (speed.direction() == SpeedType::FORWARD) {
+      value |= esp32cs::LOCO_STATE_FORWARD;
+    }
+    if (train_->get_emergencystop()) {
+      value |= esp32cs::LOCO_STATE_ESTOP;
+    }
+    uint32_t functions = 0;
+    for (uint32_t fn = 0; fn <= MAX_PUBLISHED_FN; fn++) {
+      if (train_->get_fn(fn)) {
+        functions |= (1U << fn);
+      }
+    }
+    esp32cs::publish_state(esp32cs::TOPIC_LOCO, train_->legacy_address()
+                         , value, functions);
+  }
+
+  /// Train implementation which is being wrapped.
+  openlcb::TrainImpl* train_;
+};
 
 struct AllTrainNodes::Impl
 {
@@ -66,21 +168,31 @@ struct AllTrainNodes::Impl
   openlcb::SimpleEventHandler* eventHandler_{nullptr};
   openlcb::Node* node_{nullptr};
   openlcb::TrainImpl* train_{nullptr};
+  /// DCC or Marklin train wrapped by train_, this is owned by train_.
+  dcc::PacketSource* source_{nullptr};
 };
 
 void AllTrainNodes::remove_train_impl(int address)
 {
   OSMutexLock l(&trainsLock_);
-  auto it = std::find_if(trains_.begin(), trains_.end(), [address](Impl *impl)
+  auto ent = trainsByAddress_.find(address);
+  if (ent != trainsByAddress_.end())
   {
-    return impl->train_->legacy_address() == address;
-  });
-  if (it != trains_.end())
-  {
-    Impl *impl = (*it);
+    Impl *impl = ent->second;
+    trainsByAddress_.erase(ent);
+    trainsByNodeId_.erase(impl->node_->node_id());
+    trains_.erase(std::find(trains_.begin(), trains_.end(), impl));
     impl->node_->iface()->delete_local_node(impl->node_);
     delete impl;
-    trains_.erase(it);
+    // another drive mode may be in use for the same address.
+    for (auto *train : trains_)
+    {
+      if (train->train_->legacy_address() == address)
+      {
+        trainsByAddress_.emplace(address, train);
+        break;
+      }
+    }
   }
 }
 
@@ -98,34 +210,33 @@ openlcb::TrainImpl* AllTrainNodes::get_train_impl(DccMode drive_type, int addres
 {
   {
     OSMutexLock l(&trainsLock_);
-    auto it = std::find_if(trains_.begin(), trains_.end(), [address](Impl *impl)
-    {
-      return impl->train_->legacy_address() == address;
-    });
-    if (it != trains_.end())
+    auto it = trainsByAddress_.find(address);
+    if (it != trainsByAddress_.end())
     {
-      return (*it)->train_;
+      return it->second->train_;
     }
   }
   return find_node(allocate_node(drive_type, address))->train_;
 }
 
-AllTrainNodes::Impl* AllTrainNodes::find_node(openlcb::Node* node) 
+dcc::PacketSource* AllTrainNodes::get_packet_source(DccMode drive_type,
+                                                    int address)
 {
   {
     OSMutexLock l(&trainsLock_);
-    auto it = std::find_if(trains_.begin(), trains_.end(),
-      [node](Impl *impl)
-      {
-        return impl->node_ == node;
-      });
-    if (it != trains_.end())
+    auto it = trainsByAddress_.find(address);
+    if (it != trainsByAddress_.end())
     {
-      return *it;
+      return it->second->source_;
     }
   }
-  // no active train was found with the provided node reference, try to find
-  // one via the node-id instead.
+  return find_node(allocate_node(drive_type, address))->source_;
+}
+
+AllTrainNodes::Impl* AllTrainNodes::find_node(openlcb::Node* node) 
+{
+  // train nodes are indexed by their node id, a node reference which is not
+  // active will be matched against the db via the node id.
   if (node != nullptr && node->node_id())
   {
     return find_node(node->node_id());
@@ -137,13 +248,10 @@ AllTrainNodes::Impl* AllTrainNodes::find_node(openlcb::NodeID node_id, bool allo
 {
   {
     OSMutexLock l(&trainsLock_);
-    auto it = std::find_if(trains_.begin(), trains_.end(), [node_id](Impl *impl)
-    {
-      return impl->node_->node_id() == node_id;
-    });
-    if (it != trains_.end())
+    auto it = trainsByNodeId_.find(node_id);
+    if (it != trainsByNodeId_.end())
     {
-      return *it;
+      return it->second;
     }
   }
   if (!allocate)
@@ -618,7 +726,7 @@ AllTrainNodes::Impl* AllTrainNodes::create_impl(int train_id, DccMode mode,
   switch (mode) {
     case MARKLIN_OLD: {
       LOG(CONFIG_LCC_TSP_LOG_LEVEL, "New Marklin (old) train %d", address);
-      impl->train_ = new dcc::MMOldTrain(dcc::MMAddress(address));
+      impl->source_ = new dcc::MMOldTrain(dcc::MMAddress(address));
       break;
     }
     case MARKLIN_DEFAULT:
@@ -626,7 +734,7 @@ AllTrainNodes::Impl* AllTrainNodes::create_impl(int train_id, DccMode mode,
       /// @todo (balazs.racz) implement marklin twoaddr train drive mode.
     case MARKLIN_TWOADDR: {
       LOG(CONFIG_LCC_TSP_LOG_LEVEL, "New Marklin (new) train %d", address);
-      impl->train_ = new dcc::MMNewTrain(dcc::MMAddress(address));
+      impl->source_ = new dcc::MMNewTrain(dcc::MMAddress(address));
       break;
     }
       /// @todo (balazs.racz) implement dcc 14 train drive mode.
@@ -636,9 +744,9 @@ AllTrainNodes::Impl* AllTrainNodes::create_impl(int train_id, DccMode mode,
     case DCC_28_LONG_ADDRESS: {
       LOG(CONFIG_LCC_TSP_LOG_LEVEL, "New DCC-14/28 train %d", address);
       if ((mode & DCC_LONG_ADDRESS) || address >= 128) {
-        impl->train_ = new dcc::Dcc28Train(dcc::DccLongAddress(address));
+        impl->source_ = new dcc::Dcc28Train(dcc::DccLongAddress(address));
       } else {
-        impl->train_ = new dcc::Dcc28Train(dcc::DccShortAddress(address));
+        impl->source_ = new dcc::Dcc28Train(dcc::DccShortAddress(address));
       }
       break;
     }
@@ -646,26 +754,29 @@ AllTrainNodes::Impl* AllTrainNodes::create_impl(int train_id, DccMode mode,
     case DCC_128_LONG_ADDRESS: {
       LOG(CONFIG_LCC_TSP_LOG_LEVEL, "New DCC-128 train %d", address);
       if ((mode & DCC_LONG_ADDRESS) || address >= 128) {
-        impl->train_ = new dcc::Dcc128Train(dcc::DccLongAddress(address));
+        impl->source_ = new dcc::Dcc128Train(dcc::DccLongAddress(address));
       } else {
-        impl->train_ = new dcc::Dcc128Train(dcc::DccShortAddress(address));
+        impl->source_ = new dcc::Dcc128Train(dcc::DccShortAddress(address));
       }
       break;
     }
     default:
-      impl->train_ = nullptr;
+      impl->source_ = nullptr;
       LOG_ERROR("Unhandled train drive mode.");
   }
-  if (impl->train_) {
-    {
-      OSMutexLock l(&trainsLock_);
-      trains_.push_back(impl);
-    }
+  if (impl->source_) {
+    impl->train_ = new StatePublishingTrain(impl->source_);
     impl->node_ =
         new openlcb::TrainNodeForProxy(tractionService_, impl->train_);
     impl->eventHandler_ =
         new openlcb::FixedEventProducer<openlcb::TractionDefs::IS_TRAIN_EVENT>(
             impl->node_);
+    {
+      OSMutexLock l(&trainsLock_);
+      trains_.push_back(impl);
+      trainsByNodeId_.emplace(impl->node_->node_id(), impl);
+      trainsByAddress_.emplace(address, impl);
+    }
     return impl;
   } else {
     delete impl;
@@ -678,6 +789,11 @@ size_t AllTrainNodes::size()
   return std::max(trains_.size(), db_->size());
 }
 
+uint32_t AllTrainNodes::db_generation()
+{
+  return db_->generation();
+}
+
 bool AllTrainNodes::is_valid_train_node(openlcb::Node *node)
 {
   return find_node(node) != nullptr;
@@ -0,0 +1,146 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "TrainSearchIndex.hxx"
+
+#include "AllTrainNodes.hxx"
+#include "FindProtocolDefs.hxx"
+
+#include <algorithm>
+#include <openlcb/TractionDefs.hxx>
+#include <utils/logging.h>
+
+namespace commandstation
+{
+
+static inline bool is_digit(char c)
+{
+  return c >= '0' && c <= '9';
+}
+
+void TrainSearchIndex::find(openlcb::EventId event
+                          , std::vector<unsigned> *results)
+{
+  refresh();
+  results->clear();
+  std::vector<unsigned> candidates;
+  // collect the digits of the query in the order they were entered, the
+  // non-digit nibbles are ignored in the same way as the name matching.
+  std::string query;
+  for (int shift = FindProtocolDefs::TRAIN_FIND_MASK - 4;
+       shift >= FindProtocolDefs::TRAIN_FIND_MASK_LOW; shift -= 4)
+  {
+    uint8_t nibble = (event >> shift) & 0xf;
+    if (nibble <= 9)
+    {
+      query.push_back('0' + nibble);
+    }
+  }
+  if (event == openlcb::TractionDefs::IS_TRAIN_EVENT || query.empty())
+  {
+    // every entry is a candidate for an empty search or a query which has
+    // no digits.
+    for (unsigned id = 0; id < entries_.size(); id++)
+    {
+      candidates.push_back(id);
+    }
+  }
+  else
+  {
+    // the address is compared numerically so leading zeros are dropped.
+    DccMode mode;
+    add_candidates(
+      std::to_string(FindProtocolDefs::query_to_address(event, &mode))
+    , &candidates);
+    add_candidates(query, &candidates);
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end())
+                   , candidates.end());
+  }
+  for (unsigned id : candidates)
+  {
+    if (entries_[id] &&
+        FindProtocolDefs::match_query_to_node(event, entries_[id].get()))
+    {
+      results->push_back(id);
+    }
+  }
+  LOG(VERBOSE, "[TrainSearch] %zu candidates, %zu matches", candidates.size()
+    , results->size());
+}
+
+void TrainSearchIndex::refresh()
+{
+  uint32_t generation = nodes_->db_generation();
+  size_t size = nodes_->size();
+  if (valid_ && generation == generation_ && size == size_)
+  {
+    return;
+  }
+  entries_.clear();
+  keys_.clear();
+  for (unsigned id = 0; id < size; id++)
+  {
+    auto entry = nodes_->get_traindb_entry(id);
+    entries_.push_back(entry);
+    if (!entry)
+    {
+      continue;
+    }
+    keys_.push_back({std::to_string(entry->get_legacy_address()), id});
+    // the query digits may start at any group of digits in the name and
+    // continue across the non-digit characters that follow it.
+    std::string name = entry->get_train_name();
+    std::string digits;
+    std::vector<size_t> starts;
+    for (size_t pos = 0; pos < name.size(); pos++)
+    {
+      if (is_digit(name[pos]))
+      {
+        if (pos == 0 || !is_digit(name[pos - 1]))
+        {
+          starts.push_back(digits.size());
+        }
+        digits.push_back(name[pos]);
+      }
+    }
+    for (size_t start : starts)
+    {
+      keys_.push_back({digits.substr(start), id});
+    }
+  }
+  std::sort(keys_.begin(), keys_.end());
+  generation_ = generation;
+  size_ = size;
+  valid_ = true;
+  LOG(VERBOSE, "[TrainSearch] Indexed %zu entries with %zu keys"
+    , entries_.size(), keys_.size());
+}
+
+void TrainSearchIndex::add_candidates(const std::string &digits
+                                    , std::vector<unsigned> *candidates)
+{
+  Key search{digits, 0};
+  for (auto it = std::lower_bound(keys_.begin(), keys_.end(), search);
+       it != keys_.end() && !it->digits.compare(0, digits.size(), digits);
+       ++it)
+  {
+    candidates->push_back(it->id);
+  }
+}
+
+} // namespace commandstation
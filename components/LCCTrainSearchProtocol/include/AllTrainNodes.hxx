@@ -35,6 +35,7 @@
 #ifndef _BRACZ_COMMANDSTATION_ALLTRAINNODES_HXX_
 #define _BRACZ_COMMANDSTATION_ALLTRAINNODES_HXX_
 
+#include <map>
 #include <memory>
 #include <vector>
 
@@ -52,6 +53,11 @@ class MemoryConfigHandler;
 class IncomingMessageStateFlow;
 }
 
+namespace dcc
+{
+class PacketSource;
+}
+
 namespace commandstation
 {
 class FindProtocolServer;
@@ -76,6 +82,13 @@ class AllTrainNodes : public Singleton<AllTrainNodes>
   /// @param address is the legacy address of the loco to find or create.
   openlcb::TrainImpl* get_train_impl(DccMode drive_type, int address);
 
+  /// Finds or creates the packet source for the requested address and
+  /// drive_type. The TrainImpl returned by get_train_impl wraps this object,
+  /// the packet source must be used for the refresh loop registration.
+  /// @param drive_type is the drive type for the loco to create if it doesn't exist.
+  /// @param address is the legacy address of the loco to find or create.
+  dcc::PacketSource* get_packet_source(DccMode drive_type, int address);
+
   /// Returns a traindb entry or nullptr if the id is too high.
   std::shared_ptr<TrainDbEntry> get_traindb_entry(int id);
 
@@ -91,6 +104,9 @@ class AllTrainNodes : public Singleton<AllTrainNodes>
   /// Return the maximum number of locomotives currently being serviced.
   size_t size();
 
+  /// @return a counter that changes whenever the train db entries change.
+  uint32_t db_generation();
+
   /// @return true if the provided node is a known/active train.
   bool is_valid_train_node(openlcb::Node *node);
   
@@ -120,8 +136,14 @@ class AllTrainNodes : public Singleton<AllTrainNodes>
 
   /// All train nodes that we know about.
   std::vector<Impl*> trains_;
+
+  /// Index of trains_ by the node ID of the train node.
+  std::map<openlcb::NodeID, Impl*> trainsByNodeId_;
+
+  /// Index of trains_ by the legacy address of the train.
+  std::map<int, Impl*> trainsByAddress_;
   
-  /// Lock to protect trains_.
+  /// Lock to protect trains_, trainsByNodeId_ and trainsByAddress_.
   OSMutex trainsLock_;
 
   friend class FindProtocolServer;
@@ -37,6 +37,7 @@
 
 #include "FindProtocolDefs.hxx"
 #include "AllTrainNodes.hxx"
+#include "TrainSearchIndex.hxx"
 #include <openlcb/EventHandlerTemplates.hxx>
 #include <openlcb/TractionTrain.hxx>
 
@@ -130,7 +131,8 @@ class FindProtocolServer : public openlcb::SimpleEventHandler {
    public:
     FindProtocolFlow(FindProtocolServer *parent)
         : StateFlow(parent->parent_->tractionService_), parent_(parent)
-        , tractionService_(parent->parent_->tractionService_) {}
+        , tractionService_(parent->parent_->tractionService_)
+        , index_(parent->parent_) {}
 
     Action entry() override {
       eventId_ = message()->data()->event_;
@@ -142,66 +144,62 @@ class FindProtocolServer : public openlcb::SimpleEventHandler {
           return exit();
         }
         parent_->pendingGlobalIdentify_ = false;
+        matches_.clear();
+        for (unsigned id = 0; id < nodes()->size(); id++) {
+          matches_.push_back(id);
+        }
+      } else {
+        // All matches are found in a single pass over the search index.
+        index_.find(eventId_, &matches_);
       }
-      LOG(VERBOSE, "starting iteration");
-      nextTrainId_ = 0;
-      hasMatches_ = false;
+      LOG(VERBOSE, "starting iteration, %zu matches", matches_.size());
+      nextMatch_ = 0;
+      hasMatches_ = !matches_.empty();
+      // The responses are sent back-to-back and the barrier completes once
+      // all of them have been looped back.
+      bn_.reset(this);
       return call_immediately(STATE(iterate));
     }
 
     Action iterate() {
-      LOG(VERBOSE, "iterate nextTrainId: %d", nextTrainId_);
-      if (nextTrainId_ >= nodes()->size()) {
-        return call_immediately(STATE(iteration_done));
-      }
-      if (eventId_ == REQUEST_GLOBAL_IDENTIFY) {
-        if (parent_->pendingGlobalIdentify_) {
-          LOG(VERBOSE, "restart iteration (new event)");
-          // Another notification arrived. Start iteration from 0.
-          nextTrainId_ = 0;
-          parent_->pendingGlobalIdentify_ = false;
-          return again();
-        }
-        return allocate_and_call(
-            tractionService_->iface()->global_message_write_flow(),
-            STATE(send_response));
+      LOG(VERBOSE, "iterate nextMatch: %zu", nextMatch_);
+      if (eventId_ == REQUEST_GLOBAL_IDENTIFY &&
+          parent_->pendingGlobalIdentify_) {
+        LOG(VERBOSE, "restart iteration (new event)");
+        // Another notification arrived. Start iteration from 0.
+        nextMatch_ = 0;
+        parent_->pendingGlobalIdentify_ = false;
       }
-      auto db_entry = nodes()->get_traindb_entry(nextTrainId_);
-      if (!db_entry) return call_immediately(STATE(next_iterate));
-      if (FindProtocolDefs::match_query_to_node(eventId_, db_entry.get())) {
-        LOG(VERBOSE, "found match %s / %s", uint64_to_string_hex(eventId_).c_str(), uint64_to_string_hex(db_entry->get_traction_node()).c_str());
-        hasMatches_ = true;
-        return allocate_and_call(
-            tractionService_->iface()->global_message_write_flow(),
-            STATE(send_response));
+      if (nextMatch_ >= matches_.size()) {
+        bn_.notify();
+        return wait_and_call(STATE(iteration_done));
       }
-      return yield_and_call(STATE(next_iterate));
+      return allocate_and_call(
+          tractionService_->iface()->global_message_write_flow(),
+          STATE(send_response));
     }
 
     Action send_response() {
       auto *b = get_allocation_result(
           tractionService_->iface()->global_message_write_flow());
-      b->set_done(bn_.reset(this));
+      b->set_done(bn_.new_child());
+      openlcb::NodeID train = nodes()->get_train_node_id(matches_[nextMatch_]);
       if (eventId_ == REQUEST_GLOBAL_IDENTIFY) {
         b->data()->reset(
-            openlcb::Defs::MTI_PRODUCER_IDENTIFIED_RANGE,
-            nodes()->get_train_node_id(nextTrainId_),
+            openlcb::Defs::MTI_PRODUCER_IDENTIFIED_RANGE, train,
             openlcb::eventid_to_buffer(FindProtocolDefs::TRAIN_FIND_BASE));
       } else {
-        b->data()->reset(openlcb::Defs::MTI_PRODUCER_IDENTIFIED_VALID,
-                         nodes()->get_train_node_id(nextTrainId_),
+        LOG(VERBOSE, "found match %s / %s",
+            uint64_to_string_hex(eventId_).c_str(),
+            uint64_to_string_hex(train).c_str());
+        b->data()->reset(openlcb::Defs::MTI_PRODUCER_IDENTIFIED_VALID, train,
                          openlcb::eventid_to_buffer(eventId_));
       }
       b->data()->set_flag_dst(openlcb::GenMessage::WAIT_FOR_LOCAL_LOOPBACK);
       parent_->parent_->tractionService_->iface()
           ->global_message_write_flow()
           ->send(b);
-
-      return wait_and_call(STATE(next_iterate));
-    }
-
-    Action next_iterate() {
-      ++nextTrainId_;
+      ++nextMatch_;
       return call_immediately(STATE(iterate));
     }
 
@@ -260,10 +258,13 @@ class FindProtocolServer : public openlcb::SimpleEventHandler {
     openlcb::TrainService* tractionService_;
 
     openlcb::EventId eventId_;
-    union {
-      unsigned nextTrainId_;
-      openlcb::NodeID newNodeId_;
-    };
+    /// Index of the next entry in matches_ to respond for.
+    size_t nextMatch_;
+    openlcb::NodeID newNodeId_;
+    /// Train IDs to send a response for.
+    std::vector<unsigned> matches_;
+    /// Search index of the train db entries.
+    TrainSearchIndex index_;
     BarrierNotifiable bn_;
     bool hasMatches_;
     StateFlowTimer timer_{this};
@@ -117,6 +117,11 @@ class TrainDb
    * @param mode the operating mode for the new locomotive.
    * @returns the new train_id for the given entry. */
   virtual unsigned add_dynamic_entry(uint16_t address, DccMode mode) = 0;
+
+  /** @returns a counter that changes whenever an entry is added, removed or
+   * has its name, address or drive mode changed. This is used to detect when
+   * data derived from the entries needs to be regenerated. */
+  virtual uint32_t generation() { return 0; }
 };
 
 }  // namespace commandstation
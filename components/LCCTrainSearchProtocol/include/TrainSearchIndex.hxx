@@ -0,0 +1,107 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef _COMMANDSTATION_TRAINSEARCHINDEX_HXX_
+#define _COMMANDSTATION_TRAINSEARCHINDEX_HXX_
+
+#include "TrainDb.hxx"
+
+#include <memory>
+#include <openlcb/EventHandler.hxx>
+#include <string>
+#include <vector>
+
+namespace commandstation
+{
+
+class AllTrainNodes;
+
+/// Search index for the train search protocol.
+///
+/// Every train db entry is indexed by the decimal digits of its address and
+/// by the digits of its name starting at each group of digits in the name,
+/// the keys are kept sorted so that all entries starting with the digits of
+/// a query are found with a single binary search. The candidates are then
+/// confirmed with @ref FindProtocolDefs::match_query_to_node so the results
+/// are identical to comparing the query against every entry.
+///
+/// The index is regenerated on the next search after the train db changes.
+/// This class is not thread safe, it is intended to be used only from the
+/// executor of the train search flow.
+class TrainSearchIndex
+{
+public:
+  /// Constructor.
+  ///
+  /// @param nodes is the source of the train db entries.
+  TrainSearchIndex(AllTrainNodes *nodes) : nodes_(nodes)
+  {
+  }
+
+  /// Finds all train db entries which match a search query.
+  ///
+  /// @param event is the train search query.
+  /// @param results will receive the train IDs of the matching entries in
+  /// ascending order.
+  void find(openlcb::EventId event, std::vector<unsigned> *results);
+
+private:
+  /// Index key for a train db entry.
+  struct Key
+  {
+    /// Digits of the address or of the name starting from a group of
+    /// digits.
+    std::string digits;
+
+    /// Train ID of the entry.
+    unsigned id;
+
+    bool operator<(const Key &other) const
+    {
+      return digits < other.digits;
+    }
+  };
+
+  /// Regenerates the index if the train db has changed.
+  void refresh();
+
+  /// Adds the IDs of all keys starting with the provided digits.
+  void add_candidates(const std::string &digits
+                    , std::vector<unsigned> *candidates);
+
+  /// Source of the train db entries.
+  AllTrainNodes *nodes_;
+
+  /// Train db entries by train ID, empty entries are not known to the db.
+  std::vector<std::shared_ptr<TrainDbEntry>> entries_;
+
+  /// Sorted index keys.
+  std::vector<Key> keys_;
+
+  /// Train db generation the index was created from.
+  uint32_t generation_{0};
+
+  /// Number of train IDs the index was created from.
+  size_t size_{0};
+
+  /// True once the index has been created.
+  bool valid_{false};
+};
+
+} // namespace commandstation
+
+#endif // _COMMANDSTATION_TRAINSEARCHINDEX_HXX_
@@ -0,0 +1,122 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#include "StateBus.h"
+
+#include <algorithm>
+#include <executor/Executable.hxx>
+#include <utils/StringPrintf.hxx>
+
+namespace esp32cs
+{
+
+StateBus::StateBus(ExecutorBase *executor) : executor_(executor)
+{
+}
+
+uint32_t StateBus::subscribe(uint32_t topics, Subscriber subscriber)
+{
+  OSMutexLock l(&lock_);
+  uint32_t id = nextId_++;
+  subscribers_.emplace_back(
+    new Subscription{id, topics, std::move(subscriber)});
+  return id;
+}
+
+void StateBus::unsubscribe(uint32_t id)
+{
+  OSMutexLock l(&lock_);
+  subscribers_.erase(
+    std::remove_if(subscribers_.begin(), subscribers_.end()
+                 , [id](const std::shared_ptr<Subscription> &sub)
+                   {
+                     return sub->id == id;
+                   })
+  , subscribers_.end());
+}
+
+void StateBus::publish(StateTopic topic, uint16_t id, uint32_t value
+                     , uint32_t aux)
+{
+  OSMutexLock l(&lock_);
+  published_++;
+  for (auto &change : pending_)
+  {
+    if (change.topic == topic && change.id == id)
+    {
+      change.value = value;
+      change.aux = aux;
+      coalesced_++;
+      return;
+    }
+  }
+  pending_.push_back({topic, id, value, aux});
+  // only the first pending change schedules the delivery, any further
+  // changes will be picked up by it.
+  if (pending_.size() == 1)
+  {
+    executor_->add(new CallbackExecutable([this]()
+    {
+      deliver();
+    }));
+  }
+}
+
+std::string StateBus::get_stats_json()
+{
+  OSMutexLock l(&lock_);
+  return StringPrintf("{\"subscribers\":%zu,\"published\":%u,"
+                      "\"coalesced\":%u,\"batches\":%u,\"pending\":%zu}"
+                    , subscribers_.size(), published_, coalesced_
+                    , batches_, pending_.size());
+}
+
+void StateBus::deliver()
+{
+  {
+    OSMutexLock l(&lock_);
+    delivering_.swap(pending_);
+    targets_ = subscribers_;
+    batches_++;
+  }
+  // subscribers are invoked without holding the lock so that they can
+  // publish changes or unsubscribe.
+  for (auto &target : targets_)
+  {
+    if ((target->topics & ALL_STATE_TOPICS) == ALL_STATE_TOPICS)
+    {
+      target->callback(delivering_);
+      continue;
+    }
+    filtered_.clear();
+    for (const auto &change : delivering_)
+    {
+      if (target->topics & topic_bit(change.topic))
+      {
+        filtered_.push_back(change);
+      }
+    }
+    if (!filtered_.empty())
+    {
+      target->callback(filtered_);
+    }
+  }
+  targets_.clear();
+  delivering_.clear();
+}
+
+} // namespace esp32cs
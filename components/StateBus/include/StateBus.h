@@ -0,0 +1,231 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef STATE_BUS_H_
+#define STATE_BUS_H_
+
+#include <executor/Executor.hxx>
+#include <functional>
+#include <memory>
+#include <os/OS.hxx>
+#include <stdint.h>
+#include <string>
+#include <utils/Singleton.hxx>
+#include <vector>
+
+namespace esp32cs
+{
+
+/// Categories of state changes which are published to the @ref StateBus.
+enum StateTopic : uint8_t
+{
+  /// Turnout state, the id is the accessory address, the value is one when
+  /// the turnout is thrown and the aux value is the DCC++ turnout id.
+  TOPIC_TURNOUT,
+
+  /// GPIO sensor state, the id is the sensor id and the value is one when
+  /// the sensor is active.
+  TOPIC_SENSOR,
+
+  /// S88 sensor state, the id is the sensor id and the value is one when the
+  /// sensor is active.
+  TOPIC_S88,
+
+  /// Remote sensor state, the id is the sensor id and the value is one when
+  /// the sensor is active.
+  TOPIC_REMOTE_SENSOR,
+
+  /// Track output state, the id is zero for the OPS track and one for the
+  /// PROG track, the value is one of @ref TrackState.
+  TOPIC_TRACK,
+
+  /// Locomotive state, the id is the locomotive address, the value is the
+  /// speed step combined with @ref LOCO_STATE_FORWARD and
+  /// @ref LOCO_STATE_ESTOP and the aux value has bit N set when function N
+  /// is on.
+  TOPIC_LOCO,
+
+  /// Number of topics, this must be the last entry.
+  MAX_STATE_TOPICS
+};
+
+/// @return the subscription filter bit for a topic.
+///
+/// @param topic is the topic to convert.
+static constexpr uint32_t topic_bit(StateTopic topic)
+{
+  return 1U << topic;
+}
+
+/// Subscription filter that matches every topic.
+static constexpr uint32_t ALL_STATE_TOPICS = (1U << MAX_STATE_TOPICS) - 1;
+
+/// Values used for @ref TOPIC_TRACK changes.
+enum TrackState : uint8_t
+{
+  TRACK_OFF,
+  TRACK_ON,
+  TRACK_OVERCURRENT,
+  TRACK_SHUTDOWN,
+};
+
+/// Mask for the speed step in a @ref TOPIC_LOCO value.
+static constexpr uint32_t LOCO_STATE_SPEED_MASK = 0xFF;
+
+/// Set in a @ref TOPIC_LOCO value when the locomotive is moving forward.
+static constexpr uint32_t LOCO_STATE_FORWARD = 0x100;
+
+/// Set in a @ref TOPIC_LOCO value when the locomotive is in emergency stop.
+static constexpr uint32_t LOCO_STATE_ESTOP = 0x200;
+
+/// Single state change delivered by the @ref StateBus.
+struct StateChange
+{
+  /// Category of the change.
+  StateTopic topic;
+
+  /// Identifier of the object that changed, see @ref StateTopic.
+  uint16_t id;
+
+  /// New state of the object, see @ref StateTopic.
+  uint32_t value;
+
+  /// Additional state of the object, see @ref StateTopic.
+  uint32_t aux;
+};
+
+/// Central change notification service for turnouts, sensors, track outputs
+/// and locomotives.
+///
+/// Publishers call @ref publish whenever the state of an object changes, this
+/// only records the change and can be called from any thread. The first
+/// change recorded after a delivery schedules the next delivery on the
+/// executor, any further changes to the same object before then replace the
+/// pending change so that subscribers only receive the latest state. Each
+/// subscriber receives the changes matching its topic filter as a single
+/// batch.
+class StateBus : public Singleton<StateBus>
+{
+public:
+  /// Callback which receives a batch of changes, this is called on the
+  /// executor of the @ref StateBus.
+  typedef std::function<void(const std::vector<StateChange> &)> Subscriber;
+
+  /// Constructor.
+  ///
+  /// @param executor is the executor used to deliver the changes.
+  StateBus(ExecutorBase *executor);
+
+  /// Registers a subscriber.
+  ///
+  /// @param topics is the combination of @ref topic_bit for the topics the
+  /// subscriber should receive.
+  /// @param subscriber is the callback to invoke.
+  ///
+  /// @return subscription id to use with @ref unsubscribe.
+  uint32_t subscribe(uint32_t topics, Subscriber subscriber);
+
+  /// Removes a subscriber.
+  ///
+  /// NOTE: A delivery which is already in progress on the executor may still
+  /// invoke the callback, it should not capture objects which are destroyed
+  /// after this call returns.
+  ///
+  /// @param id is the id returned by @ref subscribe.
+  void unsubscribe(uint32_t id);
+
+  /// Records a state change.
+  ///
+  /// @param topic is the category of the change.
+  /// @param id is the identifier of the object that changed.
+  /// @param value is the new state of the object.
+  /// @param aux is the additional state of the object.
+  void publish(StateTopic topic, uint16_t id, uint32_t value
+             , uint32_t aux = 0);
+
+  /// @return json formatted string containing the bus statistics.
+  std::string get_stats_json();
+
+private:
+  /// Registered subscriber.
+  struct Subscription
+  {
+    /// Subscription id.
+    uint32_t id;
+
+    /// Topic filter.
+    uint32_t topics;
+
+    /// Callback to invoke.
+    Subscriber callback;
+  };
+
+  /// Delivers the pending changes to the subscribers.
+  void deliver();
+
+  /// Executor used to deliver the changes.
+  ExecutorBase *executor_;
+
+  /// Protects @ref pending_ and @ref subscribers_.
+  OSMutex lock_;
+
+  /// Changes which have not been delivered yet, at most one per object.
+  std::vector<StateChange> pending_;
+
+  /// Registered subscribers.
+  std::vector<std::shared_ptr<Subscription>> subscribers_;
+
+  /// Changes being delivered, only used on the executor.
+  std::vector<StateChange> delivering_;
+
+  /// Changes matching a single subscriber, only used on the executor.
+  std::vector<StateChange> filtered_;
+
+  /// Subscribers being delivered to, only used on the executor.
+  std::vector<std::shared_ptr<Subscription>> targets_;
+
+  /// Id to assign to the next subscriber.
+  uint32_t nextId_{1};
+
+  /// Number of changes published.
+  uint32_t published_{0};
+
+  /// Number of changes replaced by a newer change before delivery.
+  uint32_t coalesced_{0};
+
+  /// Number of batches delivered.
+  uint32_t batches_{0};
+};
+
+/// Publishes a state change if the @ref StateBus has been created.
+///
+/// @param topic is the category of the change.
+/// @param id is the identifier of the object that changed.
+/// @param value is the new state of the object.
+/// @param aux is the additional state of the object.
+static inline void publish_state(StateTopic topic, uint16_t id
+                               , uint32_t value, uint32_t aux = 0)
+{
+  if (Singleton<StateBus>::exists())
+  {
+    Singleton<StateBus>::instance()->publish(topic, id, value, aux);
+  }
+}
+
+} // namespace esp32cs
+
+#endif // STATE_BUS_H_
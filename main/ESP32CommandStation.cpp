@@ -22,9 +22,9 @@ COPYRIGHT (c) 2017-2020 Mike Dunston
 
 #include <AllTrainNodes.hxx>
 #include <ConfigurationManager.h>
+#include <Consists.h>
 #include <dcc/ProgrammingTrackBackend.hxx>
 #include <dcc/RailcomHub.hxx>
-#include <dcc/SimpleUpdateLoop.hxx>
 #include <DCCSignalVFS.h>
 #include <driver/uart.h>
 #include <DuplexedTrackIf.h>
@@ -42,6 +42,9 @@ COPYRIGHT (c) 2017-2020 Mike Dunston
 #include <nvs_flash.h>
 #include <openlcb/SimpleInfoProtocol.hxx>
 #include <os/MDNS.hxx>
+#include <PriorityUpdateLoop.h>
+#include <RailComOccupancy.h>
+#include <StateBus.h>
 #include <StatusDisplay.h>
 #include <StatusLED.h>
 #include <Turnouts.h>
@@ -126,6 +129,12 @@ std::unique_ptr<openlcb::SimpleStackBase> lccStack;
 // and will be removed later.
 static constexpr esp32cs::Esp32ConfigDef cfg(0);
 
+#if CONFIG_OPS_RAILCOM
+// Websocket coalesce key prefix for RailCom detection updates, the lower 16
+// bits are the locomotive address.
+static constexpr uint32_t RAILCOM_COALESCE_KEY = 0x52430000;
+#endif // CONFIG_OPS_RAILCOM
+
 // define the SNIP data for the Command Station.
 namespace openlcb
 {
@@ -239,6 +248,10 @@ extern "C" void app_main()
 
   esp32cs::LCCStackManager stackManager(cfg);
 
+  // Initialize the state change bus, this must be created before any of the
+  // modules which publish or subscribe to state changes.
+  esp32cs::StateBus stateBus(stackManager.stack()->executor());
+
   esp32cs::LCCWiFiManager wifiManager(stackManager.stack(), cfg);
   
   // Initialize the Http server and mDNS instance
@@ -308,6 +321,24 @@ extern "C" void app_main()
                       , cfg.seg().hbridge().entry(esp32cs::OPS_CDI_TRACK_OUTPUT_IDX)
                       , cfg.seg().hbridge().entry(esp32cs::PROG_CDI_TRACK_OUTPUT_IDX));
 
+#if CONFIG_OPS_RAILCOM
+  // Push RailCom locomotive detection changes to all websocket clients.
+  Singleton<esp32cs::RailComOccupancy>::instance()->subscribe(
+    [](uint16_t address, bool long_address, bool present)
+    {
+      std::string update =
+        StringPrintf("{\"railcom\":{\"address\":%d,\"long\":%s,"
+                     "\"present\":%s}}", address
+                   , long_address ? "true" : "false"
+                   , present ? "true" : "false");
+      // Only the latest state for an address needs to reach a slow client.
+      Singleton<http::Httpd>::instance()->broadcast_websocket(
+        std::make_shared<const http::WebSocketMessage>(
+          update, RAILCOM_COALESCE_KEY |
+                  esp32cs::RailComLocoTracker::key(address, long_address)));
+    });
+#endif // CONFIG_OPS_RAILCOM
+
   int ops_track = ::open(
     StringPrintf("/dev/track/%s", CONFIG_OPS_TRACK_NAME).c_str(), O_WRONLY);
   HASSERT(ops_track > 0);
@@ -319,10 +350,11 @@ extern "C" void app_main()
   // Initialize Local Track inteface.
   esp32cs::DuplexedTrackIf track(stackManager.service()
                                , CONFIG_DCC_PACKET_POOL_SIZE
+                               , CONFIG_DCC_PROG_PACKET_POOL_SIZE
                                , ops_track, prog_track);
 
   // Initialize the DCC Update Loop.
-  dcc::SimpleUpdateLoop dccUpdateLoop(stackManager.service(), &track);
+  esp32cs::PriorityUpdateLoop dccUpdateLoop(stackManager.service(), &track);
 
   // Attach the DCC update loop to the track interface
   PoolToQueueFlow<Buffer<dcc::Packet>> dccPacketFlow(stackManager.service()
@@ -351,6 +383,10 @@ extern "C" void app_main()
                                          , trainDb.get_train_cdi()
                                          , trainDb.get_temp_train_cdi());
 
+  // Initialize the command station consist manager, this fans out speed and
+  // function updates to all locomotives in a consist.
+  esp32cs::ConsistManager consistManager(stackManager.service());
+
   // Task Monitor, periodically dumps runtime state to STDOUT.
   LOG(VERBOSE, "Starting FreeRTOS Task Monitor");
   FreeRTOSTaskMonitor taskMon(stackManager.service());
@@ -211,7 +211,90 @@ void Esp32TrainDbEntry::recalcuate_max_fn()
 
 static constexpr const char * TRAIN_DB_JSON_FILE = "trains.json";
 
+static constexpr const char * TRAIN_DB_JOURNAL = "trains";
+
+/// Fixed portion of the journal payload for a roster entry, it is followed by
+/// @ref fn_count function labels and the remainder of the payload is the
+/// name.
+struct TrainRecordHeader
+{
+  /// Layout version of this record, @ref TRAIN_RECORD_VERSION.
+  uint8_t version;
+  uint8_t mode;
+  uint8_t flags;
+  uint8_t fn_count;
+
+  /// Insertion ordinal of the entry, the journal replays in address order so
+  /// this is used to restore the roster indexes. Deleted entries leave gaps
+  /// which are ignored.
+  uint32_t ordinal;
+};
+
+/// Current version of @ref TrainRecordHeader.
+static constexpr uint8_t TRAIN_RECORD_VERSION = 1;
+
+/// @ref TrainRecordHeader::flags bit for automatic idle.
+static constexpr uint8_t TRAIN_RECORD_AUTO_IDLE = 0x01;
+
+/// @ref TrainRecordHeader::flags bit for show on limited throttles.
+static constexpr uint8_t TRAIN_RECORD_LIMITED_THROTTLE = 0x02;
+
+// converts a Esp32PersistentTrainData to a journal payload
+static string encode_train_record(const Esp32PersistentTrainData &data
+                                , uint32_t ordinal)
+{
+  TrainRecordHeader header =
+  {
+    .version = TRAIN_RECORD_VERSION,
+    .mode = data.mode,
+    .flags = (uint8_t)(
+      (data.automatic_idle ? TRAIN_RECORD_AUTO_IDLE : 0) |
+      (data.show_on_limited_throttles ? TRAIN_RECORD_LIMITED_THROTTLE : 0)),
+    .fn_count = (uint8_t)std::min(data.functions.size(), (size_t)UINT8_MAX),
+    .ordinal = ordinal
+  };
+  string payload(reinterpret_cast<const char *>(&header)
+               , sizeof(TrainRecordHeader));
+  payload.append(data.functions.begin()
+               , data.functions.begin() + header.fn_count);
+  payload.append(data.name);
+  return payload;
+}
+
+// converts a journal payload to a Esp32PersistentTrainData object
+static bool decode_train_record(uint32_t address, const string &payload
+                              , Esp32PersistentTrainData &data
+                              , uint32_t &ordinal)
+{
+  TrainRecordHeader header;
+  if (payload.length() < sizeof(TrainRecordHeader) || address > UINT16_MAX)
+  {
+    return false;
+  }
+  memcpy(&header, payload.data(), sizeof(TrainRecordHeader));
+  if (header.version != TRAIN_RECORD_VERSION)
+  {
+    return false;
+  }
+  size_t name_offset = sizeof(TrainRecordHeader) + header.fn_count;
+  if (payload.length() < name_offset)
+  {
+    return false;
+  }
+  ordinal = header.ordinal;
+  data.address = address;
+  data.mode = header.mode;
+  data.automatic_idle = header.flags & TRAIN_RECORD_AUTO_IDLE;
+  data.show_on_limited_throttles =
+    header.flags & TRAIN_RECORD_LIMITED_THROTTLE;
+  data.functions.assign(payload.begin() + sizeof(TrainRecordHeader)
+                      , payload.begin() + name_offset);
+  data.name.assign(payload, name_offset, string::npos);
+  return true;
+}
+
 Esp32TrainDatabase::Esp32TrainDatabase(openlcb::SimpleStackBase *stack)
+  : stack_(stack), journal_(TRAIN_DB_JOURNAL)
 {
   TrainConfigDef trainCfg(0);
   TrainTmpConfigDef tmpTrainCfg(0);
@@ -224,49 +307,58 @@ Esp32TrainDatabase::Esp32TrainDatabase(openlcb::SimpleStackBase *stack)
                      , std::bind(&Esp32TrainDatabase::persist, this));
 
   LOG(INFO, "[TrainDB] Initializing...");
-  if (Singleton<ConfigurationManager>::instance()->exists(TRAIN_DB_JSON_FILE))
+  OSMutexLock l(&knownTrainsLock_);
+  auto cfg = Singleton<ConfigurationManager>::instance();
+  if (!journal_.exists() && cfg->exists(TRAIN_DB_JSON_FILE))
   {
-    auto roster =
-      Singleton<ConfigurationManager>::instance()->load(TRAIN_DB_JSON_FILE);
-    json stored_trains = json::parse(roster, nullptr, false);
+    LOG(INFO, "[TrainDB] Converting %s to journal", TRAIN_DB_JSON_FILE);
+    json stored_trains =
+      json::parse(cfg->load(TRAIN_DB_JSON_FILE), nullptr, false);
     if (stored_trains.is_discarded())
     {
       LOG_ERROR("[TrainDB] database is corrupt, no trains loaded!");
-      Singleton<ConfigurationManager>::instance()->remove(TRAIN_DB_JSON_FILE);
+      cfg->remove(TRAIN_DB_JSON_FILE);
       return;
     }
     for (auto &entry : stored_trains)
     {
       auto data = entry.get<Esp32PersistentTrainData>();
-      auto ent = std::find_if(knownTrains_.begin(), knownTrains_.end(),
-      [data](const auto &train)
-      {
-        return train->get_legacy_address() == data.address;
-      });
-      if (ent == knownTrains_.end())
+      uint32_t ordinal = nextOrdinal_;
+      journal_.put(data.address, encode_train_record(data, ordinal));
+      register_entry_locked(data, ordinal);
+    }
+    if (journal_.compact())
+    {
+      cfg->remove(TRAIN_DB_JSON_FILE);
+    }
+  }
+  else
+  {
+    std::vector<std::pair<uint32_t, Esp32PersistentTrainData>> loaded;
+    journal_.load([&](uint32_t address, const string &payload)
+    {
+      Esp32PersistentTrainData data;
+      uint32_t ordinal;
+      if (decode_train_record(address, payload, data, ordinal))
       {
-        LOG(INFO, "[TrainDB] Registering %u - %s (idle: %s, limited: %s)"
-          , data.address, data.name.c_str()
-          , data.automatic_idle ? JSON_VALUE_ON : JSON_VALUE_OFF
-          , data.show_on_limited_throttles ? JSON_VALUE_ON : JSON_VALUE_OFF);
-        auto train = new Esp32TrainDbEntry(data);
-        train->reset_dirty();
-        if (train->is_auto_idle())
-        {
-          uint16_t address = train->get_legacy_address();
-          stack->executor()->add(new CallbackExecutable([address]()
-          {
-            auto trainMgr = Singleton<AllTrainNodes>::instance();
-            trainMgr->allocate_node(DccMode::DCC_128, address);
-          }));
-        }
-        knownTrains_.emplace_back(train);
+        loaded.emplace_back(ordinal, std::move(data));
       }
       else
       {
-        LOG_ERROR("[TrainDB] Duplicate roster entry detected for loco addr %u."
-                , data.address);
+        LOG_ERROR("[TrainDB] Invalid persistent entry for loco addr %u, "
+                  "ignoring it", address);
       }
+    });
+    // restore the roster order so the roster indexes remain stable.
+    std::stable_sort(loaded.begin(), loaded.end()
+                   , [](const std::pair<uint32_t, Esp32PersistentTrainData> &a
+                      , const std::pair<uint32_t, Esp32PersistentTrainData> &b)
+    {
+      return a.first < b.first;
+    });
+    for (auto &entry : loaded)
+    {
+      register_entry_locked(entry.second, entry.first);
     }
   }
 
@@ -274,20 +366,68 @@ Esp32TrainDatabase::Esp32TrainDatabase(openlcb::SimpleStackBase *stack)
     , knownTrains_.size());
 }
 
-#define FIND_TRAIN(id)                                    \
-  std::find_if(knownTrains_.begin(), knownTrains_.end(),  \
-    [id](const auto &train)                               \
-    {                                                     \
-      return train->get_legacy_address() == id;           \
-    })
+void Esp32TrainDatabase::register_entry_locked(
+  const Esp32PersistentTrainData &data, uint32_t ordinal)
+{
+  if (find_train_locked(data.address) != knownTrains_.end())
+  {
+    LOG_ERROR("[TrainDB] Duplicate roster entry detected for loco addr %u."
+            , data.address);
+    return;
+  }
+  LOG(INFO, "[TrainDB] Registering %u - %s (idle: %s, limited: %s)"
+    , data.address, data.name.c_str()
+    , data.automatic_idle ? JSON_VALUE_ON : JSON_VALUE_OFF
+    , data.show_on_limited_throttles ? JSON_VALUE_ON : JSON_VALUE_OFF);
+  auto train = new Esp32TrainDbEntry(data);
+  train->reset_dirty();
+  if (train->is_auto_idle())
+  {
+    uint16_t address = train->get_legacy_address();
+    stack_->executor()->add(new CallbackExecutable([address]()
+    {
+      auto trainMgr = Singleton<AllTrainNodes>::instance();
+      trainMgr->allocate_node(DccMode::DCC_128, address);
+    }));
+  }
+  add_entry_locked(train, ordinal);
+}
+
+Esp32TrainDatabase::TrainList::iterator
+Esp32TrainDatabase::find_train_locked(unsigned address)
+{
+  auto ent = addressIndex_.find(address);
+  if (ent == addressIndex_.end())
+  {
+    return knownTrains_.end();
+  }
+  return knownTrains_.begin() + ent->second;
+}
 
-#define FIND_TRAIN_HINT(id, id2)                          \
-  std::find_if(knownTrains_.begin(), knownTrains_.end(),  \
-    [id,id2](const auto &train)                           \
-    {                                                     \
-      return train->get_traction_node() == id ||          \
-             train->get_legacy_address() == id2;          \
-    })
+size_t Esp32TrainDatabase::add_entry_locked(Esp32TrainDbEntry *entry
+                                          , uint32_t ordinal)
+{
+  size_t index = knownTrains_.size();
+  entry->set_ordinal(ordinal);
+  nextOrdinal_ = std::max(nextOrdinal_, ordinal + 1);
+  knownTrains_.emplace_back(entry);
+  addressIndex_.emplace(entry->get_legacy_address(), index);
+  nodeIndex_.emplace(entry->get_traction_node(), index);
+  generation_++;
+  return index;
+}
+
+void Esp32TrainDatabase::rebuild_index_locked()
+{
+  generation_++;
+  addressIndex_.clear();
+  nodeIndex_.clear();
+  for (size_t index = 0; index < knownTrains_.size(); index++)
+  {
+    addressIndex_.emplace(knownTrains_[index]->get_legacy_address(), index);
+    nodeIndex_.emplace(knownTrains_[index]->get_traction_node(), index);
+  }
+}
 
 std::shared_ptr<TrainDbEntry> Esp32TrainDatabase::create_if_not_found(unsigned address
                                                                     , string name
@@ -295,16 +435,16 @@ std::shared_ptr<TrainDbEntry> Esp32TrainDatabase::create_if_not_found(unsigned a
 {
   OSMutexLock l(&knownTrainsLock_);
   LOG(VERBOSE, "[TrainDB] Searching for roster entry for address: %u", address);
-  auto entry = FIND_TRAIN(address);
+  auto entry = find_train_locked(address);
   if (entry != knownTrains_.end())
   {
     LOG(VERBOSE, "[TrainDB] Found existing entry:%s."
       , (*entry)->identifier().c_str());
     return *entry;
   }
-  auto index = knownTrains_.size();
-  knownTrains_.emplace_back(
-    new Esp32TrainDbEntry(Esp32PersistentTrainData(address, name, mode)));
+  auto index = add_entry_locked(
+    new Esp32TrainDbEntry(Esp32PersistentTrainData(address, name, mode))
+  , nextOrdinal_);
   LOG(VERBOSE, "[TrainDB] No entry was found, created new entry:%s."
     , knownTrains_[index]->identifier().c_str());
   return knownTrains_[index];
@@ -312,7 +452,8 @@ std::shared_ptr<TrainDbEntry> Esp32TrainDatabase::create_if_not_found(unsigned a
 
 int Esp32TrainDatabase::get_index(unsigned address)
 {
-  auto ent = FIND_TRAIN(address);
+  OSMutexLock l(&knownTrainsLock_);
+  auto ent = find_train_locked(address);
   if (ent != knownTrains_.end())
   {
     return std::distance(knownTrains_.begin(), ent);
@@ -323,6 +464,7 @@ int Esp32TrainDatabase::get_index(unsigned address)
 
 bool Esp32TrainDatabase::is_train_id_known(openlcb::NodeID train_id)
 {
+  OSMutexLock l(&knownTrainsLock_);
   LOG(VERBOSE, "[TrainDB] searching for train with id: %s"
     , uint64_to_string_hex(train_id).c_str());
   dcc::TrainAddressType type;
@@ -331,7 +473,7 @@ bool Esp32TrainDatabase::is_train_id_known(openlcb::NodeID train_id)
   if (TractionDefs::legacy_address_from_train_node_id(train_id, &type, &addr))
   {
     // only search with the address and discard the drive type (for now)
-    auto ent = FIND_TRAIN(addr);
+    auto ent = find_train_locked(addr);
     if (ent != knownTrains_.end())
     {
       LOG(VERBOSE, "[TrainDB] %s", (*ent)->identifier().c_str());
@@ -344,12 +486,18 @@ bool Esp32TrainDatabase::is_train_id_known(openlcb::NodeID train_id)
 void Esp32TrainDatabase::delete_entry(unsigned address)
 {
   OSMutexLock l(&knownTrainsLock_);
-  auto entry = FIND_TRAIN(address);
+  auto entry = find_train_locked(address);
   if (entry != knownTrains_.end())
   {
     LOG(VERBOSE, "[TrainDB] Removing persistent entry for address %u", address);
+    if ((*entry)->is_persisted())
+    {
+      journal_.erase(address);
+    }
+    // the remaining entries keep their ordinals, the gap is skipped when
+    // the journal is loaded.
     knownTrains_.erase(entry);
-    entryDeleted_ = true;
+    rebuild_index_locked();
   }
 }
 
@@ -362,7 +510,7 @@ std::shared_ptr<TrainDbEntry> Esp32TrainDatabase::get_entry(unsigned train_id)
     return knownTrains_[train_id];
   }
   // check if the train_id is a locomotive address that we know of
-  auto entry = FIND_TRAIN(train_id);
+  auto entry = find_train_locked(train_id);
   if (entry != knownTrains_.end())
   {
     return *entry;
@@ -376,7 +524,16 @@ std::shared_ptr<TrainDbEntry> Esp32TrainDatabase::find_entry(openlcb::NodeID nod
   OSMutexLock l(&knownTrainsLock_);
   LOG(VERBOSE, "[TrainDB] Searching for Train Node:%s, Hint:%u"
     , uint64_to_string(node_id).c_str(), hint);
-  auto entry = FIND_TRAIN_HINT(node_id, hint);
+  auto entry = knownTrains_.end();
+  auto node = nodeIndex_.find(node_id);
+  if (node != nodeIndex_.end())
+  {
+    entry = knownTrains_.begin() + node->second;
+  }
+  else
+  {
+    entry = find_train_locked(hint);
+  }
   if (entry != knownTrains_.end())
   {
     LOG(VERBOSE, "[TrainDB] Found existing entry: %s."
@@ -397,7 +554,7 @@ unsigned Esp32TrainDatabase::add_dynamic_entry(uint16_t address, DccMode mode)
   LOG(VERBOSE, "[TrainDB] Searching for loco %d", address);
 
   // prevent duplicate entries in the roster
-  auto ent = FIND_TRAIN(address);
+  auto ent = find_train_locked(address);
   if (ent != knownTrains_.end())
   {
     index = std::distance(knownTrains_.begin(), ent);
@@ -405,9 +562,6 @@ unsigned Esp32TrainDatabase::add_dynamic_entry(uint16_t address, DccMode mode)
   }
   else
   {
-    // track the index for the new train entry
-    index = knownTrains_.size();
-
 #ifdef CONFIG_ROSTER_AUTO_CREATE_ENTRIES
     LOG(VERBOSE
       , "[TrainDB] Creating persistent roster entry for locomotive %u."
@@ -415,9 +569,10 @@ unsigned Esp32TrainDatabase::add_dynamic_entry(uint16_t address, DccMode mode)
 
     // create the new entry, it will default to being marked dirty so it will
     // automatically persist.
-    knownTrains_.emplace_back(
+    index = add_entry_locked(
       new Esp32TrainDbEntry(
-        Esp32PersistentTrainData(address, std::to_string(address), mode)));
+        Esp32PersistentTrainData(address, std::to_string(address), mode))
+    , nextOrdinal_);
 #else
     LOG(VERBOSE
       , "[TrainDB] Adding temporary roster entry for locomotive %u."
@@ -425,10 +580,11 @@ unsigned Esp32TrainDatabase::add_dynamic_entry(uint16_t address, DccMode mode)
     // create the new entry and do not mark it as dirty so it doesn't
     // automatically persist. If the locomotive is later edited via the web UI
     // it will be marked as dirty and persisted at that point.
-    knownTrains_.emplace_back(
+    index = add_entry_locked(
       new Esp32TrainDbEntry(
         Esp32PersistentTrainData(address, std::to_string(address), mode)
-      , false));
+      , false)
+    , nextOrdinal_);
 #endif
   }
   return index;
@@ -460,11 +616,12 @@ void Esp32TrainDatabase::set_train_name(unsigned address, std::string name)
 {
   OSMutexLock l(&knownTrainsLock_);
   LOG(VERBOSE, "[TrainDB] Searching for train with address %u", address);
-  auto entry = FIND_TRAIN(address);
+  auto entry = find_train_locked(address);
   if (entry != knownTrains_.end())
   {
     LOG(VERBOSE, "[TrainDB] Setting train(%u) name: %s", address, name.c_str());
     (*entry)->set_train_name(name);
+    generation_++;
   }
   else
   {
@@ -476,7 +633,7 @@ void Esp32TrainDatabase::set_train_auto_idle(unsigned address, bool idle)
 {
   OSMutexLock l(&knownTrainsLock_);
   LOG(VERBOSE, "[TrainDB] Searching for train with address %u", address);
-  auto entry = FIND_TRAIN(address);
+  auto entry = find_train_locked(address);
   if (entry != knownTrains_.end())
   {
     LOG(VERBOSE, "[TrainDB] Setting auto-idle: %s"
@@ -495,7 +652,7 @@ void Esp32TrainDatabase::set_train_show_on_limited_throttle(unsigned address
 {
   OSMutexLock l(&knownTrainsLock_);
   LOG(VERBOSE, "[TrainDB] Searching for train with address %u", address);
-  auto entry = FIND_TRAIN(address);
+  auto entry = find_train_locked(address);
   if (entry != knownTrains_.end())
   {
     LOG(VERBOSE, "[TrainDB] Setting visible on limited throttes: %s"
@@ -513,7 +670,7 @@ void Esp32TrainDatabase::set_train_function_label(unsigned address, uint8_t fn_i
 {
   OSMutexLock l(&knownTrainsLock_);
   LOG(VERBOSE, "[TrainDB] Searching for train with address %u", address);
-  auto entry = FIND_TRAIN(address);
+  auto entry = find_train_locked(address);
   if (entry != knownTrains_.end())
   {
     (*entry)->set_function_label(fn_id, label);
@@ -529,10 +686,12 @@ void Esp32TrainDatabase::set_train_drive_mode(unsigned address, commandstation::
 {
   OSMutexLock l(&knownTrainsLock_);
   LOG(VERBOSE, "[TrainDB] Searching for train with address %u", address);
-  auto entry = FIND_TRAIN(address);
+  auto entry = find_train_locked(address);
   if (entry != knownTrains_.end())
   {
     (*entry)->set_legacy_drive_mode(mode);
+    // the traction node ID is derived from the drive mode.
+    rebuild_index_locked();
   }
   else
   {
@@ -565,7 +724,7 @@ string Esp32TrainDatabase::get_entry_as_json(unsigned address)
 
 string Esp32TrainDatabase::get_entry_as_json_locked(unsigned address)
 {
-  auto entry = FIND_TRAIN(address);
+  auto entry = find_train_locked(address);
   if (entry != knownTrains_.end())
   {
     auto train = (*entry);
@@ -600,29 +759,23 @@ void Esp32TrainDatabase::persist()
 {
   OSMutexLock l(&knownTrainsLock_);
   LOG(VERBOSE, "[TrainDB] Checking if roster needs to be persisted...");
-  auto ent = std::find_if(knownTrains_.begin(), knownTrains_.end(),
-    [](const auto &train)
-    {
-      return train->is_dirty() && train->is_persisted();
-    });
-  if (ent != knownTrains_.end() || entryDeleted_)
+  size_t count = 0;
+  for (auto entry : knownTrains_)
   {
-    LOG(VERBOSE, "[TrainDB] At least one entry requires persistence.");
-    json j;
-    size_t count = 0;
-    for (auto entry : knownTrains_)
+    if (entry->is_dirty() && entry->is_persisted())
     {
-      if (entry->is_persisted())
-      {
-        j.push_back(entry->get_data());
-        count++;
-      }
-      entry->reset_dirty();
+      journal_.put(entry->get_legacy_address()
+                 , encode_train_record(entry->get_data()
+                                     , entry->get_ordinal()));
+      count++;
     }
-    Singleton<ConfigurationManager>::instance()->store(TRAIN_DB_JSON_FILE
-                                                     , j.dump());
-    LOG(INFO, "[TrainDB] Persisted %zu entries.", count);
-    entryDeleted_ = false;
+    entry->reset_dirty();
+  }
+  if (journal_.is_dirty())
+  {
+    LOG(VERBOSE, "[TrainDB] At least one entry requires persistence.");
+    journal_.sync();
+    LOG(INFO, "[TrainDB] Persisted %zu modified entries.", count);
   }
   else
   {
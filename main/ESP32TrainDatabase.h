@@ -18,6 +18,7 @@ COPYRIGHT (c) 2019-2020 Mike Dunston
 #ifndef _ESP32_TRAIN_DB_H_
 #define _ESP32_TRAIN_DB_H_
 
+#include <map>
 #include <vector>
 
 #include <openlcb/Defs.hxx>
@@ -29,6 +30,7 @@ COPYRIGHT (c) 2019-2020 Mike Dunston
 #include <TrainDb.hxx>
 
 #include <AutoPersistCallbackFlow.h>
+#include <PersistentJournal.h>
 
 #include "sdkconfig.h"
 
@@ -196,12 +198,25 @@ namespace esp32cs
       return data_.show_on_limited_throttles;
     }
 
+    /// @return the insertion ordinal of this entry, used to restore the
+    /// roster order when the journal is loaded.
+    uint32_t get_ordinal()
+    {
+      return ordinal_;
+    }
+
+    void set_ordinal(uint32_t ordinal)
+    {
+      ordinal_ = ordinal;
+    }
+
   private:
     void recalcuate_max_fn();
     Esp32PersistentTrainData data_;
     uint8_t maxFn_;
     bool dirty_;
     bool persist_;
+    uint32_t ordinal_{0};
   };
 
   class Esp32TrainDatabase : public commandstation::TrainDb
@@ -243,6 +258,12 @@ namespace esp32cs
 
     unsigned add_dynamic_entry(uint16_t address, DccMode mode) override;
 
+    uint32_t generation() override
+    {
+      OSMutexLock l(&knownTrainsLock_);
+      return generation_;
+    }
+
     std::set<uint16_t> get_default_train_addresses(uint16_t limit);
 
     void set_train_name(unsigned address, std::string name);
@@ -267,14 +288,50 @@ namespace esp32cs
     void persist();
 
   private:
+    typedef std::vector<std::shared_ptr<Esp32TrainDbEntry>> TrainList;
     std::string get_entry_as_json_locked(unsigned address);
+
+    /// @return the entry with the provided address or the end of
+    /// @ref knownTrains_ if not found, the caller must hold
+    /// @ref knownTrainsLock_.
+    TrainList::iterator find_train_locked(unsigned address);
+
+    /// Adds a new entry to @ref knownTrains_ and the lookup indexes with the
+    /// provided ordinal, the caller must hold @ref knownTrainsLock_.
+    ///
+    /// @return the index of the new entry.
+    size_t add_entry_locked(Esp32TrainDbEntry *entry, uint32_t ordinal);
+
+    /// Regenerates the lookup indexes from @ref knownTrains_, this is used
+    /// when entries are removed or their traction node changes.
+    void rebuild_index_locked();
+
+    /// Adds an entry loaded from persistent storage, the caller must hold
+    /// @ref knownTrainsLock_.
+    void register_entry_locked(const Esp32PersistentTrainData &data
+                             , uint32_t ordinal);
+
     openlcb::SimpleStackBase *stack_;
-    bool entryDeleted_{false};
     OSMutex knownTrainsLock_;
-    std::vector<std::shared_ptr<Esp32TrainDbEntry>> knownTrains_;
+    TrainList knownTrains_;
+
+    /// Index into @ref knownTrains_ by DCC address.
+    std::map<unsigned, size_t> addressIndex_;
+
+    /// Index into @ref knownTrains_ by traction node ID.
+    std::map<openlcb::NodeID, size_t> nodeIndex_;
+
+    /// Incremented whenever an entry is added, removed or renamed.
+    uint32_t generation_{0};
+
+    /// Ordinal to assign to the next entry that is added.
+    uint32_t nextOrdinal_{0};
     std::unique_ptr<openlcb::MemorySpace> trainCdiFile_;
     std::unique_ptr<openlcb::MemorySpace> tempTrainCdiFile_;
     uninitialized<AutoPersistFlow> persistFlow_;
+
+    /// Persistent storage of the roster, keyed by DCC address.
+    PersistentJournal journal_;
   };
 
 } // namespace esp32cs
@@ -16,6 +16,7 @@ COPYRIGHT (c) 2019-2020 Mike Dunston
 **********************************************************************/
 
 #include <ConfigurationManager.h>
+#include <Consists.h>
 #include <DCCSignalVFS.h>
 #include <ESP32TrainDatabase.h>
 #include <FreeRTOSTaskMonitor.h>
@@ -42,6 +43,7 @@ void *node_reboot(void *arg)
   Singleton<StatusLED>::instance()->stop();
 #endif
   Singleton<TurnoutManager>::instance()->stop();
+  Singleton<esp32cs::ConsistManager>::instance()->stop();
   Singleton<esp32cs::Esp32TrainDatabase>::instance()->stop();
   // sleep for 1 sec to give time for restart broadcast (if needed)
   usleep(1000);
@@ -19,20 +19,26 @@ COPYRIGHT (c) 2017-2020 Mike Dunston
 #include "ESP32TrainDatabase.h"
 
 #include <AllTrainNodes.hxx>
+#include <BinaryProtocol.h>
 #include <ConfigurationManager.h>
+#include <Consists.h>
 #include <DCCppProtocol.h>
 #include <DCCProgrammer.h>
 #include <dcc/Loco.hxx>
 #include <Dnsd.h>
 #include <DCCSignalVFS.h>
+#include <DuplexedTrackIf.h>
 #include <esp_log.h>
 #include <esp_ota_ops.h>
 #include <freertos_drivers/esp32/Esp32WiFiManager.hxx>
 #include <Httpd.h>
+#include <deque>
 #include <json.hpp>
 #include <JsonConstants.h>
 #include <LCCStackManager.h>
 #include <LCCWiFiManager.h>
+#include <PacketCapture.h>
+#include <PriorityUpdateLoop.h>
 #include <Turnouts.h>
 #include <utils/FileUtils.hxx>
 #include <utils/SocketClientParams.hxx>
@@ -43,6 +49,10 @@ COPYRIGHT (c) 2017-2020 Mike Dunston
 #include <Outputs.h>
 #endif // CONFIG_GPIO_OUTPUTS
 
+#if CONFIG_JMRI
+#include <JmriInterface.h>
+#endif // CONFIG_JMRI
+
 #if CONFIG_GPIO_SENSORS
 #include <Sensors.h>
 #include <RemoteSensors.h>
@@ -73,10 +83,22 @@ using openlcb::TcpClientDefaultParams;
 class WebSocketClient : public DCCPPProtocolConsumer
 {
 public:
-  WebSocketClient(int clientID, uint32_t remoteIP)
-    : DCCPPProtocolConsumer(), _id(clientID), _remoteIP(remoteIP)
+  WebSocketClient(int clientID, uint32_t remoteIP, bool binary)
+    : DCCPPProtocolConsumer(
+      [clientID](std::string &response)
+      {
+        // responses from commands that complete asynchronously are sent
+        // directly to the websocket.
+        Singleton<Httpd>::instance()->send_websocket_text(clientID, response);
+      })
+    , _id(clientID), _remoteIP(remoteIP), _binary(binary)
   {
-    LOG(INFO, "[WS %s] Connected", name().c_str());
+    LOG(INFO, "[WS %s] Connected (%s)", name().c_str()
+      , binary ? esp32cs::BINARY_PROTOCOL_NAME : "text");
+    if (!binary)
+    {
+      subscribe_state();
+    }
   }
   virtual ~WebSocketClient()
   {
@@ -90,9 +112,33 @@ public:
   {
     return StringPrintf("%s/%d", ipv4_to_string(_remoteIP).c_str(), _id);
   }
+  bool is_binary()
+  {
+    return _binary;
+  }
+  // Returns the state topics the binary protocol client has subscribed to.
+  uint32_t binary_topics()
+  {
+    return _binaryConsumer.topics();
+  }
+  // Processes binary protocol requests, any responses are sent back to the
+  // websocket as a single frame.
+  void feed_binary(WebSocketFlow *client, const uint8_t *data, size_t len)
+  {
+    _response.clear();
+    _binaryConsumer.feed(data, len, _response);
+    if (!_response.empty())
+    {
+      client->send_binary(_response.data(), _response.size());
+    }
+  }
 private:
   uint32_t _id;
   uint32_t _remoteIP;
+  bool _binary;
+  esp32cs::BinaryProtocolConsumer _binaryConsumer;
+  // reused for each batch of binary responses to avoid reallocation.
+  std::vector<uint8_t> _response;
 };
 
 // Captive Portal landing page
@@ -111,6 +157,45 @@ static constexpr const char * const CAPTIVE_PORTAL_HTML = R"!^!(
 
 OSMutex webSocketLock;
 std::vector<std::unique_ptr<WebSocketClient>> webSocketClients;
+
+// Coalescing key prefix for binary state changes, the topic and id of the
+// change are added to it so a slow client only receives the latest state of
+// each object.
+static constexpr uint32_t STATE_COALESCE_KEY = 0x53000000;
+
+// Sends state changes to the binary protocol clients that have subscribed to
+// them, text protocol clients have their own subscription.
+static void push_binary_state(const std::vector<esp32cs::StateChange> &changes)
+{
+  OSMutexLock h(&webSocketLock);
+  std::vector<uint8_t> encoded;
+  for (const auto &change : changes)
+  {
+    uint32_t topic = esp32cs::topic_bit(change.topic);
+    http::WebSocketMessagePtr message;
+    for (auto &client : webSocketClients)
+    {
+      if (!client->is_binary() || !(client->binary_topics() & topic))
+      {
+        continue;
+      }
+      if (!message)
+      {
+        // the change is encoded once and shared by all clients.
+        encoded.clear();
+        esp32cs::BinaryProtocolConsumer::encode_state_change(change, encoded);
+        if (encoded.empty())
+        {
+          break;
+        }
+        message = std::make_shared<const http::WebSocketMessage>(
+          encoded.data(), encoded.size()
+        , STATE_COALESCE_KEY | (change.topic << 16) | change.id);
+      }
+      Singleton<Httpd>::instance()->send_websocket(client->id(), message);
+    }
+  }
+}
 WEBSOCKET_STREAM_HANDLER(process_websocket_event);
 HTTP_STREAM_HANDLER(process_ota);
 HTTP_HANDLER(process_power);
@@ -118,6 +203,7 @@ HTTP_HANDLER(process_config);
 HTTP_HANDLER(process_prog);
 HTTP_HANDLER(process_turnouts);
 HTTP_HANDLER(process_loco);
+HTTP_HANDLER(process_consist);
 HTTP_HANDLER(process_outputs);
 HTTP_HANDLER(process_sensors);
 HTTP_HANDLER(process_remote_sensors);
@@ -324,7 +410,15 @@ void init_webserver(const esp32cs::Esp32ConfigDef &cfg)
                   , MIME_TYPE_TEXT_JAVASCRIPT, HTTP_ENCODING_GZIP);
   httpd->static_uri("/images/ajax-loader.gif", ajaxLoader, ajaxLoader_size
                   , MIME_TYPE_IMAGE_GIF);
-  httpd->websocket_uri("/ws", process_websocket_event);
+  // clients which request the binary subprotocol use it, all others use the
+  // DCC++ text protocol.
+  httpd->websocket_uri("/ws", process_websocket_event
+                     , {esp32cs::BINARY_PROTOCOL_NAME});
+  if (Singleton<esp32cs::StateBus>::exists())
+  {
+    Singleton<esp32cs::StateBus>::instance()->subscribe(
+      esp32cs::ALL_STATE_TOPICS, push_binary_state);
+  }
   httpd->uri("/update", HttpMethod::POST, nullptr, process_ota);
   httpd->uri("/features", [&](HttpRequest *req)
   {
@@ -384,6 +478,86 @@ void init_webserver(const esp32cs::Esp32ConfigDef &cfg)
     request->set_status(HttpStatusCode::STATUS_NOT_FOUND);
     return nullptr;
   });
+  httpd->uri("/dcc", HttpMethod::GET,
+  [&](HttpRequest *request) -> AbstractHttpResponse *
+  {
+    auto scheduler = Singleton<esp32cs::PriorityUpdateLoop>::instance();
+    return new JsonResponse(
+      StringPrintf("{\"scheduler\":%s,\"tracks\":%s,\"signal\":%s,"
+                   "\"railcom\":%s,\"consists\":%s}"
+                 , scheduler->get_state_json().c_str()
+                 , Singleton<esp32cs::DuplexedTrackIf>::instance()->get_state_json().c_str()
+                 , esp32cs::get_track_signal_json().c_str()
+                 , esp32cs::get_railcom_state_json().c_str()
+                 , Singleton<esp32cs::ConsistManager>::instance()->get_state_json().c_str()));
+  });
+  // GET /websockets - outbound queue statistics for connected websockets.
+  httpd->uri("/websockets", HttpMethod::GET,
+  [&](HttpRequest *request) -> AbstractHttpResponse *
+  {
+    string res = "[";
+    for (auto &client : Singleton<Httpd>::instance()->websocket_stats())
+    {
+      if (res.length() > 1)
+      {
+        res += ",";
+      }
+      res += StringPrintf("{\"id\":%d,\"ip\":\"%s\",\"queued\":%zu,"
+                          "\"bytes\":%zu,\"peak\":%zu,\"sent\":%u,"
+                          "\"dropped\":%u,\"coalesced\":%u}"
+                        , client.id, ipv4_to_string(client.ip).c_str()
+                        , client.queued, client.queued_bytes
+                        , client.peak_queued, client.sent, client.dropped
+                        , client.coalesced);
+    }
+    res += "]";
+    return new JsonResponse(res);
+  });
+  // GET /statebus - state change delivery statistics.
+  httpd->uri("/statebus", HttpMethod::GET,
+  [&](HttpRequest *request) -> AbstractHttpResponse *
+  {
+    return new JsonResponse(
+      Singleton<esp32cs::StateBus>::instance()->get_stats_json());
+  });
+#if CONFIG_JMRI
+  // GET /jmri - command rate and latency statistics for JMRI clients.
+  httpd->uri("/jmri", HttpMethod::GET,
+  [&](HttpRequest *request) -> AbstractHttpResponse *
+  {
+    return new JsonResponse(get_jmri_client_stats_json());
+  });
+#endif // CONFIG_JMRI
+#if CONFIG_DCC_PACKET_CAPTURE
+  // GET /dcc/capture?since=<seq>&count=<count> - binary stream of the packets
+  // captured since the provided sequence number.
+  // PUT /dcc/capture?enabled=<bool>&tracks=<mask>&idle=<bool>&clear=<bool> -
+  // configure the packet capture, parameters that are not provided keep their
+  // current value. Returns the capture state. The binary stream can be
+  // decoded with tests/host/dcc_capture_decode.py.
+  httpd->uri("/dcc/capture", HttpMethod::GET | HttpMethod::PUT,
+  [&](HttpRequest *request) -> AbstractHttpResponse *
+  {
+    auto capture = Singleton<esp32cs::PacketCapture>::instance();
+    if (request->method() == HttpMethod::PUT)
+    {
+      capture->configure(request->param("enabled", capture->is_enabled())
+                       , request->param("tracks"
+                                      , (int)capture->get_track_mask())
+                       , request->param("idle"
+                                      , capture->is_idle_enabled()));
+      if (request->param("clear", false))
+      {
+        capture->clear();
+      }
+      return new JsonResponse(capture->get_state_json());
+    }
+    return new StringResponse(
+      capture->read(request->param("since", 0)
+                  , request->param("count", CONFIG_DCC_PACKET_CAPTURE_SIZE))
+    , http::MIME_TYPE_OCTET_STREAM);
+  });
+#endif // CONFIG_DCC_PACKET_CAPTURE
   httpd->uri("/power", HttpMethod::GET | HttpMethod::PUT, process_power);
   httpd->uri("/config", HttpMethod::GET | HttpMethod::POST, process_config);
   httpd->uri("/programmer", HttpMethod::GET | HttpMethod::POST, process_prog);
@@ -403,6 +577,10 @@ void init_webserver(const esp32cs::Esp32ConfigDef &cfg)
            , HttpMethod::GET | HttpMethod::POST |
              HttpMethod::PUT | HttpMethod::DELETE
            , process_loco);
+  httpd->uri("/consist"
+           , HttpMethod::GET | HttpMethod::POST |
+             HttpMethod::PUT | HttpMethod::DELETE
+           , process_consist);
 #if CONFIG_GPIO_OUTPUTS
   httpd->uri("/outputs"
            , HttpMethod::GET | HttpMethod::POST |
@@ -431,7 +609,9 @@ WEBSOCKET_STREAM_HANDLER_IMPL(process_websocket_event, client, event, data
   if (event == WebSocketEvent::WS_EVENT_CONNECT)
   {
     webSocketClients.push_back(
-      std::make_unique<WebSocketClient>(client->id(), client->ip()));
+      std::make_unique<WebSocketClient>(client->id(), client->ip()
+                                      , client->protocol() ==
+                                          esp32cs::BINARY_PROTOCOL_NAME));
   }
   else if (event == WebSocketEvent::WS_EVENT_DISCONNECT)
   {
@@ -460,6 +640,19 @@ WEBSOCKET_STREAM_HANDLER_IMPL(process_websocket_event, client, event, data
       }
     }
   }
+  else if (event == WebSocketEvent::WS_EVENT_BINARY)
+  {
+    auto ent = std::find_if(webSocketClients.begin(), webSocketClients.end()
+    , [client](const auto &inst) -> bool
+      {
+        return inst->id() == client->id();
+      }
+    );
+    if (ent != webSocketClients.end() && (*ent)->is_binary())
+    {
+      (*ent)->feed_binary(client, data, data_len);
+    }
+  }
 }
 
 esp_ota_handle_t otaHandle;
@@ -637,16 +830,157 @@ HTTP_HANDLER_IMPL(process_config, request)
   return new JsonResponse(response);
 }
 
+// Asynchronous PROG track request submitted via /programmer.
+struct ProgrammingJob
+{
+  // unique ID of the request.
+  uint32_t id;
+
+  // true when the request has completed.
+  bool done;
+
+  // true if the request completed successfully.
+  bool success;
+
+  // CV values read so far by the request.
+  vector<CVReadResult> results;
+};
+
+// Number of completed asynchronous PROG track requests to retain for status
+// queries.
+static constexpr size_t PROG_JOB_HISTORY = 8;
+
+static OSMutex progJobsLock;
+static std::deque<ProgrammingJob> progJobs;
+static uint32_t progJobNextId = 1;
+
+// Registers a new asynchronous PROG track request, the oldest request is
+// discarded if the history is full.
+static uint32_t add_prog_job()
+{
+  OSMutexLock l(&progJobsLock);
+  if (progJobs.size() >= PROG_JOB_HISTORY)
+  {
+    progJobs.pop_front();
+  }
+  progJobs.push_back({progJobNextId++, false, false, {}});
+  return progJobs.back().id;
+}
+
+// Invokes the callback with the request if it is still retained.
+static void update_prog_job(uint32_t id, std::function<void(ProgrammingJob &)> cb)
+{
+  OSMutexLock l(&progJobsLock);
+  for (auto &job : progJobs)
+  {
+    if (job.id == id)
+    {
+      cb(job);
+      return;
+    }
+  }
+}
+
+// Queues an asynchronous CV read and returns the response containing the
+// request ID which can be used to retrieve the progress. When the address is
+// zero the CVs are read from the PROG track, otherwise they are read from the
+// locomotive on the OPS track via RailCom.
+static AbstractHttpResponse *queue_prog_read(HttpRequest *request
+                                           , uint16_t address
+                                           , const vector<uint16_t> &cvs)
+{
+  uint32_t id = add_prog_job();
+  auto progress = [id](const CVReadResult &result)
+  {
+    update_prog_job(id, [result](ProgrammingJob &job)
+    {
+      job.results.push_back(result);
+    });
+  };
+  auto done = [id](const vector<CVReadResult> &results)
+  {
+    bool success = std::all_of(results.begin(), results.end()
+    , [](const CVReadResult &result)
+      {
+        return result.value >= 0;
+      });
+    update_prog_job(id, [success](ProgrammingJob &job)
+    {
+      job.done = true;
+      job.success = success;
+    });
+  };
+  bool queued = address ? readOpsCVsAsync(address, cvs, progress, done)
+                        : readCVsAsync(cvs, progress, done);
+  if (!queued)
+  {
+    request->set_status(HttpStatusCode::STATUS_SERVICE_UNAVAILABLE);
+    return nullptr;
+  }
+  return new JsonResponse(StringPrintf("{\"%s\":%d}", JSON_JOB_NODE, id));
+}
+
+// Returns the state of an asynchronous PROG track request.
+static AbstractHttpResponse *get_prog_job(HttpRequest *request, uint32_t id)
+{
+  string response;
+  update_prog_job(id, [&response](ProgrammingJob &job)
+  {
+    response =
+      StringPrintf("{\"%s\":%d,\"done\":%s,\"success\":%s,\"%s\":%s}"
+                 , JSON_JOB_NODE, job.id, job.done ? "true" : "false"
+                 , job.success ? "true" : "false", JSON_CVS_NODE
+                 , cv_results_to_json(job.results).c_str());
+  });
+  if (response.empty())
+  {
+    request->set_status(HttpStatusCode::STATUS_NOT_FOUND);
+    return nullptr;
+  }
+  return new JsonResponse(response);
+}
+
+// GET /programmer?pom=false&cv=<cv> - read a CV from the PROG track.
+// GET /programmer?pom=false&cvs=<list> - read a list of CVs, ie: 1-8,29.
+// GET /programmer?pom=false&identify=true - identify the decoder.
+// GET /programmer?pom=true&address=<address>&cv=<cv> - read a CV from a
+//     locomotive on the OPS track via RailCom, cvs=<list> is also supported
+//     and is always queued as with async=true.
+// GET /programmer?pom=<bool>&job=<id> - state of an asynchronous request.
+// POST /programmer?pom=<bool>&cv=<cv>&value=<value>[&bit=<bit>] - write a CV.
+// POST /programmer?pom=true&verify=true&address=<address>&cv=<cv>&value=<value>
+//     - write a CV on the OPS track and verify it via RailCom.
+//
+// Adding async=true to the CV read and PROG track write requests will queue
+// the request and return the request ID which can be used to retrieve the
+// progress and results.
 HTTP_HANDLER_IMPL(process_prog, request)
 {
   request->set_status(HttpStatusCode::STATUS_OK);
+  bool async = request->param(JSON_ASYNC_NODE, false);
   if (!request->has_param(JSON_PROG_ON_MAIN))
   {
     request->set_status(HttpStatusCode::STATUS_BAD_REQUEST);
   }
+  else if (request->method() == HttpMethod::GET &&
+           request->has_param(JSON_JOB_NODE))
+  {
+    return get_prog_job(request, request->param(JSON_JOB_NODE, 0));
+  }
   else if (request->method() == HttpMethod::GET)
   {
+    // zero when reading from the PROG track.
+    int address = 0;
     if (request->param(JSON_PROG_ON_MAIN, false))
+    {
+      address = request->param(JSON_ADDRESS_NODE, 0);
+    }
+    if (address < 0 || address > esp32cs::DCC_MAX_LOCO_ADDRESS)
+    {
+      request->set_status(HttpStatusCode::STATUS_BAD_REQUEST);
+    }
+    else if (request->param(JSON_PROG_ON_MAIN, false) &&
+            (address == 0 || request->has_param(JSON_IDENTIFY_NODE)))
     {
       request->set_status(HttpStatusCode::STATUS_NOT_ALLOWED);
     }
@@ -745,6 +1079,45 @@ HTTP_HANDLER_IMPL(process_prog, request)
         request->set_status(HttpStatusCode::STATUS_SERVER_ERROR);
       }
     }
+    else if (request->has_param(JSON_CVS_NODE))
+    {
+      // list of CVs and CV ranges to read, ie: 1-8,17,18,29
+      vector<uint16_t> cvs;
+      vector<string> entries;
+      http::tokenize(request->param(JSON_CVS_NODE), entries, ",", true, true);
+      for (auto &entry : entries)
+      {
+        vector<string> range;
+        http::tokenize(entry, range, "-", true, true);
+        if (range.empty())
+        {
+          continue;
+        }
+        uint16_t first = std::stoi(range[0]);
+        uint16_t last = range.size() > 1 ? std::stoi(range[1]) : first;
+        for (uint16_t cv = first; cv && cv <= last && cv <= 1024; cv++)
+        {
+          cvs.push_back(cv);
+        }
+      }
+      if (cvs.empty())
+      {
+        request->set_status(HttpStatusCode::STATUS_BAD_REQUEST);
+      }
+      else if (async || address)
+      {
+        // POM reads take up to POM_REQUEST_TIMEOUT_MSEC per CV, they are
+        // always queued so the web server is not blocked.
+        return queue_prog_read(request, address, cvs);
+      }
+      else
+      {
+        auto results = readCVs(cvs);
+        return new JsonResponse(
+          StringPrintf("{\"%s\":%s}", JSON_CVS_NODE
+                     , cv_results_to_json(results).c_str()));
+      }
+    }
     else
     {
       uint16_t cvNumber = request->param(JSON_CV_NODE, 0);
@@ -752,9 +1125,14 @@ HTTP_HANDLER_IMPL(process_prog, request)
       {
         request->set_status(HttpStatusCode::STATUS_BAD_REQUEST);
       }
+      else if (async)
+      {
+        return queue_prog_read(request, address, {cvNumber});
+      }
       else
       {
-        int16_t cvValue = readCV(cvNumber);
+        int16_t cvValue = address ? readOpsCV(address, cvNumber)
+                                  : readCV(cvNumber);
         if (cvValue < 0)
         {
           request->set_status(HttpStatusCode::STATUS_SERVER_ERROR);
@@ -789,16 +1167,50 @@ HTTP_HANDLER_IMPL(process_prog, request)
     }
     else if (pom)
     {
-      uint16_t address = request->param(JSON_ADDRESS_NODE, 0);
-      if (request->has_param(JSON_CV_BIT_NODE))
+      int address = request->param(JSON_ADDRESS_NODE, 0);
+      if (address <= 0 || address > esp32cs::DCC_MAX_LOCO_ADDRESS)
+      {
+        request->set_status(HttpStatusCode::STATUS_BAD_REQUEST);
+      }
+      else if (request->has_param(JSON_CV_BIT_NODE))
       {
         writeOpsCVBit(address, cv_num, cv_bit, cv_value);
       }
+      else if (request->param(JSON_VERIFY_NODE, false))
+      {
+        if (!writeOpsCVByteVerified(address, cv_num, cv_value))
+        {
+          request->set_status(HttpStatusCode::STATUS_SERVER_ERROR);
+        }
+      }
       else
       {
         writeOpsCVByte(address, cv_num, cv_value);
       }
     }
+    else if (async)
+    {
+      uint32_t id = add_prog_job();
+      auto done = [id, cv_num, cv_value](bool success)
+      {
+        update_prog_job(id, [=](ProgrammingJob &job)
+        {
+          job.results.push_back({cv_num, (int16_t)(success ? cv_value : -1)
+                               , 0, 0});
+          job.done = true;
+          job.success = success;
+        });
+      };
+      bool queued = request->has_param(JSON_CV_BIT_NODE) ?
+        writeProgCVBitAsync(cv_num, cv_bit, cv_value, done) :
+        writeProgCVByteAsync(cv_num, cv_value, done);
+      if (!queued)
+      {
+        request->set_status(HttpStatusCode::STATUS_SERVICE_UNAVAILABLE);
+        return nullptr;
+      }
+      return new JsonResponse(StringPrintf("{\"%s\":%d}", JSON_JOB_NODE, id));
+    }
     else if (request->has_param(JSON_CV_BIT_NODE) &&
              !writeProgCVBit(cv_num, cv_bit,cv_value))
     {
@@ -926,6 +1338,73 @@ string convert_loco_to_json(openlcb::TrainImpl *t)
     n.wait_for_notification();                                                        \
   }
 
+// Applies the speed, direction and function parameters of the request to the
+// locomotive, when the locomotive is part of a consist they are applied to all
+// locomotives in the consist.
+static void update_loco(HttpRequest *request, openlcb::TrainImpl *loco
+                      , uint16_t address)
+{
+  auto consists = Singleton<esp32cs::ConsistManager>::instance();
+  bool update_speed = false;
+  auto speed = loco->get_speed();
+  if (request->has_param(JSON_IDLE_NODE))
+  {
+    speed = dcc::SpeedType(0);
+    update_speed = true;
+  }
+  if (request->has_param(JSON_SPEED_NODE))
+  {
+    bool forward = true;
+    if (request->has_param(JSON_DIRECTION_NODE))
+    {
+      forward = !request->param(JSON_DIRECTION_NODE).compare(JSON_VALUE_FORWARD);
+    }
+    speed = dcc::SpeedType::from_mph(request->param(JSON_SPEED_NODE, 0));
+    if (!forward)
+    {
+      speed.set_direction(dcc::SpeedType::REVERSE);
+    }
+    update_speed = true;
+  }
+  else if (request->has_param(JSON_DIRECTION_NODE))
+  {
+    bool forward =
+      !request->param(JSON_DIRECTION_NODE).compare(JSON_VALUE_FORWARD);
+    speed.set_direction(forward ? dcc::SpeedType::FORWARD
+                                : dcc::SpeedType::REVERSE);
+    update_speed = true;
+  }
+  if (update_speed && !consists->set_speed(address, speed))
+  {
+    loco->set_speed(speed);
+  }
+
+  uint32_t fn_mask = 0;
+  uint32_t fn_values = 0;
+  for (uint8_t funcID = 0; funcID <= 28; funcID++)
+  {
+    string fArg = StringPrintf("f%d", funcID);
+    if (request->has_param(fArg.c_str()))
+    {
+      fn_mask |= (1 << funcID);
+      if (request->param(fArg, false))
+      {
+        fn_values |= (1 << funcID);
+      }
+    }
+  }
+  if (fn_mask && !consists->set_fn(address, fn_mask, fn_values))
+  {
+    for (uint8_t funcID = 0; funcID <= 28; funcID++)
+    {
+      if (fn_mask & (1 << funcID))
+      {
+        loco->set_fn(funcID, (fn_values >> funcID) & 1);
+      }
+    }
+  }
+}
+
 // method - url pattern - meaning
 // ANY /locomotive/estop - send emergency stop to all locomotives
 // GET /locomotive/roster - roster
@@ -1052,42 +1531,7 @@ HTTP_HANDLER_IMPL(process_loco, request)
       {
         GET_LOCO_VIA_EXECUTOR(loco, address);
         // Creation / Update of active locomotive
-        if (request->has_param(JSON_IDLE_NODE))
-        {
-          loco->set_speed(dcc::SpeedType(0));
-        }
-        if (request->has_param(JSON_SPEED_NODE))
-        {
-          bool forward = true;
-          if (request->has_param(JSON_DIRECTION_NODE))
-          {
-            forward = !request->param(JSON_DIRECTION_NODE).compare(JSON_VALUE_FORWARD);
-          }
-          auto speed = dcc::SpeedType::from_mph(request->param(JSON_SPEED_NODE, 0));
-          if (!forward)
-          {
-            speed.set_direction(dcc::SpeedType::REVERSE);
-          }
-          loco->set_speed(speed);
-        }
-        else if (request->has_param(JSON_DIRECTION_NODE))
-        {
-          bool forward =
-            !request->param(JSON_DIRECTION_NODE).compare(JSON_VALUE_FORWARD);
-          auto upd_speed = loco->get_speed();
-          upd_speed.set_direction(forward ? dcc::SpeedType::FORWARD
-                                          : dcc::SpeedType::REVERSE);
-          loco->set_speed(upd_speed);
-        }
-        
-        for (uint8_t funcID = 0; funcID <= 28; funcID++)
-        {
-          string fArg = StringPrintf("f%d", funcID);
-          if (request->has_param(fArg.c_str()))
-          {
-            loco->set_fn(funcID, request->param(fArg, false));
-          }
-        }
+        update_loco(request, loco, address);
         return new JsonResponse(convert_loco_to_json(loco));
       }
       else if (request->method() == HttpMethod::DELETE)
@@ -1108,6 +1552,73 @@ HTTP_HANDLER_IMPL(process_loco, request)
   return nullptr;
 }
 
+// GET /consist - full list of consists
+// GET /consist?id=<id> - retrieve consist by id
+// POST /consist?id=<id>&locos=<lead>,<loco>,...,<trail>&decoderAssisted=[true|false] - creates or replaces a consist, negative addresses face the opposite direction to the lead. When decoderAssisted is true the locomotives will be programmed to respond to the consist address.
+// PUT /consist?id=<id>&speed=<speed>&dir=[FWD|REV]&fX=[true|false] - Update all locomotives in the consist, dir is relative to the lead and fX is short for function X where X is 0-28.
+// DELETE /consist?id=<id> - delete consist
+// DELETE /consist?id=<id>&address=<address> - remove locomotive from consist
+//
+// For successful requests the result code will be 200 and either an array of consists or single consist will be returned.
+// For unsuccessful requests the result code will be 400 (bad request, missing args), 404 (not found).
+//
+HTTP_HANDLER_IMPL(process_consist, request)
+{
+  auto consists = Singleton<esp32cs::ConsistManager>::instance();
+  if (request->method() == HttpMethod::GET &&
+     !request->has_param(JSON_ID_NODE))
+  {
+    return new JsonResponse(consists->get_state_as_json());
+  }
+
+  int id = request->param(JSON_ID_NODE, 0);
+  if (id < esp32cs::ConsistManager::MIN_CONSIST_ID ||
+      id > esp32cs::ConsistManager::MAX_CONSIST_ID)
+  {
+    request->set_status(HttpStatusCode::STATUS_BAD_REQUEST);
+  }
+  else if (request->method() == HttpMethod::POST)
+  {
+    vector<string> entries;
+    vector<int32_t> locos;
+    http::tokenize(request->param(JSON_LOCOS_NODE), entries, ",", true, true);
+    for (auto &entry : entries)
+    {
+      locos.push_back(std::stoi(entry));
+    }
+    if (consists->create(id, locos
+                       , request->param(JSON_DECODER_ASSISTED_NODE, false)))
+    {
+      return new JsonResponse(consists->get_consist_as_json(id));
+    }
+    request->set_status(HttpStatusCode::STATUS_BAD_REQUEST);
+  }
+  else if (request->method() == HttpMethod::DELETE)
+  {
+    bool removed = request->has_param(JSON_ADDRESS_NODE) ?
+      consists->remove(id, request->param(JSON_ADDRESS_NODE, 0)) :
+      consists->remove(id);
+    request->set_status(removed ? HttpStatusCode::STATUS_NO_CONTENT
+                                : HttpStatusCode::STATUS_NOT_FOUND);
+  }
+  else
+  {
+    uint16_t lead = consists->lead(id);
+    if (!lead)
+    {
+      request->set_status(HttpStatusCode::STATUS_NOT_FOUND);
+      return nullptr;
+    }
+    if (request->method() == HttpMethod::PUT)
+    {
+      GET_LOCO_VIA_EXECUTOR(loco, lead);
+      update_loco(request, loco, lead);
+    }
+    return new JsonResponse(consists->get_consist_as_json(id));
+  }
+  return nullptr;
+}
+
 #if CONFIG_GPIO_OUTPUTS
 HTTP_HANDLER_IMPL(process_outputs, request)
 {
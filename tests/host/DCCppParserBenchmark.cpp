@@ -0,0 +1,582 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+// Host benchmark of the DCCPPProtocolConsumer command parsing and dispatch.
+//
+// Two client streams are fed to the parser. The JMRI stream sends one command
+// per write: mostly throttle and function commands with turnout, status and
+// current meter polling in between. The WiThrottle stream models throttle
+// apps using the DCC++ protocol while a knob is dragged. Several commands are
+// batched per write and the writes are split at arbitrary points, so commands
+// arrive in pieces.
+//
+// Each stream is parsed by a model of the parser used before commands were
+// parsed in place and by a model of the current parser:
+// - The previous parser buffered bytes in a vector and copied every command
+//   into a string. It tokenized the command with http::tokenize into a new
+//   vector and found the handler by a linear scan comparing getID().
+// - The current parser compacts a fixed buffer and references the command ID
+//   in place. It reuses the argument vector of the consumer and looks up the
+//   handler in the table indexed by the first character of the command ID.
+//
+// Every handler returns a short response, so only the parsing and
+// dispatch are measured. Heap allocations are counted by replacing the global
+// operator new.
+//
+// Usage: DCCppParserBenchmark [commands per stream]
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <random>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+static size_t allocations = 0;
+
+void *operator new(size_t size)
+{
+  allocations++;
+  void *ptr = malloc(size ? size : 1);
+  if (!ptr)
+  {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+  free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+  free(ptr);
+}
+
+// Command IDs and minimum argument counts in the order they are registered
+// by DCCPPProtocolHandler::init() and the GPIO components.
+static const struct
+{
+  const char *id;
+  size_t minArgs;
+} COMMAND_IDS[] =
+{
+  {"t", 4}, {"tex", 3}, {"f", 2}, {"fex", 3}, {"C", 0}, {"a", 3}, {"1", 0},
+  {"0", 0}, {"c", 0}, {"s", 0}, {"R", 3}, {"W", 4}, {"B", 5}, {"w", 3},
+  {"b", 4}, {"m", 4}, {"e", 0}, {"E", 0}, {"Z", 0}, {"Zex", 1}, {"T", 0},
+  {"Tex", 1}, {"S", 0}, {"S88", 0}, {"RS", 0}, {"F", 0}, {"estop", 0}
+};
+
+static const string COMMAND_FAILED_RESPONSE = "<X>";
+static const string COMMAND_SUCCESSFUL_RESPONSE = "<O>";
+
+// Same as http::tokenize() with the default arguments.
+static void tokenize(const string &str, vector<string> &tokens)
+{
+  string::size_type pos, lastPos = 0;
+  while(lastPos < str.length())
+  {
+    pos = str.find_first_of(" ", lastPos);
+    if (pos == std::string::npos)
+    {
+      pos = str.length();
+    }
+    tokens.emplace_back(string(str.data() + lastPos, pos - lastPos));
+    lastPos = pos + 1;
+  }
+}
+
+// Model of DCCPPProtocolCommand before the arguments were passed by
+// reference, process_async() forwards to process() as the base class did.
+class LegacyCommand
+{
+public:
+  LegacyCommand(const char *id, size_t min_args) : id_(id), minArgs_(min_args)
+  {
+  }
+
+  virtual ~LegacyCommand()
+  {
+  }
+
+  virtual string process(const vector<string> args)
+  {
+    return args.empty() ? COMMAND_FAILED_RESPONSE
+                        : COMMAND_SUCCESSFUL_RESPONSE;
+  }
+
+  virtual string process_async(const vector<string> args)
+  {
+    return process(args);
+  }
+
+  virtual string getID()
+  {
+    return id_;
+  }
+
+  virtual size_t getMinArgCount()
+  {
+    return minArgs_;
+  }
+
+private:
+  const char *id_;
+  size_t minArgs_;
+};
+
+// Model of DCCPPProtocolHandler and DCCPPProtocolConsumer before commands
+// were parsed in place.
+class LegacyParser
+{
+public:
+  LegacyParser()
+  {
+    for (const auto &cmd : COMMAND_IDS)
+    {
+      commands_.emplace_back(new LegacyCommand(cmd.id, cmd.minArgs));
+    }
+  }
+
+  string feed(uint8_t *data, size_t len)
+  {
+    for(size_t i = 0; i < len; i++)
+    {
+      buffer_.emplace_back(data[i]);
+    }
+    return processData();
+  }
+
+  uint32_t command_count()
+  {
+    return commandCount_;
+  }
+
+private:
+  vector<std::unique_ptr<LegacyCommand>> commands_;
+  vector<uint8_t> buffer_;
+  uint32_t commandCount_{0};
+
+  string process(const string &commandString)
+  {
+    commandCount_++;
+    vector<string> parts;
+    tokenize(commandString, parts);
+    string commandID = parts.front();
+    parts.erase(parts.begin());
+    auto command = std::find_if(commands_.begin(), commands_.end()
+    , [commandID](const auto &cmd)
+      {
+        return cmd->getID() == commandID;
+      });
+    if (command != commands_.end() &&
+        parts.size() >= (*command)->getMinArgCount())
+    {
+      return (*command)->process_async(parts);
+    }
+    return COMMAND_FAILED_RESPONSE;
+  }
+
+  string processData()
+  {
+    auto s = buffer_.begin();
+    auto consumed = buffer_.begin();
+    string response;
+    for(; s != buffer_.end();)
+    {
+      s = std::find(s, buffer_.end(), '<');
+      auto e = std::find(s, buffer_.end(), '>');
+      if(s != buffer_.end() && e != buffer_.end())
+      {
+        // discard the <
+        s++;
+        // discard the >
+        *e = 0;
+        std::string str(reinterpret_cast<char*>(&*s));
+        response += process(std::move(str));
+        consumed = e;
+      }
+      s = e;
+    }
+    // drop everything we used from the buffer.
+    buffer_.erase(buffer_.begin(), consumed);
+    return response;
+  }
+};
+
+// Model of DCCPPProtocolCommand with the arguments passed by reference.
+class Command
+{
+public:
+  Command(const char *id, size_t min_args) : id_(id), minArgs_(min_args)
+  {
+  }
+
+  virtual ~Command()
+  {
+  }
+
+  virtual string process(const vector<string> &args)
+  {
+    return args.empty() ? COMMAND_FAILED_RESPONSE
+                        : COMMAND_SUCCESSFUL_RESPONSE;
+  }
+
+  virtual string process_async(const vector<string> &args)
+  {
+    return process(args);
+  }
+
+  virtual string getID()
+  {
+    return id_;
+  }
+
+  virtual size_t getMinArgCount()
+  {
+    return minArgs_;
+  }
+
+private:
+  const char *id_;
+  size_t minArgs_;
+};
+
+// Model of the current DCCPPProtocolHandler and DCCPPProtocolConsumer.
+class Parser
+{
+public:
+  Parser()
+  {
+    for (const auto &cmd : COMMAND_IDS)
+    {
+      Command *command = new Command(cmd.id, cmd.minArgs);
+      string id = command->getID();
+      commands_[(uint8_t)id[0]].push_back(
+        {id, std::unique_ptr<Command>(command)});
+    }
+  }
+
+  string feed(uint8_t *data, size_t len)
+  {
+    string response;
+    while (len)
+    {
+      size_t count = std::min(len, COMMAND_BUFFER_SIZE - bufferUsed_);
+      memcpy(buffer_ + bufferUsed_, data, count);
+      bufferUsed_ += count;
+      data += count;
+      len -= count;
+      size_t consumed = processData(response);
+      if (consumed)
+      {
+        memmove(buffer_, buffer_ + consumed, bufferUsed_ - consumed);
+        bufferUsed_ -= consumed;
+      }
+      else if (bufferUsed_ == COMMAND_BUFFER_SIZE)
+      {
+        bufferUsed_ = 0;
+      }
+    }
+    return response;
+  }
+
+  uint32_t command_count()
+  {
+    return commandCount_;
+  }
+
+private:
+  static constexpr size_t COMMAND_BUFFER_SIZE = 256;
+  static constexpr size_t COMMAND_TABLE_SIZE = 128;
+
+  struct RegisteredCommand
+  {
+    string id;
+    std::unique_ptr<Command> command;
+  };
+
+  vector<RegisteredCommand> commands_[COMMAND_TABLE_SIZE];
+  uint8_t buffer_[COMMAND_BUFFER_SIZE];
+  size_t bufferUsed_{0};
+  vector<string> args_;
+  uint32_t commandCount_{0};
+
+  Command *find_command(const char *id, size_t length)
+  {
+    uint8_t slot = id[0];
+    if (!length || slot >= COMMAND_TABLE_SIZE)
+    {
+      return nullptr;
+    }
+    for (const auto &entry : commands_[slot])
+    {
+      if (entry.id.length() == length &&
+          !memcmp(entry.id.data(), id, length))
+      {
+        return entry.command.get();
+      }
+    }
+    return nullptr;
+  }
+
+  string process(const char *command, size_t length, vector<string> &args)
+  {
+    const char *end = command + length;
+    const char *id = nullptr;
+    size_t idLength = 0;
+    size_t count = 0;
+    for (const char *pos = command; pos < end;)
+    {
+      const char *token = pos;
+      pos = std::find(pos, end, ' ');
+      if (pos != token)
+      {
+        if (!id)
+        {
+          id = token;
+          idLength = pos - token;
+        }
+        else if (count < args.size())
+        {
+          args[count++].assign(token, pos - token);
+        }
+        else
+        {
+          args.emplace_back(token, pos - token);
+          count++;
+        }
+      }
+      if (pos < end)
+      {
+        pos++;
+      }
+    }
+    args.resize(count);
+    if (!id)
+    {
+      return COMMAND_FAILED_RESPONSE;
+    }
+    Command *handler = find_command(id, idLength);
+    if (handler && count >= handler->getMinArgCount())
+    {
+      return handler->process_async(args);
+    }
+    return COMMAND_FAILED_RESPONSE;
+  }
+
+  size_t processData(string &response)
+  {
+    const char *buffer = reinterpret_cast<const char *>(buffer_);
+    const char *end = buffer + bufferUsed_;
+    const char *pos = buffer;
+    while (pos < end)
+    {
+      const char *s = std::find(pos, end, '<');
+      if (s == end)
+      {
+        return bufferUsed_;
+      }
+      const char *e = std::find(s, end, '>');
+      if (e == end)
+      {
+        return s - buffer;
+      }
+      response += process(s + 1, e - s - 1, args_);
+      commandCount_++;
+      pos = e + 1;
+    }
+    return pos - buffer;
+  }
+};
+
+// mix of short and long addresses as found on club layouts.
+static unsigned loco_address(std::mt19937 &rng)
+{
+  unsigned loco = rng() % 64;
+  return loco < 40 ? loco + 3 : 1000 + loco * 7;
+}
+
+static string throttle_command(std::mt19937 &rng)
+{
+  return "<t " + std::to_string(1 + rng() % 8) + " " +
+         std::to_string(loco_address(rng)) + " " +
+         std::to_string(rng() % 127) + " " + std::to_string(rng() % 2) + ">";
+}
+
+static string function_command(std::mt19937 &rng)
+{
+  return "<f " + std::to_string(loco_address(rng)) + " " +
+         std::to_string(128 + rng() % 32) + ">";
+}
+
+// JMRI: one command per write.
+static vector<string> jmri_stream(size_t commands)
+{
+  std::mt19937 rng(commands);
+  vector<string> writes;
+  for (size_t idx = 0; idx < commands; idx++)
+  {
+    unsigned kind = rng() % 100;
+    if (kind < 60)
+    {
+      writes.push_back(throttle_command(rng));
+    }
+    else if (kind < 80)
+    {
+      writes.push_back(function_command(rng));
+    }
+    else if (kind < 88)
+    {
+      writes.push_back("<T " + std::to_string(1 + rng() % 50) + " " +
+                       std::to_string(rng() % 2) + ">");
+    }
+    else if (kind < 96)
+    {
+      writes.push_back("<c>");
+    }
+    else if (kind < 99)
+    {
+      writes.push_back("<s>");
+    }
+    else
+    {
+      writes.push_back("<R 29 " + std::to_string(rng() % 1000) + " " +
+                       std::to_string(rng() % 1000) + ">");
+    }
+  }
+  return writes;
+}
+
+// WiThrottle style: batches of one to six commands split at random points.
+static vector<string> withrottle_stream(size_t commands)
+{
+  std::mt19937 rng(commands + 1);
+  string data;
+  vector<string> writes;
+  size_t generated = 0;
+  while (generated < commands)
+  {
+    size_t batch = std::min<size_t>(1 + rng() % 6, commands - generated);
+    for (size_t idx = 0; idx < batch; idx++)
+    {
+      unsigned kind = rng() % 100;
+      if (kind < 70)
+      {
+        data += throttle_command(rng);
+      }
+      else if (kind < 85)
+      {
+        data += "<tex " + std::to_string(loco_address(rng)) + " " +
+                std::to_string(rng() % 127) + " " +
+                std::to_string(rng() % 2) + ">";
+      }
+      else if (kind < 95)
+      {
+        data += "<fex " + std::to_string(loco_address(rng)) + " " +
+                std::to_string(rng() % 29) + " " +
+                std::to_string(rng() % 2) + ">";
+      }
+      else
+      {
+        data += function_command(rng);
+      }
+    }
+    generated += batch;
+    size_t split = rng() % (data.length() + 1);
+    writes.push_back(data.substr(0, split));
+    data.erase(0, split);
+  }
+  writes.push_back(data);
+  return writes;
+}
+
+struct Result
+{
+  double commandsPerSec;
+  double allocationsPerCommand;
+  size_t responseBytes;
+};
+
+template <class P> static Result run(const vector<string> &writes
+                                   , size_t commands)
+{
+  // writes are copied as feed() may modify the data.
+  vector<vector<uint8_t>> data;
+  for (const auto &write : writes)
+  {
+    data.emplace_back(write.begin(), write.end());
+  }
+  P parser;
+  size_t responseBytes = 0;
+  size_t start_allocations = allocations;
+  auto start = std::chrono::steady_clock::now();
+  for (auto &write : data)
+  {
+    responseBytes += parser.feed(write.data(), write.size()).length();
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  size_t used = allocations - start_allocations;
+  if (parser.command_count() != commands)
+  {
+    fprintf(stderr, "parsed %u of %zu commands\n", parser.command_count()
+          , commands);
+    exit(EXIT_FAILURE);
+  }
+  return {commands / std::chrono::duration<double>(elapsed).count()
+        , (double)used / commands, responseBytes};
+}
+
+int main(int argc, char **argv)
+{
+  size_t commands = argc > 1 ? strtoul(argv[1], nullptr, 10) : 500000;
+  printf("%-10s %22s %22s\n", "stream", "previous cmd/s alloc"
+       , "in-place cmd/s alloc");
+  const struct
+  {
+    const char *name;
+    vector<string> writes;
+  } streams[] =
+  {
+    {"JMRI", jmri_stream(commands)},
+    {"WiThrottle", withrottle_stream(commands)},
+  };
+  for (const auto &stream : streams)
+  {
+    Result legacy = run<LegacyParser>(stream.writes, commands);
+    Result current = run<Parser>(stream.writes, commands);
+    if (legacy.responseBytes != current.responseBytes)
+    {
+      fprintf(stderr, "%s: responses differ\n", stream.name);
+      return EXIT_FAILURE;
+    }
+    printf("%-10s %15.0f %6.2f %15.0f %6.2f\n", stream.name
+         , legacy.commandsPerSec, legacy.allocationsPerCommand
+         , current.commandsPerSec, current.allocationsPerCommand);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,75 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+#ifndef HOST_TEST_H_
+#define HOST_TEST_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/// Number of failed checks in the current test binary.
+static unsigned host_test_failures = 0;
+
+/// Records a failure when the condition is false, the test continues so that
+/// all failures are reported.
+#define CHECK(cond)                                                         \
+  do                                                                        \
+  {                                                                         \
+    if (!(cond))                                                            \
+    {                                                                       \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__      \
+            , #cond);                                                       \
+      host_test_failures++;                                                 \
+    }                                                                       \
+  } while (0)
+
+/// Records a failure when the two values are not equal.
+#define CHECK_EQ(expected, actual)                                          \
+  do                                                                        \
+  {                                                                         \
+    long long e_ = (long long)(expected);                                   \
+    long long a_ = (long long)(actual);                                     \
+    if (e_ != a_)                                                           \
+    {                                                                       \
+      fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n"     \
+            , __FILE__, __LINE__, #expected, #actual, e_, a_);             \
+      host_test_failures++;                                                 \
+    }                                                                       \
+  } while (0)
+
+/// Runs a test function and reports its name.
+#define RUN_TEST(name)                                                      \
+  do                                                                        \
+  {                                                                         \
+    unsigned before_ = host_test_failures;                                  \
+    name();                                                                 \
+    printf("[%s] %s\n", host_test_failures == before_ ? " OK " : "FAIL"     \
+         , #name);                                                          \
+  } while (0)
+
+/// @return the exit code for the test binary.
+static inline int host_test_result()
+{
+  if (host_test_failures)
+  {
+    printf("%u check(s) failed\n", host_test_failures);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+#endif // HOST_TEST_H_
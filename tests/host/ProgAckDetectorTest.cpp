@@ -0,0 +1,244 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+// Host tests for the PROG track ACK detector.
+//
+// Without arguments the built-in traces are checked. When a file is passed it
+// is replayed through the detector and every ACK and SHORT is printed. The
+// file contains one raw ADC reading per line as collected at the 1mS PROG
+// track sample interval, lines starting with '#' are ignored.
+
+#include "HostTest.h"
+#include "ProgAckDetector.h"
+
+#include <vector>
+
+using esp32cs::ProgAckDetector;
+
+// Same widths as HBridgeShortDetector, one sample per mS.
+static constexpr uint8_t ACK_MIN_WIDTH = 4;
+static constexpr uint8_t ACK_MAX_WIDTH = 9;
+static constexpr uint8_t SHORT_WIDTH = 2;
+
+// ~60mA with a 2A H-Bridge on a 12 bit ADC.
+static constexpr uint16_t ACK_THRESHOLD = 123;
+static constexpr uint16_t SHORT_LIMIT = 3500;
+
+static constexpr uint16_t IDLE = 400;
+
+// Appends readings alternating slightly around the level.
+static void append(std::vector<uint16_t> &trace, uint16_t level, size_t count)
+{
+  for (size_t idx = 0; idx < count; idx++)
+  {
+    trace.push_back(level + ((idx & 1) ? 3 : -3));
+  }
+}
+
+struct Replay
+{
+  std::vector<size_t> acks;
+  std::vector<size_t> shorts;
+};
+
+static Replay replay(const std::vector<uint16_t> &trace)
+{
+  ProgAckDetector detector(ACK_THRESHOLD, SHORT_LIMIT, ACK_MIN_WIDTH
+                         , ACK_MAX_WIDTH, SHORT_WIDTH);
+  Replay result;
+  for (size_t idx = 0; idx < trace.size(); idx++)
+  {
+    auto res = detector.sample(trace[idx]);
+    if (res == ProgAckDetector::ACK)
+    {
+      result.acks.push_back(idx);
+    }
+    else if (res == ProgAckDetector::SHORT)
+    {
+      result.shorts.push_back(idx);
+    }
+  }
+  return result;
+}
+
+// Trace with a single pulse of the provided width and amplitude.
+static std::vector<uint16_t> pulse_trace(size_t width, uint16_t amplitude)
+{
+  std::vector<uint16_t> trace;
+  append(trace, IDLE, 50);
+  append(trace, IDLE + amplitude, width);
+  append(trace, IDLE, 50);
+  return trace;
+}
+
+static void idle_is_quiet()
+{
+  std::vector<uint16_t> trace;
+  append(trace, IDLE, 1000);
+  auto res = replay(trace);
+  CHECK(res.acks.empty());
+  CHECK(res.shorts.empty());
+}
+
+static void nominal_ack_reported_on_falling_edge()
+{
+  auto res = replay(pulse_trace(6, 250));
+  CHECK_EQ(1, res.acks.size());
+  if (!res.acks.empty())
+  {
+    // the first sample back at the idle level.
+    CHECK_EQ(56, res.acks[0]);
+  }
+}
+
+static void ack_width_limits()
+{
+  CHECK(replay(pulse_trace(ACK_MIN_WIDTH - 1, 250)).acks.empty());
+  CHECK_EQ(1, replay(pulse_trace(ACK_MIN_WIDTH, 250)).acks.size());
+  CHECK_EQ(1, replay(pulse_trace(ACK_MAX_WIDTH, 250)).acks.size());
+  CHECK(replay(pulse_trace(ACK_MAX_WIDTH + 1, 250)).acks.empty());
+}
+
+static void small_pulse_ignored()
+{
+  CHECK(replay(pulse_trace(6, ACK_THRESHOLD / 2)).acks.empty());
+}
+
+static void load_step_is_not_an_ack()
+{
+  // a sustained increase, ie: a sound decoder powering up, must never be
+  // reported as an ACK and becomes the new baseline.
+  std::vector<uint16_t> trace;
+  append(trace, IDLE, 50);
+  append(trace, IDLE + 300, 500);
+  auto res = replay(trace);
+  CHECK(res.acks.empty());
+
+  // an ACK on top of the new level is still detected.
+  append(trace, IDLE + 300 + 250, 6);
+  append(trace, IDLE + 300, 50);
+  res = replay(trace);
+  CHECK_EQ(1, res.acks.size());
+}
+
+static void slow_drift_is_tracked()
+{
+  std::vector<uint16_t> trace;
+  append(trace, IDLE, 50);
+  for (uint16_t level = IDLE; level < IDLE + 400; level += 2)
+  {
+    append(trace, level, 4);
+  }
+  CHECK(replay(trace).acks.empty());
+}
+
+static void back_to_back_acks()
+{
+  std::vector<uint16_t> trace;
+  append(trace, IDLE, 50);
+  for (int count = 0; count < 5; count++)
+  {
+    append(trace, IDLE + 250, 6);
+    append(trace, IDLE, 20);
+  }
+  CHECK_EQ(5, replay(trace).acks.size());
+}
+
+static void short_reported_once()
+{
+  std::vector<uint16_t> trace;
+  append(trace, IDLE, 50);
+  append(trace, SHORT_LIMIT + 100, 20);
+  append(trace, IDLE, 50);
+  auto res = replay(trace);
+  CHECK_EQ(1, res.shorts.size());
+  if (!res.shorts.empty())
+  {
+    CHECK_EQ(50 + SHORT_WIDTH - 1, res.shorts[0]);
+  }
+  CHECK(res.acks.empty());
+}
+
+static void reset_establishes_new_baseline()
+{
+  ProgAckDetector detector(ACK_THRESHOLD, SHORT_LIMIT, ACK_MIN_WIDTH
+                         , ACK_MAX_WIDTH, SHORT_WIDTH);
+  for (int idx = 0; idx < 50; idx++)
+  {
+    detector.sample(IDLE);
+  }
+  detector.reset();
+  for (int idx = 0; idx < 50; idx++)
+  {
+    CHECK(detector.sample(IDLE + 1000) == ProgAckDetector::NONE);
+  }
+  CHECK_EQ(IDLE + 1000, detector.baseline());
+}
+
+static int replay_file(const char *path)
+{
+  FILE *f = fopen(path, "r");
+  if (!f)
+  {
+    perror(path);
+    return EXIT_FAILURE;
+  }
+  ProgAckDetector detector(ACK_THRESHOLD, SHORT_LIMIT, ACK_MIN_WIDTH
+                         , ACK_MAX_WIDTH, SHORT_WIDTH);
+  char line[64];
+  size_t sample = 0;
+  while (fgets(line, sizeof(line), f))
+  {
+    if (line[0] == '#' || line[0] == '\n')
+    {
+      continue;
+    }
+    auto res = detector.sample(strtoul(line, nullptr, 10));
+    if (res == ProgAckDetector::ACK)
+    {
+      printf("%zu: ACK width:%u amplitude:%u baseline:%u\n", sample
+           , detector.last_ack_width(), detector.last_ack_amplitude()
+           , detector.baseline());
+    }
+    else if (res == ProgAckDetector::SHORT)
+    {
+      printf("%zu: SHORT\n", sample);
+    }
+    sample++;
+  }
+  fclose(f);
+  printf("%zu samples, %u ACK(s)\n", sample, detector.ack_count());
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc > 1)
+  {
+    return replay_file(argv[1]);
+  }
+  RUN_TEST(idle_is_quiet);
+  RUN_TEST(nominal_ack_reported_on_falling_edge);
+  RUN_TEST(ack_width_limits);
+  RUN_TEST(small_pulse_ignored);
+  RUN_TEST(load_step_is_not_an_ack);
+  RUN_TEST(slow_drift_is_tracked);
+  RUN_TEST(back_to_back_acks);
+  RUN_TEST(short_reported_once);
+  RUN_TEST(reset_establishes_new_baseline);
+  return host_test_result();
+}
@@ -0,0 +1,247 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+// Host benchmark of the RMTTrackDevice DCC payload encoding.
+//
+// The packet stream models the OPS track refresh: every active loco sends its
+// speed and F0-F12 function group packets in turn and occasionally a speed
+// change is interleaved. Each stream is encoded into an RMT transmit buffer
+// with a FIFO cache of pre-encoded payloads (as used previously by the RMT
+// ISR) and by encoding the payload bits directly into the transmit buffer.
+//
+// Usage: RMTEncodeBenchmark [packets per loco count]
+
+#include <chrono>
+#include <random>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+// Same layout as rmt_item32_t, only the raw value is used by the encoder.
+struct RmtItem
+{
+  uint32_t val;
+};
+
+static constexpr uint8_t MAX_PAYLOAD = 6;
+static constexpr uint8_t PREAMBLE_BITS = 16;
+static constexpr uint8_t MAX_PAYLOAD_RMT_BITS = 1 + (MAX_PAYLOAD * 9) + 1;
+
+// Default 58uS/96uS half bit timings at 1 tick per uS, high first.
+static constexpr uint32_t DCC_ONE = (0 << 31) | (58 << 16) | (1 << 15) | 58;
+static constexpr uint32_t DCC_ZERO = (0 << 31) | (96 << 16) | (1 << 15) | 96;
+
+static constexpr uint8_t PACKET_BIT_MASK[] =
+{
+  0x80, 0x40, 0x20, 0x10,
+  0x08, 0x04, 0x02, 0x01
+};
+
+struct Packet
+{
+  uint8_t dlc;
+  uint8_t payload[MAX_PAYLOAD];
+};
+
+struct EncodedPacket
+{
+  uint32_t length;
+  RmtItem items[PREAMBLE_BITS + MAX_PAYLOAD_RMT_BITS];
+};
+
+// Appends the start bit, payload bytes and end bit to the provided items.
+static uint32_t encode_bits(const Packet &packet, RmtItem *items)
+{
+  uint32_t length = 0;
+  items[length++].val = DCC_ZERO;
+  for (uint8_t dlc = 0; dlc < packet.dlc; dlc++)
+  {
+    for (uint8_t bit = 0; bit < 8; bit++)
+    {
+      items[length++].val =
+        packet.payload[dlc] & PACKET_BIT_MASK[bit] ? DCC_ONE : DCC_ZERO;
+    }
+    items[length++].val = DCC_ZERO;
+  }
+  items[length - 1].val = DCC_ONE;
+  items[length++].val = DCC_ONE;
+  return length;
+}
+
+// Encoder with a FIFO cache of pre-encoded payloads.
+template <uint8_t CACHE_SIZE> struct CachedEncoder
+{
+  struct Entry
+  {
+    uint8_t dlc{0};
+    uint8_t payload[MAX_PAYLOAD];
+    uint8_t length{0};
+    RmtItem items[MAX_PAYLOAD_RMT_BITS];
+  };
+  Entry cache[CACHE_SIZE];
+  uint8_t next{0};
+  size_t hits{0};
+
+  void encode(const Packet &packet, EncodedPacket *target)
+  {
+    const Entry *found = nullptr;
+    for (uint8_t index = 0; index < CACHE_SIZE; index++)
+    {
+      const Entry &entry = cache[index];
+      if (entry.dlc && entry.dlc == packet.dlc &&
+          !memcmp(entry.payload, packet.payload, packet.dlc))
+      {
+        hits++;
+        found = &entry;
+        break;
+      }
+    }
+    if (!found)
+    {
+      Entry &entry = cache[next];
+      next = (next + 1) % CACHE_SIZE;
+      entry.dlc = packet.dlc;
+      memcpy(entry.payload, packet.payload, packet.dlc);
+      entry.length = encode_bits(packet, entry.items);
+      found = &entry;
+    }
+    memcpy(target->items + PREAMBLE_BITS, found->items
+         , found->length * sizeof(RmtItem));
+    target->length = PREAMBLE_BITS + found->length;
+  }
+};
+
+// Encoder writing the payload bits directly into the transmit buffer.
+struct DirectEncoder
+{
+  size_t hits{0};
+
+  void encode(const Packet &packet, EncodedPacket *target)
+  {
+    target->length =
+      PREAMBLE_BITS + encode_bits(packet, target->items + PREAMBLE_BITS);
+  }
+};
+
+static void add_address(Packet &packet, unsigned address)
+{
+  if (address > 127)
+  {
+    packet.payload[packet.dlc++] = 0xC0 | (address >> 8);
+  }
+  packet.payload[packet.dlc++] = address & 0xFF;
+}
+
+static void add_checksum(Packet &packet)
+{
+  uint8_t xor_byte = 0;
+  for (uint8_t idx = 0; idx < packet.dlc; idx++)
+  {
+    xor_byte ^= packet.payload[idx];
+  }
+  packet.payload[packet.dlc++] = xor_byte;
+}
+
+// Generates the refresh packet stream for the provided number of locos.
+static std::vector<Packet> refresh_stream(unsigned locos, size_t count)
+{
+  std::mt19937 rng(locos);
+  std::vector<uint8_t> speeds(locos, 0);
+  std::vector<Packet> stream;
+  stream.reserve(count);
+  unsigned loco = 0;
+  unsigned part = 0;
+  while (stream.size() < count)
+  {
+    if (rng() % 10 == 0)
+    {
+      // throttle speed change for a random loco.
+      speeds[rng() % locos] = rng() % 128;
+    }
+    // mix of short and long addresses as found on club layouts.
+    unsigned address = loco < 50 ? loco + 3 : 1000 + loco * 7;
+    Packet packet{0, {0}};
+    add_address(packet, address);
+    switch (part)
+    {
+      case 0:
+        packet.payload[packet.dlc++] = 0x3F;
+        packet.payload[packet.dlc++] = 0x80 | speeds[loco];
+        break;
+      case 1:
+        packet.payload[packet.dlc++] = 0x90;
+        break;
+      case 2:
+        packet.payload[packet.dlc++] = 0xB0;
+        break;
+      case 3:
+        packet.payload[packet.dlc++] = 0xA0;
+        break;
+    }
+    add_checksum(packet);
+    stream.push_back(packet);
+    if (++part == 4)
+    {
+      part = 0;
+      loco = (loco + 1) % locos;
+    }
+  }
+  return stream;
+}
+
+template <class Encoder>
+static double time_per_packet(const std::vector<Packet> &stream
+                            , double *hit_rate)
+{
+  Encoder encoder;
+  EncodedPacket target[2];
+  uint32_t check = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t idx = 0; idx < stream.size(); idx++)
+  {
+    encoder.encode(stream[idx], &target[idx & 1]);
+    check += target[idx & 1].length;
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  if (!check)
+  {
+    exit(EXIT_FAILURE);
+  }
+  *hit_rate = 100.0 * encoder.hits / stream.size();
+  return std::chrono::duration<double, std::nano>(elapsed).count() /
+         stream.size();
+}
+
+int main(int argc, char **argv)
+{
+  size_t count = argc > 1 ? strtoul(argv[1], nullptr, 10) : 2000000;
+  printf("%6s %16s %16s %16s\n", "locos", "cache(8) ns/hit%"
+       , "cache(32) ns/hit%", "direct ns");
+  for (unsigned locos : {1, 2, 4, 8, 16, 32, 64})
+  {
+    auto stream = refresh_stream(locos, count);
+    double hits8, hits32, unused;
+    double cached8 = time_per_packet<CachedEncoder<8>>(stream, &hits8);
+    double cached32 = time_per_packet<CachedEncoder<32>>(stream, &hits32);
+    double direct = time_per_packet<DirectEncoder>(stream, &unused);
+    printf("%6u %9.1f/%5.1f%% %9.1f/%5.1f%% %16.1f\n", locos, cached8, hits8
+         , cached32, hits32, direct);
+  }
+  return EXIT_SUCCESS;
+}
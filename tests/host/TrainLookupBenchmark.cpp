@@ -0,0 +1,175 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+// Host benchmark of the per-message train lookup cost against roster size.
+//
+// Every SNIP, PIP, FDI and traction message addressed to a train node is
+// resolved by AllTrainNodes::find_node(NodeID) and the roster is consulted
+// via Esp32TrainDatabase::is_train_id_known(NodeID), which extracts the DCC
+// address and looks up the roster entry. This models both lookups with the
+// same containers as the command station: the linear scans that were used
+// before the indexes were added and the std::map indexes used now.
+//
+// Usage: TrainLookupBenchmark [messages per roster size]
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <random>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+typedef uint64_t NodeID;
+
+// Node ID of a train node for a DCC address, as generated by
+// TractionDefs::train_node_id_from_legacy().
+static NodeID train_node_id(unsigned address)
+{
+  static constexpr NodeID NODE_ID_DCC = 0x060100000000ULL;
+  return NODE_ID_DCC | (address > 127 ? 0xC000 | address : address);
+}
+
+// Reverse of train_node_id().
+static unsigned train_address(NodeID id)
+{
+  return id & 0x3FFF;
+}
+
+// Minimal stand-ins for the openlcb::Node and roster entry, only the fields
+// used by the lookups are present but the objects are separately allocated
+// so the scans chase pointers as they do on the device.
+struct Node
+{
+  NodeID id;
+};
+
+struct TrainNode
+{
+  std::unique_ptr<Node> node;
+  unsigned address;
+};
+
+struct RosterEntry
+{
+  unsigned address;
+  std::string name;
+};
+
+struct Roster
+{
+  std::vector<std::unique_ptr<TrainNode>> trains;
+  std::vector<std::shared_ptr<RosterEntry>> entries;
+  std::map<NodeID, TrainNode *> trainsByNodeId;
+  std::map<unsigned, size_t> entriesByAddress;
+
+  Roster(size_t count)
+  {
+    for (size_t idx = 0; idx < count; idx++)
+    {
+      // mix of short and long addresses as found on club layouts.
+      unsigned address = idx < 100 ? idx + 1 : 1000 + idx * 7;
+      trains.emplace_back(new TrainNode{
+        std::unique_ptr<Node>(new Node{train_node_id(address)}), address});
+      trainsByNodeId[train_node_id(address)] = trains.back().get();
+      entries.emplace_back(
+        new RosterEntry{address, "Loco " + std::to_string(address)});
+      entriesByAddress[address] = idx;
+    }
+  }
+
+  // AllTrainNodes::find_node() and is_train_id_known() before indexing.
+  bool dispatch_linear(NodeID id)
+  {
+    auto train = std::find_if(trains.begin(), trains.end()
+    , [id](const std::unique_ptr<TrainNode> &train)
+      {
+        return train->node && train->node->id == id;
+      });
+    if (train == trains.end())
+    {
+      return false;
+    }
+    unsigned address = train_address(id);
+    auto entry = std::find_if(entries.begin(), entries.end()
+    , [address](const std::shared_ptr<RosterEntry> &entry)
+      {
+        return entry->address == address;
+      });
+    return entry != entries.end();
+  }
+
+  // AllTrainNodes::find_node() and is_train_id_known() with the indexes.
+  bool dispatch_indexed(NodeID id)
+  {
+    auto train = trainsByNodeId.find(id);
+    if (train == trainsByNodeId.end())
+    {
+      return false;
+    }
+    return entriesByAddress.find(train_address(id)) != entriesByAddress.end();
+  }
+};
+
+template <class F> static double time_per_message(size_t messages, F f)
+{
+  auto start = std::chrono::steady_clock::now();
+  size_t found = 0;
+  for (size_t idx = 0; idx < messages; idx++)
+  {
+    found += f(idx);
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  if (found != messages)
+  {
+    fprintf(stderr, "lookup failed for %zu message(s)\n", messages - found);
+    exit(EXIT_FAILURE);
+  }
+  return std::chrono::duration<double, std::nano>(elapsed).count() / messages;
+}
+
+int main(int argc, char **argv)
+{
+  size_t messages = argc > 1 ? strtoul(argv[1], nullptr, 10) : 200000;
+  printf("%8s %14s %14s %8s\n", "roster", "linear ns/msg", "indexed ns/msg"
+       , "speedup");
+  for (size_t size : {10, 50, 100, 250, 500, 1000})
+  {
+    Roster roster(size);
+    // throttle traffic addresses random active trains.
+    std::mt19937 rng(size);
+    std::vector<NodeID> ids(messages);
+    for (auto &id : ids)
+    {
+      id = roster.trains[rng() % size]->node->id;
+    }
+    double linear = time_per_message(messages, [&](size_t idx)
+    {
+      return roster.dispatch_linear(ids[idx]);
+    });
+    double indexed = time_per_message(messages, [&](size_t idx)
+    {
+      return roster.dispatch_indexed(ids[idx]);
+    });
+    printf("%8zu %14.1f %14.1f %7.1fx\n", size, linear, indexed
+         , linear / indexed);
+  }
+  return EXIT_SUCCESS;
+}
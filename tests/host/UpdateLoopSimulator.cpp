@@ -0,0 +1,354 @@
+/**********************************************************************
+ESP32 COMMAND STATION
+
+COPYRIGHT (c) 2020 Mike Dunston
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see http://www.gnu.org/licenses
+**********************************************************************/
+
+// Host simulation of the OPS track packet scheduling.
+//
+// The packet selection of PriorityUpdateLoop (pending updates with e-stop
+// first, 5mS decoder packet spacing and the weighted background refresh) and
+// of the dcc::SimpleUpdateLoop round-robin it replaced are modelled against
+// the track timing. The command-to-rail latency is the time from a throttle
+// command to the start of the first packet on the rail that carries it.
+//
+// Each loco refreshes its speed, F0-F4, F5-F8 and F9-F12 packets in turn as
+// dcc::Dcc128Train does. A number of the locos are driven from throttles and
+// receive speed and occasional function commands, packets for commands are
+// sent three times. Packets are queued ahead of the RMT as with
+// CONFIG_OPS_PACKET_QUEUE_SIZE and every packet is followed by a RailCom
+// cutout.
+//
+// Usage: UpdateLoopSimulator [simulated seconds per loco count]
+
+#include <algorithm>
+#include <deque>
+#include <random>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+// all times are in microseconds.
+typedef long long usec_t;
+
+static constexpr usec_t DCC_ONE_USEC = 116;
+static constexpr usec_t DCC_ZERO_USEC = 192;
+static constexpr usec_t DCC_BIT_AVERAGE_USEC = (DCC_ONE_USEC + DCC_ZERO_USEC) / 2;
+static constexpr unsigned PREAMBLE_BITS = 16;
+static constexpr usec_t RAILCOM_CUTOUT_USEC = 464;
+static constexpr size_t TRACK_QUEUE_SIZE = 5;
+
+// PriorityUpdateLoop parameters.
+static constexpr usec_t DECODER_PACKET_SPACING_USEC = 5000;
+static constexpr usec_t RECENT_UPDATE_WINDOW_USEC = 10000000;
+static constexpr long long RECENT_UPDATE_WEIGHT = 4;
+static constexpr size_t MAX_PENDING_UPDATES = 32;
+
+// number of locos driven from throttles and the average time between
+// commands for each of them, a throttle knob being turned produces a command
+// every few hundred milliseconds.
+static constexpr unsigned DRIVEN_LOCOS = 8;
+static constexpr usec_t COMMAND_INTERVAL_USEC = 300000;
+
+// refresh rotation of dcc::Dcc128Train.
+enum Code
+{
+  REFRESH = 0,
+  SPEED = 1,
+  FUNCTION0 = 2,
+  FUNCTION5 = 3,
+  FUNCTION9 = 4,
+  REFRESH_CODES = 4,
+  IDLE = 99
+};
+
+struct Command
+{
+  usec_t time;
+  unsigned loco;
+  unsigned code;
+};
+
+struct Loco
+{
+  unsigned address;
+  unsigned nextRefresh{0};
+  usec_t lastPacket{-DECODER_PACKET_SPACING_USEC};
+  usec_t lastUpdate{-RECENT_UPDATE_WINDOW_USEC};
+  // time of the commands that have not reached the rail yet, by code.
+  std::vector<usec_t> waiting[REFRESH_CODES + 1];
+};
+
+struct Packet
+{
+  unsigned loco;
+  unsigned code;
+  usec_t generated;
+  usec_t duration;
+};
+
+// Duration on the rail of a packet with the provided number of payload bytes
+// sent the provided number of times.
+static usec_t packet_duration(unsigned bytes, unsigned count)
+{
+  usec_t single = PREAMBLE_BITS * DCC_ONE_USEC       // preamble
+                + bytes * DCC_ZERO_USEC              // start and separators
+                + bytes * 8 * DCC_BIT_AVERAGE_USEC   // payload bits
+                + DCC_ONE_USEC                       // end of packet
+                + RAILCOM_CUTOUT_USEC;
+  return single * count;
+}
+
+class Scheduler
+{
+public:
+  Scheduler(std::vector<Loco> &locos) : locos_(locos)
+  {
+  }
+
+  virtual ~Scheduler()
+  {
+  }
+
+  virtual void notify_update(usec_t now, unsigned loco, unsigned code) = 0;
+
+  virtual Packet next_packet(usec_t now) = 0;
+
+protected:
+  std::vector<Loco> &locos_;
+
+  Packet make_packet(usec_t now, unsigned loco, unsigned code)
+  {
+    bool update = code != REFRESH;
+    if (code == REFRESH)
+    {
+      code = SPEED + locos_[loco].nextRefresh;
+      locos_[loco].nextRefresh =
+        (locos_[loco].nextRefresh + 1) % REFRESH_CODES;
+    }
+    locos_[loco].lastPacket = now;
+    unsigned bytes = (locos_[loco].address > 127 ? 2 : 1) + 1 +
+                     (code == SPEED ? 1 : 0);
+    return {loco, code, now, packet_duration(bytes, update ? 3 : 1)};
+  }
+
+  Packet idle_packet(usec_t now)
+  {
+    return {0, IDLE, now, packet_duration(3, 1)};
+  }
+};
+
+// Model of esp32cs::PriorityUpdateLoop without exclusive sources.
+class PriorityScheduler : public Scheduler
+{
+public:
+  using Scheduler::Scheduler;
+
+  void notify_update(usec_t now, unsigned loco, unsigned code) override
+  {
+    locos_[loco].lastUpdate = now;
+    for (auto &entry : pending_)
+    {
+      if (entry.loco == loco && entry.code == code)
+      {
+        return;
+      }
+    }
+    if (pending_.size() < MAX_PENDING_UPDATES)
+    {
+      pending_.push_back({now, loco, code});
+    }
+  }
+
+  Packet next_packet(usec_t now) override
+  {
+    for (auto it = pending_.begin(); it != pending_.end(); ++it)
+    {
+      if (now - locos_[it->loco].lastPacket >= DECODER_PACKET_SPACING_USEC)
+      {
+        Command update = *it;
+        pending_.erase(it);
+        return make_packet(now, update.loco, update.code);
+      }
+    }
+    long long best_score = 0;
+    size_t selected = locos_.size();
+    for (size_t index = 0; index < locos_.size(); index++)
+    {
+      usec_t waiting = now - locos_[index].lastPacket;
+      if (waiting < DECODER_PACKET_SPACING_USEC)
+      {
+        continue;
+      }
+      long long score = waiting;
+      if (now - locos_[index].lastUpdate < RECENT_UPDATE_WINDOW_USEC)
+      {
+        score *= RECENT_UPDATE_WEIGHT;
+      }
+      if (score > best_score)
+      {
+        best_score = score;
+        selected = index;
+      }
+    }
+    if (selected < locos_.size())
+    {
+      return make_packet(now, selected, REFRESH);
+    }
+    return idle_packet(now);
+  }
+
+private:
+  std::vector<Command> pending_;
+};
+
+// Model of dcc::SimpleUpdateLoop, updates are only sent with the refresh.
+class RoundRobinScheduler : public Scheduler
+{
+public:
+  using Scheduler::Scheduler;
+
+  void notify_update(usec_t, unsigned, unsigned) override
+  {
+  }
+
+  Packet next_packet(usec_t now) override
+  {
+    usec_t prev_cycle_start = lastCycleStart_;
+    if (next_ >= locos_.size())
+    {
+      next_ = 0;
+      lastCycleStart_ = now;
+    }
+    if (next_ == 0 &&
+        (now - prev_cycle_start < DECODER_PACKET_SPACING_USEC ||
+         locos_.empty()))
+    {
+      return idle_packet(now);
+    }
+    return make_packet(now, next_++, REFRESH);
+  }
+
+private:
+  size_t next_{0};
+  usec_t lastCycleStart_{0};
+};
+
+struct Result
+{
+  size_t commands{0};
+  double p99{0};
+  double max{0};
+};
+
+static std::vector<Command> generate_commands(unsigned locos, usec_t duration)
+{
+  std::mt19937 rng(locos);
+  std::exponential_distribution<double> interval(1.0 / COMMAND_INTERVAL_USEC);
+  std::vector<Command> commands;
+  for (unsigned loco = 0; loco < std::min(locos, DRIVEN_LOCOS); loco++)
+  {
+    for (usec_t time = interval(rng); time < duration; time += interval(rng))
+    {
+      // one in ten commands is a function change.
+      commands.push_back({time, loco, rng() % 10 ? SPEED : FUNCTION0});
+    }
+  }
+  std::sort(commands.begin(), commands.end()
+          , [](const Command &a, const Command &b)
+  {
+    return a.time < b.time;
+  });
+  return commands;
+}
+
+template <class S> static Result simulate(unsigned count, usec_t duration)
+{
+  std::vector<Loco> locos(count);
+  for (unsigned index = 0; index < count; index++)
+  {
+    // mix of short and long addresses as found on club layouts.
+    locos[index].address = index < 50 ? index + 3 : 1000 + index * 7;
+  }
+  S scheduler(locos);
+  auto commands = generate_commands(count, duration);
+  size_t next_command = 0;
+  std::vector<usec_t> latency;
+  std::deque<Packet> queue;
+  usec_t now = 0;
+  while (now < duration)
+  {
+    while (next_command < commands.size() &&
+           commands[next_command].time <= now)
+    {
+      const Command &cmd = commands[next_command++];
+      locos[cmd.loco].waiting[cmd.code].push_back(cmd.time);
+      scheduler.notify_update(cmd.time, cmd.loco, cmd.code);
+    }
+    while (queue.size() < TRACK_QUEUE_SIZE)
+    {
+      queue.push_back(scheduler.next_packet(now));
+    }
+    // the packet at the head of the queue starts on the rail now, it carries
+    // the state of every command received before it was generated.
+    Packet packet = queue.front();
+    queue.pop_front();
+    if (packet.code != IDLE)
+    {
+      auto &waiting = locos[packet.loco].waiting[packet.code];
+      auto it = waiting.begin();
+      while (it != waiting.end())
+      {
+        if (*it <= packet.generated)
+        {
+          latency.push_back(now - *it);
+          it = waiting.erase(it);
+        }
+        else
+        {
+          ++it;
+        }
+      }
+    }
+    now += packet.duration;
+  }
+  Result result;
+  result.commands = latency.size();
+  if (!latency.empty())
+  {
+    std::sort(latency.begin(), latency.end());
+    result.p99 = latency[(latency.size() * 99) / 100] / 1000.0;
+    result.max = latency.back() / 1000.0;
+  }
+  return result;
+}
+
+int main(int argc, char **argv)
+{
+  usec_t duration =
+    (argc > 1 ? strtoull(argv[1], nullptr, 10) : 600) * 1000000LL;
+  printf("command-to-rail latency in mS, %u driven locos, one command per "
+         "%lldmS each\n", DRIVEN_LOCOS, COMMAND_INTERVAL_USEC / 1000);
+  printf("%6s %9s %18s %18s\n", "locos", "commands", "priority p99/max"
+       , "round-robin p99/max");
+  for (unsigned locos : {1, 2, 4, 8, 16, 32, 64, 128})
+  {
+    Result priority = simulate<PriorityScheduler>(locos, duration);
+    Result round_robin = simulate<RoundRobinScheduler>(locos, duration);
+    printf("%6u %9zu %8.1f/%8.1f %9.1f/%8.1f\n", locos, priority.commands
+         , priority.p99, priority.max, round_robin.p99, round_robin.max);
+  }
+  return EXIT_SUCCESS;
+}
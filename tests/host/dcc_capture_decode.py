@@ -0,0 +1,262 @@
+#!/usr/bin/env python3
+# ESP32 COMMAND STATION
+#
+# COPYRIGHT (c) 2020 Mike Dunston
+#
+#  This program is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#  You should have received a copy of the GNU General Public License
+#  along with this program.  If not, see http://www.gnu.org/licenses
+"""Decodes the DCC packet capture stream returned by GET /dcc/capture.
+
+The stream is read from files previously saved from the command station or
+directly from the command station, in which case --follow will keep polling
+for new packets using the sequence number returned in the stream header.
+
+  dcc_capture_decode.py capture.bin
+  dcc_capture_decode.py --summary capture.bin
+  dcc_capture_decode.py --follow http://esp32cs.local/dcc/capture
+
+Every packet is printed with its sequence number, the time since the previous
+packet, the track (RMT channel) and the decoded DCC instruction. With
+--summary the number of packets and the longest refresh interval per address
+is printed instead. Gaps in the sequence numbers are reported, these are
+packets that were overwritten on the command station before being read.
+"""
+
+import argparse
+import struct
+import sys
+import time
+import urllib.request
+
+# PacketCapture::Header
+HEADER = struct.Struct('<IBBHII')
+# PacketCapture::Entry
+ENTRY = struct.Struct('<IBBBB6s2x')
+
+CAPTURE_MAGIC = 0x50414344
+CAPTURE_VERSION = 1
+
+FLAG_MARKLIN = 0x01
+FLAG_LONG_PREAMBLE = 0x02
+
+
+class CaptureError(Exception):
+  pass
+
+
+def parse_stream(data):
+  """Returns the header fields and entries of a capture stream."""
+  if len(data) < HEADER.size:
+    raise CaptureError('stream is shorter than the header')
+  magic, version, entry_size, count, first, next_seq = \
+      HEADER.unpack_from(data)
+  if magic != CAPTURE_MAGIC:
+    raise CaptureError('not a DCC capture stream (magic %08x)' % magic)
+  if version != CAPTURE_VERSION:
+    raise CaptureError('unsupported capture version %d' % version)
+  if entry_size != ENTRY.size:
+    raise CaptureError('unexpected entry size %d' % entry_size)
+  if len(data) < HEADER.size + count * entry_size:
+    raise CaptureError('stream is truncated')
+  entries = []
+  for index in range(count):
+    timestamp, track, flags, dlc, repeat, payload = \
+        ENTRY.unpack_from(data, HEADER.size + index * entry_size)
+    entries.append({
+        'seq': first + index,
+        'timestamp': timestamp,
+        'track': track,
+        'flags': flags,
+        'repeat': repeat,
+        'payload': payload[:dlc],
+    })
+  return first, next_seq, entries
+
+
+def decode_address(payload):
+  """Returns the address description and the instruction offset."""
+  first = payload[0]
+  if first == 0:
+    return 'broadcast', 1
+  if first < 128:
+    return 'loco %d' % first, 1
+  if first < 192:
+    return 'accessory', 0
+  if first < 232 and len(payload) > 2:
+    return 'loco %d(L)' % (((first & 0x3F) << 8) | payload[1]), 2
+  return 'reserved %02x' % first, 1
+
+
+def decode_functions(first, bits, count):
+  active = ['F%d' % (first + bit) for bit in range(count) if bits & (1 << bit)]
+  return ','.join(active) if active else 'off'
+
+
+def decode_instruction(data):
+  """Decodes a multi-function decoder instruction."""
+  if not data:
+    return 'no instruction'
+  inst = data[0]
+  if inst == 0x00:
+    return 'reset'
+  if inst == 0x3F and len(data) > 1:
+    direction = 'fwd' if data[1] & 0x80 else 'rev'
+    speed = data[1] & 0x7F
+    if speed == 0:
+      return 'speed128 stop %s' % direction
+    if speed == 1:
+      return 'speed128 estop %s' % direction
+    return 'speed128 %d %s' % (speed - 1, direction)
+  if inst & 0xC0 == 0x40:
+    direction = 'fwd' if inst & 0x20 else 'rev'
+    return 'speed28 %02x %s' % (inst & 0x1F, direction)
+  if inst & 0xE0 == 0x80:
+    return 'F0-F4 ' + decode_functions(
+        0, ((inst & 0x0F) << 1) | ((inst >> 4) & 1), 5)
+  if inst & 0xF0 == 0xB0:
+    return 'F5-F8 ' + decode_functions(5, inst & 0x0F, 4)
+  if inst & 0xF0 == 0xA0:
+    return 'F9-F12 ' + decode_functions(9, inst & 0x0F, 4)
+  if inst == 0xDE and len(data) > 1:
+    return 'F13-F20 ' + decode_functions(13, data[1], 8)
+  if inst == 0xDF and len(data) > 1:
+    return 'F21-F28 ' + decode_functions(21, data[1], 8)
+  if inst & 0xF0 == 0xE0 and len(data) > 2:
+    cv = (((inst & 0x03) << 8) | data[1]) + 1
+    mode = (inst >> 2) & 0x03
+    if mode == 1:
+      return 'POM verify CV%d %d' % (cv, data[2])
+    if mode == 3:
+      return 'POM write CV%d %d' % (cv, data[2])
+    if mode == 2:
+      return 'POM bit CV%d %02x' % (cv, data[2])
+  return 'instruction %s' % ' '.join('%02x' % b for b in data)
+
+
+def decode_packet(entry):
+  """Returns (address, description) for a captured packet."""
+  payload = entry['payload']
+  if entry['flags'] & FLAG_MARKLIN:
+    return 'marklin', 'MM %s' % ' '.join('%02x' % b for b in payload)
+  if len(payload) < 2:
+    return None, 'short packet %s' % payload.hex()
+  xor = 0
+  for byte in payload:
+    xor ^= byte
+  if payload[0] == 0xFF and payload[1] == 0:
+    return None, 'idle'
+  address, offset = decode_address(payload)
+  if offset == 0:
+    # basic accessory: 10AAAAAA 1AAACDDD
+    board = payload[0] & 0x3F
+    board |= ((~payload[1] >> 4) & 0x07) << 6
+    address = 'accessory %d' % board
+    description = 'output %d %s' % (
+        payload[1] & 0x07, 'on' if payload[1] & 0x08 else 'off')
+  else:
+    description = decode_instruction(payload[offset:-1])
+  if xor:
+    description += ' (bad checksum)'
+  return address, description
+
+
+def print_entries(entries, state):
+  for entry in entries:
+    if state['next'] is not None and entry['seq'] != state['next']:
+      print('-- %d packet(s) lost' % (entry['seq'] - state['next']))
+    state['next'] = entry['seq'] + 1
+    if state['last'] is None:
+      delta = 0
+    else:
+      delta = (entry['timestamp'] - state['last']) & 0xFFFFFFFF
+    state['last'] = entry['timestamp']
+    address, description = decode_packet(entry)
+    flags = 'L' if entry['flags'] & FLAG_LONG_PREAMBLE else ' '
+    repeat = ' x%d' % (entry['repeat'] + 1) if entry['repeat'] else ''
+    print('%10d %+9.3fms t%d %s %-14s %-16s %s%s' % (
+        entry['seq'], delta / 1000.0, entry['track'], flags,
+        entry['payload'].hex(), address or '', description, repeat))
+
+
+def summarize(entries):
+  addresses = {}
+  for entry in entries:
+    address, _ = decode_packet(entry)
+    if address is None:
+      address = 'idle'
+    stats = addresses.setdefault(
+        address, {'count': 0, 'last': None, 'max_gap': 0})
+    stats['count'] += 1
+    if stats['last'] is not None:
+      gap = (entry['timestamp'] - stats['last']) & 0xFFFFFFFF
+      stats['max_gap'] = max(stats['max_gap'], gap)
+    stats['last'] = entry['timestamp']
+  print('%-16s %8s %14s' % ('address', 'packets', 'max gap (ms)'))
+  for address in sorted(addresses):
+    stats = addresses[address]
+    print('%-16s %8d %14.1f' % (
+        address, stats['count'], stats['max_gap'] / 1000.0))
+
+
+def fetch(url, since):
+  separator = '&' if '?' in url else '?'
+  with urllib.request.urlopen('%s%ssince=%d' % (url, separator, since)) as f:
+    return f.read()
+
+
+def main():
+  parser = argparse.ArgumentParser(
+      description=__doc__, formatter_class=argparse.RawTextHelpFormatter)
+  parser.add_argument('source', nargs='+',
+                      help='capture file(s) or GET /dcc/capture URL')
+  parser.add_argument('--summary', action='store_true',
+                      help='print per address statistics')
+  parser.add_argument('--follow', action='store_true',
+                      help='keep polling the URL for new packets')
+  parser.add_argument('--interval', type=float, default=1.0,
+                      help='seconds between polls with --follow')
+  args = parser.parse_args()
+
+  state = {'next': None, 'last': None}
+  collected = []
+  try:
+    for source in args.source:
+      if source.startswith('http://') or source.startswith('https://'):
+        since = 0
+        while True:
+          _, since, entries = parse_stream(fetch(source, since))
+          if args.summary:
+            collected.extend(entries)
+          else:
+            print_entries(entries, state)
+            sys.stdout.flush()
+          if not args.follow:
+            break
+          time.sleep(args.interval)
+      else:
+        with open(source, 'rb') as f:
+          _, _, entries = parse_stream(f.read())
+        if args.summary:
+          collected.extend(entries)
+        else:
+          print_entries(entries, state)
+  except CaptureError as e:
+    sys.stderr.write('%s: %s\n' % (source, e))
+    return 1
+  except KeyboardInterrupt:
+    pass
+  if args.summary:
+    summarize(collected)
+  return 0
+
+
+if __name__ == '__main__':
+  sys.exit(main())